@@ -0,0 +1,290 @@
+//
+// Versioned binary snapshots of a simulation, written with a single write and loaded with mmap (POSIX only).
+//
+
+#ifndef CLOTH_SIMULATION_CHECKPOINT_H
+#define CLOTH_SIMULATION_CHECKPOINT_H
+
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define CHECKPOINT_MAGIC "CLTHCKPT"
+#define CHECKPOINT_VERSION 2 // bumped whenever the layout of a section changes; 2 grew the parameters of both models
+#define CHECKPOINT_ALIGNMENT 64 // sections start at multiples of this so that they can be used in place
+
+#define CHECKPOINT_MODEL_SPRINGMASS 1
+#define CHECKPOINT_MODEL_INTERNALENERGY 2
+
+/**
+ * Fixed header at the start of a checkpoint file. It is followed by one CheckpointSection per section.
+ */
+struct CheckpointHeader {
+    char magic[8]; // CHECKPOINT_MAGIC without the terminating zero
+    uint32_t version; // CHECKPOINT_VERSION of the writer
+    uint32_t model; // CHECKPOINT_MODEL_* of the simulation which wrote the file
+    uint32_t scalar_size; // size of the scalars the particles are stored in, 4 for float and 8 for double
+    uint32_t num_sections;
+    uint64_t file_size; // total size, used to detect truncated files
+};
+
+/**
+ * Entry of the section table
+ */
+struct CheckpointSection {
+    uint32_t id; // meaning of the section, defined by the model
+    uint32_t reserved;
+    uint64_t offset; // position of the data from the start of the file
+    uint64_t size; // size of the data in bytes
+};
+
+/**
+ * Collects the sections of a checkpoint and writes them to disk in one go. The file is written
+ * next to its destination and renamed over it, so a crash while saving leaves the previous checkpoint intact.
+ */
+class CheckpointWriter {
+    CheckpointHeader header;
+    vector<uint32_t> ids;
+    vector<vector<char> > sections;
+
+public:
+    /**
+     * Constructor to start an empty checkpoint
+     * @param model CHECKPOINT_MODEL_* of the simulation
+     * @param scalar_size size of the scalars the particles are stored in
+     */
+    CheckpointWriter(uint32_t model, uint32_t scalar_size) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+        header.version = CHECKPOINT_VERSION;
+        header.model = model;
+        header.scalar_size = scalar_size;
+    }
+
+    /**
+     * Appends raw bytes to a section, starting the section if it does not exist yet
+     * @param id id of the section
+     * @param data the bytes
+     * @param size number of bytes
+     */
+    void append(uint32_t id, const void *data, size_t size) {
+        size_t s = find(ids.begin(), ids.end(), id) - ids.begin();
+        if (s == ids.size()) {
+            ids.push_back(id);
+            sections.push_back(vector<char>());
+        }
+        const char *bytes = static_cast<const char *>(data);
+        sections[s].insert(sections[s].end(), bytes, bytes + size);
+    }
+
+    /**
+     * Appends the elements of a vector to a section. The elements must be trivially copyable.
+     * @param id id of the section
+     * @param values the elements
+     */
+    template<typename T>
+    void append(uint32_t id, const vector<T> &values) {
+        append(id, values.data(), values.size() * sizeof(T));
+    }
+
+    /**
+     * Writes the checkpoint
+     * @param path path of the file
+     * @param error set to a description of the problem if the file cannot be written
+     * @return true if the checkpoint was written
+     */
+    bool write(const string &path, string &error) {
+        //lay the whole file out in memory so that it goes to disk with a single write
+        header.num_sections = ids.size();
+        uint64_t offset = sizeof(CheckpointHeader) + ids.size() * sizeof(CheckpointSection);
+        vector<CheckpointSection> table(ids.size());
+        for (size_t s = 0; s < ids.size(); ++s) {
+            offset = (offset + CHECKPOINT_ALIGNMENT - 1) / CHECKPOINT_ALIGNMENT * CHECKPOINT_ALIGNMENT;
+            table[s].id = ids[s];
+            table[s].reserved = 0;
+            table[s].offset = offset;
+            table[s].size = sections[s].size();
+            offset += sections[s].size();
+        }
+        header.file_size = offset;
+        vector<char> file(offset, 0);
+        memcpy(file.data(), &header, sizeof(header));
+        if (!table.empty())
+            memcpy(file.data() + sizeof(header), table.data(), table.size() * sizeof(CheckpointSection));
+        for (size_t s = 0; s < ids.size(); ++s) {
+            if (!sections[s].empty())
+                memcpy(file.data() + table[s].offset, sections[s].data(), sections[s].size());
+        }
+
+        string temporary = path + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error = "cannot create " + temporary + ": " + strerror(errno);
+            return false;
+        }
+        ssize_t written = ::write(fd, file.data(), file.size());
+        bool ok = written == (ssize_t) file.size() && fsync(fd) == 0;
+        if (!ok)
+            error = "cannot write " + temporary + ": " + (written < 0 ? strerror(errno) : "short write");
+        ::close(fd);
+        if (ok && rename(temporary.c_str(), path.c_str()) != 0) {
+            error = "cannot replace " + path + ": " + strerror(errno);
+            ok = false;
+        }
+        if (!ok)
+            unlink(temporary.c_str());
+        return ok;
+    }
+};
+
+/**
+ * Maps a checkpoint into memory. The sections are used in place or copied into the simulation
+ * buffers as a whole; nothing is parsed element by element.
+ */
+class CheckpointReader {
+    void *data;
+    size_t size;
+    const CheckpointHeader *header;
+    const CheckpointSection *table;
+
+    CheckpointReader(const CheckpointReader &);
+    CheckpointReader &operator=(const CheckpointReader &);
+
+public:
+    CheckpointReader() : data(nullptr), size(0), header(nullptr), table(nullptr) {}
+
+    ~CheckpointReader() {
+        close();
+    }
+
+    /**
+     * Maps a checkpoint and checks that it is complete and was written by the given model
+     * @param path path of the file
+     * @param model CHECKPOINT_MODEL_* expected in the file
+     * @param error set to a description of the problem if the checkpoint cannot be used
+     * @return true if the checkpoint was mapped
+     */
+    bool open(const string &path, uint32_t model, string &error) {
+        close();
+        error.clear();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error = "cannot open " + path + ": " + strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CheckpointHeader)) {
+            ::close(fd);
+            error = path + " is not a checkpoint";
+            return false;
+        }
+        size = st.st_size;
+        data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            data = nullptr;
+            error = "cannot map " + path + ": " + strerror(errno);
+            return false;
+        }
+        header = static_cast<const CheckpointHeader *>(data);
+        table = reinterpret_cast<const CheckpointSection *>(header + 1);
+        if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0)
+            error = path + " is not a checkpoint";
+        else if (header->version != CHECKPOINT_VERSION)
+            error = path + " has version " + to_string(header->version) + ", expected " +
+                    to_string(CHECKPOINT_VERSION);
+        else if (header->model != model)
+            error = path + " was written by the other cloth model";
+        else if (header->file_size != size ||
+                 sizeof(CheckpointHeader) + header->num_sections * sizeof(CheckpointSection) > size)
+            error = path + " is truncated";
+        else {
+            for (uint32_t s = 0; s < header->num_sections; ++s) {
+                if (table[s].offset > size || table[s].size > size - table[s].offset) {
+                    error = path + " is truncated";
+                    break;
+                }
+            }
+        }
+        if (error.empty())
+            return true;
+        close();
+        return false;
+    }
+
+    /**
+     * Unmaps the checkpoint
+     */
+    void close() {
+        if (data)
+            munmap(data, size);
+        data = nullptr;
+        header = nullptr;
+        table = nullptr;
+    }
+
+    /**
+     * Returns the size of the scalars the particles were stored in
+     * @return 4 for float, 8 for double
+     */
+    uint32_t getScalarSize() const {
+        return header->scalar_size;
+    }
+
+    /**
+     * Returns the data of a section in place
+     * @param id id of the section
+     * @param section_size set to the size of the section in bytes
+     * @return pointer to the data, nullptr if the checkpoint has no such section
+     */
+    const void *section(uint32_t id, uint64_t &section_size) const {
+        for (uint32_t s = 0; s < header->num_sections; ++s) {
+            if (table[s].id == id) {
+                section_size = table[s].size;
+                return static_cast<const char *>(data) + table[s].offset;
+            }
+        }
+        section_size = 0;
+        return nullptr;
+    }
+
+    /**
+     * Returns a section holding a whole number of elements of a type in place
+     * @param id id of the section
+     * @param count set to the number of elements
+     * @return pointer to the elements, nullptr if the section is missing or its size does not fit the type
+     */
+    template<typename T>
+    const T *array(uint32_t id, size_t &count) const {
+        uint64_t section_size;
+        const void *p = section(id, section_size);
+        count = section_size / sizeof(T);
+        if (!p || section_size % sizeof(T) != 0)
+            return nullptr;
+        return static_cast<const T *>(p);
+    }
+
+    /**
+     * Copies a section into a vector with a single copy
+     * @param id id of the section
+     * @param values resized to the number of elements and filled with them
+     * @return true if the section exists and holds a whole number of elements
+     */
+    template<typename T>
+    bool read(uint32_t id, vector<T> &values) const {
+        size_t count;
+        const T *p = array<T>(id, count);
+        if (!p)
+            return false;
+        values.resize(count);
+        if (count > 0)
+            memcpy(static_cast<void *>(values.data()), p, count * sizeof(T));
+        return true;
+    }
+};
+
+#endif //CLOTH_SIMULATION_CHECKPOINT_H
@@ -0,0 +1,411 @@
+//
+// Triangle meshes of garments imported from Wavefront OBJ files, with the edges and rest data both cloth models need.
+//
+
+#ifndef CLOTH_SIMULATION_CLOTHMESH_H
+#define CLOTH_SIMULATION_CLOTHMESH_H
+
+#include <bits/stdc++.h>
+#include <glm/glm.hpp>
+#include "ParticleOrder.h"
+
+using namespace std;
+using namespace glm;
+
+#define CLOTH_MESH_NONE UINT32_MAX // marks a missing triangle, e.g. on the far side of a border edge
+
+/**
+ * A cloth made of arbitrary triangles. The particles are the vertices of the mesh which faces use, and are
+ * renumbered in a cache friendly order by reorder(): sorted along a space filling curve through their rest
+ * positions, with the triangles and edges sorted by their first particle, so that the particles of nearby
+ * triangles are close in memory. Every edge becomes a structural constraint and every pair of triangles
+ * sharing an edge a bending element, joining the two particles opposite the edge (the cross edge).
+ */
+class ClothMesh {
+    /**
+     * Parses a number without the locale handling of strtod, which dominates loading large files
+     * @param p start of the number, moved past it
+     * @param value set to the number
+     * @return false if there is no number at p
+     */
+    static bool parseDouble(const char *&p, double &value) {
+        const char *start = p;
+        bool negative = *p == '-';
+        if (*p == '-' || *p == '+')
+            ++p;
+        double mantissa = 0;
+        int exponent = 0, digits = 0;
+        for (; *p >= '0' && *p <= '9'; ++p, ++digits)
+            mantissa = mantissa * 10 + (*p - '0');
+        if (*p == '.') {
+            for (++p; *p >= '0' && *p <= '9'; ++p, ++digits, --exponent)
+                mantissa = mantissa * 10 + (*p - '0');
+        }
+        if (digits == 0) {
+            p = start;
+            return false;
+        }
+        if (*p == 'e' || *p == 'E') {
+            const char *e = p + 1;
+            bool negative_exponent = *e == '-';
+            if (*e == '-' || *e == '+')
+                ++e;
+            if (*e >= '0' && *e <= '9') {
+                int power = 0;
+                for (; *e >= '0' && *e <= '9'; ++e)
+                    power = std::min(power * 10 + (*e - '0'), 10000);
+                exponent += negative_exponent ? -power : power;
+                p = e;
+            }
+        }
+        value = exponent == 0 ? mantissa : exponent > 0 ? mantissa * pow(10.0, exponent) :
+                                                          mantissa / pow(10.0, -exponent);
+        if (negative)
+            value = -value;
+        return true;
+    }
+
+    /**
+     * Parses an OBJ index, which counts from 1 or, if negative, back from the last element read so far
+     * @param p start of the index, moved past it
+     * @param count number of elements read so far
+     * @param index set to the index counting from 0
+     * @return false if there is no valid index at p
+     */
+    static bool parseIndex(const char *&p, size_t count, long &index) {
+        bool negative = *p == '-';
+        if (negative)
+            ++p;
+        if (*p < '0' || *p > '9')
+            return false;
+        long value = 0;
+        for (; *p >= '0' && *p <= '9'; ++p)
+            value = value * 10 + (*p - '0');
+        index = negative ? (long) count - value : value - 1;
+        return index >= 0 && index < (long) count;
+    }
+
+    /**
+     * Scales the texture coordinates to the units of the positions, so that the rest shape of every triangle
+     * in UV space has about the size of the triangle in the file. Without texture coordinates the mesh is
+     * flattened onto the plane of its two largest extents. Triangles whose UVs are degenerate, e.g. faces seen edge-on
+     * by that plane, are laid out flat.
+     * @param textured whether the faces of the file had texture coordinates
+     */
+    void makeRestShape(bool textured) {
+        if (!textured) {
+            dvec3 low(numeric_limits<double>::max()), high(-numeric_limits<double>::max());
+            for (const dvec3 &p : positions) {
+                low = glm::min(low, p);
+                high = glm::max(high, p);
+            }
+            dvec3 size = high - low;
+            int drop = size.x <= size.y && size.x <= size.z ? 0 : size.y <= size.z ? 1 : 2;
+            int u = drop == 0 ? 1 : 0, v = drop == 2 ? 1 : 2;
+            for (size_t t = 0; t < triangles.size(); ++t) {
+                for (int k = 0; k < 3; ++k)
+                    uvs[t][k] = dvec2(positions[triangles[t][k]][u], positions[triangles[t][k]][v]);
+            }
+        }
+        double area = 0, uv_area = 0;
+        for (size_t t = 0; textured && t < triangles.size(); ++t) {
+            area += length(cross(positions[triangles[t][1]] - positions[triangles[t][0]],
+                                 positions[triangles[t][2]] - positions[triangles[t][0]])) / 2;
+            dvec2 d1 = uvs[t][1] - uvs[t][0], d2 = uvs[t][2] - uvs[t][0];
+            uv_area += fabs(d1.x * d2.y - d2.x * d1.y) / 2;
+        }
+        double scale = uv_area > 0 ? sqrt(area / uv_area) : 1;
+        for (size_t t = 0; t < triangles.size(); ++t) {
+            for (int k = 0; k < 3; ++k)
+                uvs[t][k] *= scale;
+            dvec2 d1 = uvs[t][1] - uvs[t][0], d2 = uvs[t][2] - uvs[t][0];
+            if (fabs(d1.x * d2.y - d2.x * d1.y) > 1e-12 * std::max(dot(d1, d1), dot(d2, d2)))
+                continue;
+            //lay the triangle out in its own plane, with the first edge along u
+            dvec3 e1 = positions[triangles[t][1]] - positions[triangles[t][0]];
+            dvec3 e2 = positions[triangles[t][2]] - positions[triangles[t][0]];
+            double l1 = length(e1);
+            dvec3 axis = l1 > 0 ? e1 / l1 : dvec3(1, 0, 0);
+            double along = dot(e2, axis);
+            uvs[t][0] = dvec2(0);
+            uvs[t][1] = dvec2(l1, 0);
+            uvs[t][2] = dvec2(along, length(e2 - axis * along));
+        }
+    }
+
+public:
+    vector<dvec3> positions; // rest position of every particle
+    vector<array<uint32_t, 3> > triangles; // particles of every triangle, counter clockwise as in the file
+    vector<array<dvec2, 3> > uvs; // rest shape of every triangle: the UV of its corners, in the units of the positions
+    vector<uint32_t> groups; // group of every triangle, counted from the g, o and usemtl lines of the file
+    vector<uint32_t> particle_of_vertex; // particle of every vertex of the file, CLOTH_MESH_NONE if unused
+    vector<uint32_t> original_of_particle; // index of every particle before reordering: its rank among the used vertices
+    vector<array<uint32_t, 2> > edges; // the particles of every edge, lower index first
+    vector<array<uint32_t, 2> > edge_triangles; // the triangles on both sides of every edge, CLOTH_MESH_NONE on a border
+    vector<array<uint32_t, 2> > cross_edges; // the particles opposite every edge with two triangles, in the order of edges
+
+    /**
+     * Loads a mesh from an OBJ file. Polygons are split into triangle fans; normals, materials and
+     * anything else are ignored. Triangles without area are skipped with a warning, and vertices which no face
+     * uses are dropped.
+     * @param path path of the file
+     * @param error set to a description of the problem if the file cannot be loaded
+     * @param curve the CURVE_* constant of the curve to reorder the particles along
+     * @return true if the mesh was loaded
+     */
+    bool loadObj(const string &path, string &error, int curve = CURVE_HILBERT) {
+        ifstream in(path, ios::binary | ios::ate);
+        if (!in) {
+            error = "cannot open " + path;
+            return false;
+        }
+        vector<char> text((size_t) in.tellg() + 1, '\0');
+        in.seekg(0);
+        in.read(text.data(), text.size() - 1);
+        vector<dvec3> vertices;
+        vector<dvec2> texture;
+        positions.clear();
+        triangles.clear();
+        uvs.clear();
+        groups.clear();
+        uint32_t group = 0;
+        bool textured = true;
+        size_t degenerate = 0; // triangles skipped for having no area
+        int first_degenerate = 0; // line of the first of them
+        vector<long> corners, corner_uvs;
+        const char *p = text.data();
+        for (int line = 1; *p; ++line) {
+            while (*p == ' ' || *p == '\t')
+                ++p;
+            const char *keyword = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+                ++p;
+            size_t keyword_length = p - keyword;
+            bool valid = true;
+            if (keyword_length == 1 && keyword[0] == 'v') {
+                dvec3 v;
+                for (int k = 0; k < 3 && valid; ++k) {
+                    while (*p == ' ' || *p == '\t')
+                        ++p;
+                    valid = parseDouble(p, v[k]);
+                }
+                vertices.push_back(v);
+            } else if (keyword_length == 2 && keyword[0] == 'v' && keyword[1] == 't') {
+                dvec2 uv;
+                for (int k = 0; k < 2 && valid; ++k) {
+                    while (*p == ' ' || *p == '\t')
+                        ++p;
+                    valid = parseDouble(p, uv[k]);
+                }
+                texture.push_back(uv);
+            } else if (keyword_length == 1 && keyword[0] == 'f') {
+                corners.clear();
+                corner_uvs.clear();
+                while (valid) {
+                    while (*p == ' ' || *p == '\t')
+                        ++p;
+                    if (!*p || *p == '\n' || *p == '\r' || *p == '#')
+                        break;
+                    long vertex, uv = -1;
+                    valid = parseIndex(p, vertices.size(), vertex);
+                    if (valid && *p == '/') {
+                        ++p;
+                        if (*p != '/')
+                            valid = parseIndex(p, texture.size(), uv);
+                        while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+                            ++p; //skip the normal
+                    }
+                    corners.push_back(vertex);
+                    corner_uvs.push_back(uv);
+                }
+                valid = valid && corners.size() >= 3;
+                for (size_t k = 2; valid && k < corners.size(); ++k) {
+                    //a triangle without area, e.g. with a repeated vertex, has no rest shape to simulate
+                    dvec3 a = vertices[corners[0]], b = vertices[corners[k - 1]], c = vertices[corners[k]];
+                    if (!(length(cross(b - a, c - a)) > 1e-12 * length(b - a) * length(c - a))) {
+                        if (degenerate++ == 0)
+                            first_degenerate = line;
+                        continue;
+                    }
+                    triangles.push_back({{(uint32_t) corners[0], (uint32_t) corners[k - 1], (uint32_t) corners[k]}});
+                    array<dvec2, 3> corner_uv;
+                    long indices[3] = {corner_uvs[0], corner_uvs[k - 1], corner_uvs[k]};
+                    for (int c = 0; c < 3; ++c) {
+                        textured = textured && indices[c] >= 0;
+                        corner_uv[c] = indices[c] >= 0 ? texture[indices[c]] : dvec2(0);
+                    }
+                    uvs.push_back(corner_uv);
+                    groups.push_back(group);
+                }
+            } else if ((keyword_length == 1 && (keyword[0] == 'g' || keyword[0] == 'o')) ||
+                       (keyword_length == 6 && string(keyword, 6) == "usemtl")) {
+                if (!triangles.empty() && groups.back() == group)
+                    ++group; //the faces which follow form a new group
+            }
+            if (!valid) {
+                error = path + ":" + to_string(line) + ": invalid " + string(keyword, keyword_length) + " line";
+                return false;
+            }
+            while (*p && *p != '\n')
+                ++p;
+            if (*p)
+                ++p;
+        }
+        if (degenerate > 0)
+            cerr << path << ": skipping " << degenerate << (degenerate == 1 ? " triangle" : " triangles")
+                 << " without area, the first on line " << first_degenerate << endl;
+        if (triangles.empty()) {
+            error = path + (degenerate > 0 ? " has no faces with an area" : " has no faces");
+            return false;
+        }
+        if (vertices.size() >= CLOTH_MESH_NONE) {
+            error = path + " has too many vertices";
+            return false;
+        }
+        particle_of_vertex.assign(vertices.size(), CLOTH_MESH_NONE);
+        for (const array<uint32_t, 3> &t : triangles) {
+            for (int k = 0; k < 3; ++k)
+                particle_of_vertex[t[k]] = 0; //used; numbered below in the order of the file
+        }
+        positions.reserve(vertices.size());
+        for (uint32_t v = 0; v < vertices.size(); ++v) {
+            if (particle_of_vertex[v] != CLOTH_MESH_NONE) {
+                particle_of_vertex[v] = positions.size();
+                positions.push_back(vertices[v]);
+            }
+        }
+        for (array<uint32_t, 3> &t : triangles) {
+            for (int k = 0; k < 3; ++k)
+                t[k] = particle_of_vertex[t[k]];
+        }
+        original_of_particle.resize(positions.size());
+        iota(original_of_particle.begin(), original_of_particle.end(), 0u);
+        makeRestShape(textured);
+        reorder(curve);
+        return true;
+    }
+
+    /**
+     * Sorts the particles along a space filling curve through their rest positions, remaps the triangles,
+     * sorts them by their lowest particle and builds the edges again, which then come out sorted by their
+     * first particle. The original order stays available through original_of_particle.
+     * @param curve the CURVE_* constant of the curve, CURVE_NONE to only build the edges
+     */
+    void reorder(int curve) {
+        if (curve != CURVE_NONE) {
+            ParticleOrder order = ParticleOrder::along(positions, curve);
+            order.apply(positions);
+            order.apply(original_of_particle);
+            for (array<uint32_t, 3> &t : triangles) {
+                for (int k = 0; k < 3; ++k)
+                    t[k] = order.toNew(t[k]);
+            }
+            for (uint32_t &particle : particle_of_vertex)
+                particle = particle == CLOTH_MESH_NONE ? CLOTH_MESH_NONE : order.toNew(particle);
+
+            vector<pair<uint32_t, uint32_t> > by_first(triangles.size()); // (lowest particle, triangle)
+            for (uint32_t t = 0; t < triangles.size(); ++t)
+                by_first[t] = make_pair(std::min(std::min(triangles[t][0], triangles[t][1]), triangles[t][2]), t);
+            sort(by_first.begin(), by_first.end());
+            vector<array<uint32_t, 3> > sorted_triangles;
+            vector<array<dvec2, 3> > sorted_uvs;
+            vector<uint32_t> sorted_groups;
+            sorted_triangles.reserve(triangles.size());
+            sorted_uvs.reserve(triangles.size());
+            sorted_groups.reserve(triangles.size());
+            for (const pair<uint32_t, uint32_t> &entry : by_first) {
+                sorted_triangles.push_back(triangles[entry.second]);
+                sorted_uvs.push_back(uvs[entry.second]);
+                sorted_groups.push_back(groups[entry.second]);
+            }
+            triangles.swap(sorted_triangles);
+            uvs.swap(sorted_uvs);
+            groups.swap(sorted_groups);
+        }
+        buildEdges();
+    }
+
+    /**
+     * Finds the edges, the triangles on both sides of each edge and the cross edges from the triangles.
+     * The edges of every particle are collected in a bucket of the lower of their two particles, so that
+     * no global sort is needed and the work stays linear in the size of the mesh.
+     */
+    void buildEdges() {
+        vector<uint32_t> bucket_start(positions.size() + 1, 0);
+        for (const array<uint32_t, 3> &t : triangles) {
+            for (int k = 0; k < 3; ++k)
+                ++bucket_start[std::min(t[k], t[(k + 1) % 3]) + 1];
+        }
+        for (size_t p = 0; p < positions.size(); ++p)
+            bucket_start[p + 1] += bucket_start[p];
+        vector<uint32_t> fill(bucket_start.begin(), bucket_start.end() - 1);
+        vector<pair<uint32_t, uint32_t> > half_edges(3 * triangles.size()); // (higher particle, triangle)
+        for (uint32_t t = 0; t < triangles.size(); ++t) {
+            for (int k = 0; k < 3; ++k) {
+                uint32_t a = triangles[t][k], b = triangles[t][(k + 1) % 3];
+                half_edges[fill[std::min(a, b)]++] = make_pair(std::max(a, b), t);
+            }
+        }
+        edges.clear();
+        edge_triangles.clear();
+        cross_edges.clear();
+        edges.reserve(triangles.size() * 3 / 2 + positions.size()); //about as many edges as a closed mesh plus its border
+        edge_triangles.reserve(edges.capacity());
+        cross_edges.reserve(triangles.size() * 3 / 2);
+        for (uint32_t a = 0; a < positions.size(); ++a) {
+            for (uint32_t i = bucket_start[a]; i < bucket_start[a + 1]; ++i) {
+                if (half_edges[i].first == CLOTH_MESH_NONE)
+                    continue; //already merged into an earlier edge
+                uint32_t b = half_edges[i].first;
+                array<uint32_t, 2> sides = {{half_edges[i].second, CLOTH_MESH_NONE}};
+                for (uint32_t j = i + 1; j < bucket_start[a + 1]; ++j) {
+                    if (half_edges[j].first == b) {
+                        if (sides[1] == CLOTH_MESH_NONE)
+                            sides[1] = half_edges[j].second;
+                        half_edges[j].first = CLOTH_MESH_NONE; //edges of more than two triangles only bend once
+                    }
+                }
+                edges.push_back({{a, b}});
+                edge_triangles.push_back(sides);
+                if (sides[1] != CLOTH_MESH_NONE)
+                    cross_edges.push_back({{opposite(sides[0], a, b), opposite(sides[1], a, b)}});
+            }
+        }
+    }
+
+    /**
+     * Returns the corner of a triangle which is not on an edge
+     * @param t the triangle
+     * @param a a particle of the edge
+     * @param b the other particle of the edge
+     * @return the remaining particle
+     */
+    uint32_t opposite(uint32_t t, uint32_t a, uint32_t b) const {
+        for (int k = 0; k < 3; ++k) {
+            if (triangles[t][k] != a && triangles[t][k] != b)
+                return triangles[t][k];
+        }
+        return triangles[t][0];
+    }
+
+    /**
+     * Returns the particles at the top of the mesh, by which a garment is hung if the scene pins nothing
+     * @param tolerance distance below the highest particle, relative to the height of the mesh, still counted as top
+     * @return the particles
+     */
+    vector<uint32_t> topParticles(double tolerance = 1e-3) const {
+        double low = numeric_limits<double>::max(), high = -numeric_limits<double>::max();
+        for (const dvec3 &p : positions) {
+            low = std::min(low, p.y);
+            high = std::max(high, p.y);
+        }
+        vector<uint32_t> top;
+        for (uint32_t i = 0; i < positions.size(); ++i) {
+            if (positions[i].y >= high - tolerance * (high - low))
+                top.push_back(i);
+        }
+        return top;
+    }
+};
+
+#endif //CLOTH_SIMULATION_CLOTHMESH_H
@@ -0,0 +1,59 @@
+//
+// Counter based random numbers: every number is a pure function of a seed and its position in the stream.
+//
+
+#ifndef CLOTH_SIMULATION_COUNTERRANDOM_H
+#define CLOTH_SIMULATION_COUNTERRANDOM_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+/**
+ * A stream of random numbers which can be read in any order. The number at a counter is a hash of the seed and
+ * the counter, so that e.g. the perturbation of a particle depends only on the seed and the index of the particle,
+ * not on which thread draws it or how many numbers were drawn before, unlike rand().
+ */
+class CounterRandom {
+    uint64_t key; // the seed, mixed so that neighbouring seeds give unrelated streams
+
+public:
+    /**
+     * Mixes the bits of a value, the finalizer of SplitMix64
+     * @param x the value
+     * @return the mixed value
+     */
+    static uint64_t mix(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    /**
+     * Constructor to start a stream
+     * @param seed the seed of the stream
+     */
+    explicit CounterRandom(uint64_t seed) : key(mix(seed + 0x9e3779b97f4a7c15ULL)) {}
+
+    /**
+     * Returns the random bits at a counter
+     * @param counter position in the stream, e.g. the index of a particle
+     * @param lane one of several numbers at the same position, e.g. an axis
+     * @return 64 random bits
+     */
+    uint64_t bits(uint64_t counter, uint32_t lane = 0) const {
+        return mix(key ^ mix(counter * 0x9e3779b97f4a7c15ULL + lane));
+    }
+
+    /**
+     * Returns the random number at a counter, uniform in [0, 1)
+     * @param counter position in the stream, e.g. the index of a particle
+     * @param lane one of several numbers at the same position, e.g. an axis
+     * @return the number
+     */
+    double uniform(uint64_t counter, uint32_t lane = 0) const {
+        return (bits(counter, lane) >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+#endif //CLOTH_SIMULATION_COUNTERRANDOM_H
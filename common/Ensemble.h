@@ -0,0 +1,273 @@
+//
+// Parameter sweeps: many variants of one scene simulated headless side by side, with a table of metrics per variant.
+//
+
+#ifndef CLOTH_SIMULATION_ENSEMBLE_H
+#define CLOTH_SIMULATION_ENSEMBLE_H
+
+#include <bits/stdc++.h>
+#include <glm/glm.hpp>
+#include <time.h>
+#include "SceneConfig.h"
+#include "TaskScheduler.h"
+#include "FrameCache.h"
+
+using namespace std;
+using namespace glm;
+
+/**
+ * The variants of a sweep, read from the [ensemble] section of a scene. Each "vary" line names a key
+ * of the [material] or [solver] section, one the model reads, and the values it takes:
+ *   vary = k_bend 0.005 0.01 0.02     with sample = grid (the default): every combination of the listed values
+ *   vary = k_bend 0.005 0.02 [log]    with sample = random: "samples" variants drawn uniformly, or
+ *                                     log-uniformly, between the two bounds, reproducibly from "seed"
+ * Variant 0 is always the scene itself. The final drape of every variant is compared against the last frame
+ * of the frame cache given by "reference", or against the baseline if there is none.
+ */
+class ParameterSweep {
+    /**
+     * A key and the values it takes
+     */
+    struct Axis {
+        string key;
+        vector<double> values; // grid values, or the lower and upper bound of a random sample
+        bool logarithmic; // whether random values are drawn uniformly in the logarithm
+    };
+
+    vector<Axis> axes;
+    vector<vector<double> > variants; // values of the axes in each variant after the baseline
+
+public:
+    /**
+     * Reads the sweep from the [ensemble] section of a scene
+     * @param scene the scene
+     * @param apply applies the settings of a section to the parameters of the model, used to reject the keys it
+     *              does not read
+     * @param error set to a description of the problem if the sweep is invalid
+     * @return true if the sweep was read
+     */
+    bool fromScene(const SceneConfig &scene, const function<void(const SceneSection &)> &apply, string &error) {
+        const SceneSection &section = scene.section("ensemble");
+        string sample = section.getString("sample", "grid");
+        if (sample != "grid" && sample != "random") {
+            error = "ensemble: unknown sample " + sample + ", expected grid or random";
+            return false;
+        }
+        SceneSection probe("variant");
+        apply(probe);
+        axes.clear();
+        variants.clear();
+        for (const string &line : section.getAll("vary")) {
+            istringstream in(line);
+            Axis axis;
+            axis.logarithmic = false;
+            in >> axis.key;
+            string token;
+            while (in >> token) {
+                char *end;
+                double value = strtod(token.c_str(), &end);
+                if (token == "log" && sample == "random")
+                    axis.logarithmic = true;
+                else if (end != token.c_str() && *end == '\0')
+                    axis.values.push_back(value);
+                else {
+                    error = "ensemble: invalid value '" + token + "' in vary = " + line;
+                    return false;
+                }
+            }
+            if (axis.key.empty() || axis.values.empty() || (sample == "random" && axis.values.size() != 2) ||
+                (axis.logarithmic && std::min(axis.values[0], axis.values[1]) <= 0)) {
+                error = "ensemble: expected " + string(sample == "grid" ? "vary = key value..." :
+                                                       "vary = key low high [log] with positive bounds for log") +
+                        ", got vary = " + line;
+                return false;
+            }
+            if (!probe.wasAsked(axis.key)) {
+                error = "ensemble: unknown key " + axis.key + " in vary = " + line;
+                return false;
+            }
+            axes.push_back(axis);
+        }
+        if (axes.empty()) {
+            error = "ensemble: the [ensemble] section of the scene has no vary lines";
+            return false;
+        }
+        if (sample == "grid") {
+            size_t count = 1;
+            for (const Axis &axis : axes)
+                count *= axis.values.size();
+            for (size_t v = 0; v < count; ++v) {
+                vector<double> values;
+                for (size_t i = 0, rest = v; i < axes.size(); rest /= axes[i].values.size(), ++i)
+                    values.push_back(axes[i].values[rest % axes[i].values.size()]);
+                variants.push_back(values);
+            }
+        } else {
+            mt19937_64 random((uint64_t) section.getInt("seed", 1));
+            uniform_real_distribution<double> unit(0, 1);
+            long samples = std::max(section.getInt("samples", 16), 1L);
+            for (long v = 0; v < samples; ++v) {
+                vector<double> values;
+                for (const Axis &axis : axes) {
+                    double low = axis.values[0], high = axis.values[1], t = unit(random);
+                    values.push_back(axis.logarithmic ? low * pow(high / low, t) : low + (high - low) * t);
+                }
+                variants.push_back(values);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Returns the number of variants
+     * @return the number of variants including the baseline
+     */
+    size_t size() const {
+        return variants.size() + 1;
+    }
+
+    /**
+     * Returns the settings a variant overrides
+     * @param variant index of the variant, 0 for the baseline
+     * @return a section with one key per axis, empty for the baseline
+     */
+    SceneSection overrides(size_t variant) const {
+        SceneSection section("variant");
+        if (variant == 0)
+            return section;
+        for (size_t i = 0; i < axes.size(); ++i) {
+            ostringstream value;
+            value << setprecision(17) << variants[variant - 1][i];
+            section.add(axes[i].key, value.str());
+        }
+        return section;
+    }
+
+    /**
+     * Describes the settings of a variant
+     * @param variant index of the variant, 0 for the baseline
+     * @return "key=value" for every axis, or "baseline"
+     */
+    string describe(size_t variant) const {
+        if (variant == 0)
+            return "baseline";
+        ostringstream out;
+        for (size_t i = 0; i < axes.size(); ++i)
+            out << (i ? " " : "") << axes[i].key << "=" << setprecision(4) << variants[variant - 1][i];
+        return out.str();
+    }
+};
+
+/**
+ * Outcome of simulating one variant
+ */
+struct EnsembleResult {
+    vector<dvec3> positions; // positions of the particles after the last step
+    double max_stretch = 0; // largest relative elongation of the cloth in any step
+    double runtime_ms = 0; // processor time spent stepping the variant, see threadMilliseconds
+
+    /**
+     * Returns the processor time of the calling thread, which unlike the wall time does not count the
+     * time other variants ran while the threads outnumber the cores
+     * @return the time in milliseconds
+     */
+    static double threadMilliseconds() {
+        timespec now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return now.tv_sec * 1e3 + now.tv_nsec * 1e-6;
+    }
+};
+
+/**
+ * Simulates all the variants of a sweep as independent tasks on a thread pool and prints a table
+ * of metrics per variant. Each task builds its cloth, steps it and keeps only the final positions,
+ * so at most one cloth per thread is alive at a time.
+ */
+class EnsembleRunner {
+    const ParameterSweep &sweep;
+    vector<EnsembleResult> results;
+    vector<dvec3> reference; // drape the variants are compared against, empty to use the baseline
+
+public:
+    /**
+     * Constructor
+     * @param sweep the variants to simulate
+     */
+    explicit EnsembleRunner(const ParameterSweep &sweep) : sweep(sweep) {}
+
+    /**
+     * Reads the reference drape from the last frame of a frame cache, e.g. one of a real garment or of
+     * a simulation at a higher resolution sampled at the particles of this one
+     * @param path path of the cache
+     * @param error set to a description of the problem if the cache cannot be read
+     * @return true if the reference was read
+     */
+    bool loadReference(const string &path, string &error) {
+        FrameCacheReader cache;
+        if (!cache.open(path, error))
+            return false;
+        if (cache.getNumFrames() == 0) {
+            error = path + " has no frames";
+            return false;
+        }
+        cache.readFrame(cache.getNumFrames() - 1, reference);
+        return true;
+    }
+
+    /**
+     * Simulates every variant
+     * @param threads number of threads, 0 for one per core
+     * @param simulate simulates the variant with the given overrides and fills in its result;
+     *                 called concurrently for different variants
+     */
+    void run(unsigned threads, const function<void(const SceneSection &, EnsembleResult &)> &simulate) {
+        results.assign(sweep.size(), EnsembleResult());
+        TaskScheduler scheduler(threads);
+        TaskGraph graph;
+        for (size_t v = 0; v < sweep.size(); ++v)
+            graph.add([this, v, &simulate] { simulate(sweep.overrides(v), results[v]); });
+        scheduler.run(graph);
+    }
+
+    /**
+     * Prints the settings and metrics of every variant, ordered by the drape error. The drape error is the
+     * root mean square distance of the final positions from a reference drape, relative to its size.
+     * @param out stream to print to
+     * @param wall_ms wall time of the whole sweep
+     */
+    void print(ostream &out, double wall_ms) const {
+        const vector<dvec3> &target = reference.empty() ? results[0].positions : reference;
+        dvec3 low(numeric_limits<double>::max()), high(-numeric_limits<double>::max());
+        for (const dvec3 &p : target) {
+            low = glm::min(low, p);
+            high = glm::max(high, p);
+        }
+        double extent = target.empty() ? 1 : std::max(length(high - low), 1e-12);
+        vector<pair<double, size_t> > order;
+        for (size_t v = 0; v < results.size(); ++v) {
+            const vector<dvec3> &positions = results[v].positions;
+            double sum_squared = 0;
+            for (size_t i = 0; i < positions.size() && i < target.size(); ++i) {
+                dvec3 d = positions[i] - target[i];
+                sum_squared += dot(d, d);
+            }
+            double error = positions.size() == target.size() ?
+                           sqrt(sum_squared / std::max<size_t>(target.size(), 1)) / extent : HUGE_VAL;
+            order.push_back(make_pair(std::isfinite(error) ? error : HUGE_VAL, v));
+        }
+        stable_sort(order.begin(), order.end());
+        double total_ms = 0;
+        out << "variant  drape error   max stretch   runtime ms   settings" << endl;
+        for (auto &entry : order) {
+            const EnsembleResult &result = results[entry.second];
+            total_ms += result.runtime_ms;
+            out << setw(7) << entry.second << scientific << setprecision(3) << setw(13) << entry.first << setw(14)
+                << result.max_stretch << fixed << setprecision(1) << setw(13) << result.runtime_ms << "   "
+                << sweep.describe(entry.second) << defaultfloat << endl;
+        }
+        out << fixed << setprecision(1) << results.size() << " variants in " << wall_ms << " ms ("
+            << total_ms << " ms of stepping)" << defaultfloat << endl;
+    }
+};
+
+#endif //CLOTH_SIMULATION_ENSEMBLE_H
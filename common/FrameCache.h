@@ -0,0 +1,557 @@
+//
+// Compressed cache of the positions of every simulated frame, written on a background thread
+// and read back with random access by frame index (POSIX only).
+//
+
+#ifndef CLOTH_SIMULATION_FRAMECACHE_H
+#define CLOTH_SIMULATION_FRAMECACHE_H
+
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <glm/glm.hpp>
+#include "RangeCoder.h"
+
+using namespace std;
+using namespace glm;
+
+#define FRAME_CACHE_MAGIC "CLTHCACH"
+#define FRAME_CACHE_VERSION 1 // bumped whenever the layout or the coding of the frames changes
+#define FRAME_CACHE_KEYFRAME 1 // flag of a frame coded without reference to earlier frames
+
+/**
+ * Header at the start of a cache file. The frames follow it, each a FrameCacheRecord and its coded data,
+ * and the index of the frames follows the last frame.
+ */
+struct FrameCacheHeader {
+    char magic[8]; // FRAME_CACHE_MAGIC without the terminating zero
+    uint32_t version; // FRAME_CACHE_VERSION of the writer
+    uint32_t keyframe_interval; // number of frames from one keyframe to the next
+    double origin[3]; // position which is quantized to zero
+    double quantum; // size of a quantization step, twice the largest error of a position
+    uint64_t num_frames; // number of frames in the index, written when the cache is closed
+    uint64_t index_offset; // position of the index, 0 if the writer did not get to close the cache
+};
+
+/**
+ * Header of a coded frame
+ */
+struct FrameCacheRecord {
+    uint32_t num_particles;
+    uint32_t flags; // FRAME_CACHE_KEYFRAME or 0
+    uint64_t size; // number of bytes of coded data following the record
+};
+
+/**
+ * Codes the quantized positions of a frame. A keyframe predicts every coordinate from the same
+ * coordinate of the previous particle; any other frame predicts it from the same particle in the
+ * previous two frames, assuming it keeps its velocity, or in the previous frame right after a keyframe.
+ * The prediction residuals are range coded, in wrapping 32 bit arithmetic so that coding is lossless.
+ */
+class FrameCodec {
+    ResidualModel models[3]; // one per axis
+
+public:
+    /**
+     * Codes a frame
+     * @param current quantized coordinates of the frame, three per particle
+     * @param previous coordinates of the previous frame, nullptr for a keyframe
+     * @param older coordinates of the frame before the previous one, nullptr if it is not available
+     * @param count number of coordinates
+     * @param out buffer to which the coded frame is appended
+     */
+    void encode(const int32_t *current, const int32_t *previous, const int32_t *older, size_t count,
+                vector<uint8_t> &out) {
+        for (ResidualModel &model : models)
+            model.reset();
+        RangeEncoder encoder(out);
+        int contexts[3] = {0, 0, 0};
+        for (size_t i = 0; i < count; ++i) {
+            int axis = i % 3;
+            uint32_t residual = (uint32_t) current[i] - predict(current, previous, older, i);
+            contexts[axis] = ResidualModel::context(models[axis].encode(encoder, contexts[axis], residual));
+        }
+        encoder.finish();
+    }
+
+    /**
+     * Decodes a frame coded by encode with the same reference frames
+     * @param data the coded frame
+     * @param size number of bytes of the coded frame
+     * @param current filled with the quantized coordinates of the frame
+     * @param previous coordinates of the previous frame, nullptr for a keyframe
+     * @param older coordinates of the frame before the previous one, nullptr if it is not available
+     * @param count number of coordinates
+     */
+    void decode(const uint8_t *data, size_t size, int32_t *current, const int32_t *previous, const int32_t *older,
+                size_t count) {
+        for (ResidualModel &model : models)
+            model.reset();
+        RangeDecoder decoder(data, size);
+        int contexts[3] = {0, 0, 0};
+        for (size_t i = 0; i < count; ++i) {
+            int axis = i % 3, length;
+            uint32_t residual = models[axis].decode(decoder, contexts[axis], length);
+            current[i] = (int32_t) (predict(current, previous, older, i) + residual);
+            contexts[axis] = ResidualModel::context(length);
+        }
+    }
+
+private:
+    static uint32_t predict(const int32_t *current, const int32_t *previous, const int32_t *older, size_t i) {
+        if (!previous)
+            return i >= 3 ? (uint32_t) current[i - 3] : 0;
+        if (!older)
+            return (uint32_t) previous[i];
+        return 2 * (uint32_t) previous[i] - (uint32_t) older[i];
+    }
+};
+
+/**
+ * Streams the positions of every frame to a cache file. The positions are quantized to a fixed
+ * error bound relative to the bounding box of the first frame, coded with FrameCodec and written
+ * by a background thread: adding a frame only copies its positions into a recycled buffer. A frame which does not
+ * fit the range of the quantization ends the cache with an error, leaving the frames before it readable.
+ */
+class FrameCacheWriter {
+    int fd;
+    double error_bound; // largest error of a position relative to the diagonal of the first frame
+    FrameCacheHeader header;
+
+    thread worker;
+    mutex queue_mutex; // guards everything below up to the state of the worker
+    condition_variable queue_changed;
+    deque<vector<dvec3> > queue; // frames waiting to be coded
+    vector<vector<dvec3> > spare; // buffers of frames which have been written, reused for new frames
+    bool stopping;
+    string failure; // first error of the worker
+    size_t peak_queue_length;
+
+    //state of the worker
+    vector<uint64_t> offsets; // position of every frame written so far
+    uint64_t end_offset;
+    vector<int32_t> current, previous, older;
+    uint32_t frames_since_keyframe;
+    vector<uint8_t> buffer;
+
+    FrameCacheWriter(const FrameCacheWriter &);
+    FrameCacheWriter &operator=(const FrameCacheWriter &);
+
+    bool writeAll(const void *data, size_t size, uint64_t offset) {
+        const char *bytes = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t written = pwrite(fd, bytes, size, offset);
+            if (written <= 0)
+                return false;
+            bytes += written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    /**
+     * Quantizes, codes and writes a frame
+     * @param positions the positions of the particles
+     * @param error set to a description of the problem if the frame could not be written
+     * @return false if the frame could not be written
+     */
+    bool writeFrame(const vector<dvec3> &positions, string &error) {
+        if (offsets.empty()) {
+            //fix the grid from the bounding box of the first frame
+            dvec3 low(0), high(0);
+            if (!positions.empty())
+                low = high = positions[0];
+            for (const dvec3 &p : positions) {
+                low = glm::min(low, p);
+                high = glm::max(high, p);
+            }
+            double diagonal = length(high - low);
+            for (int axis = 0; axis < 3; ++axis)
+                header.origin[axis] = low[axis];
+            header.quantum = 2 * error_bound * (diagonal > 0 ? diagonal : 1);
+            end_offset = sizeof(FrameCacheHeader);
+            if (!writeAll(&header, sizeof(header), 0)) {
+                error = string("cannot write the frame cache: ") + strerror(errno);
+                return false;
+            }
+        }
+        previous.swap(older);
+        current.swap(previous);
+        current.resize(3 * positions.size());
+        double scale = 1 / header.quantum;
+        for (size_t i = 0; i < positions.size(); ++i) {
+            for (int axis = 0; axis < 3; ++axis) {
+                double q = round((positions[i][axis] - header.origin[axis]) * scale);
+                if (!(q >= -2147483648.0 && q <= 2147483647.0)) { // also catches a position which is not finite
+                    ostringstream out;
+                    out << "cannot write frame " << offsets.size() << " to the frame cache: particle " << i
+                        << " at " << positions[i].x << " " << positions[i].y << " " << positions[i].z
+                        << " is out of the range of the quantization fixed by the first frame";
+                    error = out.str();
+                    return false;
+                }
+                current[3 * i + axis] = (int32_t) q;
+            }
+        }
+
+        bool keyframe = offsets.size() % header.keyframe_interval == 0 || current.size() != previous.size();
+        frames_since_keyframe = keyframe ? 0 : frames_since_keyframe + 1;
+        FrameCacheRecord record;
+        record.num_particles = positions.size();
+        record.flags = keyframe ? FRAME_CACHE_KEYFRAME : 0;
+        buffer.resize(sizeof(record));
+        FrameCodec codec;
+        codec.encode(current.data(), keyframe ? nullptr : previous.data(),
+                     frames_since_keyframe >= 2 ? older.data() : nullptr, current.size(), buffer);
+        buffer.resize((buffer.size() + 7) / 8 * 8); // keep the records aligned in the mapped file
+        record.size = buffer.size() - sizeof(record);
+        memcpy(buffer.data(), &record, sizeof(record));
+        if (!writeAll(buffer.data(), buffer.size(), end_offset)) {
+            error = string("cannot write the frame cache: ") + strerror(errno);
+            return false;
+        }
+        offsets.push_back(end_offset);
+        end_offset += buffer.size();
+        return true;
+    }
+
+    void run() {
+        unique_lock<mutex> lock(queue_mutex);
+        while (true) {
+            queue_changed.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty())
+                return;
+            vector<dvec3> positions;
+            positions.swap(queue.front());
+            queue.pop_front();
+            bool failed = !failure.empty();
+            lock.unlock();
+            string error;
+            bool written = failed || writeFrame(positions, error);
+            lock.lock();
+            if (!written)
+                failure = error;
+            spare.push_back(move(positions));
+        }
+    }
+
+public:
+    FrameCacheWriter() : fd(-1), error_bound(0), stopping(false), peak_queue_length(0), end_offset(0),
+                         frames_since_keyframe(0) {}
+
+    ~FrameCacheWriter() {
+        string error;
+        close(error);
+    }
+
+    /**
+     * Creates a cache file and starts the thread which writes it
+     * @param path path of the file
+     * @param error largest error of a position relative to the diagonal of the bounding box of the first frame
+     * @param keyframe_interval number of frames from one keyframe to the next, which bounds the work of a random access
+     * @param error_message set to a description of the problem if the file cannot be created
+     * @return true if the cache was created
+     */
+    bool open(const string &path, double error, uint32_t keyframe_interval, string &error_message) {
+        close(error_message);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error_message = "cannot create " + path + ": " + strerror(errno);
+            return false;
+        }
+        error_bound = error;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, FRAME_CACHE_MAGIC, sizeof(header.magic));
+        header.version = FRAME_CACHE_VERSION;
+        header.keyframe_interval = std::max(keyframe_interval, 1u);
+        offsets.clear();
+        end_offset = 0;
+        stopping = false;
+        failure.clear();
+        peak_queue_length = 0;
+        worker = thread(&FrameCacheWriter::run, this);
+        return true;
+    }
+
+    /**
+     * Returns whether a cache is being written
+     * @return true between open and close
+     */
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    /**
+     * Queues the positions of the next frame. Never waits for the disk.
+     * @param positions the positions of the particles
+     */
+    void addFrame(const vector<dvec3> &positions) {
+        lock_guard<mutex> lock(queue_mutex);
+        if (spare.empty()) {
+            queue.push_back(positions);
+        } else {
+            queue.push_back(move(spare.back()));
+            spare.pop_back();
+            queue.back().assign(positions.begin(), positions.end());
+        }
+        peak_queue_length = std::max(peak_queue_length, queue.size());
+        queue_changed.notify_one();
+    }
+
+    /**
+     * Writes the frames still queued and the index, and closes the file
+     * @param error set to a description of the first problem if not all frames could be written
+     * @return true if the complete cache was written
+     */
+    bool close(string &error) {
+        if (fd < 0)
+            return true;
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            stopping = true;
+            queue_changed.notify_one();
+        }
+        worker.join();
+        if (failure.empty()) {
+            header.num_frames = offsets.size();
+            header.index_offset = offsets.empty() ? 0 : end_offset;
+            if (offsets.empty())
+                end_offset = sizeof(header);
+            if (!writeAll(offsets.data(), offsets.size() * sizeof(uint64_t), end_offset) ||
+                !writeAll(&header, sizeof(header), 0))
+                failure = string("cannot write the frame cache: ") + strerror(errno);
+        }
+        ::close(fd);
+        fd = -1;
+        error = failure;
+        return failure.empty();
+    }
+
+    /**
+     * Returns the number of frames written so far
+     * @return the number of frames, exact once the cache is closed
+     */
+    size_t getNumFrames() const {
+        return offsets.size();
+    }
+
+    /**
+     * Returns the size of the frames written so far
+     * @return the number of bytes, exact once the cache is closed
+     */
+    uint64_t getBytesWritten() const {
+        return end_offset;
+    }
+
+    /**
+     * Returns the largest number of frames which were waiting to be written at the same time
+     * @return the number of frames
+     */
+    size_t getPeakQueueLength() const {
+        return peak_queue_length;
+    }
+};
+
+/**
+ * Maps a cache file and decodes any frame of it. Decoding starts at the nearest keyframe before
+ * the requested frame, or continues from the last decoded frame when reading forward.
+ * A cache whose writer did not get to close it can still be read up to its last complete frame.
+ */
+class FrameCacheReader {
+    void *data;
+    size_t size;
+    const FrameCacheHeader *header;
+    vector<uint64_t> offsets; // position of every frame
+
+    long decoded; // frame held in current, -1 if none
+    long decoded_keyframe; // keyframe from which current was decoded
+    vector<int32_t> current, previous, older;
+    FrameCodec codec;
+
+    FrameCacheReader(const FrameCacheReader &);
+    FrameCacheReader &operator=(const FrameCacheReader &);
+
+    const FrameCacheRecord *record(size_t frame) const {
+        return reinterpret_cast<const FrameCacheRecord *>(static_cast<const char *>(data) + offsets[frame]);
+    }
+
+    /**
+     * Fills the index by walking through the frames, for a cache which was not closed
+     */
+    void scanFrames() {
+        uint64_t offset = sizeof(FrameCacheHeader);
+        while (offset + sizeof(FrameCacheRecord) <= size) {
+            const FrameCacheRecord *r =
+                    reinterpret_cast<const FrameCacheRecord *>(static_cast<const char *>(data) + offset);
+            if (r->size > size - offset - sizeof(FrameCacheRecord))
+                break;
+            offsets.push_back(offset);
+            offset += sizeof(FrameCacheRecord) + r->size;
+        }
+    }
+
+    /**
+     * Decodes the frame following the decoded one, or the given keyframe
+     */
+    void decodeNext(size_t frame) {
+        const FrameCacheRecord *r = record(frame);
+        bool keyframe = (r->flags & FRAME_CACHE_KEYFRAME) != 0;
+        if (keyframe)
+            decoded_keyframe = frame;
+        older.swap(previous);
+        previous.swap(current);
+        current.resize(3 * (size_t) r->num_particles);
+        codec.decode(reinterpret_cast<const uint8_t *>(r + 1), r->size, current.data(),
+                     keyframe ? nullptr : previous.data(), (long) frame - decoded_keyframe >= 2 ? older.data() : nullptr,
+                     current.size());
+        decoded = frame;
+    }
+
+public:
+    FrameCacheReader() : data(nullptr), size(0), header(nullptr), decoded(-1), decoded_keyframe(-1) {}
+
+    ~FrameCacheReader() {
+        close();
+    }
+
+    /**
+     * Maps a cache file
+     * @param path path of the file
+     * @param error set to a description of the problem if the file cannot be used
+     * @return true if the cache was mapped
+     */
+    bool open(const string &path, string &error) {
+        close();
+        error.clear();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            error = "cannot open " + path + ": " + strerror(errno);
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(FrameCacheHeader)) {
+            ::close(fd);
+            error = path + " is not a frame cache";
+            return false;
+        }
+        size = st.st_size;
+        data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            data = nullptr;
+            error = "cannot map " + path + ": " + strerror(errno);
+            return false;
+        }
+        header = static_cast<const FrameCacheHeader *>(data);
+        if (memcmp(header->magic, FRAME_CACHE_MAGIC, sizeof(header->magic)) != 0) {
+            error = path + " is not a frame cache";
+        } else if (header->version != FRAME_CACHE_VERSION) {
+            error = path + " has version " + to_string(header->version) + ", expected " +
+                    to_string(FRAME_CACHE_VERSION);
+        } else if (header->index_offset == 0 || header->index_offset > size ||
+                   header->num_frames > (size - header->index_offset) / sizeof(uint64_t)) {
+            scanFrames(); //not closed or cut off: use the frames which are complete
+        } else {
+            const uint64_t *index = reinterpret_cast<const uint64_t *>(static_cast<const char *>(data) +
+                                                                      header->index_offset);
+            offsets.assign(index, index + header->num_frames);
+            for (uint64_t offset : offsets) {
+                if (offset < sizeof(FrameCacheHeader) || offset > header->index_offset - sizeof(FrameCacheRecord) ||
+                    reinterpret_cast<const FrameCacheRecord *>(static_cast<const char *>(data) + offset)->size >
+                    header->index_offset - offset - sizeof(FrameCacheRecord)) {
+                    error = path + " has a corrupt index";
+                    break;
+                }
+            }
+        }
+        if (error.empty() && !offsets.empty() && !(record(0)->flags & FRAME_CACHE_KEYFRAME))
+            error = path + " does not start with a keyframe";
+        if (error.empty())
+            return true;
+        close();
+        return false;
+    }
+
+    /**
+     * Unmaps the cache
+     */
+    void close() {
+        if (data)
+            munmap(data, size);
+        data = nullptr;
+        header = nullptr;
+        offsets.clear();
+        decoded = decoded_keyframe = -1;
+    }
+
+    /**
+     * Returns the number of frames in the cache
+     * @return the number of frames
+     */
+    size_t getNumFrames() const {
+        return offsets.size();
+    }
+
+    /**
+     * Returns the number of frames from one keyframe to the next
+     * @return the keyframe interval
+     */
+    uint32_t getKeyframeInterval() const {
+        return header->keyframe_interval;
+    }
+
+    /**
+     * Returns the largest error of a decoded position
+     * @return half the quantization step
+     */
+    double getErrorBound() const {
+        return header->quantum / 2;
+    }
+
+    /**
+     * Returns the number of particles of a frame
+     * @param frame index of the frame, which must exist
+     * @return the number of particles
+     */
+    size_t getNumParticles(size_t frame) const {
+        return record(frame)->num_particles;
+    }
+
+    /**
+     * Returns the keyframe from which a frame is decoded
+     * @param frame index of the frame, which must exist
+     * @return index of the last keyframe up to the frame
+     */
+    size_t getKeyframe(size_t frame) const {
+        while (!(record(frame)->flags & FRAME_CACHE_KEYFRAME))
+            --frame;
+        return frame;
+    }
+
+    /**
+     * Decodes the positions of a frame
+     * @param frame index of the frame, starting at 0
+     * @param positions filled with the positions of the particles
+     * @return false if the cache has no such frame
+     */
+    bool readFrame(size_t frame, vector<dvec3> &positions) {
+        if (frame >= offsets.size())
+            return false;
+        size_t keyframe = getKeyframe(frame);
+        size_t start = keyframe;
+        if (decoded >= 0 && decoded_keyframe == (long) keyframe && (size_t) decoded <= frame)
+            start = decoded + 1;
+        for (size_t f = start; f <= frame; ++f)
+            decodeNext(f);
+        positions.resize(current.size() / 3);
+        dvec3 origin(header->origin[0], header->origin[1], header->origin[2]);
+        for (size_t i = 0; i < positions.size(); ++i)
+            positions[i] = origin + dvec3(current[3 * i], current[3 * i + 1], current[3 * i + 2]) * header->quantum;
+        return true;
+    }
+};
+
+#endif //CLOTH_SIMULATION_FRAMECACHE_H
@@ -0,0 +1,272 @@
+//
+// Playback of a frame cache with random access for scrubbing, independent of the solvers.
+//
+
+#ifndef CLOTH_SIMULATION_FRAMEPLAYER_H
+#define CLOTH_SIMULATION_FRAMEPLAYER_H
+
+#include <bits/stdc++.h>
+#include "FrameCache.h"
+
+using namespace std;
+
+#define FRAME_PLAYER_CACHED_FRAMES 96 // decoded frames kept around the one shown
+#define FRAME_PLAYER_PREFETCH_AHEAD 32 // frames decoded in advance in the direction of playback or scrubbing
+#define FRAME_PLAYER_PREFETCH_BEHIND 8 // frames decoded in advance in the other direction
+
+/**
+ * Plays a frame cache back. The cache stays memory mapped and only the frames which are shown, or
+ * are likely to be shown next, are decoded: a helper thread decodes the neighbours of the shown frame,
+ * mostly in the direction the user is moving in, into a small cache of decoded frames.
+ */
+class FramePlayer {
+    typedef shared_ptr<const vector<dvec3> > Frame;
+
+    FrameCacheReader reader; // decodes frames which were not prefetched, on the calling thread
+    FrameCacheReader prefetch_reader; // decodes on the helper thread
+    size_t num_frames;
+    size_t shown; // frame shown last
+    bool playing;
+
+    thread prefetcher;
+    mutex frames_mutex; // guards everything below
+    condition_variable request_changed;
+    map<size_t, Frame> frames; // decoded frames
+    size_t target; // frame around which the helper thread decodes
+    int direction; // 1 when moving forward, -1 when moving back
+    bool request_pending, stopping;
+    unsigned long hits, misses;
+
+    FramePlayer(const FramePlayer &);
+    FramePlayer &operator=(const FramePlayer &);
+
+    /**
+     * Drops the decoded frames farthest from the target until the cache fits. Requires frames_mutex.
+     */
+    void evict() {
+        while (frames.size() > FRAME_PLAYER_CACHED_FRAMES) {
+            auto first = frames.begin(), last = prev(frames.end());
+            if (target - min(target, first->first) > last->first - min(last->first, target))
+                frames.erase(first);
+            else
+                frames.erase(last);
+        }
+    }
+
+    /**
+     * Lists the frames to prefetch around a target. Frames are grouped by the keyframe they are decoded
+     * from, nearest group first, and ascending within a group so that each group is decoded in one pass.
+     */
+    vector<size_t> prefetchOrder(size_t around, int towards) {
+        size_t ahead = towards > 0 ? FRAME_PLAYER_PREFETCH_AHEAD : FRAME_PLAYER_PREFETCH_BEHIND;
+        size_t behind = towards > 0 ? FRAME_PLAYER_PREFETCH_BEHIND : FRAME_PLAYER_PREFETCH_AHEAD;
+        size_t low = around - min(around, behind), high = min(around + ahead, num_frames - 1);
+        map<size_t, vector<size_t> > groups; // frames by the keyframe they are decoded from, ascending
+        for (size_t f = low; f <= high; ++f) {
+            if (f != around)
+                groups[prefetch_reader.getKeyframe(f)].push_back(f);
+        }
+        vector<pair<size_t, size_t> > order; // (distance of the nearest frame of the group, keyframe)
+        for (auto &group : groups) {
+            size_t distance = SIZE_MAX;
+            for (size_t f : group.second)
+                distance = min(distance, f > around ? f - around : around - f);
+            order.push_back(make_pair(distance, group.first));
+        }
+        sort(order.begin(), order.end());
+        vector<size_t> result;
+        for (auto &entry : order)
+            result.insert(result.end(), groups[entry.second].begin(), groups[entry.second].end());
+        return result;
+    }
+
+    void run() {
+        unique_lock<mutex> lock(frames_mutex);
+        while (true) {
+            request_changed.wait(lock, [this] { return stopping || request_pending; });
+            if (stopping)
+                return;
+            request_pending = false;
+            size_t around = target;
+            int towards = direction;
+            lock.unlock();
+            vector<size_t> order = prefetchOrder(around, towards);
+            lock.lock();
+            for (size_t f : order) {
+                if (request_pending || stopping)
+                    break; //the user moved on, start over around the new frame
+                if (frames.count(f))
+                    continue;
+                lock.unlock();
+                shared_ptr<vector<dvec3> > positions = make_shared<vector<dvec3> >();
+                prefetch_reader.readFrame(f, *positions);
+                lock.lock();
+                frames.insert(make_pair(f, Frame(positions)));
+                evict();
+            }
+        }
+    }
+
+public:
+    FramePlayer() : num_frames(0), shown(0), playing(false), target(0), direction(1), request_pending(false),
+                    stopping(false), hits(0), misses(0) {}
+
+    ~FramePlayer() {
+        close();
+    }
+
+    /**
+     * Maps a frame cache and starts the helper thread
+     * @param path path of the cache
+     * @param error set to a description of the problem if the cache cannot be played
+     * @return true if the cache can be played
+     */
+    bool open(const string &path, string &error) {
+        close();
+        if (!reader.open(path, error) || !prefetch_reader.open(path, error))
+            return false;
+        num_frames = reader.getNumFrames();
+        if (num_frames == 0) {
+            error = path + " has no frames";
+            return false;
+        }
+        shown = target = 0;
+        direction = 1;
+        stopping = request_pending = false;
+        prefetcher = thread(&FramePlayer::run, this);
+        return true;
+    }
+
+    /**
+     * Stops the helper thread and unmaps the cache
+     */
+    void close() {
+        if (prefetcher.joinable()) {
+            {
+                lock_guard<mutex> lock(frames_mutex);
+                stopping = true;
+                request_changed.notify_one();
+            }
+            prefetcher.join();
+        }
+        frames.clear();
+        reader.close();
+        prefetch_reader.close();
+        num_frames = 0;
+    }
+
+    /**
+     * Returns the number of frames of the cache
+     * @return the number of frames
+     */
+    size_t getNumFrames() const {
+        return num_frames;
+    }
+
+    /**
+     * Returns the number of particles in the frames of the cache
+     * @return the number of particles of the first frame
+     */
+    size_t getNumParticles() const {
+        return reader.getNumParticles(0);
+    }
+
+    /**
+     * Returns the frame shown last
+     * @return index of the frame
+     */
+    size_t getCurrentFrame() const {
+        return shown;
+    }
+
+    /**
+     * Returns whether the frames advance on their own
+     * @return true while playing
+     */
+    bool isPlaying() const {
+        return playing;
+    }
+
+    /**
+     * Starts or pauses playback
+     * @param play true to play
+     */
+    void setPlaying(bool play) {
+        playing = play;
+    }
+
+    /**
+     * Moves to a frame, clamped to the frames of the cache
+     * @param frame index of the frame
+     */
+    void seek(long frame) {
+        shown = (size_t) std::max(0L, std::min(frame, (long) num_frames - 1));
+    }
+
+    /**
+     * Moves a number of frames forward or back
+     * @param count number of frames, negative to move back
+     */
+    void skip(long count) {
+        seek((long) shown + count);
+    }
+
+    /**
+     * Advances to the next frame while playing, pausing at the last one
+     */
+    void advance() {
+        if (!playing)
+            return;
+        if (shown + 1 < num_frames)
+            ++shown;
+        else
+            playing = false;
+    }
+
+    /**
+     * Returns the positions of the current frame, decoding it if it was not prefetched,
+     * and asks the helper thread to prefetch its neighbours
+     * @return the positions of the particles; stays valid as long as the caller holds it
+     */
+    Frame currentFrame() {
+        unique_lock<mutex> lock(frames_mutex);
+        Frame result;
+        auto found = frames.find(shown);
+        if (found != frames.end()) {
+            result = found->second;
+            ++hits;
+        } else {
+            lock.unlock();
+            shared_ptr<vector<dvec3> > positions = make_shared<vector<dvec3> >();
+            reader.readFrame(shown, *positions);
+            result = positions;
+            lock.lock();
+            frames.insert(make_pair(shown, result));
+            ++misses;
+        }
+        if (shown != target) {
+            direction = shown > target ? 1 : -1;
+            target = shown;
+            request_pending = true;
+            evict();
+            request_changed.notify_one();
+        } else if (hits + misses == 1) {
+            request_pending = true; //prefetch around the first frame shown
+            request_changed.notify_one();
+        }
+        return result;
+    }
+
+    /**
+     * Returns how many of the frames shown had already been decoded by the helper thread
+     * @param prefetched set to the number of frames which had been decoded in advance
+     * @param decoded set to the number of frames which had to be decoded when they were shown
+     */
+    void getStatistics(unsigned long &prefetched, unsigned long &decoded) {
+        lock_guard<mutex> lock(frames_mutex);
+        prefetched = hits;
+        decoded = misses;
+    }
+};
+
+#endif //CLOTH_SIMULATION_FRAMEPLAYER_H
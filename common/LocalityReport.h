@@ -0,0 +1,178 @@
+//
+// Cache behaviour of a cloth whose particles are in their original order measured against the same cloth reordered.
+//
+
+#ifndef CLOTH_SIMULATION_LOCALITYREPORT_H
+#define CLOTH_SIMULATION_LOCALITYREPORT_H
+
+#include <bits/stdc++.h>
+#include <glm/glm.hpp>
+#include "PerfCounters.h"
+
+using namespace std;
+using namespace glm;
+
+#define CACHE_MODEL_BYTES 32768 // size of the modelled cache, a typical first level data cache
+#define CACHE_MODEL_WAYS 8 // associativity of the modelled cache
+#define CACHE_MODEL_LINE 64 // bytes per cache line
+
+/**
+ * A set associative cache with least recently used replacement, fed with the addresses the loops of a step
+ * touch. It counts the misses of those loops the same way on every machine, unlike the hardware counters
+ * which are often unavailable and include everything else the process does.
+ */
+class CacheModel {
+    vector<uint64_t> lines; // the lines held by each set, most recently used first
+    uint64_t num_sets;
+
+public:
+    uint64_t accesses, misses;
+
+    CacheModel() : lines(CACHE_MODEL_BYTES / CACHE_MODEL_LINE, UINT64_MAX),
+                   num_sets(CACHE_MODEL_BYTES / CACHE_MODEL_LINE / CACHE_MODEL_WAYS), accesses(0), misses(0) {}
+
+    /**
+     * Reads an object
+     * @param address address of the object
+     * @param bytes size of the object, every line of which is read
+     */
+    void access(const void *address, size_t bytes) {
+        uint64_t first = (uint64_t) (uintptr_t) address / CACHE_MODEL_LINE;
+        uint64_t last = ((uint64_t) (uintptr_t) address + std::max<size_t>(bytes, 1) - 1) / CACHE_MODEL_LINE;
+        for (uint64_t line = first; line <= last; ++line) {
+            uint64_t *set = &lines[(line % num_sets) * CACHE_MODEL_WAYS];
+            int way = 0;
+            while (way < CACHE_MODEL_WAYS - 1 && set[way] != line)
+                ++way;
+            ++accesses;
+            if (set[way] != line)
+                ++misses; //the least recently used line is evicted
+            for (; way > 0; --way)
+                set[way] = set[way - 1];
+            set[0] = line;
+        }
+    }
+
+    /**
+     * Reads an object
+     * @param value the object
+     */
+    template<typename T>
+    void access(const T &value) {
+        access(&value, sizeof(T));
+    }
+};
+
+/**
+ * Compares a cloth in the original order of its particles with the same cloth reordered along a space filling
+ * curve: the time per step, the misses of a modelled cache replaying the loops of a step and, when compiled
+ * with CLOTH_PERF_COUNTERS, the cache misses the hardware counted while stepping.
+ */
+class LocalityReport {
+    /**
+     * Totals of one of the two cloths
+     */
+    struct Side {
+        double ms; // time spent stepping
+        uint64_t hardware_misses; // cache misses counted by the hardware while stepping
+        uint64_t accesses, misses; // cache lines read and missed by the modelled cache in one step
+    };
+
+    string curve_name; // name of the curve the reordered cloth follows
+    Side sides[2]; // the original and the reordered cloth
+    unsigned long steps; // number of steps timed
+    bool counted; // whether the hardware counters were read
+    double max_deviation; // largest distance between corresponding particles of the two cloths
+    double extent; // size of the cloth
+
+public:
+    /**
+     * Constructor to initialize an empty report
+     * @param curve_name name of the curve the reordered cloth follows
+     * @param extent size of the cloth, e.g. its diagonal, against which deviations are compared
+     */
+    LocalityReport(const string &curve_name, double extent) : curve_name(curve_name), steps(0), counted(false),
+                                                              max_deviation(0), extent(extent) {
+        memset(sides, 0, sizeof(sides));
+    }
+
+    /**
+     * Runs a step of one of the cloths and adds its time and the cache misses the hardware counted
+     * @param reordered whether the step is one of the reordered cloth
+     * @param step function which runs the step
+     */
+    template<typename F>
+    void timeStep(bool reordered, F step) {
+#ifdef CLOTH_PERF_COUNTERS
+        PerfSample start, end;
+        PerfCounters::instance().sample(start);
+        step();
+        PerfCounters::instance().sample(end);
+        sides[reordered].ms += (end.wall - start.wall) / 1e6;
+        sides[reordered].hardware_misses += end.counts[2] - start.counts[2];
+        counted = counted || end.counts[0] != start.counts[0];
+#else
+        auto start = chrono::steady_clock::now();
+        step();
+        sides[reordered].ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+#endif
+        if (reordered) //the steps of both cloths are timed in turn
+            ++steps;
+    }
+
+    /**
+     * Records the misses of the modelled cache replaying one step of a cloth
+     * @param reordered whether the cloth is the reordered one
+     * @param cache the cache after the replay
+     */
+    void addModel(bool reordered, const CacheModel &cache) {
+        sides[reordered].accesses = cache.accesses;
+        sides[reordered].misses = cache.misses;
+    }
+
+    /**
+     * Compares the positions of both cloths. A solver which sums forces over the particles gives the same positions
+     * up to rounding in any order; one which corrects the constraints one after the other, Gauss-Seidel style,
+     * converges along another path when their order changes.
+     * @param original positions of the original cloth
+     * @param reordered positions of the reordered cloth, put back into the original order
+     */
+    void compare(const vector<dvec3> &original, const vector<dvec3> &reordered) {
+        for (size_t i = 0; i < original.size() && i < reordered.size(); ++i)
+            max_deviation = std::max(max_deviation, length(original[i] - reordered[i]));
+        if (original.size() != reordered.size())
+            max_deviation = HUGE_VAL;
+    }
+
+    /**
+     * Prints the cost of both orders and the reduction of the misses
+     * @param out stream to print to
+     */
+    void print(ostream &out) const {
+        const char *names[2] = {"original", curve_name.c_str()};
+        out << "order        ms per step   modelled misses per step   miss rate";
+        if (counted)
+            out << "   hardware misses per step";
+        out << endl;
+        for (int s = 0; s < 2; ++s) {
+            out << left << setw(10) << names[s] << right << fixed << setprecision(3) << setw(14)
+                << sides[s].ms / std::max(steps, 1UL) << setw(27) << sides[s].misses << setprecision(2) << setw(11)
+                << 100.0 * sides[s].misses / std::max<uint64_t>(sides[s].accesses, 1) << "%";
+            if (counted)
+                out << setw(27) << sides[s].hardware_misses / std::max(steps, 1UL);
+            out << defaultfloat << endl;
+        }
+        out << fixed << setprecision(1) << "modelled misses " << 100.0 * (1 - (double) sides[1].misses /
+                                                                              std::max<uint64_t>(sides[0].misses, 1))
+            << "% fewer";
+        if (counted) {
+            out << ", hardware misses " << 100.0 * (1 - (double) sides[1].hardware_misses /
+                                                    std::max<uint64_t>(sides[0].hardware_misses, 1)) << "% fewer";
+        }
+        out << ", speedup " << setprecision(2) << sides[0].ms / std::max(sides[1].ms, 1e-9) << "x" << endl;
+        out << scientific << setprecision(3) << "largest deviation of the reordered cloth: " << max_deviation
+            << " (" << max_deviation / extent << " of its size)" << defaultfloat << endl;
+    }
+};
+
+#endif //CLOTH_SIMULATION_LOCALITYREPORT_H
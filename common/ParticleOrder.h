@@ -0,0 +1,187 @@
+//
+// Orders of the particles along space filling curves through their rest positions, for locality in memory.
+//
+
+#ifndef CLOTH_SIMULATION_PARTICLEORDER_H
+#define CLOTH_SIMULATION_PARTICLEORDER_H
+
+#include <bits/stdc++.h>
+#include <glm/glm.hpp>
+
+using namespace std;
+using namespace glm;
+
+#define CURVE_NONE 0 // keep the particles in the order they were created in
+#define CURVE_MORTON 1 // Z-order: interleave the bits of the coordinates
+#define CURVE_HILBERT 2 // Hilbert curve: consecutive cells are always adjacent
+#define CURVE_BITS 21 // bits per axis of the curve keys
+
+/**
+ * A permutation of the particles which sorts them along a space filling curve through their rest positions,
+ * so that particles which are close on the cloth are close in memory and the loops over constraints and
+ * triangles stay in cache. The permutation is kept in both directions, so that anything exported can be
+ * put back into the original order.
+ */
+class ParticleOrder {
+    vector<uint32_t> old_of_new; // original index of every particle in the new order
+    vector<uint32_t> new_of_old; // new index of every particle in the original order
+
+    /**
+     * Spreads the lower CURVE_BITS bits of a value to every third bit
+     */
+    static uint64_t spreadBits(uint64_t v) {
+        v &= (1u << CURVE_BITS) - 1;
+        v = (v | v << 32) & 0x1f00000000ffffULL;
+        v = (v | v << 16) & 0x1f0000ff0000ffULL;
+        v = (v | v << 8) & 0x100f00f00f00f00fULL;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+        v = (v | v << 2) & 0x1249249249249249ULL;
+        return v;
+    }
+
+public:
+    /**
+     * Returns the position of a cell along the Morton curve
+     * @param cell coordinates of the cell, CURVE_BITS bits each
+     * @return the key
+     */
+    static uint64_t mortonKey(uvec3 cell) {
+        return spreadBits(cell.x) | spreadBits(cell.y) << 1 | spreadBits(cell.z) << 2;
+    }
+
+    /**
+     * Returns the position of a cell along the Hilbert curve, using Skilling's transform of the
+     * coordinates into the transposed Hilbert index
+     * @param cell coordinates of the cell, CURVE_BITS bits each
+     * @return the key
+     */
+    static uint64_t hilbertKey(uvec3 cell) {
+        uint32_t x[3] = {cell.x, cell.y, cell.z};
+        for (uint32_t q = 1u << (CURVE_BITS - 1); q > 1; q >>= 1) {
+            uint32_t p = q - 1;
+            for (int i = 0; i < 3; ++i) {
+                //invert the low bits of x[0] if bit q of x[i] is set, else exchange them with x[i];
+                //branch free, since the bits are as good as random
+                uint32_t set = 0u - ((x[i] & q) != 0);
+                uint32_t t = (x[0] ^ x[i]) & p & ~set;
+                x[0] ^= (p & set) | t;
+                x[i] ^= t;
+            }
+        }
+        x[1] ^= x[0]; //Gray encode
+        x[2] ^= x[1];
+        uint32_t t = 0;
+        for (uint32_t q = 1u << (CURVE_BITS - 1); q > 1; q >>= 1) {
+            if (x[2] & q)
+                t ^= q - 1;
+        }
+        for (int i = 0; i < 3; ++i)
+            x[i] ^= t;
+        return spreadBits(x[2]) | spreadBits(x[1]) << 1 | spreadBits(x[0]) << 2;
+    }
+
+    /**
+     * Parses the name of a curve
+     * @param name "none", "morton" or "hilbert"
+     * @param curve set to the CURVE_* constant
+     * @return false if the name is unknown
+     */
+    static bool curveFromName(const string &name, int &curve) {
+        if (name == "none")
+            curve = CURVE_NONE;
+        else if (name == "morton")
+            curve = CURVE_MORTON;
+        else if (name == "hilbert")
+            curve = CURVE_HILBERT;
+        else
+            return false;
+        return true;
+    }
+
+    /**
+     * Sorts particles along a curve through their rest positions. Particles in the same cell keep their order.
+     * @param positions rest positions of the particles
+     * @param curve one of the CURVE_* constants
+     * @return the order
+     */
+    static ParticleOrder along(const vector<dvec3> &positions, int curve) {
+        ParticleOrder order;
+        order.old_of_new.resize(positions.size());
+        iota(order.old_of_new.begin(), order.old_of_new.end(), 0u);
+        if (curve != CURVE_NONE && !positions.empty()) {
+            dvec3 low(numeric_limits<double>::max()), high(-numeric_limits<double>::max());
+            for (const dvec3 &p : positions) {
+                low = glm::min(low, p);
+                high = glm::max(high, p);
+            }
+            //one scale for all axes keeps the cells cubic, so a flat garment is not stretched along its thin axis
+            double size = std::max(std::max(high.x - low.x, high.y - low.y), std::max(high.z - low.z, 1e-300));
+            double scale = ((1u << CURVE_BITS) - 1) / size;
+            vector<pair<uint64_t, uint32_t> > keys(positions.size()); // (key, original index)
+            for (uint32_t i = 0; i < positions.size(); ++i) {
+                uvec3 cell = uvec3((positions[i] - low) * scale);
+                keys[i] = make_pair(curve == CURVE_HILBERT ? hilbertKey(cell) : mortonKey(cell), i);
+            }
+            sort(keys.begin(), keys.end());
+            for (uint32_t i = 0; i < keys.size(); ++i)
+                order.old_of_new[i] = keys[i].second;
+        }
+        order.new_of_old.resize(positions.size());
+        for (uint32_t i = 0; i < order.old_of_new.size(); ++i)
+            order.new_of_old[order.old_of_new[i]] = i;
+        return order;
+    }
+
+    /**
+     * Returns the new index of a particle
+     * @param old_index index in the original order
+     * @return index in the new order
+     */
+    uint32_t toNew(uint32_t old_index) const {
+        return new_of_old[old_index];
+    }
+
+    /**
+     * Returns the original index of a particle
+     * @param new_index index in the new order
+     * @return index in the original order
+     */
+    uint32_t toOld(uint32_t new_index) const {
+        return old_of_new[new_index];
+    }
+
+    /**
+     * Returns the original index of every particle in the new order
+     * @return the indices
+     */
+    const vector<uint32_t> &originalIndices() const {
+        return old_of_new;
+    }
+
+    /**
+     * Moves values given per particle in the original order into the new order
+     * @param values one value per particle, replaced by the permuted values
+     */
+    template<typename T>
+    void apply(vector<T> &values) const {
+        vector<T> permuted;
+        permuted.reserve(values.size());
+        for (uint32_t old_index : old_of_new)
+            permuted.push_back(values[old_index]);
+        values.swap(permuted);
+    }
+
+    /**
+     * Moves values given per particle in the new order back into the original order
+     * @param values one value per particle, replaced by the values in the original order
+     */
+    template<typename T>
+    void restore(vector<T> &values) const {
+        vector<T> original(values.size());
+        for (size_t i = 0; i < values.size(); ++i)
+            original[old_of_new[i]] = values[i];
+        values.swap(original);
+    }
+};
+
+#endif //CLOTH_SIMULATION_PARTICLEORDER_H
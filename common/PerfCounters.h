@@ -0,0 +1,252 @@
+//
+// Hardware performance counters sampled around simulation phases (Linux only).
+//
+
+#ifndef CLOTH_SIMULATION_PERFCOUNTERS_H
+#define CLOTH_SIMULATION_PERFCOUNTERS_H
+
+#include <bits/stdc++.h>
+
+#ifdef CLOTH_PERF_COUNTERS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef CLOTH_PERF_COUNTERS
+#define PERF_SCOPE(name) PerfScope PROFILE_CONCAT(perf_scope_, __LINE__)(name)
+#define PERF_FRAME() PerfCounters::instance().nextFrame()
+#else
+#define PERF_SCOPE(name)
+#define PERF_FRAME()
+#endif
+
+#define PERF_NUM_COUNTERS 4 // cycles, instructions, cache misses and branch misses
+#define PERF_MAX_PHASES 32 // maximum number of distinct phases which can be counted
+
+#ifdef CLOTH_PERF_COUNTERS
+
+/**
+ * Values of all the counters at one point in time
+ */
+struct PerfSample {
+    uint64_t wall; // wall time in nanoseconds
+    uint64_t counts[PERF_NUM_COUNTERS];
+};
+
+/**
+ * Counts cycles, instructions, cache misses and branch misses per simulation phase using
+ * perf_event_open and writes them for every frame next to the wall time of the phase.
+ * Each thread opens its own group of counters, so phases run by worker threads are counted too.
+ * If the counters cannot be opened (e.g. because of perf_event_paranoid) only wall time is recorded.
+ */
+class PerfCounters {
+    struct Phase {
+        const char *name;
+        atomic<uint64_t> totals[PERF_NUM_COUNTERS + 1]; // wall time followed by the counters
+    };
+
+    Phase phases[PERF_MAX_PHASES];
+    atomic<int> num_phases;
+    mutex phases_mutex; // guards adding new phases
+    PerfSample frame_start; // counters of the main thread at the start of the frame
+    uint32_t frame;
+    ofstream out; // per frame report
+    atomic<bool> warned; // whether the failure to open the counters has been reported
+    bool warned_full; // whether a phase beyond PERF_MAX_PHASES has been reported, guarded by phases_mutex
+
+    PerfCounters() : num_phases(0), frame(0), warned(false), warned_full(false) {
+        const char *path = getenv("CLOTH_PERF_OUTPUT");
+        out.open(path ? path : "perf_counters.csv");
+        out << "frame,phase,wall_ms,cycles,instructions,ipc,cache_misses,branch_misses\n";
+        sample(frame_start);
+    }
+
+    /**
+     * Looks a phase up by its name, so that the same name written in different places is one phase
+     * @param name name of the phase
+     * @param n number of phases to search
+     * @return the phase, nullptr if none of the first n phases has the name
+     */
+    Phase *findPhase(const char *name, int n) {
+        for (int i = 0; i < n; ++i) {
+            if (phases[i].name == name || strcmp(phases[i].name, name) == 0)
+                return &phases[i];
+        }
+        return nullptr;
+    }
+
+    /**
+     * Opens a counter as part of the group of the calling thread
+     * @param config the hardware event to count
+     * @param group file descriptor of the group leader, -1 to open the leader
+     * @return the file descriptor of the counter, -1 on failure
+     */
+    static int openCounter(uint64_t config, int group) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = group == -1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+    }
+
+    /**
+     * Returns the group leader of the calling thread, opening the counters on first use
+     * @return the file descriptor of the group leader, -1 if the counters are unavailable
+     */
+    int threadGroup() {
+        thread_local int leader = -2;
+        if (leader != -2)
+            return leader;
+        static const uint64_t events[PERF_NUM_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                           PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        leader = openCounter(events[0], -1);
+        for (int i = 1; i < PERF_NUM_COUNTERS && leader >= 0; ++i) {
+            if (openCounter(events[i], leader) < 0) {
+                close(leader);
+                leader = -1;
+            }
+        }
+        if (leader >= 0)
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        else if (!warned.exchange(true))
+            cerr << "hardware performance counters are unavailable, recording wall time only" << endl;
+        return leader;
+    }
+
+public:
+    ~PerfCounters() {
+        out.flush();
+    }
+
+    /**
+     * Returns the counters of the process
+     * @return the counters
+     */
+    static PerfCounters &instance() {
+        static PerfCounters counters;
+        return counters;
+    }
+
+    /**
+     * Reads the wall time and the counters of the calling thread
+     * @param s sample to fill
+     */
+    void sample(PerfSample &s) {
+        struct {
+            uint64_t nr;
+            uint64_t values[PERF_NUM_COUNTERS];
+        } group = {0, {0}};
+        int leader = threadGroup();
+        if (leader < 0 || read(leader, &group, sizeof(group)) < (ssize_t) sizeof(group))
+            memset(&group, 0, sizeof(group));
+        s.wall = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now().time_since_epoch()).count();
+        for (int i = 0; i < PERF_NUM_COUNTERS; ++i)
+            s.counts[i] = group.values[i];
+    }
+
+    /**
+     * Adds the difference between two samples to the totals of a phase
+     * @param name name of the phase, which has to outlive the counters, e.g. a string literal
+     * @param start sample taken at the start of the phase
+     * @param end sample taken at the end of the phase
+     */
+    void accumulate(const char *name, const PerfSample &start, const PerfSample &end) {
+        Phase *phase = findPhase(name, num_phases.load(memory_order_acquire));
+        if (!phase) {
+            lock_guard<mutex> lock(phases_mutex);
+            int n = num_phases.load(memory_order_relaxed);
+            phase = findPhase(name, n);
+            if (!phase) {
+                if (n == PERF_MAX_PHASES) {
+                    if (!warned_full) {
+                        cerr << "more than " << PERF_MAX_PHASES << " phases, not counting " << name
+                             << " and any other new phase; raise PERF_MAX_PHASES" << endl;
+                        warned_full = true;
+                    }
+                    return;
+                }
+                phase = &phases[n];
+                phase->name = name;
+                for (int i = 0; i <= PERF_NUM_COUNTERS; ++i)
+                    phase->totals[i] = 0;
+                num_phases.store(n + 1, memory_order_release);
+            }
+        }
+        phase->totals[0].fetch_add(end.wall - start.wall, memory_order_relaxed);
+        for (int i = 0; i < PERF_NUM_COUNTERS; ++i)
+            phase->totals[i + 1].fetch_add(end.counts[i] - start.counts[i], memory_order_relaxed);
+    }
+
+    /**
+     * Writes the totals of every phase for the frame which just ended, followed by the
+     * counters of the whole frame on the main thread, and starts a new frame
+     */
+    void nextFrame() {
+        PerfSample now;
+        sample(now);
+        auto write = [&](const char *name, const uint64_t *totals) {
+            out << frame << "," << name << "," << totals[0] / 1e6;
+            for (int i = 1; i <= PERF_NUM_COUNTERS; ++i) {
+                out << ",";
+                if (i == 3)
+                    out << (totals[1] ? totals[2] / (double) totals[1] : 0.0) << ",";
+                out << totals[i];
+            }
+            out << "\n";
+        };
+        if (frame > 0) {
+            int n = num_phases.load(memory_order_acquire);
+            for (int p = 0; p < n; ++p) {
+                uint64_t totals[PERF_NUM_COUNTERS + 1];
+                for (int i = 0; i <= PERF_NUM_COUNTERS; ++i)
+                    totals[i] = phases[p].totals[i].exchange(0, memory_order_relaxed);
+                if (totals[0] > 0)
+                    write(phases[p].name, totals);
+            }
+            uint64_t totals[PERF_NUM_COUNTERS + 1] = {now.wall - frame_start.wall};
+            for (int i = 0; i < PERF_NUM_COUNTERS; ++i)
+                totals[i + 1] = now.counts[i] - frame_start.counts[i];
+            write("frame", totals);
+        }
+        frame_start = now;
+        ++frame;
+    }
+};
+
+/**
+ * Counts the scope it lives in and adds the counts to a phase
+ */
+class PerfScope {
+    const char *name;
+    PerfSample start;
+
+public:
+    /**
+     * Starts counting
+     * @param name name of the phase, which has to outlive the counters, e.g. a string literal
+     */
+    explicit PerfScope(const char *name) : name(name) {
+        PerfCounters::instance().sample(start);
+    }
+
+    ~PerfScope() {
+        PerfSample end;
+        PerfCounters &counters = PerfCounters::instance();
+        counters.sample(end);
+        counters.accumulate(name, start, end);
+    }
+};
+
+#endif //CLOTH_PERF_COUNTERS
+
+#endif //CLOTH_SIMULATION_PERFCOUNTERS_H
@@ -0,0 +1,86 @@
+//
+// Accuracy of a cloth simulated in single precision measured against the same cloth in double precision.
+//
+
+#ifndef CLOTH_SIMULATION_PRECISIONREPORT_H
+#define CLOTH_SIMULATION_PRECISIONREPORT_H
+
+#include <bits/stdc++.h>
+#include <glm/glm.hpp>
+
+using namespace std;
+using namespace glm;
+
+/**
+ * Collects how far the particles of a single precision cloth drift from the particles of the
+ * same cloth simulated in double precision, and how long each of the two took per step.
+ * The deviations are summed in double and reported relative to the size of the cloth.
+ */
+class PrecisionReport {
+    /**
+     * Deviation of the single precision cloth at one sampled step
+     */
+    struct Row {
+        unsigned long step;
+        double max_deviation; // largest distance between corresponding particles
+        double rms_deviation; // root mean square of the distances
+    };
+
+    double extent; // size of the cloth
+    vector<Row> rows;
+    double double_ms, single_ms; // total time spent stepping each cloth
+    unsigned long steps; // number of steps timed
+
+public:
+    /**
+     * Constructor to initialize an empty report
+     * @param extent size of the cloth, e.g. its diagonal, against which deviations are compared
+     */
+    explicit PrecisionReport(double extent) : extent(extent), double_ms(0), single_ms(0), steps(0) {}
+
+    /**
+     * Adds the time spent on one step of each cloth
+     * @param double_step_ms time of the step of the double precision cloth in milliseconds
+     * @param single_step_ms time of the step of the single precision cloth in milliseconds
+     */
+    void addTiming(double double_step_ms, double single_step_ms) {
+        double_ms += double_step_ms;
+        single_ms += single_step_ms;
+        ++steps;
+    }
+
+    /**
+     * Compares the positions of both cloths after a step
+     * @param step number of the step
+     * @param reference positions of the double precision cloth
+     * @param single positions of the single precision cloth, in the same order
+     */
+    void sample(unsigned long step, const vector<dvec3> &reference, const vector<dvec3> &single) {
+        double max_deviation = 0, sum_squared = 0;
+        for (size_t i = 0; i < reference.size(); ++i) {
+            double d = length(single[i] - reference[i]);
+            max_deviation = std::max(max_deviation, d);
+            sum_squared += d * d;
+        }
+        rows.push_back({step, max_deviation, sqrt(sum_squared / std::max<size_t>(reference.size(), 1))});
+    }
+
+    /**
+     * Prints the deviation at every sampled step and the cost of each precision
+     * @param out stream to print to
+     */
+    void print(ostream &out) {
+        out << "step      max deviation   rms deviation   max / size" << endl;
+        for (const Row &row : rows) {
+            out << setw(8) << row.step << scientific << setprecision(3) << setw(16) << row.max_deviation
+                << setw(16) << row.rms_deviation << setw(13) << row.max_deviation / extent << defaultfloat << endl;
+        }
+        if (steps > 0) {
+            out << fixed << setprecision(3) << "double: " << double_ms / steps << " ms per step, float: "
+                << single_ms / steps << " ms per step (" << setprecision(2) << double_ms / std::max(single_ms, 1e-9)
+                << "x)" << defaultfloat << endl;
+        }
+    }
+};
+
+#endif //CLOTH_SIMULATION_PRECISIONREPORT_H
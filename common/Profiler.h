@@ -0,0 +1,236 @@
+//
+// Scoped phase timers shared by both cloth models.
+//
+
+#ifndef CLOTH_SIMULATION_PROFILER_H
+#define CLOTH_SIMULATION_PROFILER_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+#define PROFILE_CONCAT_IMPL(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_IMPL(a, b)
+
+#include "PerfCounters.h"
+
+#ifdef CLOTH_PROFILE
+#define PROFILE_TIMER(name) ScopedTimer PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define PROFILE_TIMER_FRAME() Profiler::instance().nextFrame()
+#else
+#define PROFILE_TIMER(name)
+#define PROFILE_TIMER_FRAME()
+#endif
+
+// a phase is timed when compiled with CLOTH_PROFILE and counted when compiled with CLOTH_PERF_COUNTERS
+#define PROFILE_SCOPE(name) PROFILE_TIMER(name); PERF_SCOPE(name)
+#define PROFILE_FRAME() PROFILE_TIMER_FRAME(); PERF_FRAME()
+
+#define PROFILE_RESERVED_EVENTS (1 << 20) // number of events each thread can record before its buffer grows
+
+/**
+ * A single timed interval
+ */
+struct ProfileEvent {
+    const char *name; // name of the phase, must be a string literal
+    uint64_t start; // start of the interval in nanoseconds since the profiler was created
+    uint64_t duration; // length of the interval in nanoseconds
+    uint32_t frame; // frame during which the interval started
+};
+
+/**
+ * Collects timed intervals from all threads and writes them as a Chrome trace
+ * (which can be opened in chrome://tracing or Perfetto) along with a per-phase summary.
+ * Each thread records into its own buffer, so recording takes no locks.
+ */
+class Profiler {
+    struct ThreadBuffer {
+        uint32_t tid; // small id of the thread used in the trace
+        vector<ProfileEvent> events;
+    };
+
+    chrono::steady_clock::time_point epoch; // time from which all events are measured
+    atomic<uint32_t> frame; // number of the current frame
+    uint64_t frame_start; // start of the current frame
+    vector<ProfileEvent> frames; // one interval per completed frame
+    mutex buffers_mutex; // guards the list of thread buffers
+    vector<unique_ptr<ThreadBuffer> > buffers;
+    string output_path; // file to which the trace is written on exit, empty if none
+
+    Profiler() : epoch(chrono::steady_clock::now()), frame(0), frame_start(0) {
+        const char *path = getenv("CLOTH_TRACE");
+        output_path = path ? path : "trace.json";
+        frames.reserve(PROFILE_RESERVED_EVENTS);
+    }
+
+    /**
+     * Returns the buffer of the calling thread, creating it on first use
+     * @return the buffer of the calling thread
+     */
+    ThreadBuffer &threadBuffer() {
+        thread_local ThreadBuffer *buffer = nullptr;
+        if (!buffer) {
+            lock_guard<mutex> lock(buffers_mutex);
+            buffers.emplace_back(new ThreadBuffer());
+            buffer = buffers.back().get();
+            buffer->tid = buffers.size();
+            buffer->events.reserve(PROFILE_RESERVED_EVENTS);
+        }
+        return *buffer;
+    }
+
+    /**
+     * Returns the value at the given fraction of a sorted list
+     * @param sorted sorted values
+     * @param fraction fraction between 0 and 1
+     * @return the percentile
+     */
+    static double percentile(const vector<double> &sorted, double fraction) {
+        return sorted[min(sorted.size() - 1, (size_t) (fraction * (sorted.size() - 1) + 0.5))];
+    }
+
+public:
+    ~Profiler() {
+        if (output_path.empty())
+            return;
+        writeChromeTrace(output_path);
+        printSummary(cerr);
+    }
+
+    /**
+     * Returns the profiler of the process
+     * @return the profiler
+     */
+    static Profiler &instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    /**
+     * Returns the current time
+     * @return nanoseconds since the profiler was created
+     */
+    uint64_t now() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+    }
+
+    /**
+     * Returns the number of the current frame
+     * @return the frame number
+     */
+    uint32_t currentFrame() {
+        return frame.load(memory_order_relaxed);
+    }
+
+    /**
+     * Records a timed interval for the calling thread
+     * @param name name of the phase
+     * @param start start of the interval
+     * @param end end of the interval
+     * @param frame_number frame during which the interval started
+     */
+    void record(const char *name, uint64_t start, uint64_t end, uint32_t frame_number) {
+        threadBuffer().events.push_back({name, start, end - start, frame_number});
+    }
+
+    /**
+     * Marks the end of the current frame and the start of the next one
+     */
+    void nextFrame() {
+        uint64_t time = now();
+        if (currentFrame() > 0)
+            frames.push_back({"frame", frame_start, time - frame_start, currentFrame()});
+        frame_start = time;
+        frame.fetch_add(1, memory_order_relaxed);
+    }
+
+    /**
+     * Sets the file to which the trace is written on exit
+     * @param path path of the file, empty to disable writing
+     */
+    void setOutput(const string &path) {
+        output_path = path;
+    }
+
+    /**
+     * Writes all the recorded intervals in the Chrome trace event format
+     * @param path path of the JSON file
+     */
+    void writeChromeTrace(const string &path) {
+        lock_guard<mutex> lock(buffers_mutex);
+        ofstream out(path);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        bool first = true;
+        auto write = [&](const ProfileEvent &e, uint32_t tid) {
+            out << (first ? "" : ",\n") << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                << ",\"ts\":" << e.start / 1000.0 << ",\"dur\":" << e.duration / 1000.0
+                << ",\"args\":{\"frame\":" << e.frame << "}}";
+            first = false;
+        };
+        for (const ProfileEvent &e : frames)
+            write(e, 0);
+        for (auto &buffer : buffers) {
+            for (const ProfileEvent &e : buffer->events)
+                write(e, buffer->tid);
+        }
+        out << "\n]}\n";
+    }
+
+    /**
+     * Prints the minimum, median, 99th percentile and maximum time of each phase
+     * along with the slowest frames
+     * @param out stream to print to
+     */
+    void printSummary(ostream &out) {
+        lock_guard<mutex> lock(buffers_mutex);
+        map<string, vector<double> > phases;
+        for (const ProfileEvent &e : frames)
+            phases["frame"].push_back(e.duration / 1e6);
+        for (auto &buffer : buffers) {
+            for (const ProfileEvent &e : buffer->events)
+                phases[e.name].push_back(e.duration / 1e6);
+        }
+        out << left << setw(16) << "phase" << right << setw(10) << "count" << setw(12) << "min ms"
+            << setw(12) << "median ms" << setw(12) << "p99 ms" << setw(12) << "max ms" << "\n";
+        for (auto &phase : phases) {
+            vector<double> &times = phase.second;
+            sort(times.begin(), times.end());
+            out << left << setw(16) << phase.first << right << setw(10) << times.size() << fixed
+                << setprecision(4) << setw(12) << times.front() << setw(12) << percentile(times, 0.5)
+                << setw(12) << percentile(times, 0.99) << setw(12) << times.back() << "\n";
+        }
+        vector<ProfileEvent> slowest(frames);
+        sort(slowest.begin(), slowest.end(), [](const ProfileEvent &a, const ProfileEvent &b) {
+            return a.duration > b.duration;
+        });
+        for (size_t i = 0; i < min(slowest.size(), (size_t) 5); ++i)
+            out << "slow frame " << slowest[i].frame << ": " << slowest[i].duration / 1e6 << " ms\n";
+    }
+};
+
+/**
+ * Times the scope it lives in and records it with the profiler
+ */
+class ScopedTimer {
+    const char *name;
+    uint64_t start;
+    uint32_t frame;
+
+public:
+    /**
+     * Starts timing
+     * @param name name of the phase, must be a string literal
+     */
+    explicit ScopedTimer(const char *name) : name(name) {
+        Profiler &profiler = Profiler::instance();
+        frame = profiler.currentFrame();
+        start = profiler.now();
+    }
+
+    ~ScopedTimer() {
+        Profiler &profiler = Profiler::instance();
+        profiler.record(name, start, profiler.now(), frame);
+    }
+};
+
+#endif //CLOTH_SIMULATION_PROFILER_H
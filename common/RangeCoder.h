@@ -0,0 +1,252 @@
+//
+// Adaptive binary range coder and a model for coding small signed integers with it.
+//
+
+#ifndef CLOTH_SIMULATION_RANGECODER_H
+#define CLOTH_SIMULATION_RANGECODER_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+#define RANGE_CODER_PROBABILITY_BITS 11 // precision of the adaptive bit probabilities
+#define RANGE_CODER_ADAPT_SHIFT 5 // larger adapts slower but settles closer to the true probability
+#define RANGE_CODER_TOP (1u << 24) // the range is renormalized whenever it drops below this
+
+#define RESIDUAL_LENGTH_BITS 6 // bits of the tree coding the bit length of a residual (0 to 32)
+#define RESIDUAL_CONTEXTS 12 // residuals are coded in the context of the length of the previous one
+
+/**
+ * Encodes bits with adaptive probabilities into a byte buffer. The carry of the low end
+ * of the interval is propagated through a cached byte, so no bits are lost.
+ */
+class RangeEncoder {
+    vector<uint8_t> &out;
+    uint64_t low;
+    uint32_t range;
+    uint8_t cache; // last byte not yet written, it may still receive a carry
+    uint64_t cache_size; // number of pending bytes: the cached byte followed by 0xFF bytes
+
+    void shiftLow() {
+        if ((uint32_t) low < 0xFF000000u || (low >> 32) != 0) {
+            uint8_t carry = (uint8_t) (low >> 32);
+            uint8_t pending = cache;
+            do {
+                out.push_back((uint8_t) (pending + carry));
+                pending = 0xFF;
+            } while (--cache_size != 0);
+            cache = (uint8_t) (low >> 24);
+        }
+        ++cache_size;
+        low = (low & 0x00FFFFFFu) << 8;
+    }
+
+    void normalize() {
+        while (range < RANGE_CODER_TOP) {
+            range <<= 8;
+            shiftLow();
+        }
+    }
+
+public:
+    /**
+     * Constructor to start encoding
+     * @param out buffer to which the encoded bytes are appended
+     */
+    explicit RangeEncoder(vector<uint8_t> &out) : out(out), low(0), range(0xFFFFFFFFu), cache(0), cache_size(1) {}
+
+    /**
+     * Encodes a bit and adapts its probability
+     * @param probability probability of a zero bit, scaled to RANGE_CODER_PROBABILITY_BITS
+     * @param bit the bit
+     */
+    void encodeBit(uint16_t &probability, int bit) {
+        uint32_t bound = (range >> RANGE_CODER_PROBABILITY_BITS) * probability;
+        if (!bit) {
+            range = bound;
+            probability += ((1 << RANGE_CODER_PROBABILITY_BITS) - probability) >> RANGE_CODER_ADAPT_SHIFT;
+        } else {
+            low += bound;
+            range -= bound;
+            probability -= probability >> RANGE_CODER_ADAPT_SHIFT;
+        }
+        normalize();
+    }
+
+    /**
+     * Encodes bits which are equally likely to be zero or one, most significant first
+     * @param value the bits
+     * @param bits number of bits, at most 32
+     */
+    void encodeDirect(uint32_t value, int bits) {
+        while (bits-- > 0) {
+            range >>= 1;
+            if ((value >> bits) & 1)
+                low += range;
+            normalize();
+        }
+    }
+
+    /**
+     * Writes the remaining bytes. The encoder cannot be used afterwards.
+     */
+    void finish() {
+        for (int i = 0; i < 5; ++i)
+            shiftLow();
+    }
+};
+
+/**
+ * Decodes what a RangeEncoder encoded, given the same sequence of probabilities
+ */
+class RangeDecoder {
+    const uint8_t *in, *end;
+    uint32_t range, code;
+
+    uint8_t nextByte() {
+        return in < end ? *in++ : 0;
+    }
+
+    void normalize() {
+        if (range < RANGE_CODER_TOP) {
+            range <<= 8;
+            code = (code << 8) | nextByte();
+        }
+    }
+
+public:
+    /**
+     * Constructor to start decoding
+     * @param data the encoded bytes
+     * @param size number of encoded bytes
+     */
+    RangeDecoder(const uint8_t *data, size_t size) : in(data), end(data + size), range(0xFFFFFFFFu), code(0) {
+        for (int i = 0; i < 5; ++i)
+            code = (code << 8) | nextByte();
+    }
+
+    /**
+     * Decodes a bit and adapts its probability
+     * @param probability probability of a zero bit, scaled to RANGE_CODER_PROBABILITY_BITS
+     * @return the bit
+     */
+    int decodeBit(uint16_t &probability) {
+        uint32_t bound = (range >> RANGE_CODER_PROBABILITY_BITS) * probability;
+        int bit;
+        if (code < bound) {
+            range = bound;
+            probability += ((1 << RANGE_CODER_PROBABILITY_BITS) - probability) >> RANGE_CODER_ADAPT_SHIFT;
+            bit = 0;
+        } else {
+            code -= bound;
+            range -= bound;
+            probability -= probability >> RANGE_CODER_ADAPT_SHIFT;
+            bit = 1;
+        }
+        normalize();
+        return bit;
+    }
+
+    /**
+     * Decodes bits which were encoded with encodeDirect
+     * @param bits number of bits, at most 32
+     * @return the bits
+     */
+    uint32_t decodeDirect(int bits) {
+        uint32_t value = 0;
+        while (bits-- > 0) {
+            range >>= 1;
+            uint32_t bit = code >= range;
+            if (bit)
+                code -= range;
+            value = (value << 1) | bit;
+            normalize();
+        }
+        return value;
+    }
+};
+
+/**
+ * Adaptive model for signed residuals which are mostly close to zero. A residual is coded as
+ * its bit length, with adaptive probabilities that depend on the context, followed by the bits
+ * below its leading one, which are close to uniformly distributed.
+ */
+class ResidualModel {
+    uint16_t lengths[RESIDUAL_CONTEXTS][1 << RESIDUAL_LENGTH_BITS];
+
+    static uint32_t zigzag(uint32_t value) {
+        return (value << 1) ^ (uint32_t) -(int32_t) (value >> 31);
+    }
+
+    static uint32_t unzigzag(uint32_t value) {
+        return (value >> 1) ^ (uint32_t) -(int32_t) (value & 1);
+    }
+
+public:
+    ResidualModel() {
+        reset();
+    }
+
+    /**
+     * Forgets everything learned, making all bit lengths equally likely
+     */
+    void reset() {
+        for (auto &context : lengths)
+            fill(begin(context), end(context), (uint16_t) (1 << (RANGE_CODER_PROBABILITY_BITS - 1)));
+    }
+
+    /**
+     * Returns the context of the residual following one of the given bit length
+     * @param length bit length returned by encode or decode
+     * @return the context
+     */
+    static int context(int length) {
+        return min(length, RESIDUAL_CONTEXTS - 1);
+    }
+
+    /**
+     * Encodes a residual
+     * @param encoder the encoder
+     * @param context context of the residual, between 0 and RESIDUAL_CONTEXTS - 1
+     * @param residual the residual, a signed value stored in two's complement
+     * @return the bit length of the residual, from which the context of the next one is formed
+     */
+    int encode(RangeEncoder &encoder, int context, uint32_t residual) {
+        uint32_t value = zigzag(residual);
+        int length = 0;
+        while (length < 32 && (value >> length) != 0)
+            ++length;
+        uint16_t *tree = lengths[context];
+        for (int node = 1, bit = RESIDUAL_LENGTH_BITS - 1; bit >= 0; --bit) {
+            int b = (length >> bit) & 1;
+            encoder.encodeBit(tree[node], b);
+            node = node * 2 + b;
+        }
+        if (length > 1)
+            encoder.encodeDirect(value, length - 1); // the leading one is implied by the length
+        return length;
+    }
+
+    /**
+     * Decodes a residual
+     * @param decoder the decoder
+     * @param context context the residual was encoded in
+     * @param length set to the bit length of the residual
+     * @return the residual in two's complement
+     */
+    uint32_t decode(RangeDecoder &decoder, int context, int &length) {
+        uint16_t *tree = lengths[context];
+        int node = 1;
+        for (int bit = 0; bit < RESIDUAL_LENGTH_BITS; ++bit)
+            node = node * 2 + decoder.decodeBit(tree[node]);
+        length = node - (1 << RESIDUAL_LENGTH_BITS);
+        if (length == 0)
+            return 0;
+        uint32_t value = length > 1 ? decoder.decodeDirect(length - 1) : 0;
+        if (length <= 32)
+            value |= 1u << (length - 1);
+        return unzigzag(value);
+    }
+};
+
+#endif //CLOTH_SIMULATION_RANGECODER_H
@@ -0,0 +1,264 @@
+//
+// Comparison of a simulated trajectory with a golden one recorded earlier, to catch changes of the results.
+//
+
+#ifndef CLOTH_SIMULATION_REGRESSIONREPORT_H
+#define CLOTH_SIMULATION_REGRESSIONREPORT_H
+
+#include <bits/stdc++.h>
+#include <glm/glm.hpp>
+#include "FrameCache.h"
+#include "SceneConfig.h"
+
+using namespace std;
+using namespace glm;
+
+/**
+ * Compares the positions of the particles frame by frame with the golden positions. A particle diverges when its
+ * distance to its golden position exceeds abs_tolerance + rel_tolerance * |golden position|, like numpy's isclose.
+ * The report keeps the largest error with the particle and frame where it occurred, and the first frame in which
+ * any particle diverged, which usually points at the cause better than the largest error does.
+ */
+class RegressionReport {
+    double abs_tolerance, rel_tolerance;
+    double max_error; // largest distance of a particle to its golden position
+    size_t worst_particle, worst_frame; // where the largest error occurred
+    long first_divergence; // first frame with a diverged particle, -1 if none
+    size_t diverged_particles; // number of diverged particles in the first diverged frame
+    size_t first_diverged_particle; // the diverged particle with the largest error in that frame
+    size_t frames, particles; // frames compared and particles per frame
+    string mismatch; // why the trajectories could not be compared, empty if they could
+
+public:
+    /**
+     * Constructor to initialize an empty report
+     * @param abs_tolerance largest distance to the golden position, in scene units
+     * @param rel_tolerance largest distance to the golden position relative to its distance to the origin
+     */
+    RegressionReport(double abs_tolerance, double rel_tolerance)
+            : abs_tolerance(abs_tolerance), rel_tolerance(rel_tolerance), max_error(0), worst_particle(0),
+              worst_frame(0), first_divergence(-1), diverged_particles(0), first_diverged_particle(0), frames(0),
+              particles(0) {}
+
+    /**
+     * Compares the positions of a frame with the golden ones
+     * @param frame index of the frame
+     * @param positions simulated positions of the particles
+     * @param golden golden positions of the particles
+     */
+    void compare(size_t frame, const vector<dvec3> &positions, const vector<dvec3> &golden) {
+        if (positions.size() != golden.size()) {
+            ostringstream out;
+            out << "frame " << frame << " has " << positions.size() << " particles, the golden one "
+                << golden.size();
+            fail(out.str());
+            return;
+        }
+        size_t diverged = 0, worst_diverged = 0;
+        double worst_diverged_error = -1;
+        for (size_t i = 0; i < positions.size(); ++i) {
+            double error = length(positions[i] - golden[i]);
+            if (max_error == max_error && !(error <= max_error)) { // a NaN is the largest error and stays it
+                max_error = error;
+                worst_particle = i;
+                worst_frame = frame;
+            }
+            if (!(error <= abs_tolerance + rel_tolerance * length(golden[i]))) {
+                ++diverged;
+                if (!(error <= worst_diverged_error)) {
+                    worst_diverged_error = error;
+                    worst_diverged = i;
+                }
+            }
+        }
+        if (diverged > 0 && first_divergence < 0) {
+            first_divergence = frame;
+            diverged_particles = diverged;
+            first_diverged_particle = worst_diverged;
+        }
+        ++frames;
+        particles = positions.size();
+    }
+
+    /**
+     * Marks the comparison as failed for a reason other than a diverged particle
+     * @param reason description of the problem, e.g. the golden trajectory is shorter
+     */
+    void fail(const string &reason) {
+        if (mismatch.empty())
+            mismatch = reason;
+    }
+
+    /**
+     * Returns whether every particle of every frame was within the tolerances
+     * @return true if the run matches the golden trajectory
+     */
+    bool passed() const {
+        return mismatch.empty() && first_divergence < 0 && frames > 0;
+    }
+
+    /**
+     * Prints the errors and whether the run passed
+     * @param out stream to print to
+     */
+    void print(ostream &out) const {
+        out << "compared " << frames << " frames of " << particles << " particles, tolerance " << abs_tolerance
+            << " + " << rel_tolerance << " * |golden|" << endl;
+        out << scientific << setprecision(3) << "max error " << max_error << defaultfloat << " at particle "
+            << worst_particle << " in frame " << worst_frame << endl;
+        if (first_divergence >= 0) {
+            out << "first diverged in frame " << first_divergence << ": " << diverged_particles
+                << " particles out of tolerance, worst particle " << first_diverged_particle << endl;
+        }
+        if (!mismatch.empty())
+            out << mismatch << endl;
+        out << (passed() ? "PASSED" : "FAILED") << endl;
+    }
+};
+
+/**
+ * A golden trajectory stored as a frame cache: the positions of all particles of a scene at its start and after
+ * every "interval" steps. A run either records it or compares itself with it. The cache is written with an error
+ * far below the tolerances, so the quantization of the golden positions does not hide a divergence nor cause one.
+ */
+class GoldenTrajectory {
+    bool recording;
+    FrameCacheWriter writer;
+    FrameCacheReader reader;
+    RegressionReport report;
+    vector<dvec3> golden; // golden positions of the frame being compared, reused to avoid allocations
+    size_t next_frame; // frame of the cache the next sample is recorded in or compared with
+    unsigned long steps;
+    unsigned long interval; // steps from one sampled frame to the next
+    double error; // largest error of a golden position relative to the diagonal of the first frame
+    double step_ms; // time spent stepping
+    double stretch_limit; // largest stretch allowed in a sampled frame, negative for no limit
+    double max_stretch; // largest stretch of any cloth in the sampled frames
+    unsigned long max_stretch_step; // step after which it occurred
+
+public:
+    /**
+     * Constructor reading the settings from the [regression] section of a scene
+     * @param settings the section: "steps", "interval", "abs_tolerance", "rel_tolerance", "error" of the
+     *                 recorded positions and "max_stretch", the largest stretch of a cloth, if any
+     */
+    explicit GoldenTrajectory(const SceneSection &settings)
+            : recording(false),
+              report(settings.getDouble("abs_tolerance", 1e-6), settings.getDouble("rel_tolerance", 1e-6)),
+              next_frame(0), steps(std::max(settings.getInt("steps", 300), 1L)),
+              interval(std::max(settings.getInt("interval", 1), 1L)),
+              error(settings.getDouble("error", 1e-9)), step_ms(0),
+              stretch_limit(settings.getDouble("max_stretch", -1)), max_stretch(-1), max_stretch_step(0) {}
+
+    /**
+     * Opens the golden trajectory
+     * @param path path of the file
+     * @param record true to record the trajectory, replacing the file; false to compare with it
+     * @param error_message set to a description of the problem if the file cannot be opened
+     * @return false if the file cannot be opened
+     */
+    bool open(const string &path, bool record, string &error_message) {
+        recording = record;
+        if (recording)
+            return writer.open(path, error, 64, error_message);
+        return reader.open(path, error_message);
+    }
+
+    /**
+     * Returns the number of steps to simulate
+     * @return the number of steps
+     */
+    unsigned long getSteps() const {
+        return steps;
+    }
+
+    /**
+     * Returns whether the positions after a step are recorded or compared
+     * @param step number of steps simulated, 0 for the start
+     * @return true for every "interval"-th step
+     */
+    bool samples(unsigned long step) const {
+        return step % interval == 0;
+    }
+
+    /**
+     * Runs a step and adds its time to the runtime of the run
+     * @param step function which runs the step
+     */
+    template<typename F>
+    void timeStep(F step) {
+        auto start = chrono::steady_clock::now();
+        step();
+        step_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    /**
+     * Records the positions after a sampled step, or compares them with the golden ones
+     * @param step number of steps simulated, for which samples returns true
+     * @param positions positions of all particles of the scene
+     */
+    void addFrame(unsigned long step, const vector<dvec3> &positions) {
+        size_t frame = next_frame++;
+        if (recording) {
+            writer.addFrame(positions);
+        } else if (reader.readFrame(frame, golden)) {
+            report.compare(step, positions, golden);
+        } else {
+            ostringstream out;
+            out << "the golden trajectory ends after " << reader.getNumFrames() << " sampled frames, the run has more";
+            report.fail(out.str());
+        }
+    }
+
+    /**
+     * Adds the stretch of a cloth after a sampled step, which must stay below the "max_stretch" of the scene both
+     * while recording and while comparing, so that a run which blows up cannot become the golden trajectory
+     * @param step number of steps simulated
+     * @param stretch how far the cloth is stretched beyond its rest length, see getMaxStretch of the cloths
+     */
+    void addStretch(unsigned long step, double stretch) {
+        if (max_stretch == max_stretch && !(stretch <= max_stretch)) { // a NaN is the largest stretch and stays it
+            max_stretch = stretch;
+            max_stretch_step = step;
+        }
+    }
+
+    /**
+     * Finishes the run: closes a recorded trajectory, or prints how the run compares with the golden one
+     * @param out stream to print to
+     * @param error_message set to a description of the problem if the recorded trajectory cannot be written
+     * @return true if the trajectory was recorded or the run matches it
+     */
+    bool finish(ostream &out, string &error_message) {
+        out << "simulated " << steps << " steps in " << fixed << setprecision(1) << step_ms << " ms"
+            << defaultfloat << endl;
+        bool stretched = stretch_limit >= 0 && !(max_stretch <= stretch_limit);
+        if (stretch_limit >= 0) {
+            out << setprecision(3) << "max stretch " << max_stretch << " after step " << max_stretch_step << ", limit "
+                << stretch_limit << endl;
+        }
+        if (stretched && recording) {
+            error_message = "the run stretched beyond max_stretch, not recording it";
+            return false;
+        }
+        if (stretched)
+            report.fail("the run stretched beyond max_stretch");
+        if (recording) {
+            if (!writer.close(error_message))
+                return false;
+            out << "recorded " << writer.getNumFrames() << " frames in " << writer.getBytesWritten() << " bytes"
+                << endl;
+            return true;
+        }
+        if (next_frame < reader.getNumFrames()) {
+            ostringstream message;
+            message << "the golden trajectory has " << reader.getNumFrames() << " sampled frames, the run "
+                    << next_frame;
+            report.fail(message.str());
+        }
+        report.print(out);
+        return report.passed();
+    }
+};
+
+#endif //CLOTH_SIMULATION_REGRESSIONREPORT_H
@@ -0,0 +1,347 @@
+//
+// Scene description files shared by both cloth models.
+//
+
+#ifndef CLOTH_SIMULATION_SCENECONFIG_H
+#define CLOTH_SIMULATION_SCENECONFIG_H
+
+#include <bits/stdc++.h>
+#include <glm/glm.hpp>
+
+using namespace std;
+using namespace glm;
+
+/**
+ * A section of a scene file: a name followed by "key = value" lines.
+ * A key may appear several times, e.g. one "pin" line per pinned particle.
+ */
+class SceneSection {
+    string name;
+    vector<pair<string, string> > entries;
+    mutable set<string> asked; // keys looked up so far, whether or not the section has them
+
+    /**
+     * Returns the lock guarding the keys looked up, as the tasks of an ensemble read the same sections at once
+     * @return the lock
+     */
+    static mutex &askedLock() {
+        static mutex lock;
+        return lock;
+    }
+
+    /**
+     * Remembers that a key was looked up
+     * @param key the key
+     */
+    void note(const string &key) const {
+        lock_guard<mutex> hold(askedLock());
+        asked.insert(key);
+    }
+
+    /**
+     * Reports a value which could not be parsed
+     * @param key key of the value
+     * @param value the value
+     */
+    void warnInvalid(const string &key, const string &value) const {
+        cerr << "scene: ignoring invalid value '" << value << "' for " << name << "." << key << endl;
+    }
+
+public:
+    /**
+     * Constructor to initialize an empty section
+     * @param name name of the section
+     */
+    explicit SceneSection(const string &name = "") : name(name) {}
+
+    /**
+     * Adds a key value pair to the section
+     * @param key the key
+     * @param value the value
+     */
+    void add(const string &key, const string &value) {
+        entries.push_back(make_pair(key, value));
+    }
+
+    /**
+     * Returns the name of the section
+     * @return the name
+     */
+    const string &getName() const {
+        return name;
+    }
+
+    /**
+     * Checks whether the section has a value for the key
+     * @param key the key
+     * @return true if the key appears in the section
+     */
+    bool has(const string &key) const {
+        note(key);
+        for (const auto &entry : entries) {
+            if (entry.first == key)
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * Returns all the values given for a key, in the order they appear
+     * @param key the key
+     * @return the values
+     */
+    vector<string> getAll(const string &key) const {
+        vector<string> values;
+        note(key);
+        for (const auto &entry : entries) {
+            if (entry.first == key)
+                values.push_back(entry.second);
+        }
+        return values;
+    }
+
+    /**
+     * Returns the last value given for a key
+     * @param key the key
+     * @param fallback value returned if the key is missing
+     * @return the value
+     */
+    string getString(const string &key, const string &fallback) const {
+        note(key);
+        for (auto entry = entries.rbegin(); entry != entries.rend(); ++entry) {
+            if (entry->first == key)
+                return entry->second;
+        }
+        return fallback;
+    }
+
+    /**
+     * Checks whether a key was looked up with any of the getters, e.g. to find out which keys a function reads
+     * by passing it an empty section
+     * @param key the key
+     * @return true if the key was looked up
+     */
+    bool wasAsked(const string &key) const {
+        lock_guard<mutex> hold(askedLock());
+        return asked.count(key) > 0;
+    }
+
+    /**
+     * Returns the keys of the section which were never looked up, e.g. misspelled ones
+     * @return the keys, once each in the order they first appear
+     */
+    vector<string> unused() const {
+        vector<string> keys;
+        for (const auto &entry : entries) {
+            if (!wasAsked(entry.first) && find(keys.begin(), keys.end(), entry.first) == keys.end())
+                keys.push_back(entry.first);
+        }
+        return keys;
+    }
+
+    /**
+     * Returns the value of a key as a number
+     * @param key the key
+     * @param fallback value returned if the key is missing or invalid
+     * @return the value
+     */
+    double getDouble(const string &key, double fallback) const {
+        if (!has(key))
+            return fallback;
+        string value = getString(key, "");
+        char *end;
+        double result = strtod(value.c_str(), &end);
+        if (end == value.c_str() || *end != '\0') {
+            warnInvalid(key, value);
+            return fallback;
+        }
+        return result;
+    }
+
+    /**
+     * Returns the value of a key as an integer
+     * @param key the key
+     * @param fallback value returned if the key is missing or invalid
+     * @return the value
+     */
+    long getInt(const string &key, long fallback) const {
+        if (!has(key))
+            return fallback;
+        string value = getString(key, "");
+        char *end;
+        long result = strtol(value.c_str(), &end, 10);
+        if (end == value.c_str() || *end != '\0') {
+            warnInvalid(key, value);
+            return fallback;
+        }
+        return result;
+    }
+
+    /**
+     * Returns the value of a key as a boolean (true/false, yes/no, on/off or 1/0)
+     * @param key the key
+     * @param fallback value returned if the key is missing or invalid
+     * @return the value
+     */
+    bool getBool(const string &key, bool fallback) const {
+        if (!has(key))
+            return fallback;
+        string value = getString(key, "");
+        if (value == "true" || value == "yes" || value == "on" || value == "1")
+            return true;
+        if (value == "false" || value == "no" || value == "off" || value == "0")
+            return false;
+        warnInvalid(key, value);
+        return fallback;
+    }
+
+    /**
+     * Returns the value of a key as a vector of three space separated numbers
+     * @param key the key
+     * @param fallback value returned if the key is missing or invalid
+     * @return the value
+     */
+    dvec3 getVec3(const string &key, dvec3 fallback) const {
+        if (!has(key))
+            return fallback;
+        string value = getString(key, "");
+        istringstream in(value);
+        dvec3 result;
+        string rest;
+        if (!(in >> result.x >> result.y >> result.z) || (in >> rest)) {
+            warnInvalid(key, value);
+            return fallback;
+        }
+        return result;
+    }
+};
+
+/**
+ * A scene description file. The file consists of sections started by "[name]" lines,
+ * each holding "key = value" lines. Everything after a '#' is a comment.
+ * Sections such as [collider] may appear several times.
+ */
+class SceneConfig {
+    vector<SceneSection> sections;
+    string directory; // directory of the file, ending in a slash, empty for the working directory
+    mutable set<string> asked; // names of the sections looked up so far
+
+    /**
+     * Remembers that a section was looked up, from any thread
+     * @param name name of the section
+     */
+    void note(const string &name) const {
+        static mutex lock;
+        lock_guard<mutex> hold(lock);
+        asked.insert(name);
+    }
+
+    /**
+     * Removes the whitespace at both ends of a string
+     * @param s the string
+     * @return the trimmed string
+     */
+    static string trim(const string &s) {
+        size_t begin = s.find_first_not_of(" \t\r");
+        if (begin == string::npos)
+            return "";
+        size_t end = s.find_last_not_of(" \t\r");
+        return s.substr(begin, end - begin + 1);
+    }
+
+public:
+    /**
+     * Loads a scene file
+     * @param path path of the file
+     * @param error set to a description of the problem if the file cannot be loaded
+     * @return true if the file was loaded
+     */
+    bool load(const string &path, string &error) {
+        ifstream in(path);
+        if (!in) {
+            error = "cannot open " + path;
+            return false;
+        }
+        sections.clear();
+        size_t slash = path.rfind('/');
+        directory = slash == string::npos ? "" : path.substr(0, slash + 1);
+        string line;
+        for (int number = 1; getline(in, line); ++number) {
+            line = trim(line.substr(0, line.find('#')));
+            if (line.empty())
+                continue;
+            if (line[0] == '[') {
+                if (line[line.size() - 1] != ']') {
+                    error = path + ":" + to_string(number) + ": unterminated section name";
+                    return false;
+                }
+                sections.push_back(SceneSection(trim(line.substr(1, line.size() - 2))));
+                continue;
+            }
+            size_t equals = line.find('=');
+            if (equals == string::npos || sections.empty()) {
+                error = path + ":" + to_string(number) + ": expected 'key = value' inside a section";
+                return false;
+            }
+            sections.back().add(trim(line.substr(0, equals)), trim(line.substr(equals + 1)));
+        }
+        return true;
+    }
+
+    /**
+     * Resolves a path given in the scene, e.g. of a mesh, which is relative to the directory of the scene file
+     * @param path the path as written in the scene
+     * @return the path to open, unchanged if it is empty or absolute
+     */
+    string resolve(const string &path) const {
+        if (path.empty() || path[0] == '/')
+            return path;
+        return directory + path;
+    }
+
+    /**
+     * Returns the first section with the given name
+     * @param name name of the section
+     * @return the section, or an empty section if there is none
+     */
+    const SceneSection &section(const string &name) const {
+        static const SceneSection empty;
+        note(name);
+        for (const SceneSection &s : sections) {
+            if (s.getName() == name)
+                return s;
+        }
+        return empty;
+    }
+
+    /**
+     * Returns all the sections with the given name, in the order they appear
+     * @param name name of the sections
+     * @return the sections
+     */
+    vector<const SceneSection *> all(const string &name) const {
+        vector<const SceneSection *> result;
+        note(name);
+        for (const SceneSection &s : sections) {
+            if (s.getName() == name)
+                result.push_back(&s);
+        }
+        return result;
+    }
+
+    /**
+     * Warns about the keys which were never looked up in the sections that were, e.g. misspelled ones.
+     * Call once everything the run needs has been read; sections which the run does not use at all,
+     * such as [ensemble] outside of an ensemble, are left alone.
+     */
+    void warnUnused() const {
+        for (const SceneSection &s : sections) {
+            if (!asked.count(s.getName()))
+                continue;
+            for (const string &key : s.unused())
+                cerr << "scene: ignoring unknown key " << s.getName() << "." << key << endl;
+        }
+    }
+};
+
+#endif //CLOTH_SIMULATION_SCENECONFIG_H
@@ -0,0 +1,532 @@
+//
+// Sparse signed distance fields of closed triangle meshes, for colliders of any shape (POSIX only).
+//
+
+#ifndef CLOTH_SIMULATION_SIGNEDDISTANCEFIELD_H
+#define CLOTH_SIMULATION_SIGNEDDISTANCEFIELD_H
+
+#include <bits/stdc++.h>
+#include <unistd.h>
+#include <glm/glm.hpp>
+#include "TaskScheduler.h"
+
+using namespace std;
+using namespace glm;
+
+#define DISTANCE_FIELD_MAGIC "CLTHSDFG"
+#define DISTANCE_FIELD_VERSION 1 // bumped whenever the layout of the file or the way the field is built changes
+#define DISTANCE_FIELD_BRICK 8 // cells along each side of a brick
+#define DISTANCE_FIELD_NODES (DISTANCE_FIELD_BRICK + 1) // nodes along each side of a brick, sharing its faces
+#define DISTANCE_FIELD_OUTSIDE UINT32_MAX // marks a brick away from the surface, outside the mesh
+#define DISTANCE_FIELD_INSIDE (UINT32_MAX - 1) // marks a brick away from the surface, inside the mesh
+#define DISTANCE_FIELD_MAX_CELLS 4096 // largest number of cells along an axis
+#define DISTANCE_FIELD_BLOCK 3 // nodes along each side of the blocks a brick is built in
+
+/**
+ * Fixed header at the start of a distance field file. It is followed by the brick table, one uint32_t per brick,
+ * and the distances of the stored bricks, DISTANCE_FIELD_NODES^3 floats each.
+ */
+struct DistanceFieldHeader {
+    char magic[8]; // DISTANCE_FIELD_MAGIC without the terminating zero
+    uint32_t version; // DISTANCE_FIELD_VERSION of the writer
+    uint32_t brick_size; // DISTANCE_FIELD_BRICK of the writer
+    uint64_t key; // fingerprint of the mesh and settings the field was built from
+    float origin[3]; // position of the first node
+    float cell; // distance between neighbouring nodes
+    float band; // distances are exact up to this far from the surface, and clamped to it beyond
+    uint32_t bricks[3]; // number of bricks along each axis
+    uint64_t num_stored; // number of bricks with distances
+    uint64_t file_size; // total size, used to detect truncated files
+};
+
+/**
+ * The signed distance to a closed triangle mesh, positive outside, sampled at the nodes of a regular grid. Only the
+ * bricks of DISTANCE_FIELD_BRICK^3 cells within "band" of the surface store their nodes; every other brick is
+ * entirely inside or outside and reads as -band or band. A brick stores its own copy of the nodes on its faces, so
+ * the eight nodes around any point are in one brick and a lookup is a table read plus a trilinear interpolation,
+ * whatever the size of the mesh.
+ *
+ * The distances come from the closest points on the triangles near each brick, the signs from the parity of the
+ * triangles crossed by a ray along x through every line of nodes, so the mesh needs no consistent winding but must
+ * be closed.
+ */
+class SignedDistanceField {
+    float origin[3];
+    float cell, inverse_cell, band;
+    uint32_t bricks[3]; // number of bricks along each axis
+    vector<uint32_t> table; // stored brick of every brick, or DISTANCE_FIELD_INSIDE or DISTANCE_FIELD_OUTSIDE
+    vector<float> values; // the nodes of the stored bricks, x fastest
+    uint64_t key;
+
+    /**
+     * Returns the squared distance from a point to a triangle, from the closest point found by the regions of
+     * Ericson's Real-Time Collision Detection
+     * @param p the point
+     * @param a,b,c the corners of the triangle
+     * @return the squared distance
+     */
+    static double squaredDistance(const dvec3 &p, const dvec3 &a, const dvec3 &b, const dvec3 &c) {
+        dvec3 ab = b - a, ac = c - a, ap = p - a;
+        double d1 = dot(ab, ap), d2 = dot(ac, ap);
+        if (d1 <= 0 && d2 <= 0)
+            return dot(ap, ap);
+        dvec3 bp = p - b;
+        double d3 = dot(ab, bp), d4 = dot(ac, bp);
+        if (d3 >= 0 && d4 <= d3)
+            return dot(bp, bp);
+        double vc = d1 * d4 - d3 * d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+            dvec3 q = ap - ab * (d1 / (d1 - d3));
+            return dot(q, q);
+        }
+        dvec3 cp = p - c;
+        double d5 = dot(ab, cp), d6 = dot(ac, cp);
+        if (d6 >= 0 && d5 <= d6)
+            return dot(cp, cp);
+        double vb = d5 * d2 - d1 * d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+            dvec3 q = ap - ac * (d2 / (d2 - d6));
+            return dot(q, q);
+        }
+        double va = d3 * d6 - d5 * d4;
+        if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+            dvec3 q = bp - (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+            return dot(q, q);
+        }
+        double denominator = 1 / (va + vb + vc);
+        dvec3 q = ap - ab * (vb * denominator) - ac * (vc * denominator);
+        return dot(q, q);
+    }
+
+    /**
+     * Sorts items into buckets, as offsets into one array of items
+     * @param num_buckets number of buckets
+     * @param num_items number of items
+     * @param visit function visit(item, f) which calls f(bucket) for every bucket of the item
+     * @param offsets set to the first entry of every bucket, and the end of the last one
+     * @param items set to the items of every bucket, in the order of the items
+     */
+    template<typename F>
+    static void bucket(size_t num_buckets, size_t num_items, F visit, vector<uint32_t> &offsets,
+                       vector<uint32_t> &items) {
+        offsets.assign(num_buckets + 1, 0);
+        for (size_t i = 0; i < num_items; ++i)
+            visit(i, [&](size_t b) { ++offsets[b + 1]; });
+        for (size_t b = 0; b < num_buckets; ++b)
+            offsets[b + 1] += offsets[b];
+        items.resize(offsets[num_buckets]);
+        vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < num_items; ++i)
+            visit(i, [&](size_t b) { items[fill[b]++] = (uint32_t) i; });
+    }
+
+public:
+    SignedDistanceField() : cell(1), inverse_cell(1), band(0), key(0) {
+        memset(origin, 0, sizeof(origin));
+        memset(bricks, 0, sizeof(bricks));
+    }
+
+    /**
+     * Returns a fingerprint of a mesh and the settings of its field, to tell whether a saved field still fits
+     * @param positions the vertices of the mesh
+     * @param triangles the vertices of every triangle
+     * @param cell distance between neighbouring nodes
+     * @param band distance from the surface up to which the distances are exact
+     * @return the fingerprint, FNV-1a of all of them
+     */
+    static uint64_t fingerprint(const vector<dvec3> &positions, const vector<array<uint32_t, 3> > &triangles,
+                                double cell, double band) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        auto add = [&](const void *data, size_t size) {
+            const unsigned char *bytes = static_cast<const unsigned char *>(data);
+            for (size_t i = 0; i < size; ++i)
+                hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+        };
+        uint32_t version = DISTANCE_FIELD_VERSION;
+        add(&version, sizeof(version));
+        add(&cell, sizeof(cell));
+        add(&band, sizeof(band));
+        add(positions.data(), positions.size() * sizeof(dvec3));
+        add(triangles.data(), triangles.size() * sizeof(array<uint32_t, 3>));
+        return hash;
+    }
+
+    /**
+     * Builds the field of a closed mesh
+     * @param positions the vertices of the mesh
+     * @param triangles the vertices of every triangle
+     * @param cell_size distance between neighbouring nodes
+     * @param band_width distance from the surface up to which the distances are exact, at least a cell
+     * @param error set to a description of the problem if the field cannot be built
+     * @param threads number of threads computing the distances, 0 for one per core
+     * @return false if the mesh is empty or the grid would be too large
+     */
+    bool build(const vector<dvec3> &positions, const vector<array<uint32_t, 3> > &triangles, double cell_size,
+               double band_width, string &error, unsigned threads = 0) {
+        if (triangles.empty() || !(cell_size > 0)) {
+            error = "the mesh has no triangles or the cell size is not positive";
+            return false;
+        }
+        key = fingerprint(positions, triangles, cell_size, band_width);
+        band_width = std::max(band_width, cell_size);
+        dvec3 low(numeric_limits<double>::max()), high(-numeric_limits<double>::max());
+        for (const array<uint32_t, 3> &t : triangles) {
+            for (int k = 0; k < 3; ++k) {
+                low = glm::min(low, positions[t[k]]);
+                high = glm::max(high, positions[t[k]]);
+            }
+        }
+        //a margin of a band and a cell, so that every point beyond the grid is outside the band
+        low -= dvec3(band_width + cell_size);
+        high += dvec3(band_width + cell_size);
+        const double brick_size = cell_size * DISTANCE_FIELD_BRICK;
+        for (int axis = 0; axis < 3; ++axis) {
+            double count = ceil((high[axis] - low[axis]) / brick_size);
+            if (count * DISTANCE_FIELD_BRICK > DISTANCE_FIELD_MAX_CELLS) {
+                error = "the grid would have more than " + to_string(DISTANCE_FIELD_MAX_CELLS) +
+                        " cells along an axis, the cell size is too small for the mesh";
+                return false;
+            }
+            bricks[axis] = (uint32_t) std::max(count, 1.0);
+            origin[axis] = (float) low[axis];
+        }
+        cell = (float) cell_size;
+        inverse_cell = (float) (1 / cell_size);
+        band = (float) band_width;
+        dvec3 start(origin[0], origin[1], origin[2]); // the nodes as the lookups see them, from the float origin
+        const uint32_t nodes_y = bricks[1] * DISTANCE_FIELD_BRICK + 1, nodes_z = bricks[2] * DISTANCE_FIELD_BRICK + 1;
+        const size_t num_bricks = (size_t) bricks[0] * bricks[1] * bricks[2];
+
+        //the triangles near every brick, from their bounding boxes grown by the band
+        vector<uint32_t> brick_offsets, brick_triangles;
+        bucket(num_bricks, triangles.size(), [&](size_t t, const function<void(size_t)> &f) {
+            dvec3 a = positions[triangles[t][0]], b = positions[triangles[t][1]], c = positions[triangles[t][2]];
+            ivec3 first, last;
+            for (int axis = 0; axis < 3; ++axis) {
+                double lo = std::min(std::min(a[axis], b[axis]), c[axis]) - band_width - start[axis];
+                double hi = std::max(std::max(a[axis], b[axis]), c[axis]) + band_width - start[axis];
+                first[axis] = std::max((int) floor(lo / brick_size), 0);
+                last[axis] = std::min((int) floor(hi / brick_size), (int) bricks[axis] - 1);
+            }
+            for (int z = first.z; z <= last.z; ++z) {
+                for (int y = first.y; y <= last.y; ++y) {
+                    for (int x = first.x; x <= last.x; ++x)
+                        f(((size_t) z * bricks[1] + y) * bricks[0] + x);
+                }
+            }
+        }, brick_offsets, brick_triangles);
+
+        //the x of every crossing of a triangle with every line of nodes along x, for the parity of the nodes.
+        //The lines are shifted by a fraction of a cell which no mesh is built along, so that they miss the edges.
+        const dvec2 jitter(cell_size * 1.2345e-4, cell_size * 3.1415e-5);
+        auto crossing = [&](size_t t, uint32_t y, uint32_t z, double &x) {
+            dvec3 a = positions[triangles[t][0]], b = positions[triangles[t][1]], c = positions[triangles[t][2]];
+            dvec2 p = dvec2(start.y + y * cell_size, start.z + z * cell_size) + jitter;
+            dvec2 pa = dvec2(a.y, a.z) - p, pb = dvec2(b.y, b.z) - p, pc = dvec2(c.y, c.z) - p;
+            double wa = pb.x * pc.y - pb.y * pc.x, wb = pc.x * pa.y - pc.y * pa.x, wc = pa.x * pb.y - pa.y * pb.x;
+            if (!((wa >= 0 && wb >= 0 && wc >= 0) || (wa <= 0 && wb <= 0 && wc <= 0)) || wa + wb + wc == 0)
+                return false;
+            x = (a.x * wa + b.x * wb + c.x * wc) / (wa + wb + wc);
+            return true;
+        };
+        vector<uint32_t> line_offsets, line_triangles;
+        bucket((size_t) nodes_y * nodes_z, triangles.size(), [&](size_t t, const function<void(size_t)> &f) {
+            dvec3 a = positions[triangles[t][0]], b = positions[triangles[t][1]], c = positions[triangles[t][2]];
+            double y0 = (std::min(std::min(a.y, b.y), c.y) - start.y - jitter.x) / cell_size;
+            double y1 = (std::max(std::max(a.y, b.y), c.y) - start.y - jitter.x) / cell_size;
+            double z0 = (std::min(std::min(a.z, b.z), c.z) - start.z - jitter.y) / cell_size;
+            double z1 = (std::max(std::max(a.z, b.z), c.z) - start.z - jitter.y) / cell_size;
+            double x;
+            for (long z = std::max((long) ceil(z0), 0L); z <= std::min((long) floor(z1), (long) nodes_z - 1); ++z) {
+                for (long y = std::max((long) ceil(y0), 0L); y <= std::min((long) floor(y1), (long) nodes_y - 1);
+                     ++y) {
+                    if (crossing(t, y, z, x))
+                        f((size_t) z * nodes_y + y);
+                }
+            }
+        }, line_offsets, line_triangles);
+        vector<double> crossings(line_triangles.size());
+        for (size_t line = 0; line + 1 < line_offsets.size(); ++line) {
+            for (uint32_t i = line_offsets[line]; i < line_offsets[line + 1]; ++i)
+                crossing(line_triangles[i], line % nodes_y, line / nodes_y, crossings[i]);
+            sort(crossings.begin() + line_offsets[line], crossings.begin() + line_offsets[line + 1]);
+        }
+        //whether a node is inside: an odd number of crossings lies before it along its line
+        auto inside = [&](uint32_t x, uint32_t y, uint32_t z) {
+            size_t line = (size_t) z * nodes_y + y;
+            auto first = crossings.begin() + line_offsets[line], last = crossings.begin() + line_offsets[line + 1];
+            return (lower_bound(first, last, start.x + x * cell_size) - first) % 2 == 1;
+        };
+
+        table.assign(num_bricks, DISTANCE_FIELD_OUTSIDE);
+        uint32_t num_stored = 0;
+        for (size_t b = 0; b < num_bricks; ++b) {
+            uint32_t x = b % bricks[0], y = (b / bricks[0]) % bricks[1], z = b / ((size_t) bricks[0] * bricks[1]);
+            if (brick_offsets[b] < brick_offsets[b + 1])
+                table[b] = num_stored++;
+            else if (inside(x * DISTANCE_FIELD_BRICK, y * DISTANCE_FIELD_BRICK, z * DISTANCE_FIELD_BRICK))
+                table[b] = DISTANCE_FIELD_INSIDE;
+        }
+        const size_t brick_values = DISTANCE_FIELD_NODES * DISTANCE_FIELD_NODES * DISTANCE_FIELD_NODES;
+        values.assign(num_stored * brick_values, 0);
+
+        //the bounding box of every triangle, to skip those which cannot be closer than the nearest one so far
+        vector<pair<dvec3, dvec3> > boxes(triangles.size());
+        for (size_t t = 0; t < triangles.size(); ++t) {
+            dvec3 a = positions[triangles[t][0]], b = positions[triangles[t][1]], c = positions[triangles[t][2]];
+            boxes[t] = make_pair(glm::min(glm::min(a, b), c), glm::max(glm::max(a, b), c));
+        }
+
+        //the distances of the stored bricks, a task per brick
+        TaskScheduler scheduler(threads);
+        TaskGraph tasks;
+        for (size_t b = 0; b < num_bricks; ++b) {
+            if (table[b] >= DISTANCE_FIELD_INSIDE)
+                continue;
+            tasks.add([&, b] {
+                uint32_t bx = b % bricks[0], by = (b / bricks[0]) % bricks[1];
+                uint32_t bz = b / ((size_t) bricks[0] * bricks[1]);
+                float *v = &values[table[b] * brick_values];
+                auto squaredDistanceTo = [&](uint32_t t, const dvec3 &p) {
+                    return squaredDistance(p, positions[triangles[t][0]], positions[triangles[t][1]],
+                                           positions[triangles[t][2]]);
+                };
+                auto squaredBoxDistance = [&](uint32_t t, const dvec3 &low, const dvec3 &high) {
+                    dvec3 outside = glm::max(glm::max(boxes[t].first - high, low - boxes[t].second), dvec3(0));
+                    return dot(outside, outside);
+                };
+                //the nearest triangle of one node bounds the distance of the nodes around it, so every block of
+                //DISTANCE_FIELD_BLOCK^3 nodes only looks at the few triangles within that bound of the block;
+                //the triangle nearest to the previous node is looked at first, as it is likely the nearest again
+                const dvec3 node = start + dvec3(bx, by, bz) * brick_size;
+                const double reach = sqrt(3.0) * cell_size * (DISTANCE_FIELD_BLOCK / 2);
+                vector<uint32_t> candidates;
+                uint32_t closest = brick_triangles[brick_offsets[b]];
+                for (uint32_t k0 = 0; k0 < DISTANCE_FIELD_NODES; k0 += DISTANCE_FIELD_BLOCK) {
+                    for (uint32_t j0 = 0; j0 < DISTANCE_FIELD_NODES; j0 += DISTANCE_FIELD_BLOCK) {
+                        for (uint32_t i0 = 0; i0 < DISTANCE_FIELD_NODES; i0 += DISTANCE_FIELD_BLOCK) {
+                            uvec3 low(i0, j0, k0), high = glm::min(low + uvec3(DISTANCE_FIELD_BLOCK - 1),
+                                                                      uvec3(DISTANCE_FIELD_NODES - 1));
+                            dvec3 low_corner = node + dvec3(low) * cell_size;
+                            dvec3 high_corner = node + dvec3(high) * cell_size;
+                            dvec3 centre = (low_corner + high_corner) / 2.0;
+                            double nearest = std::min(band_width * band_width, squaredDistanceTo(closest, centre));
+                            for (uint32_t e = brick_offsets[b]; e < brick_offsets[b + 1]; ++e) {
+                                uint32_t t = brick_triangles[e];
+                                if (squaredBoxDistance(t, centre, centre) < nearest)
+                                    nearest = std::min(nearest, squaredDistanceTo(t, centre));
+                            }
+                            double bound = std::min(sqrt(nearest) + reach, band_width);
+                            candidates.clear();
+                            for (uint32_t e = brick_offsets[b]; e < brick_offsets[b + 1]; ++e) {
+                                if (squaredBoxDistance(brick_triangles[e], low_corner, high_corner) < bound * bound)
+                                    candidates.push_back(brick_triangles[e]);
+                            }
+                            for (uint32_t k = low.z; k <= high.z; ++k) {
+                                for (uint32_t j = low.y; j <= high.y; ++j) {
+                                    for (uint32_t i = low.x; i <= high.x; ++i) {
+                                        dvec3 p = node + dvec3(i, j, k) * cell_size;
+                                        nearest = std::min(band_width * band_width, squaredDistanceTo(closest, p));
+                                        for (uint32_t t : candidates) {
+                                            if (squaredBoxDistance(t, p, p) >= nearest)
+                                                continue;
+                                            double squared = squaredDistanceTo(t, p);
+                                            if (squared < nearest) {
+                                                nearest = squared;
+                                                closest = t;
+                                            }
+                                        }
+                                        v[(k * DISTANCE_FIELD_NODES + j) * DISTANCE_FIELD_NODES + i] =
+                                                (float) sqrt(nearest);
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+                //the signs, walking along the crossings of every line of nodes
+                for (uint32_t k = 0; k < DISTANCE_FIELD_NODES; ++k) {
+                    for (uint32_t j = 0; j < DISTANCE_FIELD_NODES; ++j) {
+                        size_t line = (size_t) (bz * DISTANCE_FIELD_BRICK + k) * nodes_y +
+                                      by * DISTANCE_FIELD_BRICK + j;
+                        const double *first = crossings.data() + line_offsets[line];
+                        const double *last = crossings.data() + line_offsets[line + 1];
+                        const double *next = lower_bound(first, last, node.x);
+                        float *row = v + (k * DISTANCE_FIELD_NODES + j) * DISTANCE_FIELD_NODES;
+                        for (uint32_t i = 0; i < DISTANCE_FIELD_NODES; ++i) {
+                            while (next < last && *next < node.x + i * cell_size)
+                                ++next;
+                            if ((next - first) % 2 == 1)
+                                row[i] = -row[i];
+                        }
+                    }
+                }
+            });
+        }
+        scheduler.run(tasks);
+        return true;
+    }
+
+    /**
+     * Saves the field. The file is written next to its destination and renamed over it, like a checkpoint.
+     * @param path path of the file
+     * @param error set to a description of the problem if the file cannot be written
+     * @return true if the field was saved
+     */
+    bool save(const string &path, string &error) const {
+        DistanceFieldHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DISTANCE_FIELD_MAGIC, sizeof(header.magic));
+        header.version = DISTANCE_FIELD_VERSION;
+        header.brick_size = DISTANCE_FIELD_BRICK;
+        header.key = key;
+        memcpy(header.origin, origin, sizeof(origin));
+        header.cell = cell;
+        header.band = band;
+        memcpy(header.bricks, bricks, sizeof(bricks));
+        header.num_stored = values.size() / (DISTANCE_FIELD_NODES * DISTANCE_FIELD_NODES * DISTANCE_FIELD_NODES);
+        header.file_size = sizeof(header) + table.size() * sizeof(uint32_t) + values.size() * sizeof(float);
+
+        string temporary = path + ".tmp";
+        ofstream out(temporary, ios::binary | ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(table.data()), table.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(float));
+        out.close();
+        if (!out) {
+            error = "cannot write " + temporary;
+            unlink(temporary.c_str());
+            return false;
+        }
+        if (rename(temporary.c_str(), path.c_str()) != 0) {
+            error = "cannot replace " + path + ": " + strerror(errno);
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Loads a saved field if it was built from the same mesh and settings
+     * @param path path of the file
+     * @param expected_key fingerprint of the mesh and settings, see fingerprint
+     * @param error set to a description of the problem if the field cannot be used
+     * @return true if the field was loaded
+     */
+    bool load(const string &path, uint64_t expected_key, string &error) {
+        ifstream in(path, ios::binary | ios::ate);
+        if (!in) {
+            error = "cannot open " + path;
+            return false;
+        }
+        uint64_t size = in.tellg();
+        in.seekg(0);
+        DistanceFieldHeader header;
+        if (size < sizeof(header) || !in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+            memcmp(header.magic, DISTANCE_FIELD_MAGIC, sizeof(header.magic)) != 0) {
+            error = path + " is not a distance field";
+            return false;
+        }
+        if (header.version != DISTANCE_FIELD_VERSION || header.brick_size != DISTANCE_FIELD_BRICK) {
+            error = path + " has version " + to_string(header.version) + ", expected " +
+                    to_string(DISTANCE_FIELD_VERSION);
+            return false;
+        }
+        if (header.key != expected_key) {
+            error = path + " was built from another mesh or other settings";
+            return false;
+        }
+        const uint64_t brick_values = DISTANCE_FIELD_NODES * DISTANCE_FIELD_NODES * DISTANCE_FIELD_NODES;
+        uint64_t num_bricks = (uint64_t) header.bricks[0] * header.bricks[1] * header.bricks[2];
+        if (header.file_size != size ||
+            size != sizeof(header) + num_bricks * sizeof(uint32_t) + header.num_stored * brick_values * sizeof(float)) {
+            error = path + " is truncated";
+            return false;
+        }
+        vector<uint32_t> new_table(num_bricks);
+        vector<float> new_values(header.num_stored * brick_values);
+        in.read(reinterpret_cast<char *>(new_table.data()), new_table.size() * sizeof(uint32_t));
+        in.read(reinterpret_cast<char *>(new_values.data()), new_values.size() * sizeof(float));
+        for (uint32_t entry : new_table) {
+            if (!in || (entry < DISTANCE_FIELD_INSIDE && entry >= header.num_stored)) {
+                error = path + " is corrupt";
+                return false;
+            }
+        }
+        memcpy(origin, header.origin, sizeof(origin));
+        cell = header.cell;
+        inverse_cell = 1 / cell;
+        band = header.band;
+        memcpy(bricks, header.bricks, sizeof(bricks));
+        table.swap(new_table);
+        values.swap(new_values);
+        key = header.key;
+        return true;
+    }
+
+    /**
+     * Returns the distance up to which the field is exact
+     * @return the band; distances beyond it are clamped to it
+     */
+    float getBand() const {
+        return band;
+    }
+
+    /**
+     * Returns the size of the field in memory
+     * @return the bytes of the brick table and the stored bricks
+     */
+    size_t getBytes() const {
+        return table.size() * sizeof(uint32_t) + values.size() * sizeof(float);
+    }
+
+    /**
+     * Interpolates the distance and its gradient at a batch of points. A point away from the surface, inside or
+     * outside the grid, gets -band or band and no gradient.
+     * @param points the points, 4 floats each of which the last is ignored
+     * @param count number of points
+     * @param distances filled with the distance at each point, negative inside the mesh
+     * @param gradients filled with the gradient of the distance at each point, 4 floats each of which the last is 0
+     */
+    void sample(const float *points, size_t count, float *distances, float *gradients) const {
+        const uint32_t cells_x = bricks[0] * DISTANCE_FIELD_BRICK, cells_y = bricks[1] * DISTANCE_FIELD_BRICK;
+        const uint32_t cells_z = bricks[2] * DISTANCE_FIELD_BRICK;
+        const size_t brick_values = DISTANCE_FIELD_NODES * DISTANCE_FIELD_NODES * DISTANCE_FIELD_NODES;
+        const size_t dy = DISTANCE_FIELD_NODES, dz = DISTANCE_FIELD_NODES * DISTANCE_FIELD_NODES;
+        for (size_t i = 0; i < count; ++i) {
+            const float *p = points + 4 * i;
+            float *gradient = gradients + 4 * i;
+            float gx = (p[0] - origin[0]) * inverse_cell, gy = (p[1] - origin[1]) * inverse_cell;
+            float gz = (p[2] - origin[2]) * inverse_cell;
+            gradient[0] = gradient[1] = gradient[2] = gradient[3] = 0;
+            //the grid reaches a band beyond the mesh, so anything outside it is away from the surface
+            if (!(gx >= 0 && gy >= 0 && gz >= 0 && gx < cells_x && gy < cells_y && gz < cells_z)) {
+                distances[i] = band;
+                continue;
+            }
+            uint32_t x = (uint32_t) gx, y = (uint32_t) gy, z = (uint32_t) gz;
+            uint32_t entry = table[((size_t) (z / DISTANCE_FIELD_BRICK) * bricks[1] + y / DISTANCE_FIELD_BRICK) *
+                                   bricks[0] + x / DISTANCE_FIELD_BRICK];
+            if (entry >= DISTANCE_FIELD_INSIDE) {
+                distances[i] = entry == DISTANCE_FIELD_INSIDE ? -band : band;
+                continue;
+            }
+            const float *v = &values[entry * brick_values + (z % DISTANCE_FIELD_BRICK) * dz +
+                                     (y % DISTANCE_FIELD_BRICK) * dy + x % DISTANCE_FIELD_BRICK];
+            float fx = gx - x, fy = gy - y, fz = gz - z;
+            //the four edges along x, then the two faces along y, then along z
+            float e00 = v[0] + (v[1] - v[0]) * fx, e10 = v[dy] + (v[dy + 1] - v[dy]) * fx;
+            float e01 = v[dz] + (v[dz + 1] - v[dz]) * fx, e11 = v[dz + dy] + (v[dz + dy + 1] - v[dz + dy]) * fx;
+            float f0 = e00 + (e10 - e00) * fy, f1 = e01 + (e11 - e01) * fy;
+            distances[i] = f0 + (f1 - f0) * fz;
+            float d00 = v[1] - v[0], d10 = v[dy + 1] - v[dy], d01 = v[dz + 1] - v[dz];
+            float d11 = v[dz + dy + 1] - v[dz + dy];
+            float dx0 = d00 + (d10 - d00) * fy, dx1 = d01 + (d11 - d01) * fy;
+            gradient[0] = (dx0 + (dx1 - dx0) * fz) * inverse_cell;
+            gradient[1] = ((e10 - e00) + ((e11 - e01) - (e10 - e00)) * fz) * inverse_cell;
+            gradient[2] = (f1 - f0) * inverse_cell;
+        }
+    }
+};
+
+#endif //CLOTH_SIMULATION_SIGNEDDISTANCEFIELD_H
@@ -0,0 +1,251 @@
+//
+// Work-stealing thread pool which runs a graph of dependent tasks, e.g. the phases of many cloths in a frame.
+//
+
+#ifndef CLOTH_SIMULATION_TASKSCHEDULER_H
+#define CLOTH_SIMULATION_TASKSCHEDULER_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+/**
+ * Tasks and the order they have to run in. The graph is built once and can be run any number of times;
+ * every run executes each task exactly once, after all the tasks it depends on.
+ */
+class TaskGraph {
+    friend class TaskScheduler;
+
+    /**
+     * A task and the tasks waiting for it
+     */
+    struct Task {
+        function<void()> work;
+        vector<size_t> successors; // tasks which depend on this one
+        size_t num_predecessors; // number of tasks this one depends on
+        atomic<size_t> pending; // predecessors which have not finished in the current run
+
+        explicit Task(const function<void()> &work) : work(work), num_predecessors(0), pending(0) {}
+    };
+
+    vector<unique_ptr<Task> > tasks;
+
+public:
+    /**
+     * Adds a task without dependencies
+     * @param work the work of the task
+     * @return id of the task
+     */
+    size_t add(const function<void()> &work) {
+        tasks.push_back(unique_ptr<Task>(new Task(work)));
+        return tasks.size() - 1;
+    }
+
+    /**
+     * Makes a task wait for another one
+     * @param before id of the task which has to finish first
+     * @param after id of the task which waits for it
+     */
+    void precede(size_t before, size_t after) {
+        tasks[before]->successors.push_back(after);
+        ++tasks[after]->num_predecessors;
+    }
+
+    /**
+     * Returns the number of tasks
+     * @return the number of tasks
+     */
+    size_t size() const {
+        return tasks.size();
+    }
+
+    /**
+     * Removes all tasks
+     */
+    void clear() {
+        tasks.clear();
+    }
+};
+
+/**
+ * Runs task graphs on a fixed set of threads. Every thread owns a queue: it pushes the tasks which
+ * become ready to the back of its own queue and takes work from the back, so dependent tasks tend to run
+ * on the thread which just touched the same data. A thread whose queue is empty steals from the front
+ * of the queue of another thread, taking the oldest and usually largest piece of outstanding work.
+ * Threads without work sleep until a task becomes ready.
+ */
+class TaskScheduler {
+    /**
+     * Queue of ready tasks of one thread
+     */
+    struct Queue {
+        mutex queue_mutex;
+        deque<size_t> tasks;
+    };
+
+    vector<unique_ptr<Queue> > queues; // queue 0 belongs to the thread calling run
+    vector<thread> workers;
+    TaskGraph *graph; // graph of the current run, nullptr between runs
+    atomic<size_t> remaining; // tasks of the current run which have not finished
+    atomic<long> queued; // ready tasks in all the queues
+    atomic<int> sleepers; // threads waiting for work
+    mutex sleep_mutex;
+    condition_variable work_available;
+    bool stopping;
+    atomic<unsigned long> steals; // number of tasks taken from the queue of another thread, for statistics
+
+    TaskScheduler(const TaskScheduler &);
+    TaskScheduler &operator=(const TaskScheduler &);
+
+    void push(size_t self, size_t task) {
+        {
+            lock_guard<mutex> lock(queues[self]->queue_mutex);
+            queues[self]->tasks.push_back(task);
+        }
+        ++queued;
+        if (sleepers > 0) {
+            lock_guard<mutex> lock(sleep_mutex);
+            work_available.notify_one();
+        }
+    }
+
+    /**
+     * Takes the newest task of the own queue or, failing that, the oldest task of another queue
+     * @param self index of the calling thread
+     * @param task set to the id of the task
+     * @return false if all queues are empty
+     */
+    bool take(size_t self, size_t &task) {
+        {
+            lock_guard<mutex> lock(queues[self]->queue_mutex);
+            if (!queues[self]->tasks.empty()) {
+                task = queues[self]->tasks.back();
+                queues[self]->tasks.pop_back();
+                --queued;
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue &victim = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> lock(victim.queue_mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                --queued;
+                ++steals;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void execute(size_t self, size_t id) {
+        TaskGraph::Task &task = *graph->tasks[id];
+        task.work();
+        for (size_t successor : task.successors) {
+            if (--graph->tasks[successor]->pending == 0)
+                push(self, successor);
+        }
+        if (--remaining == 0) {
+            lock_guard<mutex> lock(sleep_mutex);
+            work_available.notify_all();
+        }
+    }
+
+    /**
+     * Runs tasks until the current run is over
+     * @param self index of the calling thread
+     */
+    void work(size_t self) {
+        size_t task;
+        while (remaining > 0) {
+            if (take(self, task)) {
+                execute(self, task);
+                continue;
+            }
+            unique_lock<mutex> lock(sleep_mutex);
+            ++sleepers;
+            work_available.wait(lock, [this] { return stopping || queued > 0 || remaining == 0; });
+            --sleepers;
+            if (stopping)
+                return;
+        }
+    }
+
+    void workerLoop(size_t self) {
+        while (true) {
+            {
+                unique_lock<mutex> lock(sleep_mutex);
+                ++sleepers;
+                work_available.wait(lock, [this] { return stopping || queued > 0; });
+                --sleepers;
+                if (stopping)
+                    return;
+            }
+            work(self);
+        }
+    }
+
+public:
+    /**
+     * Constructor to start the threads
+     * @param threads number of threads including the one calling run, 0 for one per core
+     */
+    explicit TaskScheduler(unsigned threads = 0) : graph(nullptr), remaining(0), queued(0), sleepers(0),
+                                                   stopping(false), steals(0) {
+        if (threads == 0)
+            threads = std::max(thread::hardware_concurrency(), 1u);
+        for (unsigned i = 0; i < threads; ++i)
+            queues.push_back(unique_ptr<Queue>(new Queue()));
+        for (unsigned i = 1; i < threads; ++i)
+            workers.push_back(thread(&TaskScheduler::workerLoop, this, i));
+    }
+
+    ~TaskScheduler() {
+        {
+            lock_guard<mutex> lock(sleep_mutex);
+            stopping = true;
+            work_available.notify_all();
+        }
+        for (thread &worker : workers)
+            worker.join();
+    }
+
+    /**
+     * Runs every task of a graph once and returns when all of them have finished.
+     * The calling thread works on the graph as well.
+     * @param tasks the graph, which must not contain cycles
+     */
+    void run(TaskGraph &tasks) {
+        if (tasks.size() == 0)
+            return;
+        graph = &tasks;
+        remaining = tasks.size();
+        for (auto &task : tasks.tasks)
+            task->pending = task->num_predecessors;
+        for (size_t id = 0; id < tasks.size(); ++id) {
+            if (tasks.tasks[id]->num_predecessors == 0)
+                push(0, id);
+        }
+        work(0);
+        graph = nullptr;
+    }
+
+    /**
+     * Returns the number of threads which run tasks
+     * @return the number of threads including the one calling run
+     */
+    unsigned getNumThreads() const {
+        return queues.size();
+    }
+
+    /**
+     * Returns how many tasks were stolen from the queue of another thread so far
+     * @return the number of tasks
+     */
+    unsigned long getSteals() const {
+        return steals;
+    }
+};
+
+#endif //CLOTH_SIMULATION_TASKSCHEDULER_H
@@ -0,0 +1,525 @@
+//
+// Bounding volume hierarchy over the triangles of a cloth, refitted to the moving points every step.
+//
+
+#ifndef CLOTH_SIMULATION_TRIANGLEBVH_H
+#define CLOTH_SIMULATION_TRIANGLEBVH_H
+
+#include <bits/stdc++.h>
+#include <glm/glm.hpp>
+
+using namespace std;
+using namespace glm;
+
+#define BVH_LEAF_SIZE 4 // largest number of triangles in a leaf
+#define BVH_BINS 16 // bins the centroids of a node are sorted into along each axis to find its split
+#define BVH_REFIT_TASKS 64 // subtrees refitted as separate tasks, at most
+
+/**
+ * A binary tree of boxes over the triangles of a cloth. The tree is built once with the surface area heuristic
+ * from the positions at hand; as the cloth moves, only the boxes are refitted bottom-up from the current positions,
+ * which is linear and keeps the tree valid, if looser than a rebuild, since neighbouring triangles stay neighbours.
+ *
+ * The nodes are stored depth first: the first child of an inner node follows it and every subtree is a contiguous
+ * range of nodes, so the refit is split into a few subtrees which are independent tasks, followed by the nodes above
+ * them. The triangles are stored in the order of the leaves along with their corners and boxes.
+ */
+class TriangleBVH {
+    /**
+     * A node of the tree
+     */
+    struct Node {
+        dvec3 low, high; // bounding box
+        uint32_t first; // leaf: first triangle in leaf order; inner node: index of its second child
+        uint32_t count; // number of triangles of a leaf, 0 for an inner node
+    };
+
+    vector<Node> nodes; // the root first
+    vector<array<uint32_t, 3> > corners; // points of each triangle, in leaf order
+    vector<uint32_t> order; // index of each triangle of the cloth, in leaf order
+    vector<pair<dvec3, dvec3> > boxes; // box of each triangle, in leaf order
+    vector<pair<uint32_t, uint32_t> > subtrees; // first node and node after the last of each refit task
+    vector<uint32_t> top; // nodes above the subtrees, children before parents
+
+    /**
+     * Returns whether two boxes overlap
+     * @param low1,high1 the first box
+     * @param low2,high2 the second box
+     * @param margin distance up to which boxes apart still overlap
+     */
+    static bool overlap(const dvec3 &low1, const dvec3 &high1, const dvec3 &low2, const dvec3 &high2,
+                        double margin) {
+        return low1.x <= high2.x + margin && low2.x <= high1.x + margin && low1.y <= high2.y + margin &&
+               low2.y <= high1.y + margin && low1.z <= high2.z + margin && low2.z <= high1.z + margin;
+    }
+
+    /**
+     * Returns half the surface area of a box
+     */
+    static double area(const dvec3 &low, const dvec3 &high) {
+        dvec3 size = high - low;
+        return size.x * size.y + size.y * size.z + size.z * size.x;
+    }
+
+    /**
+     * Recomputes the box of a node from its triangles or its children, around the triangles at two positions of
+     * the points and so around all they sweep through moving linearly from the one to the other
+     * @param n the node
+     * @param from,to positions of the points of the cloth, the same for the triangles where they are
+     */
+    template<typename Vec3>
+    void refitNode(uint32_t n, const vector<Vec3> &from, const vector<Vec3> &to) {
+        Node &node = nodes[n];
+        if (node.count == 0) {
+            node.low = glm::min(nodes[n + 1].low, nodes[node.first].low);
+            node.high = glm::max(nodes[n + 1].high, nodes[node.first].high);
+            return;
+        }
+        node.low = dvec3(numeric_limits<double>::max());
+        node.high = dvec3(-numeric_limits<double>::max());
+        for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+            dvec3 a(from[corners[i][0]]), b(from[corners[i][1]]), c(from[corners[i][2]]);
+            boxes[i].first = glm::min(glm::min(a, b), c);
+            boxes[i].second = glm::max(glm::max(a, b), c);
+            if (&from != &to) {
+                a = dvec3(to[corners[i][0]]);
+                b = dvec3(to[corners[i][1]]);
+                c = dvec3(to[corners[i][2]]);
+                boxes[i].first = glm::min(boxes[i].first, glm::min(glm::min(a, b), c));
+                boxes[i].second = glm::max(boxes[i].second, glm::max(glm::max(a, b), c));
+            }
+            node.low = glm::min(node.low, boxes[i].first);
+            node.high = glm::max(node.high, boxes[i].second);
+        }
+    }
+
+    /**
+     * Splits the tree into at most BVH_REFIT_TASKS subtrees by splitting the largest one until there are enough
+     */
+    void divideRefit() {
+        subtrees.clear();
+        top.clear();
+        if (nodes.empty())
+            return;
+        //size of the subtree of every node, from its position in depth first order
+        auto end = [&](uint32_t n) {
+            uint32_t e = n + 1;
+            while (nodes[e - 1].count == 0) // the last node of a subtree is its rightmost leaf
+                e = nodes[e - 1].first + 1;
+            return e;
+        };
+        vector<uint32_t> roots(1, 0);
+        while (roots.size() < BVH_REFIT_TASKS) {
+            uint32_t largest = roots.size();
+            for (uint32_t r = 0; r < roots.size(); ++r) {
+                if (nodes[roots[r]].count == 0 &&
+                    (largest == roots.size() || end(roots[r]) - roots[r] > end(roots[largest]) - roots[largest]))
+                    largest = r;
+            }
+            if (largest == roots.size())
+                break; // only leaves left
+            uint32_t n = roots[largest];
+            top.push_back(n);
+            roots[largest] = n + 1;
+            roots.push_back(nodes[n].first);
+        }
+        for (uint32_t r : roots)
+            subtrees.push_back(make_pair(r, end(r)));
+        sort(subtrees.begin(), subtrees.end());
+        reverse(top.begin(), top.end()); // a node was split before its children
+    }
+
+    /**
+     * Visits the overlapping pairs of the triangles below a node of this tree and those of another tree
+     * @param root the node
+     * @param other the other tree, or this one if the node is the root
+     * @param margin distance up to which boxes apart still overlap
+     * @param f function taking the index of the triangle of this tree and that of the other one
+     */
+    template<typename F>
+    void overlappingPairs(uint32_t root, const TriangleBVH &other, double margin, F &f) const {
+        if (other.nodes.empty())
+            return;
+        bool self = &other == this;
+        vector<pair<uint32_t, uint32_t> > stack(1, make_pair(root, 0u));
+        while (!stack.empty()) {
+            uint32_t a = stack.back().first, b = stack.back().second;
+            stack.pop_back();
+            const Node &x = nodes[a], &y = other.nodes[b];
+            if (self && a == b) {
+                if (x.count == 0) {
+                    stack.push_back(make_pair(a + 1, a + 1));
+                    stack.push_back(make_pair(x.first, x.first));
+                    stack.push_back(make_pair(a + 1, x.first));
+                    continue;
+                }
+                for (uint32_t i = x.first; i < x.first + x.count; ++i) {
+                    for (uint32_t j = i + 1; j < x.first + x.count; ++j) {
+                        if (overlap(boxes[i].first, boxes[i].second, boxes[j].first, boxes[j].second, margin) &&
+                            !adjacent(corners[i], corners[j]))
+                            f(order[i], order[j]);
+                    }
+                }
+                continue;
+            }
+            if (!overlap(x.low, x.high, y.low, y.high, margin))
+                continue;
+            if (x.count > 0 && y.count > 0) {
+                for (uint32_t i = x.first; i < x.first + x.count; ++i) {
+                    for (uint32_t j = y.first; j < y.first + y.count; ++j) {
+                        if (overlap(boxes[i].first, boxes[i].second, other.boxes[j].first, other.boxes[j].second,
+                                    margin) && !(self && adjacent(corners[i], other.corners[j])))
+                            f(order[i], other.order[j]);
+                    }
+                }
+            } else if (y.count > 0 || (x.count == 0 && area(x.low, x.high) >= area(y.low, y.high))) {
+                //descends into the larger box
+                stack.push_back(make_pair(a + 1, b));
+                stack.push_back(make_pair(x.first, b));
+            } else {
+                stack.push_back(make_pair(a, b + 1));
+                stack.push_back(make_pair(a, y.first));
+            }
+        }
+    }
+
+public:
+    /**
+     * Builds the tree over the triangles of a cloth at the given positions
+     * @param triangles the three points of each triangle
+     * @param points positions of the points
+     */
+    template<typename Vec3>
+    void build(const vector<array<uint32_t, 3> > &triangles, const vector<Vec3> &points) {
+        size_t count = triangles.size();
+        nodes.clear();
+        order.resize(count);
+        vector<dvec3> centroids(count), lows(count), highs(count);
+        for (size_t t = 0; t < count; ++t) {
+            order[t] = t;
+            dvec3 a(points[triangles[t][0]]), b(points[triangles[t][1]]), c(points[triangles[t][2]]);
+            lows[t] = glm::min(glm::min(a, b), c);
+            highs[t] = glm::max(glm::max(a, b), c);
+            centroids[t] = (lows[t] + highs[t]) * 0.5;
+        }
+
+        //ranges of triangles still to be turned into nodes, with the inner node which takes them as second child
+        struct Pending {
+            uint32_t begin, end, parent;
+        };
+        vector<Pending> pending;
+        if (count > 0)
+            pending.push_back({0, (uint32_t) count, UINT32_MAX});
+        while (!pending.empty()) {
+            Pending range = pending.back();
+            pending.pop_back();
+            uint32_t index = nodes.size();
+            nodes.push_back(Node());
+            if (range.parent != UINT32_MAX)
+                nodes[range.parent].first = index;
+            uint32_t size = range.end - range.begin;
+            if (size <= BVH_LEAF_SIZE) {
+                nodes[index].first = range.begin;
+                nodes[index].count = size;
+                continue;
+            }
+
+            dvec3 low(numeric_limits<double>::max()), high(-numeric_limits<double>::max());
+            for (uint32_t i = range.begin; i < range.end; ++i) {
+                low = glm::min(low, centroids[order[i]]);
+                high = glm::max(high, centroids[order[i]]);
+            }
+            //the cheapest split between bins along any axis, by the surface area heuristic
+            int best_axis = -1, best_split = 0;
+            double best_cost = numeric_limits<double>::max();
+            for (int axis = 0; axis < 3; ++axis) {
+                double extent = high[axis] - low[axis];
+                if (!(extent > 0))
+                    continue;
+                double scale = BVH_BINS / extent;
+                uint32_t bin_count[BVH_BINS] = {0};
+                dvec3 bin_low[BVH_BINS], bin_high[BVH_BINS];
+                for (int b = 0; b < BVH_BINS; ++b) {
+                    bin_low[b] = dvec3(numeric_limits<double>::max());
+                    bin_high[b] = dvec3(-numeric_limits<double>::max());
+                }
+                for (uint32_t i = range.begin; i < range.end; ++i) {
+                    uint32_t t = order[i];
+                    int b = std::min((int) ((centroids[t][axis] - low[axis]) * scale), BVH_BINS - 1);
+                    ++bin_count[b];
+                    bin_low[b] = glm::min(bin_low[b], lows[t]);
+                    bin_high[b] = glm::max(bin_high[b], highs[t]);
+                }
+                //areas of the bins right of each split, swept from the right
+                double right_area[BVH_BINS];
+                uint32_t right_count[BVH_BINS];
+                dvec3 l(numeric_limits<double>::max()), h(-numeric_limits<double>::max());
+                uint32_t n = 0;
+                for (int b = BVH_BINS - 1; b > 0; --b) {
+                    l = glm::min(l, bin_low[b]);
+                    h = glm::max(h, bin_high[b]);
+                    n += bin_count[b];
+                    right_area[b] = n > 0 ? area(l, h) : 0;
+                    right_count[b] = n;
+                }
+                l = dvec3(numeric_limits<double>::max());
+                h = dvec3(-numeric_limits<double>::max());
+                n = 0;
+                for (int b = 0; b < BVH_BINS - 1; ++b) {
+                    l = glm::min(l, bin_low[b]);
+                    h = glm::max(h, bin_high[b]);
+                    n += bin_count[b];
+                    if (n == 0 || right_count[b + 1] == 0)
+                        continue;
+                    double cost = area(l, h) * n + right_area[b + 1] * right_count[b + 1];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = b + 1;
+                    }
+                }
+            }
+
+            uint32_t middle;
+            if (best_axis >= 0) {
+                double scale = BVH_BINS / (high[best_axis] - low[best_axis]);
+                uint32_t *split = partition(order.data() + range.begin, order.data() + range.end, [&](uint32_t t) {
+                    return std::min((int) ((centroids[t][best_axis] - low[best_axis]) * scale), BVH_BINS - 1) <
+                           best_split;
+                });
+                middle = split - order.data();
+            } else {
+                middle = range.begin + size / 2; // all the centroids coincide
+            }
+            nodes[index].count = 0;
+            pending.push_back({middle, range.end, index}); // after the whole first child
+            pending.push_back({range.begin, middle, UINT32_MAX});
+        }
+
+        corners.resize(count);
+        boxes.resize(count);
+        for (size_t i = 0; i < count; ++i)
+            corners[i] = triangles[order[i]];
+        divideRefit();
+        refit(points);
+    }
+
+    /**
+     * Returns whether the tree has been built over any triangles
+     */
+    bool empty() const {
+        return nodes.empty();
+    }
+
+    /**
+     * Returns the number of tasks the refit is split into, to be run before refitTop
+     */
+    int getNumRefitTasks() const {
+        return subtrees.size();
+    }
+
+    /**
+     * Refits the boxes of one of the subtrees to the current positions of the points. The tasks write disjoint
+     * nodes and may run at the same time.
+     * @param task the subtree
+     * @param points positions of the points
+     */
+    template<typename Vec3>
+    void refitTask(int task, const vector<Vec3> &points) {
+        for (uint32_t n = subtrees[task].second; n > subtrees[task].first; --n)
+            refitNode(n - 1, points, points);
+    }
+
+    /**
+     * Refits the boxes of the nodes above the subtrees, once all the tasks are done
+     * @param points positions of the points
+     */
+    template<typename Vec3>
+    void refitTop(const vector<Vec3> &points) {
+        for (uint32_t n : top)
+            refitNode(n, points, points);
+    }
+
+    /**
+     * Refits the whole tree to the current positions of the points
+     * @param points positions of the points
+     */
+    template<typename Vec3>
+    void refit(const vector<Vec3> &points) {
+        for (int task = 0; task < getNumRefitTasks(); ++task)
+            refitTask(task, points);
+        refitTop(points);
+    }
+
+    /**
+     * Refits the whole tree to the boxes the triangles sweep through as the points move linearly from one set of
+     * positions to another, so that the pairs of triangles which may have met on the way overlap
+     * @param from positions of the points at the start of the motion
+     * @param to positions of the points at its end
+     */
+    template<typename Vec3>
+    void refit(const vector<Vec3> &from, const vector<Vec3> &to) {
+        for (uint32_t n = nodes.size(); n > 0; --n) // children follow their parents
+            refitNode(n - 1, from, to);
+    }
+
+    /**
+     * Returns the box around all the triangles
+     * @return the lowest and highest corner, or an inverted box if there are no triangles
+     */
+    pair<dvec3, dvec3> getBounds() const {
+        if (nodes.empty())
+            return make_pair(dvec3(numeric_limits<double>::max()), dvec3(-numeric_limits<double>::max()));
+        return make_pair(nodes[0].low, nodes[0].high);
+    }
+
+    /**
+     * Calls a function for every triangle whose box overlaps a box, e.g. the triangles which may be near a point
+     * @param low,high the box
+     * @param margin distance up to which boxes apart still overlap
+     * @param f function taking the index of the triangle
+     */
+    template<typename F>
+    void forEachTriangleNear(const dvec3 &low, const dvec3 &high, double margin, F f) const {
+        if (nodes.empty())
+            return;
+        vector<uint32_t> stack(1, 0);
+        while (!stack.empty()) {
+            uint32_t n = stack.back();
+            stack.pop_back();
+            const Node &node = nodes[n];
+            if (!overlap(node.low, node.high, low, high, margin))
+                continue;
+            if (node.count == 0) {
+                stack.push_back(node.first);
+                stack.push_back(n + 1);
+                continue;
+            }
+            for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                if (overlap(boxes[i].first, boxes[i].second, low, high, margin))
+                    f(order[i]);
+            }
+        }
+    }
+
+    /**
+     * Finds the first triangle hit by a ray
+     * @param origin start of the ray
+     * @param direction direction of the ray, not necessarily normalized
+     * @param points positions of the points
+     * @param distance the largest distance along the ray in units of the direction; set to that of the hit
+     * @param triangle set to the index of the triangle hit
+     * @return false if no triangle is hit within the distance
+     */
+    template<typename Vec3>
+    bool intersectRay(const dvec3 &origin, const dvec3 &direction, const vector<Vec3> &points, double &distance,
+                      uint32_t &triangle) const {
+        if (nodes.empty())
+            return false;
+        dvec3 inverse(1 / direction.x, 1 / direction.y, 1 / direction.z);
+        //distance at which the ray enters a box, or a negative value if it misses it before the current hit
+        auto enter = [&](const Node &node) {
+            double near = 0, far = distance;
+            for (int axis = 0; axis < 3; ++axis) {
+                if (direction[axis] == 0) {
+                    //parallel to the slab, which then either holds the whole ray or none of it
+                    if (origin[axis] < node.low[axis] || origin[axis] > node.high[axis])
+                        return -1.0;
+                    continue;
+                }
+                double t1 = (node.low[axis] - origin[axis]) * inverse[axis];
+                double t2 = (node.high[axis] - origin[axis]) * inverse[axis];
+                near = std::max(near, std::min(t1, t2));
+                far = std::min(far, std::max(t1, t2));
+            }
+            return near <= far ? near : -1.0;
+        };
+        bool hit = false;
+        vector<uint32_t> stack(1, 0);
+        while (!stack.empty()) {
+            uint32_t n = stack.back();
+            stack.pop_back();
+            const Node &node = nodes[n];
+            if (enter(node) < 0)
+                continue;
+            if (node.count == 0) {
+                //the nearer child is looked at first, so that it shortens the ray for the other one
+                double first = enter(nodes[n + 1]), second = enter(nodes[node.first]);
+                if (first >= 0 && second >= 0 && second < first) {
+                    stack.push_back(n + 1);
+                    stack.push_back(node.first);
+                } else {
+                    if (second >= 0)
+                        stack.push_back(node.first);
+                    if (first >= 0)
+                        stack.push_back(n + 1);
+                }
+                continue;
+            }
+            for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+                //Moller and Trumbore
+                dvec3 a(points[corners[i][0]]), b(points[corners[i][1]]), c(points[corners[i][2]]);
+                dvec3 ab = b - a, ac = c - a, p = cross(direction, ac);
+                double determinant = dot(ab, p);
+                if (determinant == 0)
+                    continue;
+                double inverse_determinant = 1 / determinant;
+                dvec3 s = origin - a;
+                double u = dot(s, p) * inverse_determinant;
+                if (u < 0 || u > 1)
+                    continue;
+                dvec3 q = cross(s, ab);
+                double v = dot(direction, q) * inverse_determinant;
+                if (v < 0 || u + v > 1)
+                    continue;
+                double t = dot(ac, q) * inverse_determinant;
+                if (t >= 0 && t < distance) {
+                    distance = t;
+                    triangle = order[i];
+                    hit = true;
+                }
+            }
+        }
+        return hit;
+    }
+
+    /**
+     * Calls a function for every pair of a triangle of this tree and one of another tree whose boxes overlap
+     * @param other the other tree, which may be this one; each pair of its own triangles is then visited once
+     * and pairs of triangles sharing a point are left out, since neighbours always touch
+     * @param margin distance up to which boxes apart still overlap, e.g. the thickness of the cloth
+     * @param f function taking the index of the triangle of this tree and that of the other one
+     */
+    template<typename F>
+    void forEachOverlappingPair(const TriangleBVH &other, double margin, F f) const {
+        if (!nodes.empty())
+            overlappingPairs(0, other, margin, f);
+    }
+
+    /**
+     * Calls a function for every pair of a triangle of one of the subtrees of the refit and one of another tree
+     * whose boxes overlap. The subtrees hold every triangle once, so running all of them, e.g. as parallel tasks,
+     * visits the pairs of forEachOverlappingPair.
+     * @param task the subtree, below getNumRefitTasks
+     * @param other the other tree, which must not be this one
+     * @param margin distance up to which boxes apart still overlap
+     * @param f function taking the index of the triangle of this tree and that of the other one
+     */
+    template<typename F>
+    void forEachOverlappingPair(int task, const TriangleBVH &other, double margin, F f) const {
+        overlappingPairs(subtrees[task].first, other, margin, f);
+    }
+
+    /**
+     * Returns whether two triangles share a point
+     */
+    static bool adjacent(const array<uint32_t, 3> &t1, const array<uint32_t, 3> &t2) {
+        for (int i = 0; i < 3; ++i) {
+            if (t1[i] == t2[0] || t1[i] == t2[1] || t1[i] == t2[2])
+                return true;
+        }
+        return false;
+    }
+};
+
+#endif //CLOTH_SIMULATION_TRIANGLEBVH_H
@@ -0,0 +1,28 @@
+//
+// Vector types of the scalar types a cloth can be stored in.
+//
+
+#ifndef CLOTH_SIMULATION_VECTOR3_H
+#define CLOTH_SIMULATION_VECTOR3_H
+
+#include <glm/glm.hpp>
+
+using namespace glm;
+
+/**
+ * Maps a scalar type to the glm vector of three such scalars
+ */
+template<typename Real>
+struct Vector3;
+
+template<>
+struct Vector3<float> {
+    typedef vec3 type;
+};
+
+template<>
+struct Vector3<double> {
+    typedef dvec3 type;
+};
+
+#endif //CLOTH_SIMULATION_VECTOR3_H
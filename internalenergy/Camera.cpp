@@ -111,4 +111,17 @@ void Camera:: yaw(double angle)
     glLoadIdentity();
     glRotatef(-angle, 0, 0, 1);
     glMultMatrixd(temp);
-}
\ No newline at end of file
+}
+
+void Camera::getRay(int x, int y, dvec3& origin, dvec3& direction)
+{
+    GLdouble modelview[16], projection[16];
+    GLint viewport[4];
+    glGetDoublev(GL_MODELVIEW_MATRIX, modelview);
+    glGetDoublev(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLdouble winY = viewport[3] - y, end[3];
+    gluUnProject(x, winY, 0, modelview, projection, viewport, &origin.x, &origin.y, &origin.z);
+    gluUnProject(x, winY, 1, modelview, projection, viewport, &end[0], &end[1], &end[2]);
+    direction = dvec3(end[0], end[1], end[2]) - origin;
+}
@@ -76,6 +76,14 @@ class Camera
          * @param displacement Displacement vector which specifies additions to the camera position
          */
         void move(dvec3 displacement);
+        /**
+         * Returns the ray through a pixel of the window in the current view
+         * @param x The horizontal position of the pixel
+         * @param y The vertical position of the pixel, from the top of the window as GLUT counts it
+         * @param origin Set to the point of the ray on the near plane
+         * @param direction Set to the direction of the ray, which reaches the far plane at a distance of 1
+         */
+        void getRay(int x, int y, dvec3& origin, dvec3& direction);
 };
 
 #endif
\ No newline at end of file
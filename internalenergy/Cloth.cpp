@@ -5,14 +5,6 @@
  * Created on 25 November, 2017, 12:58 PM
  */
 #include "Cloth.h"
-/**
- * Generates a random number between 0.0 and 1.0
- * @return The generated random number
- */
-double uniformRandom()
-{
-    return rand()/(double)RAND_MAX;
-}
 /**
  * Clamps each dimension of a dvec3 to a range of -lim to +lim
  * @param x The dvec3
@@ -28,51 +20,553 @@ dvec3 clamp(dvec3 x, double lim)
     return result;
 }
 
-Cloth::Cloth(int X, int Y)
+/**
+ * Finds the point of a triangle closest to a point
+ * @param p The point
+ * @param a,b,c The corners of the triangle
+ * @return The barycentric coordinates of the closest point
+ */
+dvec3 closestOnTriangle(dvec3 p, dvec3 a, dvec3 b, dvec3 c)
 {
-    numX = X;
-    numY = Y;
-    UVarea = 1.0/(2*(X - 1)*(Y - 1)); //area of a triangle
-    imass = (X*Y) / (double)mass;
-    points.reserve(X*Y); //reserving memory for each buffer
-    uvpoints.reserve(X*Y);
-    velocities.reserve(X*Y);
-    forces.reserve(X*Y);
-    pointNorms.reserve(X*Y);
-    movable.reserve(X*Y);
-    triangles.reserve(2*(X - 1)*(Y - 1));
-    triNorms.reserve(2*(X - 1)*(Y - 1));
-    for(int i = 0; i < X*Y; i++) //init all points
+    dvec3 ab = b - a, ac = c - a, ap = p - a;
+    double d1 = dot(ab, ap), d2 = dot(ac, ap);
+    if(d1 <= 0 && d2 <= 0)
+        return dvec3(1, 0, 0);
+    dvec3 bp = p - b;
+    double d3 = dot(ab, bp), d4 = dot(ac, bp);
+    if(d3 >= 0 && d4 <= d3)
+        return dvec3(0, 1, 0);
+    double vc = d1*d4 - d3*d2;
+    if(vc <= 0 && d1 >= 0 && d3 <= 0)
+    {
+        double v = d1/(d1 - d3);
+        return dvec3(1 - v, v, 0);
+    }
+    dvec3 cp = p - c;
+    double d5 = dot(ab, cp), d6 = dot(ac, cp);
+    if(d6 >= 0 && d5 <= d6)
+        return dvec3(0, 0, 1);
+    double vb = d5*d2 - d1*d6;
+    if(vb <= 0 && d2 >= 0 && d6 <= 0)
+    {
+        double w = d2/(d2 - d6);
+        return dvec3(1 - w, 0, w);
+    }
+    double va = d3*d6 - d5*d4;
+    if(va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0)
+    {
+        double w = (d4 - d3)/((d4 - d3) + (d5 - d6));
+        return dvec3(0, 1 - w, w);
+    }
+    double denom = 1/(va + vb + vc);
+    double v = vb*denom, w = vc*denom;
+    return dvec3(1 - v - w, v, w);
+}
+
+/**
+ * Finds the closest points of two segments
+ * @param p1,p2 The ends of the first segment
+ * @param q1,q2 The ends of the second segment
+ * @return How far along each segment its closest point is, from 0 at its first end to 1 at its second
+ */
+dvec2 closestOnSegments(dvec3 p1, dvec3 p2, dvec3 q1, dvec3 q2)
+{
+    dvec3 d1 = p2 - p1, d2 = q2 - q1, r = p1 - q1;
+    double a = dot(d1, d1), e = dot(d2, d2), f = dot(d2, r);
+    if(a <= 1e-30 && e <= 1e-30)
+        return dvec2(0, 0);
+    if(a <= 1e-30)
+        return dvec2(0, std::min(std::max(f/e, 0.0), 1.0));
+    double c = dot(d1, r);
+    if(e <= 1e-30)
+        return dvec2(std::min(std::max(-c/a, 0.0), 1.0), 0);
+    double b = dot(d1, d2), denom = a*e - b*b;
+    double s = denom > 0 ? std::min(std::max((b*f - c*e)/denom, 0.0), 1.0) : 0;
+    double t = (b*s + f)/e;
+    if(t < 0)
+    {
+        t = 0;
+        s = std::min(std::max(-c/a, 0.0), 1.0);
+    }
+    else if(t > 1)
+    {
+        t = 1;
+        s = std::min(std::max((b - c)/a, 0.0), 1.0);
+    }
+    return dvec2(s, t);
+}
+
+/**
+ * Computes the impulse which stops a point and a triangle, or two edges, closer than a thickness from approaching
+ * each other, and the push which moves them apart towards the thickness
+ * @param x The point and the corners of the triangle, or the two ends of each edge
+ * @param v The velocities with which the points are about to move
+ * @param im The inverse masses of the points, 0 for pinned ones
+ * @param edges Whether it is a pair of edges
+ * @param thickness The distance to keep
+ * @param stiffness The part of the missing distance which the impulse restores
+ * @param side A direction from the triangle or second edge towards the other side, for pairs which touch
+ * @param weights Set to the change of velocity, or of position for the push, of each point per unit of the impulse
+ * @param impulse Set to the impulse which removes the velocity towards each other, zero if the pair is not closer
+ * than the thickness
+ * @param push Set to the impulse which restores the stiffness part of the missing distance, moving the points once
+ */
+void repel(const dvec3 x[4], const dvec3 v[4], const double im[4], bool edges, double thickness, double stiffness,
+           dvec3 side, double weights[4], dvec3& impulse, dvec3& push)
+{
+    double w[4];
+    dvec3 normal;
+    if(edges)
     {
-        uvpoints.push_back(UVpoint((i%X)/((double)X - 1), (i/X) / ((double)Y - 1)));
-        points.push_back(point((i%X)/((double)X - 1), (i/X)/((double)Y - 1), 0.0));
-        velocities.push_back(dvec3(0.0, 0.0, 0.0));
-        forces.push_back(dvec3(0.0, 0.0, 0.0));
-        pointNorms.push_back(dvec3(0.0, 0.0, 0.0));
-        movable.push_back(true);
+        dvec2 st = closestOnSegments(x[0], x[1], x[2], x[3]);
+        w[0] = 1 - st.x;
+        w[1] = st.x;
+        w[2] = st.y - 1;
+        w[3] = -st.y;
+        normal = cross(x[1] - x[0], x[3] - x[2]); //the edges touch, or are parallel and this is zero
+    }
+    else
+    {
+        dvec3 uvw = closestOnTriangle(x[0], x[1], x[2], x[3]);
+        w[0] = 1;
+        w[1] = -uvw.x;
+        w[2] = -uvw.y;
+        w[3] = -uvw.z;
+        normal = cross(x[2] - x[1], x[3] - x[1]); //the point is on the triangle
+    }
+    dvec3 apart = x[0]*w[0] + x[1]*w[1] + x[2]*w[2] + x[3]*w[3];
+    double distance = length(apart);
+    impulse = dvec3(0);
+    push = dvec3(0);
+    for(int k = 0; k < 4; k++)
+        weights[k] = 0;
+    if(distance >= thickness)
+        return;
+    if(distance > 1e-12)
+        normal = apart/distance;
+    else if(length(normal) > 0 && dot(normal, side) != 0)
+        normal = normalize(dot(normal, side) < 0 ? -normal : normal);
+    else
+        return;
+    //pinned points take no share of the impulse
+    double share = 0, largest = 0;
+    dvec3 velocity(0);
+    for(int k = 0; k < 4; k++)
+    {
+        if(im[k] == 0)
+        {
+            w[k] = 0;
+            continue;
+        }
+        share += w[k]*w[k]*im[k];
+        largest = std::max(largest, std::abs(w[k])*im[k]);
+        velocity += v[k]*w[k];
+    }
+    if(share == 0)
+        return;
+    double approach = std::max(-dot(velocity, normal), 0.0), missing = stiffness*(thickness - distance);
+    //no point moves farther than the change itself; when the only movable points barely take part in the pair,
+    //e.g. a free corner far from the closest point of a triangle, the pair closes over several updates instead
+    double scale = 1/std::max(share, largest);
+    impulse = normal*(approach*scale);
+    push = normal*(missing*scale);
+    for(int k = 0; k < 4; k++)
+        weights[k] = w[k]*im[k];
+}
+
+ClothParameters ClothParameters::fromScene(const SceneConfig& scene)
+{
+    ClothParameters p;
+    p.apply(scene.section("cloth"));
+    p.apply(scene.section("material"));
+    p.apply(scene.section("solver"));
+    return p;
+}
+
+void ClothParameters::apply(const SceneSection& section)
+{
+    mass = section.getDouble("mass", mass);
+    strX = section.getDouble("stretch_x", strX);
+    strY = section.getDouble("stretch_y", strY);
+    kStrX = section.getDouble("k_stretch_x", kStrX);
+    kStrY = section.getDouble("k_stretch_y", kStrY);
+    kSh = section.getDouble("k_shear", kSh);
+    kBend = section.getDouble("k_bend", kBend);
+    kDamp = section.getDouble("k_damp", kDamp);
+    maxBend = section.getDouble("max_bend", maxBend);
+    maxBendDamp = section.getDouble("max_bend_damp", maxBendDamp);
+    maxShear = section.getDouble("max_shear", maxShear);
+    maxShearDamp = section.getDouble("max_shear_damp", maxShearDamp);
+    maxStretch = section.getDouble("max_stretch", maxStretch);
+    maxStretchDamp = section.getDouble("max_stretch_damp", maxStretchDamp);
+    gravity = section.getVec3("gravity", gravity);
+    del = section.getDouble("derivative_step", del);
+    fps = section.getInt("fps", fps);
+    seed = section.getInt("seed", seed);
+    selfThickness = std::max(section.getDouble("self_thickness", selfThickness), 0.0);
+    kSelf = section.getDouble("k_self", kSelf);
+    clothThickness = std::max(section.getDouble("cloth_thickness", clothThickness), 0.0);
+    string precision = section.getString("precision", singlePrecision ? "float" : "double");
+    if(precision == "float" || precision == "double")
+        singlePrecision = precision == "float";
+    else
+        cerr << "scene: ignoring unknown precision " << precision << endl;
+}
+
+Cloth* Cloth::create(int X, int Y, const ClothParameters& params)
+{
+    if(params.singlePrecision)
+        return new ClothT<float>(X, Y, params);
+    return new ClothT<double>(X, Y, params);
+}
+
+Cloth* Cloth::create(const shared_ptr<const ClothTopology>& topology, const ClothParameters& params,
+                     const vector<bool>& movable)
+{
+    if(params.singlePrecision)
+        return new ClothT<float>(topology, params, movable);
+    return new ClothT<double>(topology, params, movable);
+}
+
+/**
+ * Copies a section of vectors into a buffer, converting them if they were saved in the other precision
+ * @param checkpoint The checkpoint
+ * @param id The id of the section
+ * @param values The buffer, which must already have the size of the section
+ * @return true if the section exists and has the size of the buffer
+ */
+template<typename Vec3>
+bool readVectors(const CheckpointReader& checkpoint, uint32_t id, vector<Vec3>& values)
+{
+    size_t count;
+    if(checkpoint.getScalarSize() == sizeof(values[0][0])) //same precision: a single copy
+    {
+        const Vec3* stored = checkpoint.array<Vec3>(id, count);
+        if(!stored || count != values.size())
+            return false;
+        memcpy(static_cast<void*>(values.data()), stored, count*sizeof(Vec3));
+        return true;
+    }
+    if(checkpoint.getScalarSize() == sizeof(float))
+    {
+        const vec3* stored = checkpoint.array<vec3>(id, count);
+        if(!stored || count != values.size())
+            return false;
+        for(size_t i = 0; i < count; i++)
+            values[i] = Vec3(stored[i]);
+        return true;
+    }
+    const dvec3* stored = checkpoint.array<dvec3>(id, count);
+    if(!stored || count != values.size())
+        return false;
+    for(size_t i = 0; i < count; i++)
+        values[i] = Vec3(stored[i]);
+    return true;
+}
+
+Cloth* Cloth::loadCheckpoint(const string& path, string& error)
+{
+    CheckpointReader checkpoint;
+    if(!checkpoint.open(path, CHECKPOINT_MODEL_INTERNALENERGY, error))
+        return nullptr;
+    size_t count, numParams;
+    const int32_t* size = checkpoint.array<int32_t>(CHECKPOINT_CLOTH, count);
+    const ClothParameters* params = checkpoint.array<ClothParameters>(CHECKPOINT_PARAMETERS, numParams);
+    if(!size || count != 2 || !params || numParams != 1 || size[0] < 2 || size[1] < 1 || (size[0] < 3 && size[1] < 2))
+    {
+        error = "checkpoint was written by an incompatible version of the simulation";
+        return nullptr;
+    }
+    ClothParameters stored = *params;
+    stored.singlePrecision = checkpoint.getScalarSize() == sizeof(float); //resume in the precision it was saved in
+    Cloth* cloth;
+    if(size[1] == 1) //an imported mesh: its triangles and rest shape are in the checkpoint
+    {
+        ClothMesh mesh;
+        mesh.positions.resize(size[0]);
+        const int32_t* corners = checkpoint.array<int32_t>(CHECKPOINT_TRIANGLES, count);
+        size_t numUVs;
+        const dvec2* uvs = checkpoint.array<dvec2>(CHECKPOINT_UVS, numUVs);
+        if(!corners || !uvs || count % 3 != 0 || numUVs != count || !readVectors(checkpoint, CHECKPOINT_POINTS, mesh.positions))
+        {
+            error = "checkpoint of an imported mesh is missing its triangles";
+            return nullptr;
+        }
+        for(size_t i = 0; i < count; i += 3)
+        {
+            array<uint32_t, 3> t;
+            array<dvec2, 3> uv;
+            for(int k = 0; k < 3; k++)
+            {
+                if(corners[i + k] < 0 || corners[i + k] >= size[0])
+                {
+                    error = "checkpoint of an imported mesh has an invalid triangle";
+                    return nullptr;
+                }
+                t[k] = corners[i + k];
+                uv[k] = uvs[i + k];
+            }
+            mesh.triangles.push_back(t);
+            mesh.uvs.push_back(uv);
+        }
+        mesh.groups.assign(mesh.triangles.size(), 0);
+        size_t numOrder;
+        const int32_t* order = checkpoint.array<int32_t>(CHECKPOINT_ORDER, numOrder);
+        mesh.original_of_particle.resize(mesh.positions.size());
+        iota(mesh.original_of_particle.begin(), mesh.original_of_particle.end(), 0u);
+        if(order && numOrder == mesh.positions.size()) //the points were saved in the order they were simulated in
+        {
+            vector<bool> seen(numOrder, false);
+            for(size_t i = 0; i < numOrder; i++)
+            {
+                if(order[i] < 0 || order[i] >= (int32_t)numOrder || seen[order[i]])
+                {
+                    error = "checkpoint of an imported mesh has an invalid point order";
+                    return nullptr;
+                }
+                seen[order[i]] = true;
+                mesh.original_of_particle[i] = order[i];
+            }
+        }
+        mesh.buildEdges();
+        cloth = create(make_shared<ClothTopology>(mesh), stored);
+    }
+    else
+        cloth = create(size[0], size[1], stored);
+    if(!cloth->changeState(checkpoint, false, error))
+    {
+        delete cloth;
+        return nullptr;
+    }
+    return cloth;
+}
+
+/**
+ * Splits elements into tasks of UPDATE_TASK_SIZE consecutive elements and colors the tasks greedily, in order,
+ * so that no two tasks of a color share a point. The elements of a mesh sorted along a curve are close to each
+ * other, so a task only shares points with a few neighbouring tasks and there are few colors.
+ * @param elements The points of every element, -1 where an element has fewer than four
+ * @param numPoints The number of points
+ * @return The tasks of every color
+ */
+vector<vector<int> > colorTasks(const vector<array<int, 4> >& elements, int numPoints)
+{
+    int numTasks = (elements.size() + UPDATE_TASK_SIZE - 1) / UPDATE_TASK_SIZE;
+    vector<int> start(numPoints + 1, 0), lastTask(numPoints, -1); //the tasks touching each point, counted then listed
+    for(size_t e = 0; e < elements.size(); e++)
+    {
+        for(int p : elements[e])
+        {
+            if(p >= 0 && lastTask[p] != (int)(e / UPDATE_TASK_SIZE))
+            {
+                lastTask[p] = e / UPDATE_TASK_SIZE;
+                start[p + 1]++;
+            }
+        }
     }
-    movable[movable.size() - 1] = false;
-    movable[movable.size() - numX] = false;
+    for(int p = 0; p < numPoints; p++)
+        start[p + 1] += start[p];
+    vector<int> tasksOfPoint(start[numPoints]), next(start.begin(), start.end() - 1);
+    lastTask.assign(numPoints, -1);
+    for(size_t e = 0; e < elements.size(); e++)
+    {
+        for(int p : elements[e])
+        {
+            if(p >= 0 && lastTask[p] != (int)(e / UPDATE_TASK_SIZE))
+            {
+                lastTask[p] = e / UPDATE_TASK_SIZE;
+                tasksOfPoint[next[p]++] = e / UPDATE_TASK_SIZE;
+            }
+        }
+    }
+    vector<int> colorOfTask(numTasks), forbidden; //forbidden[c] is the last task which could not take color c
+    vector<vector<int> > colors;
+    for(int task = 0; task < numTasks; task++)
+    {
+        size_t end = std::min(elements.size(), (size_t)(task + 1)*UPDATE_TASK_SIZE);
+        for(size_t e = (size_t)task*UPDATE_TASK_SIZE; e < end; e++)
+        {
+            for(int p : elements[e])
+            {
+                if(p < 0)
+                    continue;
+                for(int i = start[p]; i < start[p + 1] && tasksOfPoint[i] < task; i++) //the tasks already colored
+                    forbidden[colorOfTask[tasksOfPoint[i]]] = task;
+            }
+        }
+        int color = 0;
+        while(color < (int)colors.size() && forbidden[color] == task)
+            color++;
+        if(color == (int)colors.size())
+        {
+            colors.push_back(vector<int>());
+            forbidden.push_back(-1);
+        }
+        colorOfTask[task] = color;
+        colors[color].push_back(task);
+    }
+    return colors;
+}
+
+ClothTopology::ClothTopology(int X, int Y)
+{
+    ClothMesh grid; //a grid is a mesh whose points keep their row major order
+    grid.positions.reserve(X*Y); //reserving memory for each buffer
+    grid.triangles.reserve(2*(X - 1)*(Y - 1));
+    for(int i = 0; i < X*Y; i++) //init all points
+        grid.positions.push_back(dvec3((i%X)/((double)X - 1), (i/X) / ((double)Y - 1), 0.0));
     for(int i = 0; i < 2*(X - 1)*(Y -1); i++) //init all triangles
     {
         int x = (i / 2)%(X - 1);
         int y = (i / 2)/(X - 1);
         if(i % 2 == 0)
         {
-            triangles.push_back(make_tuple(x + y*X, x + 1 + (y + 1)*X, x + (y + 1)*X));
+            grid.triangles.push_back({{(uint32_t)(x + y*X), (uint32_t)(x + 1 + (y + 1)*X), (uint32_t)(x + (y + 1)*X)}});
         }
         else
         {
-            triangles.push_back(make_tuple(x + y*X, x + 1 + y*X, x + 1 + (y + 1)*X));
+            grid.triangles.push_back({{(uint32_t)(x + y*X), (uint32_t)(x + 1 + y*X), (uint32_t)(x + 1 + (y + 1)*X)}});
         }
-        triNorms.push_back(dvec3(0.0, 0.0, 0.0));
+        array<dvec2, 3> uv;
+        for(int k = 0; k < 3; k++) //the uv coordinates are the rest positions
+            uv[k] = dvec2(grid.positions[grid.triangles.back()[k]]);
+        grid.uvs.push_back(uv);
+    }
+    grid.groups.assign(grid.triangles.size(), 0);
+    grid.buildEdges();
+    build(grid);
+    numX = X;
+    numY = Y;
+    areas.assign(triangles.size(), 1.0/(2*(X - 1)*(Y - 1))); //area of a triangle
+    defaultPins = {X*Y - 1, X*Y - X}; //the two top corners
+    pointOfVertex.clear();
+}
+
+ClothTopology::ClothTopology(const ClothMesh& mesh)
+{
+    build(mesh);
+    numX = restPoints.size();
+    numY = 1;
+    for(uint32_t p : mesh.topParticles())
+        defaultPins.push_back(p);
+    for(uint32_t p : mesh.particle_of_vertex)
+        pointOfVertex.push_back(p == CLOTH_MESH_NONE ? -1 : (int)p);
+    originalOfPoint.assign(mesh.original_of_particle.begin(), mesh.original_of_particle.end());
+}
+
+void ClothTopology::build(const ClothMesh& mesh)
+{
+    restPoints = mesh.positions;
+    triangles.reserve(mesh.triangles.size());
+    uvs.reserve(mesh.triangles.size());
+    areas.reserve(mesh.triangles.size());
+    for(size_t t = 0; t < mesh.triangles.size(); t++)
+    {
+        triangles.push_back(make_tuple((int)mesh.triangles[t][0], (int)mesh.triangles[t][1], (int)mesh.triangles[t][2]));
+        array<UVpoint, 3> uv = {{UVpoint(mesh.uvs[t][0]), UVpoint(mesh.uvs[t][1]), UVpoint(mesh.uvs[t][2])}};
+        uvs.push_back(uv);
+        auto dUV1 = uv[1] - uv[0];
+        auto dUV2 = uv[2] - uv[0];
+        areas.push_back(fabs(dUV1[0]*dUV2[1] - dUV2[0]*dUV1[1]) / 2);
+    }
+    bendPairs.reserve(mesh.cross_edges.size());
+    for(size_t e = 0; e < mesh.edges.size(); e++)
+    {
+        if(mesh.edge_triangles[e][1] == CLOTH_MESH_NONE) //a border edge does not bend
+            continue;
+        BendPair pair;
+        pair.t1 = mesh.edge_triangles[e][0];
+        pair.t2 = mesh.edge_triangles[e][1];
+        const array<uint32_t, 3>& t1 = mesh.triangles[pair.t1];
+        for(int k = 0; k < 3; k++) //the edge runs against its direction in t1
+        {
+            int a = t1[k], b = t1[(k + 1) % 3];
+            if((a == (int)mesh.edges[e][0] && b == (int)mesh.edges[e][1]) || (a == (int)mesh.edges[e][1] && b == (int)mesh.edges[e][0]))
+                pair.edge = make_pair(b, a);
+        }
+        pair.remaining = mesh.opposite(pair.t2, mesh.edges[e][0], mesh.edges[e][1]);
+        bendPairs.push_back(pair);
+    }
+    vector<array<int, 4> > elements;
+    elements.reserve(triangles.size());
+    for(const triangle& t : triangles)
+        elements.push_back({{get<0>(t), get<1>(t), get<2>(t), -1}});
+    trianglePasses = colorTasks(elements, restPoints.size());
+    elements.clear();
+    for(const BendPair& pair : bendPairs) //the forces go to the points of t1 and the remaining point
+        elements.push_back({{get<0>(triangles[pair.t1]), get<1>(triangles[pair.t1]), get<2>(triangles[pair.t1]), pair.remaining}});
+    bendPasses = colorTasks(elements, restPoints.size());
+}
+
+Cloth::Cloth(const shared_ptr<const ClothTopology>& topology, const ClothParameters& params, const vector<bool>& movable)
+    : topology(topology), triangles(topology->triangles), uvs(topology->uvs), areas(topology->areas),
+      bendPairs(topology->bendPairs)
+{
+    this->params = params;
+    mass = params.mass;
+    numX = topology->numX;
+    numY = topology->numY;
+    imass = (numX*numY) / (double)mass;
+    if((int)movable.size() == numX*numY)
+    {
+        this->movable = movable;
+        return;
+    }
+    this->movable.assign(numX*numY, true);
+    for(int p : topology->defaultPins)
+        this->movable[p] = false;
+}
+
+template<typename Real>
+ClothT<Real>::ClothT(int X, int Y, const ClothParameters& params)
+    : ClothT(make_shared<ClothTopology>(X, Y), params)
+{
+}
+
+template<typename Real>
+ClothT<Real>::ClothT(const shared_ptr<const ClothTopology>& topology, const ClothParameters& params,
+                     const vector<bool>& movable)
+    : Cloth(topology, params, movable)
+{
+    int X = numX, Y = numY;
+    points.reserve(X*Y); //reserving memory for each buffer
+    velocities.reserve(X*Y);
+    forces.reserve(X*Y);
+    pointNorms.reserve(X*Y);
+    triNorms.reserve(triangles.size());
+    for(int i = 0; i < X*Y; i++) //init all points
+    {
+        points.push_back(Vec3(topology->restPoints[i]));
+        velocities.push_back(Vec3(0.0, 0.0, 0.0));
+        forces.push_back(Vec3(0.0, 0.0, 0.0));
+        pointNorms.push_back(Vec3(0.0, 0.0, 0.0));
     }
+    triNorms.assign(triangles.size(), Vec3(0.0, 0.0, 0.0));
     perturb();
     makeNorms();
-    
+    vector<array<uint32_t, 3> > corners(triangles.size());
+    for(size_t t = 0; t < triangles.size(); t++)
+        corners[t] = {{(uint32_t)get<0>(triangles[t]), (uint32_t)get<1>(triangles[t]), (uint32_t)get<2>(triangles[t])}};
+    bvh.build(corners, points);
+    //the lowest triangle around every point and edge tests it against the others
+    ownerOfPoint.assign(points.size(), -1);
+    ownedEdges.assign(triangles.size(), 0);
+    map<pair<int, int>, int> ownerOfEdge;
+    for(int t = (int)triangles.size() - 1; t >= 0; t--)
+    {
+        for(int k = 0; k < 3; k++)
+        {
+            int p = corners[t][k], q = corners[t][(k + 1)%3];
+            ownerOfPoint[p] = t;
+            ownerOfEdge[make_pair(std::min(p, q), std::max(p, q))] = t*3 + k;
+        }
+    }
+    for(auto& edge : ownerOfEdge)
+        ownedEdges[edge.second/3] |= 1 << (edge.second%3);
 }
 
-void Cloth::changeState(vector<point> points, vector<dvec3> velocities, vector<bool> movable, bool pert)
+template<typename Real>
+void ClothT<Real>::changeState(vector<Vec3> points, vector<Vec3> velocities, vector<bool> movable, bool pert)
 {
     this->points = points;
     this->velocities = velocities;
@@ -80,31 +574,94 @@ void Cloth::changeState(vector<point> points, vector<dvec3> velocities, vector<b
     if(pert) //perturb if required
         perturb();
     makeNorms();
+    bvh.refit(this->points); //the parameter still holds the points before the perturbation
+}
+
+template<typename Real>
+bool ClothT<Real>::changeState(const CheckpointReader& checkpoint, bool pert, string& error)
+{
+    size_t count;
+    const int32_t* size = checkpoint.array<int32_t>(CHECKPOINT_CLOTH, count);
+    if(!size || count != 2 || size[0] != numX || size[1] != numY)
+    {
+        error = "checkpoint is of a cloth of another resolution";
+        return false;
+    }
+    const uint8_t* pins = checkpoint.array<uint8_t>(CHECKPOINT_MOVABLE, count);
+    if(!pins || count != points.size() ||
+       !readVectors(checkpoint, CHECKPOINT_POINTS, points) || !readVectors(checkpoint, CHECKPOINT_VELOCITIES, velocities))
+    {
+        error = "checkpoint does not match the size of the cloth";
+        return false;
+    }
+    movable.assign(pins, pins + count);
+    if(pert) //perturb if required
+        perturb();
+    makeNorms();
+    bvh.refit(points);
+    return true;
+}
+
+template<typename Real>
+bool ClothT<Real>::saveCheckpoint(const string& path, string& error)
+{
+    CheckpointWriter checkpoint(CHECKPOINT_MODEL_INTERNALENERGY, sizeof(Real));
+    int32_t size[2] = {numX, numY};
+    checkpoint.append(CHECKPOINT_CLOTH, size, sizeof(size));
+    checkpoint.append(CHECKPOINT_PARAMETERS, &params, sizeof(params));
+    checkpoint.append(CHECKPOINT_POINTS, points);
+    checkpoint.append(CHECKPOINT_VELOCITIES, velocities);
+    checkpoint.append(CHECKPOINT_MOVABLE, vector<uint8_t>(movable.begin(), movable.end()));
+    vector<int32_t> corners;
+    corners.reserve(3*triangles.size());
+    for(auto t: triangles)
+    {
+        corners.push_back(get<0>(t));
+        corners.push_back(get<1>(t));
+        corners.push_back(get<2>(t));
+    }
+    checkpoint.append(CHECKPOINT_TRIANGLES, corners);
+    if(numY == 1) //an imported mesh cannot be rebuilt from its size
+    {
+        vector<dvec2> corneruvs;
+        corneruvs.reserve(3*uvs.size());
+        for(auto& uv: uvs)
+            corneruvs.insert(corneruvs.end(), uv.begin(), uv.end());
+        checkpoint.append(CHECKPOINT_UVS, corneruvs);
+        checkpoint.append(CHECKPOINT_ORDER, vector<int32_t>(topology->originalOfPoint.begin(), topology->originalOfPoint.end()));
+    }
+    return checkpoint.write(path, error);
 }
 
-void Cloth::perturb()
+template<typename Real>
+void ClothT<Real>::perturb()
 {
-    for(int i = 0; i < points.size() - numX; i++)
+    CounterRandom random(params.seed);
+    const vector<int>& order = topology->originalOfPoint;
+    int end = numY == 1 ? points.size() : points.size() - numX; //a grid leaves its top row as it is
+    for(int i = 0; i < end; i++)
     {
         for(int j = 0; j < 3; j++)
         {
-            if(movable[i])
-                points[i][j] += uniformRandom() / 50; //perturbing by a small random amount
+            if(movable[i]) //perturbing by a small random amount, the same for the point in any order
+                points[i][j] += random.uniform(order.empty() ? i : order[i], j) / 50;
         }
     }
 }
 
-void Cloth::integrate() 
+template<typename Real>
+void ClothT<Real>::integrate(int begin, int end)
 {
-    for(int i = 0; i < forces.size(); i++)
+    for(int i = begin; i < end; i++)
     {
         for(int j = 0; j < 3; j++)
             velocities[i][j] += forces[i][j] * imass;
-        velocities[i][1] -= GRAVITY;
+        for(int j = 0; j < 3; j++)
+            velocities[i][j] += params.gravity[j];
         
         
     }
-    for(int i = 0; i < points.size(); i++)
+    for(int i = begin; i < end; i++)
     {
         for(int j = 0; j < 3; j++)
         {
@@ -114,24 +671,15 @@ void Cloth::integrate()
     }
 }
 
-int Cloth::getRemaining(pair<int, int> shared, int t)
+template<typename Real>
+pair<dvec3, dvec3> ClothT<Real>::getWUV(int t)
 {
-    if(get<0>(triangles[t]) != shared.first && get<0>(triangles[t]) != shared.second)
-        return get<0>(triangles[t]);
-    else if(get<1>(triangles[t]) != shared.first && get<1>(triangles[t]) != shared.second)
-        return get<1>(triangles[t]);
-    else
-        return get<2>(triangles[t]);
-}
-
-pair<dvec3, dvec3> Cloth::getWUV(triangle t)
-{
-    auto uvp0 = uvpoints[get<0>(t)];
-    auto uvp1 = uvpoints[get<1>(t)];
-    auto uvp2 = uvpoints[get<2>(t)];
-    auto p0 = points[get<0>(t)];
-    auto p1 = points[get<1>(t)];
-    auto p2 = points[get<2>(t)];
+    auto uvp0 = uvs[t][0];
+    auto uvp1 = uvs[t][1];
+    auto uvp2 = uvs[t][2];
+    dvec3 p0(points[get<0>(triangles[t])]); //the conditions are evaluated in double
+    dvec3 p1(points[get<1>(triangles[t])]);
+    dvec3 p2(points[get<2>(triangles[t])]);
     auto dUV1 = uvp1 - uvp0;
     auto dUV2 = uvp2 - uvp0;
     auto dP1 = p1 - p0;
@@ -146,305 +694,824 @@ pair<dvec3, dvec3> Cloth::getWUV(triangle t)
     return make_pair(Wu, Wv);    
 }
 
-pair<int, int> Cloth::sharedEdge(int t1, int t2)
-{
-    if(t2 - t1 == 1)
-        return make_pair(get<1>(triangles[t1]), get<0>(triangles[t1]));
-    else if(t2 - t1 == -1)
-        return make_pair(get<0>(triangles[t1]), get<2>(triangles[t1]));
-    else
-        return make_pair(get<2>(triangles[t1]), get<1>(triangles[t1]));
-}
-
-double Cloth::condStretchX(triangle t, double stretchiness)
+template<typename Real>
+double ClothT<Real>::condStretchX(int t, double stretchiness)
 {
     auto wuv = getWUV(t);
-    return UVarea * (length(wuv.first) - stretchiness); //scaling the condition by the area
+    return areas[t] * (length(wuv.first) - stretchiness); //scaling the condition by the area
 }
 
-double Cloth::condStretchY(triangle t, double stretchiness)
+template<typename Real>
+double ClothT<Real>::condStretchY(int t, double stretchiness)
 {
     auto wuv = getWUV(t);
-    return UVarea * (length(wuv.second) - stretchiness); //scaling the condition by the area
+    return areas[t] * (length(wuv.second) - stretchiness); //scaling the condition by the area
 }
 
-double Cloth::condShear(triangle t)
+template<typename Real>
+double ClothT<Real>::condShear(int t)
 {
     auto wuv = getWUV(t);
-    return UVarea * dot(wuv.first, wuv.second);
+    return areas[t] * dot(wuv.first, wuv.second);
 }
 
-double Cloth::condBend(int t1, int t2)
+template<typename Real>
+double ClothT<Real>::condBend(const BendPair& pair)
 {
-    dvec3 n1 = triNorms[t1];
-    dvec3 n2 = triNorms[t2];
-    auto shared = sharedEdge(t1, t2);
-    auto e = (points[shared.first] - points[shared.second]);
+    dvec3 n1(triNorms[pair.t1]);
+    dvec3 n2(triNorms[pair.t2]);
+    auto shared = pair.edge;
+    auto e = (dvec3(points[shared.first]) - dvec3(points[shared.second]));
     double sin = dot(cross(n1, n2), e); //getting sin and cos to maintain numerical stability
     double cos = dot(n1, n2);
     return atan(sin, cos);//, cos);
 }
 
-tuple<dvec3, dvec3, dvec3> Cloth::derivativeStretchX(triangle t, double stretchiness)
+template<typename Real>
+template<typename Condition>
+dvec3 ClothT<Real>::gradient(int p, Condition condition)
 {
-    auto result = make_tuple(dvec3(0.0), dvec3(0.0), dvec3(0.0)); //for each of the three points
-    for(int i = 0; i < 3; i++)
-    {
-        points[get<0>(t)][i] -= DEL;
-        double f1 = condStretchX(t, stretchiness);
-        points[get<0>(t)][i] += 2*DEL;
-        double f2 = condStretchX(t, stretchiness);
-        double grad = (f2 - f1) / (2*DEL); //numerical gradient
-        points[get<0>(t)][i] -= DEL;
-        get<0>(result)[i] = grad;
-    }
+    dvec3 grad(0.0);
     for(int i = 0; i < 3; i++)
     {
-        points[get<1>(t)][i] -= DEL;
-        double f1 = condStretchX(t, stretchiness);
-        points[get<1>(t)][i] += 2*DEL;
-        double f2 = condStretchX(t, stretchiness);
-        double grad = (f2 - f1) / (2*DEL);
-        points[get<1>(t)][i] -= DEL;
-        get<1>(result)[i] = grad;
+        Real original = points[p][i];
+        points[p][i] = original - params.del;
+        double low = points[p][i];
+        double f1 = condition();
+        points[p][i] = original + params.del;
+        double high = points[p][i];
+        double f2 = condition();
+        points[p][i] = original;
+        grad[i] = (f2 - f1) / (high - low); //numerical gradient
     }
-    for(int i = 0; i < 3; i++)
+    return grad;
+}
+
+template<typename Real>
+tuple<dvec3, dvec3, dvec3> ClothT<Real>::derivativeStretchX(int t, double stretchiness)
+{
+    auto condition = [&]() { return condStretchX(t, stretchiness); };
+    return make_tuple(gradient(get<0>(triangles[t]), condition), gradient(get<1>(triangles[t]), condition),
+                      gradient(get<2>(triangles[t]), condition)); //for each of the three points
+}
+
+template<typename Real>
+tuple<dvec3, dvec3, dvec3> ClothT<Real>::derivativeStretchY(int t, double stretchiness)
+{
+    auto condition = [&]() { return condStretchY(t, stretchiness); };
+    return make_tuple(gradient(get<0>(triangles[t]), condition), gradient(get<1>(triangles[t]), condition),
+                      gradient(get<2>(triangles[t]), condition)); //for each of the three points
+}
+
+template<typename Real>
+tuple<dvec3, dvec3, dvec3> ClothT<Real>::derivativeShear(int t)
+{
+    auto condition = [&]() { return condShear(t); };
+    return make_tuple(gradient(get<0>(triangles[t]), condition), gradient(get<1>(triangles[t]), condition),
+                      gradient(get<2>(triangles[t]), condition)); //for each of the three points
+}
+
+template<typename Real>
+tuple<dvec3, dvec3, dvec3, dvec3> ClothT<Real>::derivativeBend(const BendPair& pair)
+{
+    auto condition = [&]() { return condBend(pair); };
+    int t1 = pair.t1;
+    int rem = pair.remaining;
+    return make_tuple(gradient(get<0>(triangles[t1]), condition), gradient(get<1>(triangles[t1]), condition),
+                      gradient(get<2>(triangles[t1]), condition), gradient(rem, condition)); //for each of the four points
+}
+
+template<typename Real>
+void ClothT<Real>::addStretchXForces(int begin, int end, double str)
+{
+    for(int i = begin; i < end; i++)
     {
-        points[get<2>(t)][i] -= DEL;
-        double f1 = condStretchX(t, stretchiness);
-        points[get<2>(t)][i] += 2*DEL;
-        double f2 = condStretchX(t, stretchiness);
-        double grad = (f2 - f1) / (2*DEL);
-        points[get<2>(t)][i] -= DEL;
-        get<2>(result)[i] = grad;
+        auto gradx = derivativeStretchX(i, str);
+        double condx = condStretchX(i, str);
+        forces[get<0>(triangles[i])] -= Vec3(clamp(get<0>(gradx)*condx*params.kStrX, params.maxStretch)); //adding forces
+        forces[get<1>(triangles[i])] -= Vec3(clamp(get<1>(gradx)*condx*params.kStrX, params.maxStretch));
+        forces[get<2>(triangles[i])] -= Vec3(clamp(get<2>(gradx)*condx*params.kStrX, params.maxStretch));
+        double timederivative = dot(get<0>(gradx), dvec3(velocities[get<0>(triangles[i])])); //time derivative of the condition
+        timederivative +=  dot(get<1>(gradx), dvec3(velocities[get<1>(triangles[i])]));
+        timederivative += dot(get<2>(gradx), dvec3(velocities[get<2>(triangles[i])]));
+        forces[get<0>(triangles[i])] -= Vec3(clamp(get<0>(gradx)*timederivative*params.kStrX*params.kDamp, params.maxStretchDamp)); //damping
+        forces[get<1>(triangles[i])] -= Vec3(clamp(get<1>(gradx)*timederivative*params.kStrX*params.kDamp, params.maxStretchDamp));
+        forces[get<2>(triangles[i])] -= Vec3(clamp(get<2>(gradx)*timederivative*params.kStrX*params.kDamp, params.maxStretchDamp));
     }
-    return result;
 }
 
-tuple<dvec3, dvec3, dvec3> Cloth::derivativeStretchY(triangle t, double stretchiness)
+template<typename Real>
+void ClothT<Real>::addStretchYForces(int begin, int end, double str)
 {
-    auto result = make_tuple(dvec3(0.0), dvec3(0.0), dvec3(0.0)); //for each of the three points
-    for(int i = 0; i < 3; i++)
+    for(int i = begin; i < end; i++)
     {
-        points[get<0>(t)][i] -= DEL;
-        double f1 = condStretchY(t, stretchiness);
-        points[get<0>(t)][i] += 2*DEL;
-        double f2 = condStretchY(t, stretchiness);
-        double grad = (f2 - f1) / (2*DEL); //numerical gradient
-        points[get<0>(t)][i] -= DEL;
-        get<0>(result)[i] = grad;
+        auto grady = derivativeStretchY(i, str);
+        double condy = condStretchY(i, str);
+        forces[get<0>(triangles[i])] -= Vec3(clamp(get<0>(grady)*condy*params.kStrY, params.maxStretch)); //adding forces
+        forces[get<1>(triangles[i])] -= Vec3(clamp(get<1>(grady)*condy*params.kStrY, params.maxStretch));
+        forces[get<2>(triangles[i])] -= Vec3(clamp(get<2>(grady)*condy*params.kStrY, params.maxStretch));
+        double timederivative = dot(get<0>(grady), dvec3(velocities[get<0>(triangles[i])])); //time derivative of the condition
+        timederivative +=  dot(get<1>(grady), dvec3(velocities[get<1>(triangles[i])]));
+        timederivative += dot(get<2>(grady), dvec3(velocities[get<2>(triangles[i])]));
+        forces[get<0>(triangles[i])] -= Vec3(clamp(get<0>(grady)*timederivative*params.kStrY*params.kDamp, params.maxStretchDamp)); //damping
+        forces[get<1>(triangles[i])] -= Vec3(clamp(get<1>(grady)*timederivative*params.kStrY*params.kDamp, params.maxStretchDamp));
+        forces[get<2>(triangles[i])] -= Vec3(clamp(get<2>(grady)*timederivative*params.kStrY*params.kDamp, params.maxStretchDamp));
     }
-    for(int i = 0; i < 3; i++)
+}
+
+template<typename Real>
+void ClothT<Real>::addShearForces(int begin, int end)
+{
+    for(int i = begin; i < end; i++)
     {
-        points[get<1>(t)][i] -= DEL;
-        double f1 = condStretchY(t, stretchiness);
-        points[get<1>(t)][i] += 2*DEL;
-        double f2 = condStretchY(t, stretchiness);
-        double grad = (f2 - f1) / (2*DEL);
-        points[get<1>(t)][i] -= DEL;
-        get<1>(result)[i] = grad;
+        auto gradsh = derivativeShear(i);
+        double condsh = condShear(i);
+        forces[get<0>(triangles[i])] -= Vec3(clamp(get<0>(gradsh)*condsh*params.kSh, params.maxShear)); //adding normal forces
+        forces[get<1>(triangles[i])] -= Vec3(clamp(get<1>(gradsh)*condsh*params.kSh, params.maxShear));
+        forces[get<2>(triangles[i])] -= Vec3(clamp(get<2>(gradsh)*condsh*params.kSh, params.maxShear));
+        double timederivative = dot(get<0>(gradsh), dvec3(velocities[get<0>(triangles[i])])); //time derivative of the condition
+        timederivative +=  dot(get<1>(gradsh), dvec3(velocities[get<1>(triangles[i])]));
+        timederivative += dot(get<2>(gradsh), dvec3(velocities[get<2>(triangles[i])]));
+        forces[get<0>(triangles[i])] -= Vec3(clamp(get<0>(gradsh)*timederivative*params.kSh*params.kDamp, params.maxShearDamp)); //damping
+        forces[get<1>(triangles[i])] -= Vec3(clamp(get<1>(gradsh)*timederivative*params.kSh*params.kDamp, params.maxShearDamp));
+        forces[get<2>(triangles[i])] -= Vec3(clamp(get<2>(gradsh)*timederivative*params.kSh*params.kDamp, params.maxShearDamp));
     }
-    for(int i = 0; i < 3; i++)
+}
+
+template<typename Real>
+void ClothT<Real>::bend(const BendPair& pair)
+{
+    int t1 = pair.t1;
+    double condb = condBend(pair);
+    auto gradb = derivativeBend(pair);
+    forces[get<0>(triangles[t1])] -= Vec3(clamp(get<0>(gradb)*condb*params.kBend, params.maxBend)); //adding normal forces
+    forces[get<1>(triangles[t1])] -= Vec3(clamp(get<1>(gradb)*condb*params.kBend, params.maxBend));
+    forces[get<2>(triangles[t1])] -= Vec3(clamp(get<2>(gradb)*condb*params.kBend, params.maxBend));
+    int rem = pair.remaining;
+    forces[rem] -= Vec3(get<3>(gradb)*condb*params.kBend);
+    double timederivative = dot(get<0>(gradb), dvec3(velocities[get<0>(triangles[t1])])); //time derivative of the condition
+    timederivative +=  dot(get<1>(gradb), dvec3(velocities[get<1>(triangles[t1])]));
+    timederivative += dot(get<2>(gradb), dvec3(velocities[get<2>(triangles[t1])]));
+    timederivative += dot(get<3>(gradb), dvec3(velocities[rem]));
+    forces[get<0>(triangles[t1])] -= Vec3(clamp(get<0>(gradb)*timederivative*params.kBend*params.kDamp, params.maxBendDamp)); //damping
+    forces[get<1>(triangles[t1])] -= Vec3(clamp(get<1>(gradb)*timederivative*params.kBend*params.kDamp, params.maxBendDamp));
+    forces[get<2>(triangles[t1])] -= Vec3(clamp(get<2>(gradb)*timederivative*params.kBend*params.kDamp, params.maxBendDamp));
+    forces[rem] -= Vec3(get<3>(gradb)*timederivative*params.kBend*params.kDamp);
+}
+
+template<typename Real>
+void ClothT<Real>::addBendForces(int begin, int end)
+{
+    for(int i = begin; i < end; i++) //every edge shared by two triangles
+        bend(bendPairs[i]);
+}
+
+template<typename Real>
+void ClothT<Real>::update()
+{
+    for(int pass = 0; pass < getNumPasses(); pass++)
     {
-        points[get<2>(t)][i] -= DEL;
-        double f1 = condStretchY(t, stretchiness);
-        points[get<2>(t)][i] += 2*DEL;
-        double f2 = condStretchY(t, stretchiness);
-        double grad = (f2 - f1) / (2*DEL);
-        points[get<2>(t)][i] -= DEL;
-        get<2>(result)[i] = grad;
+        for(int task = 0; task < getNumTasks(pass); task++)
+            updateTask(pass, task);
     }
-    return result;
 }
 
-tuple<dvec3, dvec3, dvec3> Cloth::derivativeShear(triangle t) 
+template<typename Real>
+int ClothT<Real>::getNumPasses()
 {
-    auto result = make_tuple(dvec3(0.0), dvec3(0.0), dvec3(0.0)); //for each of the three points
-    for(int i = 0; i < 3; i++)
+    return topology->trianglePasses.size() + topology->bendPasses.size() + 9;
+}
+
+template<typename Real>
+int ClothT<Real>::getNumTasks(int pass)
+{
+    int numTrianglePasses = topology->trianglePasses.size(), numBendPasses = topology->bendPasses.size();
+    if(pass > 0 && pass <= numTrianglePasses)
+        return topology->trianglePasses[pass - 1].size();
+    if(pass > numTrianglePasses && pass <= numTrianglePasses + numBendPasses)
+        return topology->bendPasses[pass - 1 - numTrianglePasses].size();
+    int last = numTrianglePasses + numBendPasses; //the last bending pass
+    bool self = params.selfThickness > 0;
+    if(pass == last + 1 || pass == last + 3 || pass == last + 5) //the self contacts are found and resolved in order
+        return self ? 1 : 0;
+    if(pass == last + 2)
+        return self ? SELF_TASKS : 0;
+    if(pass == last + 6) //the normals of the points are sums over the triangles
+        return 1;
+    if(pass == last + 7)
+        return bvh.getNumRefitTasks();
+    if(pass == last + 8)
+        return 1;
+    return (points.size() + UPDATE_TASK_SIZE - 1) / UPDATE_TASK_SIZE; //clearing and integrating, point by point
+}
+
+template<typename Real>
+void ClothT<Real>::updateTask(int pass, int task)
+{
+    int numTrianglePasses = topology->trianglePasses.size(), numBendPasses = topology->bendPasses.size();
+    int begin = task*UPDATE_TASK_SIZE;
+    if(pass == 0)
     {
-        points[get<0>(t)][i] -= DEL;
-        double f1 = condShear(t);
-        points[get<0>(t)][i] += 2*DEL;
-        double f2 = condShear(t);
-        double grad = (f2 - f1) / (2*DEL); //numerical gradient
-        points[get<0>(t)][i] -= DEL;
-        get<0>(result)[i] = grad;
+        PROFILE_SCOPE("clear forces");
+        int end = std::min((int)forces.size(), begin + UPDATE_TASK_SIZE);
+        for(int i = begin; i < end; i++)
+        {
+            forces[i] = Vec3(0.0);
+        }
     }
-    for(int i = 0; i < 3; i++)
+    else if(pass <= numTrianglePasses)
     {
-        points[get<1>(t)][i] -= DEL;
-        double f1 = condShear(t);
-        points[get<1>(t)][i] += 2*DEL;
-        double f2 = condShear(t);
-        double grad = (f2 - f1) / (2*DEL);
-        points[get<1>(t)][i] -= DEL;
-        get<1>(result)[i] = grad;
+        begin = topology->trianglePasses[pass - 1][task]*UPDATE_TASK_SIZE;
+        int end = std::min((int)triangles.size(), begin + UPDATE_TASK_SIZE);
+        {
+            PROFILE_SCOPE("stretch");
+            addStretchXForces(begin, end, params.strX);
+            addStretchYForces(begin, end, params.strY);
+        }
+        PROFILE_SCOPE("shear");
+        addShearForces(begin, end);
     }
-    for(int i = 0; i < 3; i++)
+    else if(pass <= numTrianglePasses + numBendPasses)
     {
-        points[get<2>(t)][i] -= DEL;
-        double f1 = condShear(t);
-        points[get<2>(t)][i] += 2*DEL;
-        double f2 = condShear(t);
-        double grad = (f2 - f1) / (2*DEL);
-        points[get<2>(t)][i] -= DEL;
-        get<2>(result)[i] = grad;
+        PROFILE_SCOPE("bend");
+        begin = topology->bendPasses[pass - 1 - numTrianglePasses][task]*UPDATE_TASK_SIZE;
+        addBendForces(begin, std::min((int)bendPairs.size(), begin + UPDATE_TASK_SIZE));
+    }
+    else if(pass == numTrianglePasses + numBendPasses + 1)
+    {
+        PROFILE_SCOPE("self contacts");
+        findSelfContacts();
+    }
+    else if(pass == numTrianglePasses + numBendPasses + 2)
+    {
+        PROFILE_SCOPE("self contacts");
+        int size = selfContacts.size();
+        computeRepulsions(task*size/SELF_TASKS, (task + 1)*size/SELF_TASKS);
+    }
+    else if(pass == numTrianglePasses + numBendPasses + 3)
+    {
+        PROFILE_SCOPE("self contacts");
+        addRepulsions();
+    }
+    else if(pass == numTrianglePasses + numBendPasses + 4)
+    {
+        PROFILE_SCOPE("integration");
+        integrate(begin, std::min((int)points.size(), begin + UPDATE_TASK_SIZE));
+    }
+    else if(pass == numTrianglePasses + numBendPasses + 5)
+    {
+        PROFILE_SCOPE("impact zones");
+        resolveImpactZones();
+    }
+    else if(pass == numTrianglePasses + numBendPasses + 6)
+    {
+        PROFILE_SCOPE("normals");
+        makeNorms();
+    }
+    else if(pass == numTrianglePasses + numBendPasses + 7)
+    {
+        PROFILE_SCOPE("bvh refit");
+        bvh.refitTask(task, points);
+    }
+    else
+    {
+        PROFILE_SCOPE("bvh refit");
+        bvh.refitTop(points);
     }
-    return result;
 }
 
-tuple<dvec3, dvec3, dvec3, dvec3> Cloth::derivativeBend(int t1, int t2)
+template<typename Real>
+template<typename F>
+void ClothT<Real>::forEachSelfPair(const vector<Vec3>& from, const vector<Vec3>& to, double margin, F f)
 {
-    auto result = make_tuple(dvec3(0.0), dvec3(0.0), dvec3(0.0), dvec3(0.0)); //for each of the four points
-    for(int i = 0; i < 3; i++)
-    {
-        points[get<0>(triangles[t1])][i] -= DEL;
-        double f1 = condBend(t1, t2);
-        points[get<0>(triangles[t1])][i] += 2*DEL;
-        double f2 = condBend(t1, t2);
-        double grad = (f2 - f1) / (2*DEL); //numerical gradient        
-        points[get<0>(triangles[t1])][i] -= DEL;
-        get<0>(result)[i] = grad;
-    }
-    for(int i = 0; i < 3; i++)
+    auto corner = [&](int t, int k) {
+        return k == 0 ? get<0>(triangles[t]) : k == 1 ? get<1>(triangles[t]) : get<2>(triangles[t]);
+    };
+    const vector<Vec3>* ends[2] = {&from, &to};
+    int numEnds = &from == &to ? 1 : 2;
+    //whether the boxes swept by two sets of points are within the margin
+    auto near = [&](const int* first, int numFirst, const int* second, int numSecond) {
+        for(int axis = 0; axis < 3; axis++)
+        {
+            double low1 = DBL_MAX, high1 = -DBL_MAX, low2 = DBL_MAX, high2 = -DBL_MAX;
+            for(int e = 0; e < numEnds; e++)
+            {
+                const vector<Vec3>& positions = *ends[e];
+                for(int i = 0; i < numFirst; i++)
+                {
+                    low1 = std::min(low1, (double)positions[first[i]][axis]);
+                    high1 = std::max(high1, (double)positions[first[i]][axis]);
+                }
+                for(int i = 0; i < numSecond; i++)
+                {
+                    low2 = std::min(low2, (double)positions[second[i]][axis]);
+                    high2 = std::max(high2, (double)positions[second[i]][axis]);
+                }
+            }
+            if(low1 > high2 + margin || low2 > high1 + margin)
+                return false;
+        }
+        return true;
+    };
+    //a cloth which blew up has nearly every pair of triangles near each other; the update goes on with the first
+    //pairs rather than running out of memory
+    size_t found = 0, limit = SELF_CONTACTS_PER_POINT*points.size();
+    auto keep = [&](const SelfContact& pair) {
+        if(found++ < limit)
+            f(pair);
+    };
+    bvh.forEachOverlappingPair(bvh, margin, [&](uint32_t t1, uint32_t t2) {
+        int c1[3] = {corner(t1, 0), corner(t1, 1), corner(t1, 2)}, c2[3] = {corner(t2, 0), corner(t2, 1), corner(t2, 2)};
+        SelfContact pair;
+        pair.edges = false;
+        for(int side = 0; side < 2; side++)
+        {
+            int t = side == 0 ? t1 : t2;
+            const int* own = side == 0 ? c1 : c2;
+            const int* other = side == 0 ? c2 : c1;
+            for(int k = 0; k < 3; k++)
+            {
+                if(ownerOfPoint[own[k]] != t || !near(own + k, 1, other, 3))
+                    continue;
+                pair.points[0] = own[k];
+                for(int j = 0; j < 3; j++)
+                    pair.points[j + 1] = other[j];
+                keep(pair);
+            }
+        }
+        pair.edges = true;
+        for(int k = 0; k < 3; k++)
+        {
+            if(!(ownedEdges[t1] & (1 << k)))
+                continue;
+            int e1[2] = {c1[k], c1[(k + 1)%3]};
+            for(int j = 0; j < 3; j++)
+            {
+                int e2[2] = {c2[j], c2[(j + 1)%3]};
+                if(!(ownedEdges[t2] & (1 << j)) || !near(e1, 2, e2, 2))
+                    continue;
+                pair.points[0] = e1[0];
+                pair.points[1] = e1[1];
+                pair.points[2] = e2[0];
+                pair.points[3] = e2[1];
+                keep(pair);
+            }
+        }
+    });
+    if(found > limit && !selfOverflow)
+        cerr << "self collision: " << found << " pairs near each other, keeping the first " << limit << endl;
+    selfOverflow = found > limit;
+}
+
+template<typename Real>
+void ClothT<Real>::findSelfContacts()
+{
+    previous = points;
+    selfContacts.clear();
+    //the bvh was refitted to these points at the end of the last update
+    forEachSelfPair(points, points, params.selfThickness, [&](const SelfContact& pair) {
+        selfContacts.push_back(pair);
+    });
+}
+
+template<typename Real>
+void ClothT<Real>::computeRepulsions(int begin, int end)
+{
+    for(int i = begin; i < end; i++)
     {
-        points[get<1>(triangles[t1])][i] -= DEL;
-        double f1 = condBend(t1, t2);
-        points[get<1>(triangles[t1])][i] += 2*DEL;
-        double f2 = condBend(t1, t2);
-        double grad = (f2 - f1) / (2*DEL);
-        points[get<1>(triangles[t1])][i] -= DEL;
-        get<1>(result)[i] = grad;
+        SelfContact& pair = selfContacts[i];
+        //the points move as the integration is about to move them
+        dvec3 x[4], v[4];
+        double im[4];
+        for(int k = 0; k < 4; k++)
+        {
+            int p = pair.points[k];
+            x[k] = dvec3(points[p]);
+            v[k] = movable[p] ? dvec3(velocities[p]) + dvec3(forces[p])*imass + params.gravity : dvec3(0);
+            im[k] = movable[p] ? 1 : 0; //all the points weigh the same
+        }
+        dvec3 side(previous[pair.points[0]] - previous[pair.points[3]]), push;
+        repel(x, v, im, pair.edges, params.selfThickness, params.kSelf, side, pair.weights, pair.impulse, push);
+        pair.impulse += push; //both go through the forces of the integration
     }
-    for(int i = 0; i < 3; i++)
+}
+
+template<typename Real>
+void ClothT<Real>::addRepulsions()
+{
+    repulsionsOfPoint.assign(points.size(), 0);
+    for(const SelfContact& pair : selfContacts)
     {
-        points[get<2>(triangles[t1])][i] -= DEL;
-        double f1 = condBend(t1, t2);
-        points[get<2>(triangles[t1])][i] += 2*DEL;
-        double f2 = condBend(t1, t2);
-        double grad = (f2 - f1) / (2*DEL);
-        points[get<2>(triangles[t1])][i] -= DEL;
-        get<2>(result)[i] = grad;
+        for(int k = 0; k < 4; k++)
+            repulsionsOfPoint[pair.points[k]] += pair.weights[k] != 0;
     }
-    auto shared = sharedEdge(t1, t2);
-    int rem = getRemaining(shared, t2);
-    for(int i = 0; i < 3; i++)
+    for(const SelfContact& pair : selfContacts)
     {
-        points[rem][i] -= DEL;
-        double f1 = condBend(t1, t2);
-        points[rem][i] += 2*DEL;
-        double f2 = condBend(t1, t2);        
-        double grad = (f2 - f1) / (2*DEL);
-        points[rem][i] -= DEL;
-        get<3>(result)[i] = grad;
+        for(int k = 0; k < 4; k++)
+        {
+            int p = pair.points[k];
+            if(pair.weights[k] != 0)
+                forces[p] += Vec3(pair.impulse*(pair.weights[k]/(imass*repulsionsOfPoint[p])));
+        }
     }
-    return result;    
 }
 
-void Cloth::addStretchXForces(double str)
+template<typename Real>
+bool ClothT<Real>::crossed(const SelfContact& pair)
 {
-    for(int i = 0; i < triangles.size(); i++)
+    dvec3 start[4], motion[4];
+    for(int k = 0; k < 4; k++)
+    {
+        start[k] = dvec3(previous[pair.points[k]]);
+        motion[k] = dvec3(points[pair.points[k]]) - start[k];
+    }
+    //six times the signed volume of the four points, a . (b x c), zero when they are coplanar; the vectors are
+    //differences of the points, x0 - x1, x2 - x1 and x3 - x1 for a triangle, x2 - x0, x1 - x0 and x3 - x2 for edges
+    static const int triangleEnds[6] = {0, 1, 2, 1, 3, 1}, edgeEnds[6] = {2, 0, 1, 0, 3, 2};
+    const int* ends = pair.edges ? edgeEnds : triangleEnds;
+    dvec3 a0 = start[ends[0]] - start[ends[1]], a1 = motion[ends[0]] - motion[ends[1]];
+    dvec3 b0 = start[ends[2]] - start[ends[3]], b1 = motion[ends[2]] - motion[ends[3]];
+    dvec3 c0 = start[ends[4]] - start[ends[5]], c1 = motion[ends[4]] - motion[ends[5]];
+    auto volume = [&](double t) {
+        return dot(a0 + a1*t, cross(b0 + b1*t, c0 + c1*t));
+    };
+    //the volume is a cubic in t; between the roots of its derivative it is monotone and crosses zero at most once
+    double cubic = dot(a1, cross(b1, c1));
+    double square = dot(a1, cross(b1, c0) + cross(b0, c1)) + dot(a0, cross(b1, c1));
+    double linear = dot(a1, cross(b0, c0)) + dot(a0, cross(b1, c0) + cross(b0, c1));
+    double bounds[4] = {0, 1, 1, 1};
+    int numBounds = 1;
+    if(std::abs(cubic) > 1e-300)
+    {
+        double discriminant = square*square - 3*cubic*linear;
+        if(discriminant > 0)
+        {
+            double root = sqrt(discriminant);
+            double first = (-square - root)/(3*cubic), second = (-square + root)/(3*cubic);
+            for(double split : {std::min(first, second), std::max(first, second)})
+            {
+                if(split > 0 && split < 1)
+                    bounds[numBounds++] = split;
+            }
+        }
+    }
+    else if(square != 0 && -linear/(2*square) > 0 && -linear/(2*square) < 1)
+        bounds[numBounds++] = -linear/(2*square);
+    bounds[numBounds] = 1;
+    for(int piece = 0; piece < numBounds; piece++)
     {
-        auto gradx = derivativeStretchX(triangles[i], str);
-        double condx = condStretchX(triangles[i], str);
-        forces[get<0>(triangles[i])] -= clamp(get<0>(gradx)*condx*KSTRX, MAX_STRETCH); //adding forces
-        forces[get<1>(triangles[i])] -= clamp(get<1>(gradx)*condx*KSTRX, MAX_STRETCH);
-        forces[get<2>(triangles[i])] -= clamp(get<2>(gradx)*condx*KSTRX, MAX_STRETCH);
-        double timederivative = dot(get<0>(gradx), velocities[get<0>(triangles[i])]); //time derivative of the condition
-        timederivative +=  dot(get<1>(gradx), velocities[get<1>(triangles[i])]);
-        timederivative += dot(get<2>(gradx), velocities[get<2>(triangles[i])]);
-        forces[get<0>(triangles[i])] -= clamp(get<0>(gradx)*timederivative*KSTRX*KDAMP, MAX_STRETCH_DAMP); //damping
-        forces[get<1>(triangles[i])] -= clamp(get<1>(gradx)*timederivative*KSTRX*KDAMP, MAX_STRETCH_DAMP);
-        forces[get<2>(triangles[i])] -= clamp(get<2>(gradx)*timederivative*KSTRX*KDAMP, MAX_STRETCH_DAMP);
+        double low = bounds[piece], high = bounds[piece + 1], atLow = volume(low), atHigh = volume(high);
+        if(atLow*atHigh > 0)
+            continue;
+        for(int i = 0; i < 40 && atLow != 0; i++)
+        {
+            double middle = (low + high)/2, atMiddle = volume(middle);
+            if(atLow*atMiddle <= 0)
+            {
+                high = middle;
+            }
+            else
+            {
+                low = middle;
+                atLow = atMiddle;
+            }
+        }
+        double t = atLow == 0 ? low : high;
+        dvec3 x[4];
+        for(int k = 0; k < 4; k++)
+            x[k] = start[k] + motion[k]*t;
+        //coplanar, and the closest points meet
+        dvec3 apart;
+        if(pair.edges)
+        {
+            dvec2 st = closestOnSegments(x[0], x[1], x[2], x[3]);
+            apart = x[0] + (x[1] - x[0])*st.x - x[2] - (x[3] - x[2])*st.y;
+        }
+        else
+        {
+            dvec3 uvw = closestOnTriangle(x[0], x[1], x[2], x[3]);
+            apart = x[0] - x[1]*uvw.x - x[2]*uvw.y - x[3]*uvw.z;
+        }
+        if(length(apart) <= 1e-3*params.selfThickness)
+            return true;
     }
+    return false;
 }
 
-void Cloth::addStretchYForces(double str)
+template<typename Real>
+void ClothT<Real>::resolveImpactZones()
 {
-    for(int i = 0; i < triangles.size(); i++)
+    double displacement = 0;
+    for(size_t i = 0; i < points.size(); i++)
+        displacement = std::max(displacement, (double)length(points[i] - previous[i]));
+    //only the pairs whose two sides swept through overlapping boxes can have crossed. Unless some point moved farther
+    //than half the thickness, these are among the contacts found within the thickness of the previous points; else
+    //every triangle is searched with the box it swept through itself, so that one fast point does not widen the
+    //search for the whole cloth.
+    vector<SelfContact> candidates;
+    auto sweep = [&](const SelfContact& pair) {
+        int split = pair.edges ? 2 : 1;
+        for(int axis = 0; axis < 3; axis++)
+        {
+            double low[2] = {DBL_MAX, DBL_MAX}, high[2] = {-DBL_MAX, -DBL_MAX};
+            for(int k = 0; k < 4; k++)
+            {
+                int side = k < split ? 0 : 1;
+                double from = previous[pair.points[k]][axis], to = points[pair.points[k]][axis];
+                low[side] = std::min(low[side], std::min(from, to));
+                high[side] = std::max(high[side], std::max(from, to));
+            }
+            if(low[0] > high[1] || low[1] > high[0])
+                return;
+        }
+        candidates.push_back(pair);
+    };
+    if(2*displacement <= params.selfThickness)
     {
-        auto grady = derivativeStretchY(triangles[i], str);
-        double condy = condStretchY(triangles[i], str);
-        forces[get<0>(triangles[i])] -= clamp(get<0>(grady)*condy*KSTRY, MAX_STRETCH); //adding forces
-        forces[get<1>(triangles[i])] -= clamp(get<1>(grady)*condy*KSTRY, MAX_STRETCH);
-        forces[get<2>(triangles[i])] -= clamp(get<2>(grady)*condy*KSTRY, MAX_STRETCH);
-        double timederivative = dot(get<0>(grady), velocities[get<0>(triangles[i])]); //time derivative of the condition
-        timederivative +=  dot(get<1>(grady), velocities[get<1>(triangles[i])]);
-        timederivative += dot(get<2>(grady), velocities[get<2>(triangles[i])]);
-        forces[get<0>(triangles[i])] -= clamp(get<0>(grady)*timederivative*KSTRY*KDAMP, MAX_STRETCH_DAMP); //damping
-        forces[get<1>(triangles[i])] -= clamp(get<1>(grady)*timederivative*KSTRY*KDAMP, MAX_STRETCH_DAMP);
-        forces[get<2>(triangles[i])] -= clamp(get<2>(grady)*timederivative*KSTRY*KDAMP, MAX_STRETCH_DAMP);
+        for(const SelfContact& pair : selfContacts)
+            sweep(pair);
+    }
+    else
+    {
+        bvh.refit(previous, points); //refitted to the points once the zones are resolved
+        forEachSelfPair(previous, points, 0, sweep);
+    }
+    vector<int> members;
+    for(int iteration = 0; iteration < SELF_ZONE_ITERATIONS; iteration++)
+    {
+        bool any = false;
+        for(const SelfContact& pair : candidates)
+        {
+            if(!crossed(pair))
+                continue;
+            if(!any && iteration == 0)
+            {
+                zoneOf.resize(points.size());
+                for(size_t i = 0; i < points.size(); i++)
+                    zoneOf[i] = i;
+            }
+            any = true;
+            for(int k = 0; k < 4; k++) //merges the zones of the four points
+            {
+                int a = pair.points[0], b = pair.points[k];
+                while(zoneOf[a] != a)
+                    a = zoneOf[a] = zoneOf[zoneOf[a]];
+                while(zoneOf[b] != b)
+                    b = zoneOf[b] = zoneOf[zoneOf[b]];
+                zoneOf[std::max(a, b)] = std::min(a, b);
+                members.push_back(pair.points[k]);
+            }
+        }
+        if(!any)
+            break;
+        //the points of every zone, zone by zone
+        sort(members.begin(), members.end());
+        members.erase(unique(members.begin(), members.end()), members.end());
+        vector<pair<int, int> > zones; //root of the zone and point
+        for(int p : members)
+        {
+            int root = p;
+            while(zoneOf[root] != root)
+                root = zoneOf[root];
+            zones.push_back(make_pair(root, p));
+        }
+        sort(zones.begin(), zones.end());
+        for(size_t first = 0, last; first < zones.size(); first = last)
+        {
+            for(last = first; last < zones.size() && zones[last].first == zones[first].first; last++);
+            bool pinned = false;
+            dvec3 centre(0), velocity(0);
+            for(size_t i = first; i < last; i++)
+            {
+                int p = zones[i].second;
+                pinned = pinned || !movable[p];
+                centre += dvec3(previous[p]);
+                velocity += dvec3(points[p] - previous[p]);
+            }
+            double count = last - first;
+            centre /= count;
+            velocity /= count;
+            //the angular velocity which carries the angular momentum of the points about their centre
+            dvec3 momentum(0), rows[3] = {dvec3(0), dvec3(0), dvec3(0)};
+            for(size_t i = first; i < last; i++)
+            {
+                int p = zones[i].second;
+                dvec3 r = dvec3(previous[p]) - centre;
+                momentum += cross(r, dvec3(points[p] - previous[p]) - velocity);
+                double r2 = dot(r, r);
+                rows[0] += dvec3(r2 - r.x*r.x, -r.x*r.y, -r.x*r.z);
+                rows[1] += dvec3(-r.y*r.x, r2 - r.y*r.y, -r.y*r.z);
+                rows[2] += dvec3(-r.z*r.x, -r.z*r.y, r2 - r.z*r.z);
+            }
+            double determinant = dot(rows[0], cross(rows[1], rows[2]));
+            dvec3 spin(0);
+            if(std::abs(determinant) > 1e-30)
+            {
+                spin = dvec3(dot(momentum, cross(rows[1], rows[2])), dot(rows[0], cross(momentum, rows[2])),
+                             dot(rows[0], cross(rows[1], momentum)))/determinant;
+            }
+            for(size_t i = first; i < last; i++)
+            {
+                int p = zones[i].second;
+                dvec3 v = pinned ? dvec3(0) : velocity + cross(spin, dvec3(previous[p]) - centre);
+                velocities[p] = Vec3(v);
+                points[p] = Vec3(dvec3(previous[p]) + v);
+            }
+        }
     }
 }
 
-void Cloth::addShearForces()
+template<typename Real>
+void ClothT<Real>::findClothContacts(int task, Cloth& other, double thickness, double stiffness,
+                                     vector<ClothContact>& contacts)
 {
-    for(int i = 0; i < triangles.size(); i++)
+    if(ClothT<double>* cloth = dynamic_cast<ClothT<double>*>(&other))
+        findContacts(task, *cloth, thickness, stiffness, contacts);
+    else
+        findContacts(task, dynamic_cast<ClothT<float>&>(other), thickness, stiffness, contacts);
+}
+
+template<typename Real>
+template<typename Other>
+void ClothT<Real>::findContacts(int task, ClothT<Other>& other, double thickness, double stiffness,
+                                vector<ClothContact>& contacts)
+{
+    contacts.clear();
+    auto corner = [](const triangle& t, int k) {
+        return k == 0 ? get<0>(t) : k == 1 ? get<1>(t) : get<2>(t);
+    };
+    //keeps the pair if it is closer than the thickness; the points move as the last update moved them
+    auto repelPair = [&](ClothContact& pair) {
+        dvec3 x[4], v[4];
+        double im[4];
+        int split = pair.edges ? 2 : 1;
+        for(int k = 0; k < 4; k++)
+            x[k] = (k < split) != pair.swapped ? dvec3(points[pair.points[k]]) : dvec3(other.points[pair.points[k]]);
+        for(int axis = 0; axis < 3; axis++) //the boxes of the two sides are apart
+        {
+            double low1 = x[0][axis], high1 = low1, low2 = x[split][axis], high2 = low2;
+            for(int k = 1; k < split; k++)
+            {
+                low1 = std::min(low1, x[k][axis]);
+                high1 = std::max(high1, x[k][axis]);
+            }
+            for(int k = split + 1; k < 4; k++)
+            {
+                low2 = std::min(low2, x[k][axis]);
+                high2 = std::max(high2, x[k][axis]);
+            }
+            if(low1 > high2 + thickness || low2 > high1 + thickness)
+                return;
+        }
+        for(int k = 0; k < 4; k++)
+        {
+            int p = pair.points[k];
+            bool mine = (k < split) != pair.swapped;
+            bool moves = mine ? movable[p] : other.movable[p];
+            v[k] = !moves ? dvec3(0) : mine ? dvec3(velocities[p]) : dvec3(other.velocities[p]);
+            im[k] = !moves ? 0 : mine ? imass : other.imass;
+        }
+        repel(x, v, im, pair.edges, thickness, stiffness, dvec3(0), pair.weights, pair.impulse, pair.push);
+        if(pair.impulse != dvec3(0) || pair.push != dvec3(0))
+            contacts.push_back(pair);
+    };
+    bvh.forEachOverlappingPair(task, other.bvh, thickness, [&](uint32_t t1, uint32_t t2) {
+        int c1[3], c2[3];
+        for(int k = 0; k < 3; k++)
+        {
+            c1[k] = corner(triangles[t1], k);
+            c2[k] = corner(other.triangles[t2], k);
+        }
+        //every point and edge is tested from the lowest triangle around it
+        ClothContact pair;
+        pair.edges = false;
+        for(int k = 0; k < 3; k++)
+        {
+            pair.swapped = false;
+            if(ownerOfPoint[c1[k]] == (int)t1)
+            {
+                pair.points[0] = c1[k];
+                for(int j = 0; j < 3; j++)
+                    pair.points[j + 1] = c2[j];
+                repelPair(pair);
+            }
+            pair.swapped = true;
+            if(other.ownerOfPoint[c2[k]] == (int)t2)
+            {
+                pair.points[0] = c2[k];
+                for(int j = 0; j < 3; j++)
+                    pair.points[j + 1] = c1[j];
+                repelPair(pair);
+            }
+        }
+        pair.edges = true;
+        pair.swapped = false;
+        for(int k = 0; k < 3; k++)
+        {
+            for(int j = 0; j < 3; j++)
+            {
+                if(!(ownedEdges[t1] & (1 << k)) || !(other.ownedEdges[t2] & (1 << j)))
+                    continue;
+                pair.points[0] = c1[k];
+                pair.points[1] = c1[(k + 1)%3];
+                pair.points[2] = c2[j];
+                pair.points[3] = c2[(j + 1)%3];
+                repelPair(pair);
+            }
+        }
+    });
+}
+
+template<typename Real>
+void ClothT<Real>::addClothContacts(const vector<ClothContact>& contacts, bool second)
+{
+    if(clothPushes.empty())
     {
-        auto gradsh = derivativeShear(triangles[i]);
-        double condsh = condShear(triangles[i]);
-        forces[get<0>(triangles[i])] -= clamp(get<0>(gradsh)*condsh*KSH, MAX_SHEAR); //adding normal forces
-        forces[get<1>(triangles[i])] -= clamp(get<1>(gradsh)*condsh*KSH, MAX_SHEAR);
-        forces[get<2>(triangles[i])] -= clamp(get<2>(gradsh)*condsh*KSH, MAX_SHEAR);
-        double timederivative = dot(get<0>(gradsh), velocities[get<0>(triangles[i])]); //time derivative of the condition
-        timederivative +=  dot(get<1>(gradsh), velocities[get<1>(triangles[i])]);
-        timederivative += dot(get<2>(gradsh), velocities[get<2>(triangles[i])]);
-        forces[get<0>(triangles[i])] -= clamp(get<0>(gradsh)*timederivative*KSH*KDAMP, MAX_SHEAR_DAMP); //damping
-        forces[get<1>(triangles[i])] -= clamp(get<1>(gradsh)*timederivative*KSH*KDAMP, MAX_SHEAR_DAMP);
-        forces[get<2>(triangles[i])] -= clamp(get<2>(gradsh)*timederivative*KSH*KDAMP, MAX_SHEAR_DAMP);
+        clothPushes.assign(points.size(), dvec3(0));
+        clothShifts.assign(points.size(), dvec3(0));
+        clothContactsOfPoint.assign(points.size(), 0);
+    }
+    for(const ClothContact& pair : contacts)
+    {
+        int split = pair.edges ? 2 : 1;
+        for(int k = 0; k < 4; k++)
+        {
+            int p = pair.points[k];
+            if(((k < split) != pair.swapped) == second || pair.weights[k] == 0) //a point of the other cloth
+                continue;
+            if(clothContactsOfPoint[p]++ == 0)
+                pushedPoints.push_back(p);
+            clothPushes[p] += pair.impulse*pair.weights[k];
+            clothShifts[p] += pair.push*pair.weights[k];
+        }
     }
 }
 
-void Cloth::checkAndBend(int t1, int t2)
+template<typename Real>
+void ClothT<Real>::applyClothContacts()
 {
-    
-    if(t2 < 0 || t2 >= triangles.size()) //rejecting if out of bounds
+    if(pushedPoints.empty())
         return;
-    double condb = condBend(t1, t2);
-    auto gradb = derivativeBend(t1, t2);
-    forces[get<0>(triangles[t1])] -= clamp(get<0>(gradb)*condb*KBEND, MAX_BEND); //adding normal forces
-    forces[get<1>(triangles[t1])] -= clamp(get<1>(gradb)*condb*KBEND, MAX_BEND);
-    forces[get<2>(triangles[t1])] -= clamp(get<2>(gradb)*condb*KBEND, MAX_BEND);
-    int rem = getRemaining(sharedEdge(t1, t2), t2);
-    forces[rem] -= get<3>(gradb)*condb*KBEND;
-    double timederivative = dot(get<0>(gradb), velocities[get<0>(triangles[t1])]); //time derivative of the condition
-    timederivative +=  dot(get<1>(gradb), velocities[get<1>(triangles[t1])]);
-    timederivative += dot(get<2>(gradb), velocities[get<2>(triangles[t1])]);
-    timederivative += dot(get<3>(gradb), velocities[rem]);
-    forces[get<0>(triangles[t1])] -= clamp(get<0>(gradb)*timederivative*KBEND*KDAMP, MAX_BEND_DAMP); //damping
-    forces[get<1>(triangles[t1])] -= clamp(get<1>(gradb)*timederivative*KBEND*KDAMP, MAX_BEND_DAMP);
-    forces[get<2>(triangles[t1])] -= clamp(get<2>(gradb)*timederivative*KBEND*KDAMP, MAX_BEND_DAMP);
-    forces[rem] -= get<3>(gradb)*timederivative*KBEND*KDAMP;
+    for(int p : pushedPoints)
+    {
+        //the velocity towards the other cloth is gone as if it had been before the integration, while the push to
+        //the thickness only moves the point, so that a cloth starting inside the thickness does not fly off
+        Vec3 change(clothPushes[p]/(double)clothContactsOfPoint[p]);
+        velocities[p] += change;
+        points[p] += change + Vec3(clothShifts[p]/(double)clothContactsOfPoint[p]);
+        clothPushes[p] = dvec3(0);
+        clothShifts[p] = dvec3(0);
+        clothContactsOfPoint[p] = 0;
+    }
+    pushedPoints.clear();
+    bvh.refit(points);
 }
 
-void Cloth::addBendForces()
+template<typename Real>
+int ClothT<Real>::pick(const dvec3& origin, const dvec3& direction, double& distance)
 {
-    for(int i = 0; i < triangles.size(); i+=2)
+    uint32_t t;
+    if(!bvh.intersectRay(origin, direction, points, distance, t))
+        return -1;
+    dvec3 hit = origin + direction*distance;
+    int nearest = get<0>(triangles[t]);
+    for(int p : {get<1>(triangles[t]), get<2>(triangles[t])})
     {
-        int c1 = i-1;
-        int c2 = i+1;
-        int c3 = i+numX+1;
-        checkAndBend(i, c1); //trying for all three possible triangles
-        checkAndBend(i, c2);
-        checkAndBend(i, c3);
+        if(length(dvec3(points[p]) - hit) < length(dvec3(points[nearest]) - hit))
+            nearest = p;
     }
+    return nearest;
+}
+
+template<typename Real>
+void ClothT<Real>::findPointsNear(const dvec3& centre, double radius, vector<int>& near)
+{
+    near.clear();
+    bvh.forEachTriangleNear(centre, centre, radius, [&](uint32_t t) {
+        for(int p : {get<0>(triangles[t]), get<1>(triangles[t]), get<2>(triangles[t])})
+        {
+            if(length(dvec3(points[p]) - centre) <= radius)
+                near.push_back(p);
+        }
+    });
+    sort(near.begin(), near.end());
+    near.erase(unique(near.begin(), near.end()), near.end());
 }
 
-void Cloth::update()
+template<typename Real>
+void ClothT<Real>::movePoints(const vector<int>& moved, const dvec3& displacement)
 {
-    for(int i = 0; i < forces.size(); i++)
+    for(int p : moved)
     {
-        forces[i] = dvec3(0.0);
+        points[p] += Vec3(displacement);
+        velocities[p] = Vec3(0);
     }
-    addStretchXForces(STRX);
-    addStretchYForces(STRY);
-    addShearForces();
-    addBendForces();
-    integrate();
     makeNorms();
+    bvh.refit(points);
 }
 
-dvec3 Cloth::getNormTriangle(triangle t)
+template<typename Real>
+dvec3 ClothT<Real>::getNormTriangle(triangle t)
 {
     auto p0 = points[get<0>(t)];
     auto p1 = points[get<1>(t)];
@@ -452,15 +1519,16 @@ dvec3 Cloth::getNormTriangle(triangle t)
     auto d1 = p1 - p0;
     auto d2 = p2 - p0;
     auto norm = cross(d1, d2);
-    return normalize(norm);
+    return dvec3(normalize(norm));
 }
 
 
-void Cloth::makeNorms()
+template<typename Real>
+void ClothT<Real>::makeNorms()
 {
     for(int i = 0; i < pointNorms.size(); i++)
     {
-        pointNorms[i] = dvec3(0, 0, 0);
+        pointNorms[i] = Vec3(0, 0, 0);
     }
     for(int i = 0; i < triangles.size(); i++)
     {
@@ -482,3 +1550,101 @@ void Cloth::makeNorms()
         pointNorms[i] = normalize(pointNorms[i]); //normalizing all the point normals
     }
 }
+
+template<typename Real>
+void ClothT<Real>::draw()
+{
+    glBegin(GL_TRIANGLES);
+    for(auto x: triangles) //drawing each triangle individually
+    {
+        for(int p : {get<0>(x), get<1>(x), get<2>(x)})
+        {
+            glNormal3d(pointNorms[p].x, pointNorms[p].y, pointNorms[p].z);
+            glVertex3d(points[p].x, points[p].y, points[p].z);
+        }
+    }
+    glEnd();
+}
+
+template<typename Real>
+void ClothT<Real>::getPositions(vector<dvec3>& positions)
+{
+    const vector<int>& order = topology->originalOfPoint;
+    positions.resize(points.size());
+    for(int i = 0; i < points.size(); i++)
+        positions[order.empty() ? i : order[i]] = dvec3(points[i]); //back into the order of the mesh file
+}
+
+template<typename Real>
+bool ClothT<Real>::setPositions(const vector<dvec3>& positions)
+{
+    if(positions.size() != points.size())
+        return false;
+    const vector<int>& order = topology->originalOfPoint;
+    for(int i = 0; i < points.size(); i++)
+    {
+        points[i] = Vec3(positions[order.empty() ? i : order[i]]);
+        velocities[i] = Vec3(0);
+    }
+    makeNorms();
+    bvh.refit(points);
+    return true;
+}
+
+template<typename Real>
+double ClothT<Real>::getMaxStretch()
+{
+    double stretch = -1;
+    for(int t = 0; t < triangles.size(); t++)
+    {
+        auto wuv = getWUV(t);
+        stretch = std::max(stretch, std::max(length(wuv.first)/params.strX, length(wuv.second)/params.strY) - 1);
+    }
+    return stretch;
+}
+
+template<typename Real>
+void ClothT<Real>::traceAccesses(CacheModel& cache)
+{
+    for(int pass = 0; pass < 3; pass++) //stretch in both directions and shear
+    {
+        for(int t = 0; t < triangles.size(); t++)
+        {
+            cache.access(triangles[t]);
+            cache.access(uvs[t]);
+            cache.access(areas[t]);
+            for(int p : {get<0>(triangles[t]), get<1>(triangles[t]), get<2>(triangles[t])})
+            {
+                cache.access(points[p]);
+                cache.access(velocities[p]);
+                cache.access(forces[p]);
+            }
+        }
+    }
+    for(const BendPair& pair : bendPairs)
+    {
+        cache.access(pair);
+        cache.access(triNorms[pair.t1]);
+        cache.access(triNorms[pair.t2]);
+        cache.access(triangles[pair.t1]);
+        for(int p : {get<0>(triangles[pair.t1]), get<1>(triangles[pair.t1]), get<2>(triangles[pair.t1]), pair.remaining})
+        {
+            cache.access(points[p]);
+            cache.access(velocities[p]);
+            cache.access(forces[p]);
+        }
+    }
+    for(int t = 0; t < triangles.size(); t++) //the normals
+    {
+        cache.access(triangles[t]);
+        cache.access(triNorms[t]);
+        for(int p : {get<0>(triangles[t]), get<1>(triangles[t]), get<2>(triangles[t])})
+        {
+            cache.access(points[p]);
+            cache.access(pointNorms[p]);
+        }
+    }
+}
+
+template class ClothT<double>;
+template class ClothT<float>;
@@ -13,10 +13,17 @@
 #include <GL/glu.h>
 #include <glm/glm.hpp>
 #include <cstdlib>
+#include "../common/Profiler.h"
+#include "../common/SceneConfig.h"
+#include "../common/Vector3.h"
+#include "../common/Checkpoint.h"
+#include "../common/ClothMesh.h"
+#include "../common/LocalityReport.h"
+#include "../common/CounterRandom.h"
+#include "../common/TriangleBVH.h"
 
 using namespace std;
 using namespace glm;
-typedef dvec3 point;
 typedef dvec2 UVpoint;
 typedef tuple<int, int, int> triangle;
 
@@ -35,75 +42,561 @@ typedef tuple<int, int, int> triangle;
 #define MAX_SHEAR_DAMP 0.01
 #define MAX_STRETCH 0.01
 #define MAX_STRETCH_DAMP 0.01
+#define FPS 200
+#define K_SELF 0.25
+#define SELF_TASKS 16 //tasks the repulsions of the self contacts of an update are computed in
+#define SELF_ZONE_ITERATIONS 8 //largest number of rounds of merging impact zones in an update
+#define SELF_CONTACTS_PER_POINT 256 //self contacts or crossing candidates an update keeps per point, the rest are dropped
 
+//sections of a checkpoint of the internal energy cloth
+#define CHECKPOINT_CLOTH 1 // resolution of the cloth as two 32 bit integers, X then Y
+#define CHECKPOINT_PARAMETERS 2 // ClothParameters
+#define CHECKPOINT_POINTS 3 // locations of the points, in the precision of the cloth
+#define CHECKPOINT_VELOCITIES 4 // velocities of the points, in the precision of the cloth
+#define CHECKPOINT_MOVABLE 5 // one byte per point, 1 if movable
+#define CHECKPOINT_TRIANGLES 6 // three 32 bit point indices per triangle
+#define CHECKPOINT_UVS 7 // UV of the three corners of every triangle as doubles, for imported meshes
+#define CHECKPOINT_ORDER 8 // 32 bit index of every point before its mesh was reordered, for imported meshes
+
+//an update runs in passes of tasks; see Cloth::getNumPasses
+#define UPDATE_TASK_SIZE 1024 //triangles, bending pairs or points handled by one task of an update
+
+/**
+ * Material constants and solver settings of the cloth. The defaults reproduce the compile time constants.
+ */
+struct ClothParameters
+{
+    double mass = 20; //mass of the entire cloth
+    dvec3 gravity = dvec3(0.0, -GRAVITY, 0.0); //change in velocity due to gravity in each step, in any direction
+    double del = DEL; //step used for the numerical derivatives
+    double strX = STRX; //rest stretch along X
+    double strY = STRY; //rest stretch along Y
+    double kStrX = KSTRX; //stiffness of the stretch along X
+    double kStrY = KSTRY; //stiffness of the stretch along Y
+    double kSh = KSH; //shear stiffness
+    double kBend = KBEND; //bending stiffness
+    double kDamp = KDAMP; //damping relative to the stiffness
+    double maxBend = MAX_BEND; //clamps for each force component
+    double maxBendDamp = MAX_BEND_DAMP;
+    double maxShear = MAX_SHEAR;
+    double maxShearDamp = MAX_SHEAR_DAMP;
+    double maxStretch = MAX_STRETCH;
+    double maxStretchDamp = MAX_STRETCH_DAMP;
+    int fps = FPS; //number of updates per second
+    double selfThickness = 0; //distance the cloth keeps from itself, 0 to let it pass through itself
+    double kSelf = K_SELF; //part of the missing distance to the thickness which a repulsion restores per update
+    double clothThickness = 0; //distance the cloth keeps from other cloths, 0 to let them pass through it
+    bool singlePrecision = false; //whether the points, velocities and forces are stored in float instead of double
+    unsigned long seed = 1; //seed of the random perturbation of the points
+    /**
+     * Reads the parameters from the [cloth], [material] and [solver] sections of a scene
+     * @param scene The scene
+     * @return The parameters, with defaults for everything the scene does not set
+     */
+    static ClothParameters fromScene(const SceneConfig& scene);
+    /**
+     * Overrides the parameters which a section sets, with the keys of the [cloth], [material] and [solver]
+     * sections. Used for the settings of a single cloth.
+     * @param section The section
+     */
+    void apply(const SceneSection& section);
+};
+
+/**
+ * Two triangles which share an edge and resist bending about it
+ */
+struct BendPair
+{
+    int t1; //the triangle whose three points receive the bending forces
+    int t2; //the triangle on the other side of the edge
+    pair<int, int> edge; //the shared edge, against its direction in t1
+    int remaining; //the point of t2 which is not on the edge
+};
+
+/**
+ * A point near a triangle, or an edge near another edge, of the same cloth and the impulse pushing them apart
+ */
+struct SelfContact
+{
+    int points[4]; //the point and the three corners of the triangle, or the two ends of each edge
+    bool edges; //whether it is a pair of edges
+    double weights[4]; //share of the impulse of each point, negative on the side of the triangle or second edge
+    dvec3 impulse; //change of velocity along the normal, zero when the pair is not closer than the thickness
+};
+
+/**
+ * A point of one cloth near a triangle of another, or an edge near an edge of another, and the impulse pushing them
+ * apart. The point or first edge is on the first cloth of the pair and the rest on the second, unless swapped.
+ */
+struct ClothContact
+{
+    int points[4]; //the point and the three corners of the triangle, or the two ends of each edge
+    bool edges; //whether it is a pair of edges
+    bool swapped; //whether the point or first edge is on the second cloth
+    double weights[4]; //change of velocity of each point per unit of the impulse, negative on the second side
+    dvec3 impulse; //removes the velocity towards each other, zero when the pair is not closer than the thickness
+    dvec3 push; //change of position along the normal which restores part of the missing distance
+};
+
+/**
+ * The rest shape of a cloth in UV space, its triangles and the pairs of triangles which bend, none of
+ * which change while simulating. Cloths of the same shape can share one topology, e.g. the variants of
+ * an ensemble or copies of a garment.
+ */
+struct ClothTopology
+{
+    int numX; //resolution on the X axis; the number of points of an imported mesh
+    int numY; //resolution on the Y axis; 1 for an imported mesh, all of whose movable points are perturbed
+    vector<dvec3> restPoints; //the initial locations of the points
+    vector<triangle> triangles; //all the triangles as tuples
+    vector<array<UVpoint, 3> > uvs; //the uv coordinates of the corners of each triangle
+    vector<double> areas; //the area of each triangle in UV space
+    vector<BendPair> bendPairs; //every pair of triangles sharing an edge
+    vector<int> defaultPins; //the points pinned unless the scene pins others: the top corners or the top of a mesh
+    vector<int> pointOfVertex; //the point of each vertex of an imported mesh file, -1 if unused
+    vector<int> originalOfPoint; //the index of each point before its mesh was reordered, empty for a grid
+    vector<vector<int> > trianglePasses; //tasks of UPDATE_TASK_SIZE consecutive triangles, grouped so that the tasks of a pass share no point
+    vector<vector<int> > bendPasses; //tasks of UPDATE_TASK_SIZE consecutive bending pairs, grouped the same way
+    /**
+     * Constructor. Lays out the points and triangles of a cloth of the given resolution
+     * @param X The resolution on the X axis
+     * @param Y The resolution on the Y axis
+     */
+    ClothTopology(int X, int Y);
+    /**
+     * Constructor. Takes the points, triangles and rest shape of an imported mesh
+     * @param mesh The mesh, e.g. loaded from an OBJ file
+     */
+    ClothTopology(const ClothMesh& mesh);
+private:
+    /**
+     * Copies the triangles and rest shape of a mesh and pairs the triangles on both sides of its edges
+     * @param mesh The mesh
+     */
+    void build(const ClothMesh& mesh);
+};
+
+/**
+ * The part of the cloth which does not depend on the precision it is simulated in:
+ * its rest shape in UV space, its triangles and its pinned points. See ClothT for the simulation.
+ */
 class Cloth
 {
 public:
     int numX; //resolution on the X axis
     int numY; //resolution on the Y axis
-    double mass = 20; //mass of the entire cloth
+    ClothParameters params; //material constants and solver settings
+    double mass; //mass of the entire cloth
     double imass; //inverse of the mass per particle
-    vector<point> points; //all the points of the cloth
-    vector<UVpoint> uvpoints; //the uv coordinates of all the points
-    vector<triangle> triangles; //all the triangles as tuples
-    vector<dvec3> pointNorms; //normals of all points
-    vector<dvec3> triNorms; //normals of all triangles (required for bending)
-    vector<dvec3> forces; //all the forces calculated for each point
-    vector<dvec3> velocities; //the velocities for each point
+    shared_ptr<const ClothTopology> topology; //rest shape and triangles, possibly shared with other cloths
+    const vector<triangle>& triangles; //all the triangles as tuples
+    const vector<array<UVpoint, 3> >& uvs; //the uv coordinates of the corners of each triangle
+    const vector<double>& areas; //the area of each triangle in UV space
+    const vector<BendPair>& bendPairs; //every pair of triangles sharing an edge
     vector<bool> movable; //whether the point is movable or not
-    double UVarea; //the area of the UV triangle
+    TriangleBVH bvh; //boxes around the triangles, built at the start and refitted at the end of every update
+    /**
+     * Generates a cloth of the given resolution, stored in double precision or,
+     * if the parameters ask for it, in single precision
+     * @param X The resolution on the X axis
+     * @param Y The resolution on the Y axis
+     * @param params The material constants and solver settings
+     * @return The cloth
+     */
+    static Cloth* create(int X, int Y, const ClothParameters& params = ClothParameters());
+    /**
+     * Generates a cloth on an existing topology, which it shares with the other cloths created on it
+     * @param topology The layout and triangles of the cloth
+     * @param params The material constants and solver settings
+     * @param movable Whether each point is movable, empty for the default pins; only movable points are perturbed
+     * @return The cloth
+     */
+    static Cloth* create(const shared_ptr<const ClothTopology>& topology, const ClothParameters& params,
+                         const vector<bool>& movable = vector<bool>());
+    /**
+     * Restores a cloth, in the precision it was saved in, from a checkpoint
+     * @param path The path of the checkpoint
+     * @param error Set to a description of the problem if the checkpoint cannot be loaded
+     * @return The cloth, nullptr on failure
+     */
+    static Cloth* loadCheckpoint(const string& path, string& error);
+    virtual ~Cloth() {}
+    /**
+     * updates all the points, forces, velocities and normals
+     */
+    virtual void update() = 0;
+    /**
+     * Returns the number of passes of an update. The passes run one after the other and the tasks of a pass
+     * may run at the same time, since no two of them write the same point. Which tasks there are and the order
+     * in which each point sums its forces depend only on the cloth, so an update gives the same bits on any
+     * number of threads.
+     * @return The number of passes
+     */
+    virtual int getNumPasses() = 0;
+    /**
+     * Returns the number of tasks of a pass of an update
+     * @param pass The pass
+     * @return The number of tasks
+     */
+    virtual int getNumTasks(int pass) = 0;
+    /**
+     * Runs one task of an update. Running all the tasks of every pass, pass by pass, is the same as update().
+     * @param pass The pass
+     * @param task The task
+     */
+    virtual void updateTask(int pass, int task) = 0;
+    /**
+     * Draws all the triangles of the cloth with smooth normals in the current color
+     */
+    virtual void draw() = 0;
+    /**
+     * Copies the locations of all the points in double precision, in the order of the points before an imported
+     * mesh was reordered, so that frame caches keep the numbering of the file
+     * @param positions Filled with the locations
+     */
+    virtual void getPositions(vector<dvec3>& positions) = 0;
+    /**
+     * Places all the points at rest without simulating, e.g. at positions played back from a frame cache
+     * @param positions The locations, in the order of getPositions
+     * @return false if the number of locations does not match the cloth
+     */
+    virtual bool setPositions(const vector<dvec3>& positions) = 0;
+    /**
+     * Returns how far the cloth is stretched beyond its rest stretch, the largest of the ratios
+     * |W_u|/strX and |W_v|/strY over all triangles minus one
+     * @return The largest relative elongation, negative if the cloth is compressed everywhere
+     */
+    virtual double getMaxStretch() = 0;
+    /**
+     * Saves the points, velocities, pins, triangles and parameters of the cloth with a single write
+     * @param path The path of the checkpoint
+     * @param error Set to a description of the problem if the checkpoint cannot be written
+     * @return true if the checkpoint was written
+     */
+    virtual bool saveCheckpoint(const string& path, string& error) = 0;
+    /**
+     * Changes the configuration of the entire system to the one stored in a checkpoint.
+     * The points and velocities are copied straight from the mapped file.
+     * @param checkpoint The checkpoint, which must be of a cloth of the same resolution
+     * @param pert Whether to perturb after applying the new config or not
+     * @param error Set to a description of the problem if the checkpoint does not fit the cloth
+     * @return true if the configuration was changed
+     */
+    virtual bool changeState(const CheckpointReader& checkpoint, bool pert, string& error) = 0;
+    /**
+     * Replays the memory accesses of the loops over the triangles and bending pairs in one update on a cache model
+     * @param cache The cache model
+     */
+    virtual void traceAccesses(CacheModel& cache) = 0;
+    /**
+     * Finds the contacts of the triangles in one subtree of the bvh with those of another cloth and computes
+     * their impulses, without changing either cloth, so that the subtrees may be searched at the same time
+     * @param task The subtree, below bvh.getNumRefitTasks()
+     * @param other The other cloth, in either precision
+     * @param thickness The distance the two cloths keep from each other
+     * @param stiffness The part of the missing distance to the thickness which a repulsion restores
+     * @param contacts Filled with the pairs closer than the thickness
+     */
+    virtual void findClothContacts(int task, Cloth& other, double thickness, double stiffness,
+                                   vector<ClothContact>& contacts) = 0;
+    /**
+     * Adds up the impulses of contacts with another cloth on the points of this one, to be applied by
+     * applyClothContacts
+     * @param contacts The contacts found by findClothContacts
+     * @param second Whether this cloth is the other cloth of the search
+     */
+    virtual void addClothContacts(const vector<ClothContact>& contacts, bool second) = 0;
+    /**
+     * Changes the velocities and positions of the points pushed by other cloths by the average impulse they
+     * received, as if the impulses had been there before the last integration, moves them on by the average push
+     * without keeping it in their velocities, and refits the bvh to them
+     */
+    virtual void applyClothContacts() = 0;
+    /**
+     * Finds the first triangle of the cloth hit by a ray, e.g. the one under the mouse, with the bvh
+     * @param origin The start of the ray
+     * @param direction The direction of the ray
+     * @param distance The largest distance along the ray in units of the direction; set to that of the hit
+     * @return The corner of the triangle nearest to where it was hit, -1 if the ray misses the cloth
+     */
+    virtual int pick(const dvec3& origin, const dvec3& direction, double& distance) = 0;
+    /**
+     * Finds the points within a distance of a location with the bvh
+     * @param centre The location
+     * @param radius The distance
+     * @param near Filled with the points, in increasing order
+     */
+    virtual void findPointsNear(const dvec3& centre, double radius, vector<int>& near) = 0;
+    /**
+     * Moves points by a displacement and stops them, e.g. the points dragged with the mouse, and refits the bvh
+     * @param moved The points
+     * @param displacement The displacement
+     */
+    virtual void movePoints(const vector<int>& moved, const dvec3& displacement) = 0;
+protected:
+    /**
+     * Constructor. Pins the given points of a cloth laid out on the given topology
+     * @param topology The layout and triangles of the cloth
+     * @param params The material constants and solver settings
+     * @param movable Whether each point is movable, empty for the default pins
+     */
+    Cloth(const shared_ptr<const ClothTopology>& topology, const ClothParameters& params, const vector<bool>& movable);
+};
+
+/**
+ * The cloth simulated with its points, velocities and forces stored in the given precision.
+ * The conditions, their derivatives and the sums over them are always evaluated in double.
+ * @tparam Real float or double
+ */
+template<typename Real>
+class ClothT : public Cloth
+{
+public:
+    typedef typename Vector3<Real>::type Vec3;
+    vector<Vec3> points; //all the points of the cloth
+    vector<Vec3> pointNorms; //normals of all points
+    vector<Vec3> triNorms; //normals of all triangles (required for bending)
+    vector<Vec3> forces; //all the forces calculated for each point
+    vector<Vec3> velocities; //the velocities for each point
+    vector<Vec3> previous; //the points at the start of the update, which the impact zones move rigidly from
+    vector<SelfContact> selfContacts; //pairs which may be closer than the thickness at the start of the update
+    vector<int> ownerOfPoint; //the lowest triangle of each point, the only one which tests it against others
+    vector<uint8_t> ownedEdges; //bit k set if the triangle is the lowest one on its edge from corner k to k + 1
+    vector<int> zoneOf; //parent of each point in the union-find forest of the impact zones
+    vector<int> repulsionsOfPoint; //number of self contacts pushing each point in the current update
+    bool selfOverflow = false; //whether the last search for self pairs found more than SELF_CONTACTS_PER_POINT per point
+    vector<dvec3> clothPushes; //sum of the changes of velocity of each point by the contacts with other cloths
+    vector<dvec3> clothShifts; //sum of the changes of position of each point by the pushes of those contacts
+    vector<int> clothContactsOfPoint; //number of contacts with other cloths pushing each point
+    vector<int> pushedPoints; //the points with contacts with other cloths, in the order they were first pushed
     /**
      * Constructor. Generates a cloth of the given resolution
      * @param X The resolution on the X axis
      * @param Y The resolution on the Y axis
+     * @param params The material constants and solver settings
+     */
+    ClothT(int X, int Y, const ClothParameters& params = ClothParameters());
+    /**
+     * Constructor. Generates a cloth on an existing topology
+     * @param topology The layout and triangles of the cloth
+     * @param params The material constants and solver settings
+     * @param movable Whether each point is movable, empty for the default pins; only movable points are perturbed
      */
-    Cloth(int X, int Y);
+    ClothT(const shared_ptr<const ClothTopology>& topology, const ClothParameters& params,
+           const vector<bool>& movable = vector<bool>());
     /**
      * updates all the points, forces, velocities and normals
      */
     void update();
     /**
-     * Integrates the calculated forces
+     * Returns the number of passes of an update: clearing the forces, the passes of the triangles, those of
+     * the bending pairs, finding the self contacts, their repulsions in SELF_TASKS tasks, adding the repulsions
+     * to the forces, integrating, the impact zones, the normals, and refitting the subtrees of the bvh and then
+     * its top. The self collision passes have no tasks while the thickness is 0.
+     * @return The number of passes
+     */
+    int getNumPasses();
+    /**
+     * Returns the number of tasks of a pass of an update
+     * @param pass The pass
+     * @return The number of tasks
+     */
+    int getNumTasks(int pass);
+    /**
+     * Runs one task of an update
+     * @param pass The pass
+     * @param task The task
+     */
+    void updateTask(int pass, int task);
+    /**
+     * Draws all the triangles of the cloth with smooth normals in the current color
+     */
+    void draw();
+    /**
+     * Copies the locations of all the points in double precision, in the order of the points before an imported
+     * mesh was reordered, so that frame caches keep the numbering of the file
+     * @param positions Filled with the locations
+     */
+    void getPositions(vector<dvec3>& positions);
+    /**
+     * Places all the points at rest without simulating, e.g. at positions played back from a frame cache
+     * @param positions The locations, in the order of getPositions
+     * @return false if the number of locations does not match the cloth
+     */
+    bool setPositions(const vector<dvec3>& positions);
+    /**
+     * Returns how far the cloth is stretched beyond its rest stretch, the largest of the ratios
+     * |W_u|/strX and |W_v|/strY over all triangles minus one
+     * @return The largest relative elongation, negative if the cloth is compressed everywhere
+     */
+    double getMaxStretch();
+    /**
+     * Replays the memory accesses of the loops over the triangles and bending pairs in one update on a cache model
+     * @param cache The cache model
+     */
+    void traceAccesses(CacheModel& cache);
+    /**
+     * Saves the points, velocities, pins, triangles and parameters of the cloth with a single write
+     * @param path The path of the checkpoint
+     * @param error Set to a description of the problem if the checkpoint cannot be written
+     * @return true if the checkpoint was written
+     */
+    bool saveCheckpoint(const string& path, string& error);
+    /**
+     * Changes the configuration of the entire system to the one stored in a checkpoint.
+     * The points and velocities are copied straight from the mapped file.
+     * @param checkpoint The checkpoint, which must be of a cloth of the same resolution
+     * @param pert Whether to perturb after applying the new config or not
+     * @param error Set to a description of the problem if the checkpoint does not fit the cloth
+     * @return true if the configuration was changed
+     */
+    bool changeState(const CheckpointReader& checkpoint, bool pert, string& error);
+    /**
+     * Finds the contacts of the triangles in one subtree of the bvh with those of another cloth and computes
+     * their impulses, without changing either cloth, so that the subtrees may be searched at the same time
+     * @param task The subtree, below bvh.getNumRefitTasks()
+     * @param other The other cloth, in either precision
+     * @param thickness The distance the two cloths keep from each other
+     * @param stiffness The part of the missing distance to the thickness which a repulsion restores
+     * @param contacts Filled with the pairs closer than the thickness
+     */
+    void findClothContacts(int task, Cloth& other, double thickness, double stiffness, vector<ClothContact>& contacts);
+    /**
+     * Adds up the impulses of contacts with another cloth on the points of this one, to be applied by
+     * applyClothContacts
+     * @param contacts The contacts found by findClothContacts
+     * @param second Whether this cloth is the other cloth of the search
+     */
+    void addClothContacts(const vector<ClothContact>& contacts, bool second);
+    /**
+     * Changes the velocities and positions of the points pushed by other cloths by the average impulse they
+     * received, as if the impulses had been there before the last integration, moves them on by the average push
+     * without keeping it in their velocities, and refits the bvh to them
+     */
+    void applyClothContacts();
+    /**
+     * Finds the first triangle of the cloth hit by a ray, e.g. the one under the mouse, with the bvh
+     * @param origin The start of the ray
+     * @param direction The direction of the ray
+     * @param distance The largest distance along the ray in units of the direction; set to that of the hit
+     * @return The corner of the triangle nearest to where it was hit, -1 if the ray misses the cloth
      */
-    void integrate();
+    int pick(const dvec3& origin, const dvec3& direction, double& distance);
+    /**
+     * Finds the points within a distance of a location with the bvh
+     * @param centre The location
+     * @param radius The distance
+     * @param near Filled with the points, in increasing order
+     */
+    void findPointsNear(const dvec3& centre, double radius, vector<int>& near);
+    /**
+     * Moves points by a displacement and stops them, e.g. the points dragged with the mouse, and refits the bvh
+     * @param moved The points
+     * @param displacement The displacement
+     */
+    void movePoints(const vector<int>& moved, const dvec3& displacement);
+    /**
+     * Finds the contacts with another cloth of a known precision, see findClothContacts
+     */
+    template<typename Other>
+    void findContacts(int task, ClothT<Other>& other, double thickness, double stiffness,
+                      vector<ClothContact>& contacts);
+    /**
+     * Integrates the calculated forces of a range of points
+     * @param begin The first point
+     * @param end The point after the last one
+     */
+    void integrate(int begin, int end);
+    /**
+     * Calls a function for every point-triangle and edge-edge pair whose boxes, swept as the points move linearly
+     * between two positions, are within a margin; the bvh must hold the boxes swept between the same positions. The
+     * pairs come from the pairs of triangles of the bvh; pairs of triangles which share a point are left out, as the
+     * stretch and bend forces keep neighbours apart. Every pair is found once, from the lowest triangle around its
+     * point or edge. At most SELF_CONTACTS_PER_POINT pairs per point are passed on.
+     * @param from The positions of the points at the start of the motion
+     * @param to The positions at its end, the same vector to find the pairs near each other at one position
+     * @param margin The distance up to which pairs apart are still found
+     * @param f Function taking the pair, with its points set
+     */
+    template<typename F>
+    void forEachSelfPair(const vector<Vec3>& from, const vector<Vec3>& to, double margin, F f);
+    /**
+     * Remembers the points at the start of the update and finds the pairs which are closer than the thickness
+     */
+    void findSelfContacts();
+    /**
+     * Computes the impulses of a range of the self contacts: a pair closer than the thickness loses its relative
+     * velocity towards each other and is pushed apart by kSelf of the missing distance
+     * @param begin The first contact
+     * @param end The contact after the last one
+     */
+    void computeRepulsions(int begin, int end);
+    /**
+     * Adds the impulses of the self contacts to the forces, in the order of the contacts. A point pushed by several
+     * contacts receives their average, so that a dense patch of contacts does not overshoot.
+     */
+    void addRepulsions();
+    /**
+     * Finds the pairs which crossed during the integration and merges their points into impact zones, which
+     * move rigidly from where they started with the mean velocity and angular velocity of their points; a zone
+     * with a pinned point stays where it was. Repeats with the merged zones until nothing crosses, at most SELF_ZONE_ITERATIONS times.
+     * The pairs which may have crossed are among the self contacts while no point moved farther than half the
+     * thickness; otherwise the bvh is refitted to the boxes the triangles swept through and searched again.
+     */
+    void resolveImpactZones();
+    /**
+     * Returns whether a pair crossed between the start of the update and now: whether the four points became
+     * coplanar with the point on the triangle or the edges on each other on the way, moving linearly
+     * @param pair The pair
+     * @return true if they crossed
+     */
+    bool crossed(const SelfContact& pair);
     /**
      * Makes both the poin and the triangle normals
      */
     void makeNorms();
     /**
      * Gets the W_u and W_v for the triangle
-     * @param t The triangle for which the grads are required
+     * @param t The index of the triangle for which the grads are required
      * @return A pair of the two vectors
      */
-    pair<dvec3, dvec3> getWUV(triangle t);
+    pair<dvec3, dvec3> getWUV(int t);
     /**
-     * Adds the stretch forces due to the X axis, as well as the damping components
+     * Adds the stretch forces due to the X axis of a range of triangles, as well as the damping components
+     * @param begin The first triangle
+     * @param end The triangle after the last one
      * @param str The stretchiness for X axis
      */
-    void addStretchXForces(double str);
+    void addStretchXForces(int begin, int end, double str);
     /**
-     * Adds the stretch forces due to the Y axis, as well as the damping components
+     * Adds the stretch forces due to the Y axis of a range of triangles, as well as the damping components
+     * @param begin The first triangle
+     * @param end The triangle after the last one
      * @param str The stretchiness for Y axis
      */
-    void addStretchYForces(double str);
+    void addStretchYForces(int begin, int end, double str);
     /**
-     * Adds the shear forces as well as the damping components
+     * Adds the shear forces of a range of triangles as well as the damping components
+     * @param begin The first triangle
+     * @param end The triangle after the last one
      */
-    void addShearForces();
+    void addShearForces(int begin, int end);
     /**
-     * Adds the bending forces as well as the damping components
+     * Adds the bending forces of a range of bending pairs as well as the damping components
+     * @param begin The first pair
+     * @param end The pair after the last one
      */
-    void addBendForces();
+    void addBendForces(int begin, int end);
     /**
-     * Perturbs each particle by a small amount
+     * Perturbs each movable particle by a small amount, drawn from the stream of the seed of the parameters at the
+     * index the point had in its mesh file, so that the same seed always gives the same cloth in any order of points
      */
     void perturb();
     /**
-     * Checks if the two triangles are in bounds and then adds their bending components
-     * @param t1 Triangle 1 index
-     * @param t2 Triangle 2 index
+     * Adds the bending components of a pair of triangles
+     * @param pair The two triangles and their shared edge
      */
-    void checkAndBend(int t1, int t2);
+    void bend(const BendPair& pair);
     /**
      * Changes the configuration of the entire system.
      * @param points The new point locations
@@ -111,14 +604,7 @@ public:
      * @param movable The new movable vector
      * @param pert Whether to perturb after applying the new config or not
      */
-    void changeState(vector<point> points, vector<dvec3> velocities, vector<bool> movable, bool pert);
-    /**
-     * Given a triangle and two points, returns the index of the remaning point
-     * @param shared A pair of two points
-     * @param t The index of the triangle
-     * @return The index(in the points vector) of the remaining point
-     */
-    int getRemaining(pair<int, int> shared, int t);
+    void changeState(vector<Vec3> points, vector<Vec3> velocities, vector<bool> movable, bool pert);
     /**
      * Returns the normal of a triangle
      * @param t The triangle
@@ -127,66 +613,65 @@ public:
     dvec3 getNormTriangle(triangle t);
     /**
      * Calculates the Stretch condition along the X axis
-     * @param t The triangle
+     * @param t The index of the triangle
      * @param stretchiness The stretchiness along X
      * @return The value of the condition along X
      */
-    double condStretchX(triangle t, double stretchiness);
+    double condStretchX(int t, double stretchiness);
     /**
      * Calculates the Stretch condition along the YX axis
-     * @param t The triangle
+     * @param t The index of the triangle
      * @param stretchiness The stretchiness along Y
      * @return The value of the condition along Y
      */
-    double condStretchY(triangle t, double stretchiness);
+    double condStretchY(int t, double stretchiness);
     /**
      * Calculates the Shear condition
-     * @param t The triangle
+     * @param t The index of the triangle
      * @return The shear condition value
      */
-    double condShear(triangle t);
+    double condShear(int t);
     /**
-     * Calculates the bend condition between the two given triangles
-     * @param t1 The index of the first triangle
-     * @param t2 The index of the second triangle
+     * Calculates the bend condition between two adjacent triangles
+     * @param pair The two triangles and their shared edge
      * @return The bend condition value
      */
-    double condBend(int t1, int t2);
-    /**
-     * Calculates the shared edge between two adjacent triangles
-     * @param t1 The first triangle index
-     * @param t2 The second triangle index
-     * @return A pair of point indices representing the shared edge
-     */
-    pair<int, int> sharedEdge(int t1, int t2);
+    double condBend(const BendPair& pair);
     /**
      * Calculates the derivative of the StretchX condition
-     * @param t The triangle
+     * @param t The index of the triangle
      * @param stretchiness The stretchiness value in the X direction
      * @return A tuple of vectors for derivatives wrt all points involved
      */
-    tuple<dvec3, dvec3, dvec3> derivativeStretchX(triangle t, double stretchiness);
+    tuple<dvec3, dvec3, dvec3> derivativeStretchX(int t, double stretchiness);
     /**
      * Calculates the derivative of the StretchY condition
-     * @param t The triangle
+     * @param t The index of the triangle
      * @param stretchiness The stretchiness value in the Y direction
      * @return A tuple of vectors for derivatives wrt all points involved
      */
-    tuple<dvec3, dvec3, dvec3> derivativeStretchY(triangle t, double stretchiness);
+    tuple<dvec3, dvec3, dvec3> derivativeStretchY(int t, double stretchiness);
     /**
      * Calculates the derivative of the Shear condition
-     * @param t The triangle
+     * @param t The index of the triangle
      * @return A tuple of vectors for derivatives wrt all points involved
      */
-    tuple<dvec3, dvec3, dvec3> derivativeShear(triangle t);
+    tuple<dvec3, dvec3, dvec3> derivativeShear(int t);
     /**
      * Calculates the derivative of the Bend condition for all points involved
-     * @param t1 The first triangle index
-     * @param t2 The second triangle index
+     * @param pair The two triangles and their shared edge
      * @return A tuple of vectors for derivatives wrt all points involved (first all the three points of t1, then the remaining one)
      */
-    tuple<dvec3, dvec3, dvec3, dvec3>derivativeBend(int t1, int t2);    
-    
+    tuple<dvec3, dvec3, dvec3, dvec3> derivativeBend(const BendPair& pair);
+    /**
+     * Calculates the numerical gradient of a condition with respect to one point. The difference
+     * quotient uses the step which could actually be stored in the precision of the points.
+     * @param p The index of the point
+     * @param condition Evaluates the condition for the current locations of the points
+     * @return The gradient
+     */
+    template<typename Condition>
+    dvec3 gradient(int p, Condition condition);
 };
 
 #endif /* CLOTH_H */
@@ -0,0 +1,181 @@
+/* 
+ * File:   ClothScene.cpp
+ * Author: tanmaya
+ *
+ * Created on 25 November, 2017, 12:58 PM
+ */
+
+#include "ClothScene.h"
+
+ClothScene::ClothScene(unsigned threads) : scheduler(threads)
+{
+    frameDirty = true;
+}
+
+ClothScene::~ClothScene()
+{
+    for(Cloth* cloth : cloths)
+        delete cloth;
+}
+
+void ClothScene::add(Cloth* cloth)
+{
+    cloths.push_back(cloth);
+    frameDirty = true;
+}
+
+void ClothScene::replace(int index, Cloth* cloth)
+{
+    delete cloths[index];
+    cloths[index] = cloth;
+    frameDirty = true; //the new cloth may split into other tasks
+}
+
+void ClothScene::update()
+{
+    if(scheduler.getNumThreads() == 1)
+    {
+        for(Cloth* cloth : cloths)
+            cloth->update();
+        collide();
+        return;
+    }
+    if(frameDirty)
+    {
+        frame.clear();
+        for(int c = 0; c < cloths.size(); c++)
+        {
+            size_t previous = 0;
+            for(int pass = 0; pass < cloths[c]->getNumPasses(); pass++)
+            {
+                vector<size_t> tasks;
+                for(int task = 0; task < cloths[c]->getNumTasks(pass); task++)
+                {
+                    tasks.push_back(frame.add([this, c, pass, task]{ cloths[c]->updateTask(pass, task); }));
+                    if(pass > 0)
+                        frame.precede(previous, tasks.back());
+                }
+                if(tasks.empty())
+                    continue;
+                previous = tasks[0];
+                if(tasks.size() > 1) //the next pass waits for all the tasks of this one
+                {
+                    previous = frame.add([]{});
+                    for(size_t task : tasks)
+                        frame.precede(task, previous);
+                }
+            }
+        }
+        frameDirty = false;
+    }
+    scheduler.run(frame);
+    collide();
+}
+
+void ClothScene::findPairs()
+{
+    pairs.clear();
+    vector<pair<dvec3, dvec3> > boxes;
+    vector<int> sorted;
+    for(int c = 0; c < cloths.size(); c++)
+    {
+        pair<dvec3, dvec3> box = cloths[c]->bvh.getBounds();
+        double thickness = cloths[c]->params.clothThickness;
+        boxes.push_back(make_pair(box.first - dvec3(thickness), box.second + dvec3(thickness)));
+        if(thickness > 0 && box.first.x <= box.second.x)
+            sorted.push_back(c);
+    }
+    //sweep and prune along X; only the cloths whose boxes reach the current one are still open
+    sort(sorted.begin(), sorted.end(), [&](int a, int b) {
+        return boxes[a].first.x < boxes[b].first.x || (boxes[a].first.x == boxes[b].first.x && a < b);
+    });
+    vector<int> open;
+    for(int c : sorted)
+    {
+        const pair<dvec3, dvec3>& box = boxes[c];
+        size_t kept = 0;
+        for(int o : open)
+        {
+            if(boxes[o].second.x < box.first.x)
+                continue; //it ends before the current box, and before all those still to come
+            open[kept++] = o;
+            if(boxes[o].first.y <= box.second.y && box.first.y <= boxes[o].second.y &&
+               boxes[o].first.z <= box.second.z && box.first.z <= boxes[o].second.z)
+            {
+                const ClothParameters &a = cloths[std::min(o, c)]->params, &b = cloths[std::max(o, c)]->params;
+                pairs.push_back({std::min(o, c), std::max(o, c), std::max(a.clothThickness, b.clothThickness),
+                                 (a.kSelf + b.kSelf)/2, 0});
+            }
+        }
+        open.resize(kept);
+        open.push_back(c);
+    }
+    //the order of the pairs, in which the cloths sum their impulses, does not depend on the sweep
+    sort(pairs.begin(), pairs.end(), [](const ClothPair& a, const ClothPair& b) {
+        return a.first < b.first || (a.first == b.first && a.second < b.second);
+    });
+}
+
+void ClothScene::collide()
+{
+    findPairs();
+    if(pairs.empty())
+        return;
+    size_t numSearches = 0;
+    for(ClothPair& pair : pairs)
+    {
+        pair.begin = numSearches;
+        numSearches += cloths[pair.first]->bvh.getNumRefitTasks();
+    }
+    contacts.resize(numSearches);
+    //every search writes only its own contacts and every cloth only its own points
+    auto search = [this](const ClothPair& pair, int task) {
+        cloths[pair.first]->findClothContacts(task, *cloths[pair.second], pair.thickness, pair.stiffness,
+                                              contacts[pair.begin + task]);
+    };
+    auto push = [this](int c) {
+        for(const ClothPair& pair : pairs)
+        {
+            if(pair.first != c && pair.second != c)
+                continue;
+            for(int task = 0; task < cloths[pair.first]->bvh.getNumRefitTasks(); task++)
+                cloths[c]->addClothContacts(contacts[pair.begin + task], c == pair.second);
+        }
+        cloths[c]->applyClothContacts();
+    };
+    if(scheduler.getNumThreads() == 1)
+    {
+        for(const ClothPair& pair : pairs)
+        {
+            for(int task = 0; task < cloths[pair.first]->bvh.getNumRefitTasks(); task++)
+                search(pair, task);
+        }
+        for(int c = 0; c < cloths.size(); c++)
+            push(c);
+        return;
+    }
+    //the pairs change from update to update, so the graph is built anew; it has a few tasks per pair
+    collisions.clear();
+    vector<size_t> searched(cloths.size(), SIZE_MAX); //the task every cloth waits for before it is pushed
+    for(const ClothPair& pair : pairs)
+    {
+        size_t done = collisions.add([]{});
+        for(int task = 0; task < cloths[pair.first]->bvh.getNumRefitTasks(); task++)
+        {
+            size_t id = collisions.add([&search, &pair, task]{ search(pair, task); });
+            collisions.precede(id, done);
+        }
+        for(int c : {pair.first, pair.second})
+        {
+            if(searched[c] == SIZE_MAX)
+                searched[c] = collisions.add([]{});
+            collisions.precede(done, searched[c]);
+        }
+    }
+    for(int c = 0; c < cloths.size(); c++)
+    {
+        if(searched[c] != SIZE_MAX)
+            collisions.precede(searched[c], collisions.add([&push, c]{ push(c); }));
+    }
+    scheduler.run(collisions);
+}
@@ -0,0 +1,78 @@
+/* 
+ * File:   ClothScene.h
+ * Author: tanmaya
+ *
+ * Created on 25 November, 2017, 12:58 PM
+ */
+
+#ifndef CLOTHSCENE_H
+#define CLOTHSCENE_H
+#include "Cloth.h"
+#include "../common/TaskScheduler.h"
+
+/**
+ * Any number of cloths, each with its own parameters, updated together on a work-stealing thread pool.
+ * An update is a task graph with a chain of passes for every cloth, each pass made of tasks which do not
+ * write the same point; the chains do not depend on each other, so small and large cloths are balanced over
+ * the cores, and the tasks of a single large cloth are spread over them. Every point sums its forces in an
+ * order fixed by its cloth, so the result has the same bits on any number of threads.
+ *
+ * After the update the cloths with a thickness are kept apart from each other. The boxes of all the cloths are
+ * swept along X to find the pairs which may touch; only those pairs are searched for contacts, one task per
+ * subtree of the bvh of the first cloth of a pair, and every cloth then sums the impulses of its pairs in the
+ * order of the pairs.
+ */
+class ClothScene
+{
+public:
+    vector<Cloth*> cloths; //all the cloths, deleted with the scene
+    /**
+     * Constructor. Starts the threads of an empty scene
+     * @param threads The number of threads updating the cloths, 0 for one per core
+     */
+    ClothScene(unsigned threads);
+    ~ClothScene();
+    /**
+     * Adds a cloth, which the scene deletes when it is destroyed
+     * @param cloth The cloth
+     */
+    void add(Cloth* cloth);
+    /**
+     * Replaces a cloth, e.g. by one restored from a checkpoint, deleting the old one
+     * @param index The index of the cloth
+     * @param cloth The new cloth
+     */
+    void replace(int index, Cloth* cloth);
+    /**
+     * Updates all the cloths
+     */
+    void update();
+private:
+    /**
+     * Two cloths whose boxes overlap
+     */
+    struct ClothPair
+    {
+        int first; //the cloth whose subtrees are searched
+        int second; //the cloth searched in, of a higher index
+        double thickness; //the larger thickness of the two
+        double stiffness; //the mean kSelf of the two
+        size_t begin; //the contacts of the first subtree of the first cloth
+    };
+    vector<ClothPair> pairs; //the pairs of cloths which may touch after the current update
+    vector<vector<ClothContact> > contacts; //the contacts found by every subtree of every pair
+    TaskGraph collisions; //the searches of the pairs and the cloths summing their impulses
+    /**
+     * Finds the pairs of cloths whose boxes, grown by the thickness of each, overlap
+     */
+    void findPairs();
+    /**
+     * Keeps the cloths apart from each other after they have been updated
+     */
+    void collide();
+    TaskScheduler scheduler; //runs the phases of the cloths
+    TaskGraph frame; //the phases of all the cloths, rebuilt when a cloth is added
+    bool frameDirty; //whether the frame has to be rebuilt
+};
+
+#endif /* CLOTHSCENE_H */
@@ -10,7 +10,11 @@
 #include <time.h>
 #include "Camera.h"
 #include "Cloth.h"
-#define FPS 200
+#include "ClothScene.h"
+#include "../common/PrecisionReport.h"
+#include "../common/FramePlayer.h"
+#include "../common/Ensemble.h"
+#include "../common/RegressionReport.h"
 
 using namespace std;
 using namespace glm;
@@ -24,7 +28,153 @@ GLdouble backColor[3] = {0.0, 0.0, 0.0}; //color of the background
 GLdouble clothColor1[3] = {0.5, 0.5, 0.9};
 GLdouble clothColor2[3] = {0.8, 0.2, 0.5};
 Camera* cam;
-Cloth* c;
+ClothScene* clothScene; //all the cloths of the scene
+Cloth* c; //the first cloth, which is checkpointed, cached and played back
+SceneConfig scene; //scene description given on the command line, empty for the default scene
+string checkpointPath = "cloth.ckpt"; //where the checkpoints are saved
+unsigned long checkpointInterval = 0; //number of frames between automatic checkpoints, 0 to save only on request
+unsigned long frameCount = 0; //number of updates since the start of the simulation
+FrameCacheWriter frameCache; //streams the positions of every frame to disk if a cache is requested
+vector<dvec3> cachePositions; //positions handed to the frame cache, reused to avoid allocations
+FramePlayer* player = nullptr; //plays a frame cache back instead of simulating, see --play
+Cloth* grabbedCloth = nullptr; //the cloth dragged with the mouse, nullptr if none
+vector<int> grabbedPoints; //its points dragged along, pinned while they are
+vector<bool> grabbedMovable; //whether each of them was movable before it was grabbed
+dvec3 grabbedAt; //where the mouse holds the cloth
+double grabDepth; //distance of that location along the ray through the mouse
+#define GRAB_RADIUS 0.05 //points this close to where the cloth is clicked are dragged together
+
+/**
+ * Saves the cloth to the checkpoint path
+ */
+void saveCheckpoint()
+{
+    PROFILE_SCOPE("checkpoint");
+    string error;
+    if(c->saveCheckpoint(checkpointPath, error))
+        cout << "saved checkpoint of frame " << frameCount << " to " << checkpointPath << endl;
+    else
+        cerr << error << endl;
+}
+
+/**
+ * Plays, pauses or scrubs a played back cache
+ * @param key Space to play or pause, ',' and '.' to step one frame, '[' and ']' to jump 100 frames
+ */
+void controlPlayback(unsigned char key)
+{
+    switch(key)
+    {
+        case ' ':
+            player->setPlaying(!player->isPlaying());
+            break;
+        case ',':
+            player->skip(-1);
+            break;
+        case '.':
+            player->skip(1);
+            break;
+        case '[':
+            player->skip(-100);
+            break;
+        case ']':
+            player->skip(100);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Scrubs a played back cache by dragging the mouse: the width of the window spans all the frames
+ * @param x The horizontal position of the mouse
+ * @param y The vertical position of the mouse
+ */
+void scrub(int x, int y)
+{
+    int w = std::max(glutGet(GLUT_WINDOW_WIDTH), 1);
+    player->seek((long)((double)x/w*player->getNumFrames()));
+    glutPostRedisplay();
+}
+
+/**
+ * Starts scrubbing when the left mouse button is pressed
+ * @param button The button
+ * @param state Whether it was pressed or released
+ * @param x The horizontal position of the mouse
+ * @param y The vertical position of the mouse
+ */
+void mousePress(int button, int state, int x, int y)
+{
+    if(button == GLUT_LEFT_BUTTON && state == GLUT_DOWN)
+        scrub(x, y);
+}
+
+/**
+ * Grabs the cloth under the mouse when the left mouse button is pressed and lets it go when it is released.
+ * The cloth is found by casting the ray through the mouse into the bvh of every cloth, and the points around the
+ * triangle hit are pinned to the mouse while it drags them.
+ * @param button The button
+ * @param state Whether it was pressed or released
+ * @param x The horizontal position of the mouse
+ * @param y The vertical position of the mouse
+ */
+void grab(int button, int state, int x, int y)
+{
+    if(button != GLUT_LEFT_BUTTON)
+        return;
+    if(grabbedCloth) //released, or pressed again without a release
+    {
+        for(size_t i = 0; i < grabbedPoints.size(); i++)
+            grabbedCloth->movable[grabbedPoints[i]] = grabbedMovable[i];
+        grabbedCloth = nullptr;
+    }
+    if(state != GLUT_DOWN)
+        return;
+    dvec3 origin, direction;
+    cam->getRay(x, y, origin, direction);
+    double distance = 1; //up to the far plane
+    int nearest = -1;
+    for(Cloth* cloth : clothScene->cloths) //every hit shortens the ray for the cloths after it
+    {
+        int p = cloth->pick(origin, direction, distance);
+        if(p >= 0)
+        {
+            grabbedCloth = cloth;
+            nearest = p;
+        }
+    }
+    if(!grabbedCloth)
+        return;
+    grabDepth = distance;
+    grabbedAt = origin + direction*distance;
+    grabbedCloth->findPointsNear(grabbedAt, GRAB_RADIUS, grabbedPoints);
+    if(!binary_search(grabbedPoints.begin(), grabbedPoints.end(), nearest)) //a triangle larger than the radius
+        grabbedPoints.insert(lower_bound(grabbedPoints.begin(), grabbedPoints.end(), nearest), nearest);
+    grabbedMovable.clear();
+    for(int p : grabbedPoints)
+    {
+        grabbedMovable.push_back(grabbedCloth->movable[p]);
+        grabbedCloth->movable[p] = false;
+    }
+}
+
+/**
+ * Drags the grabbed points along with the mouse, keeping them at the depth at which they were grabbed
+ * @param x The horizontal position of the mouse
+ * @param y The vertical position of the mouse
+ */
+void drag(int x, int y)
+{
+    if(!grabbedCloth)
+        return;
+    dvec3 origin, direction;
+    cam->getRay(x, y, origin, direction);
+    dvec3 target = origin + direction*grabDepth;
+    grabbedCloth->movePoints(grabbedPoints, target - grabbedAt);
+    grabbedAt = target;
+    glutPostRedisplay();
+}
 
 void keyPress(unsigned char key,int x,int y)
 {
@@ -75,6 +225,19 @@ void keyPress(unsigned char key,int x,int y)
             cam->yaw(-1.0);
             break;
         //Rotate anti-clockwise
+        case 'c':
+            saveCheckpoint();
+            return;
+        //Play, pause and step through a played back cache
+        case ' ':
+        case ',':
+        case '.':
+        case '[':
+        case ']':
+            if(!player)
+                return;
+            controlPlayback(key);
+            break;
         case 'x':
             cam->yaw(1.0);
             break;
@@ -86,26 +249,43 @@ void keyPress(unsigned char key,int x,int y)
 
 void draw()
 {
+    PROFILE_SCOPE("draw");
     glClear  (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glColor3dv(clothColor1);
-    glBegin(GL_TRIANGLES);
-    for(auto x: c->triangles) //drawing each triangle individually
-    {
-        glNormal3dv(value_ptr(c->pointNorms[get<0>(x)]));
-        glVertex3dv(value_ptr(c->points[get<0>(x)]));
-        glNormal3dv(value_ptr(c->pointNorms[get<1>(x)]));
-        glVertex3dv(value_ptr(c->points[get<1>(x)]));
-        glNormal3dv(value_ptr(c->pointNorms[get<2>(x)]));
-        glVertex3dv(value_ptr(c->points[get<2>(x)]));
-    }
-    glEnd();
+    for(int i = 0; i < clothScene->cloths.size(); i++)
+    {
+        glColor3dv(i % 2 ? clothColor2 : clothColor1);
+        clothScene->cloths[i]->draw();
+    }
     glutSwapBuffers();
 }
 void timer(int t)
 {
-    c->update();
+    PROFILE_FRAME();
+    if(player)
+    {
+        //show the cached frame instead of simulating
+        player->advance();
+        shared_ptr<const vector<dvec3> > frame = player->currentFrame();
+        c->setPositions(*frame);
+        ostringstream title;
+        title << "Cloth - frame " << player->getCurrentFrame() + 1 << "/" << player->getNumFrames() << (player->isPlaying() ? "" : " (paused)");
+        glutSetWindowTitle(title.str().c_str());
+        glutPostRedisplay();
+        glutTimerFunc(1000/c->params.fps, timer, 0);
+        return;
+    }
+    clothScene->update();
+    frameCount++;
+    if(frameCache.isOpen())
+    {
+        PROFILE_SCOPE("cache");
+        c->getPositions(cachePositions);
+        frameCache.addFrame(cachePositions); //coded and written on the thread of the cache
+    }
+    if(checkpointInterval > 0 && frameCount % checkpointInterval == 0)
+        saveCheckpoint();
     glutPostRedisplay();
-    glutTimerFunc(1000/FPS, timer, 0);
+    glutTimerFunc(1000/c->params.fps, timer, 0);
 }
 
 void light()
@@ -128,10 +308,478 @@ void light()
     glEnable(GL_LIGHT0);
 }
 
-void initGlut()
+/**
+ * Pins the rows and points listed by the "row" and "pin" keys of a section. The pins of an imported mesh
+ * are the numbers of vertices in its file, counted from 1, and it has no rows.
+ * @param section The section
+ * @param topology The layout of the cloth
+ * @param movable The movable flags of the points, cleared for the pinned ones
+ */
+void pinPoints(const SceneSection& section, const ClothTopology& topology, vector<bool>& movable)
+{
+    int X = topology.numX, Y = topology.numY;
+    if(!topology.pointOfVertex.empty())
+    {
+        for(const string& row : section.getAll("row"))
+            cerr << "scene: ignoring pinned row " << row << " of a mesh" << endl;
+        for(const string& pin : section.getAll("pin"))
+        {
+            istringstream in(pin);
+            int v;
+            if(in >> v && v >= 1 && v <= topology.pointOfVertex.size() && topology.pointOfVertex[v - 1] >= 0)
+                movable[topology.pointOfVertex[v - 1]] = false;
+            else
+                cerr << "scene: ignoring invalid pin " << pin << endl;
+        }
+        return;
+    }
+    for(const string& row : section.getAll("row"))
+    {
+        istringstream in(row);
+        int y;
+        if(!(in >> y) || y < 0 || y >= Y)
+        {
+            cerr << "scene: ignoring invalid pinned row " << row << endl;
+            continue;
+        }
+        for(int x = 0; x < X; x++)
+            movable[x + y*X] = false;
+    }
+    for(const string& pin : section.getAll("pin"))
+    {
+        istringstream in(pin);
+        int y, x;
+        if(in >> y >> x && y >= 0 && y < Y && x >= 0 && x < X)
+            movable[x + y*X] = false;
+        else
+            cerr << "scene: ignoring invalid pin " << pin << endl;
+    }
+}
+
+/**
+ * Reads the curve along which imported meshes are reordered from the "reorder" key of the [solver] section
+ * @return One of the CURVE_* constants, the Hilbert curve by default
+ */
+int loadCurve()
+{
+    string name = scene.section("solver").getString("reorder", "hilbert");
+    int curve = CURVE_HILBERT;
+    if(!ParticleOrder::curveFromName(name, curve))
+        cerr << "scene: ignoring unknown reorder curve " << name << endl;
+    return curve;
+}
+
+/**
+ * Builds the layout of the cloth of a [cloth] section: the garment imported from the OBJ file named by
+ * "mesh", else a grid of "columns" by "rows" points. Sections importing the same file share one topology.
+ * The points of a garment are sorted along a space filling curve, those of a grid keep their row major order.
+ * @param section The section describing the cloth
+ * @param curve The curve to sort the points of a garment along
+ * @return The topology, nullptr if the mesh cannot be loaded
+ */
+shared_ptr<const ClothTopology> loadTopology(const SceneSection& section, int curve)
+{
+    if(!section.has("mesh"))
+        return make_shared<ClothTopology>(section.getInt("columns", 10), section.getInt("rows", 30));
+    static map<pair<string, int>, shared_ptr<const ClothTopology> > meshes; //already imported files
+    string path = scene.resolve(section.getString("mesh", ""));
+    auto found = meshes.find(make_pair(path, curve));
+    if(found != meshes.end())
+        return found->second;
+    ClothMesh mesh;
+    string error;
+    auto start = chrono::steady_clock::now();
+    if(!mesh.loadObj(path, error, curve))
+    {
+        cerr << error << endl;
+        return nullptr;
+    }
+    shared_ptr<const ClothTopology> topology = make_shared<ClothTopology>(mesh);
+    cerr << path << ": " << mesh.positions.size() << " points, " << mesh.triangles.size() << " triangles, "
+         << topology->bendPairs.size() << " bending edges in "
+         << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+    meshes[make_pair(path, curve)] = topology;
+    return topology;
+}
+
+/**
+ * Builds the layout of the cloth of a [cloth] section, sorting a garment along the curve of the scene
+ * @param section The section describing the cloth
+ * @return The topology, nullptr if the mesh cannot be loaded
+ */
+shared_ptr<const ClothTopology> loadTopology(const SceneSection& section)
+{
+    return loadTopology(section, loadCurve());
+}
+
+/**
+ * Builds a cloth from a [cloth] section of the scene. The pins are taken from the section itself, else for a grid
+ * from the [pins] sections of the scene, else the two top corners of a grid or the top of a mesh are pinned.
+ * @param section The section describing the cloth
+ * @param params The material constants and solver settings of the cloth
+ * @param offset Displacement of the cloth from the "position" of the section
+ * @param topology The layout and triangles to share with other cloths of the same shape, nullptr to load it
+ * @return The cloth, nullptr if its mesh cannot be loaded
+ */
+Cloth* loadCloth(const SceneSection& section, const ClothParameters& params, dvec3 offset,
+                 shared_ptr<const ClothTopology> topology = nullptr)
+{
+    if(!topology)
+        topology = loadTopology(section);
+    if(!topology)
+        return nullptr;
+    vector<const SceneSection*> pins;
+    if(section.has("row") || section.has("pin"))
+        pins.push_back(&section);
+    else if(topology->pointOfVertex.empty()) //the [pins] sections name points of grids
+        pins = scene.all("pins");
+    vector<bool> movable; //the default pins unless the scene pins others
+    if(!pins.empty())
+    {
+        movable.assign(topology->numX*topology->numY, true);
+        for(const SceneSection* pinned : pins)
+            pinPoints(*pinned, *topology, movable);
+    }
+    Cloth* c = Cloth::create(topology, params, movable); //the pinned points are not perturbed
+    offset += section.getVec3("position", dvec3(0));
+    if(offset != dvec3(0))
+    {
+        vector<dvec3> positions;
+        c->getPositions(positions);
+        for(dvec3& p : positions)
+            p += offset;
+        c->setPositions(positions);
+    }
+    return c;
+}
+
+/**
+ * Builds the cloths of the scene: every [cloth] section adds "count" cloths, each "offset" away from the
+ * previous one. A scene without [cloth] sections has a single cloth. The keys of a section override the
+ * material constants and solver settings of the scene for its cloths.
+ * @param params The material constants and solver settings of the scene
+ * @return false if a mesh cannot be loaded
+ */
+bool loadCloths(const ClothParameters& params)
+{
+    vector<const SceneSection*> sections = scene.all("cloth");
+    if(sections.empty())
+        sections.push_back(&scene.section("cloth"));
+    for(const SceneSection* section : sections)
+    {
+        ClothParameters clothParams = params;
+        clothParams.apply(*section);
+        int count = section->getInt("count", 1);
+        dvec3 offset = section->getVec3("offset", dvec3(0));
+        unsigned long seed = clothParams.seed;
+        for(int k = 0; k < count; k++)
+        {
+            clothParams.seed = seed + clothScene->cloths.size(); //every cloth is perturbed differently
+            Cloth* cloth = loadCloth(*section, clothParams, offset*(double)k);
+            if(!cloth)
+                return false;
+            clothScene->add(cloth);
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads the material constants and solver settings from the scene
+ * @return The parameters
+ */
+ClothParameters loadParameters()
+{
+    ClothParameters params = ClothParameters::fromScene(scene);
+    if(params.fps <= 0)
+    {
+        cerr << "scene: ignoring invalid fps " << params.fps << endl;
+        params.fps = FPS;
+    }
+    return params;
+}
+
+/**
+ * Simulates the scene in double and in single precision side by side, without a window,
+ * and prints how far the single precision cloth drifts from the double precision one
+ * @param steps The number of steps to simulate
+ * @return false if the mesh of the cloth cannot be loaded
+ */
+bool runPrecisionReport(unsigned long steps)
+{
+    ClothParameters params = loadParameters();
+    shared_ptr<const ClothTopology> topology = loadTopology(scene.section("cloth"));
+    if(!topology)
+        return false;
+    params.singlePrecision = false; //both cloths get the same perturbation from the seed
+    Cloth* reference = loadCloth(scene.section("cloth"), params, dvec3(0), topology);
+    params.singlePrecision = true;
+    Cloth* single = loadCloth(scene.section("cloth"), params, dvec3(0), topology);
+    PrecisionReport report(sqrt(2.0)); //the cloth spans the unit square
+    vector<dvec3> referencePositions, singlePositions;
+    unsigned long interval = std::max(steps / 20, 1UL);
+    for(unsigned long s = 1; s <= steps; s++)
+    {
+        PROFILE_FRAME();
+        auto start = chrono::steady_clock::now();
+        reference->update();
+        auto middle = chrono::steady_clock::now();
+        single->update();
+        auto end = chrono::steady_clock::now();
+        report.addTiming(chrono::duration<double, milli>(middle - start).count(),
+                         chrono::duration<double, milli>(end - middle).count());
+        if(s % interval == 0 || s == steps)
+        {
+            reference->getPositions(referencePositions);
+            single->getPositions(singlePositions);
+            report.sample(s, referencePositions, singlePositions);
+        }
+    }
+    PROFILE_FRAME(); //closes the last step
+    report.print(cout);
+    delete reference;
+    delete single;
+    return true;
+}
+
+/**
+ * Simulates the garment of the scene twice without a window, once with its points in the order of the mesh file
+ * and once sorted along the curve of the scene, and prints the time per step and the cache misses of both
+ * @param steps The number of steps to simulate
+ * @return false if the cloth of the scene is not an imported mesh or cannot be loaded
+ */
+bool runLocalityReport(unsigned long steps)
+{
+    const SceneSection& section = scene.section("cloth");
+    if(!section.has("mesh"))
+    {
+        cerr << "locality report: the [cloth] section of the scene does not import a mesh" << endl;
+        return false;
+    }
+    int curve = loadCurve();
+    if(curve == CURVE_NONE) //nothing to compare against
+        curve = CURVE_HILBERT;
+    ClothParameters params = loadParameters();
+    Cloth* cloths[2];
+    for(int k = 0; k < 2; k++)
+    {
+        shared_ptr<const ClothTopology> topology = loadTopology(section, k == 0 ? CURVE_NONE : curve);
+        if(!topology)
+            return false;
+        cloths[k] = loadCloth(section, params, dvec3(0), topology);
+    }
+    vector<dvec3> positions[2];
+    cloths[0]->getPositions(positions[0]);
+    dvec3 low = positions[0][0], high = positions[0][0];
+    for(const dvec3& p : positions[0])
+    {
+        low = glm::min(low, p);
+        high = glm::max(high, p);
+    }
+    LocalityReport report(curve == CURVE_MORTON ? "morton" : "hilbert", length(high - low));
+    for(int k = 0; k < 2; k++)
+    {
+        CacheModel cache;
+        cloths[k]->traceAccesses(cache);
+        report.addModel(k == 1, cache);
+    }
+    for(unsigned long s = 0; s < steps; s++)
+    {
+        PROFILE_FRAME();
+        for(int k = 0; k < 2; k++) //in turn, so that both see the same state of the machine
+            report.timeStep(k == 1, [&]() { cloths[k]->update(); });
+    }
+    PROFILE_FRAME(); //closes the last step
+    for(int k = 0; k < 2; k++)
+    {
+        cloths[k]->getPositions(positions[k]);
+        delete cloths[k];
+    }
+    report.compare(positions[0], positions[1]);
+    report.print(cout);
+    return true;
+}
+
+/**
+ * Simulates the variants listed in the [ensemble] section of the scene without a window, in parallel and all
+ * on one shared topology, and prints the drape error, largest stretch and runtime of each
+ * @param steps The number of steps to simulate each variant
+ * @return false if the sweep, its reference drape or the mesh of the cloth is invalid
+ */
+bool runEnsemble(unsigned long steps)
+{
+    ParameterSweep sweep;
+    EnsembleRunner runner(sweep);
+    const SceneSection& ensemble = scene.section("ensemble");
+    string error;
+    ClothParameters probe;
+    if(!sweep.fromScene(scene, [&probe](const SceneSection& s) { probe.apply(s); }, error) ||
+       (ensemble.has("reference") && !runner.loadReference(ensemble.getString("reference", ""), error)))
+    {
+        cerr << error << endl;
+        return false;
+    }
+    const SceneSection& section = scene.section("cloth");
+    ClothParameters params = loadParameters();
+    shared_ptr<const ClothTopology> topology = loadTopology(section);
+    if(!topology)
+        return false;
+    Cloth* initial = loadCloth(section, params, dvec3(0), topology);
+    vector<dvec3> start;
+    initial->getPositions(start);
+    vector<bool> movable = initial->movable; //every variant starts from the same perturbed cloth
+    delete initial;
+    auto begin = chrono::steady_clock::now();
+    PROFILE_FRAME(); //the whole sweep is one frame, as its variants step at the same time on several threads
+    runner.run(std::max(ensemble.getInt("threads", 0), 0L), [&](const SceneSection& overrides, EnsembleResult& result)
+    {
+        ClothParameters variant = params;
+        variant.apply(overrides);
+        Cloth* cloth = Cloth::create(topology, variant);
+        cloth->movable = movable;
+        cloth->setPositions(start);
+        for(unsigned long s = 0; s < steps; s++)
+        {
+            double stepStart = EnsembleResult::threadMilliseconds();
+            cloth->update();
+            result.runtime_ms += EnsembleResult::threadMilliseconds() - stepStart;
+            result.max_stretch = std::max(result.max_stretch, cloth->getMaxStretch());
+        }
+        cloth->getPositions(result.positions);
+        delete cloth;
+    });
+    PROFILE_FRAME();
+    runner.print(cout, chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count());
+    return true;
+}
+
+/**
+ * Simulates all cloths of the scene without a window for the number of steps of its [regression] section and
+ * compares their points with a golden trajectory every "interval" steps, or records that trajectory
+ * @param goldenPath The path of the golden trajectory
+ * @param record true to record the golden trajectory, false to compare with it
+ * @return false if the scene or the golden trajectory cannot be loaded, or the run diverged from it
+ */
+bool runRegression(const char* goldenPath, bool record)
+{
+    GoldenTrajectory golden(scene.section("regression"));
+    string error;
+    if(!golden.open(goldenPath, record, error))
+    {
+        cerr << error << endl;
+        return false;
+    }
+    clothScene = new ClothScene(std::max(scene.section("solver").getInt("threads", 0), 0L));
+    if(!loadCloths(loadParameters())) //without a seed in the scene, the default seed makes the run reproducible
+        return false;
+    scene.warnUnused();
+    vector<dvec3> positions, clothPositions;
+    for(unsigned long s = 0; s <= golden.getSteps(); s++)
+    {
+        if(s > 0)
+        {
+            PROFILE_FRAME();
+            golden.timeStep([]() { clothScene->update(); });
+        }
+        if(!golden.samples(s))
+            continue;
+        positions.clear();
+        for(Cloth* cloth : clothScene->cloths)
+        {
+            cloth->getPositions(clothPositions);
+            positions.insert(positions.end(), clothPositions.begin(), clothPositions.end());
+            golden.addStretch(s, cloth->getMaxStretch());
+        }
+        golden.addFrame(s, positions);
+    }
+    PROFILE_FRAME(); //closes the last step
+    if(!golden.finish(cout, error))
+    {
+        cerr << error << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Starts streaming every simulated frame to the cache described by the [cache] section of the scene
+ * @param path The path of the cache, overriding the scene; nullptr to use the path of the scene, if any
+ * @return false if the cache cannot be created
+ */
+bool openFrameCache(const char* path)
+{
+    const SceneSection& section = scene.section("cache");
+    string cachePath = section.getString("path", "");
+    double errorBound = section.getDouble("error", 1e-4);
+    long keyframeInterval = section.getInt("keyframe_interval", 30);
+    if(path)
+        cachePath = path;
+    if(cachePath.empty())
+        return true;
+    string error;
+    if(!frameCache.open(cachePath, errorBound, keyframeInterval, error))
+    {
+        cerr << error << endl;
+        return false;
+    }
+    atexit([]
+    {
+        string error;
+        if(!frameCache.close(error))
+            cerr << error << endl;
+        else if(frameCache.getNumFrames() > 0)
+            cout << "cached " << frameCache.getNumFrames() << " frames in " << frameCache.getBytesWritten() << " bytes" << endl;
+    });
+    return true;
+}
+
+/**
+ * Opens a frame cache for playback. The cloth of the scene is only used to draw the cached positions.
+ * @param path The path of the cache
+ * @return false if the cache cannot be played on the cloth of the scene
+ */
+bool openPlayer(const char* path)
+{
+    player = new FramePlayer();
+    string error;
+    if(!player->open(path, error))
+    {
+        cerr << error << endl;
+        return false;
+    }
+    if(player->getNumParticles() != c->numX*c->numY)
+    {
+        cerr << path << " holds " << player->getNumParticles() << " points, the cloth of the scene has " << c->numX*c->numY << endl;
+        return false;
+    }
+    player->setPlaying(true);
+    glutMouseFunc(mousePress);
+    glutMotionFunc(scrub);
+    return true;
+}
+
+/**
+ * Reads where and how often checkpoints are saved from the scene
+ */
+void loadCheckpointSettings()
+{
+    const SceneSection& checkpoint = scene.section("checkpoint");
+    checkpointPath = checkpoint.getString("path", checkpointPath);
+    int interval = checkpoint.getInt("interval", 0);
+    if(interval < 0)
+        cerr << "scene: ignoring invalid checkpoint interval " << interval << endl;
+    else
+        checkpointInterval = interval;
+}
+
+/**
+ * Creates the window and the cloths of the scene, the first of which may be restored from a checkpoint
+ * @param resumePath The checkpoint to resume from, nullptr to start from the scene
+ * @return false if a mesh or the checkpoint cannot be loaded
+ */
+bool initGlut(const char* resumePath)
 {
     int x = 0;
-    srand(time(NULL));
     glutInit(&x, nullptr);    
     glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
     glutInitWindowPosition(0,0);
@@ -141,17 +789,87 @@ void initGlut()
     cam = new Camera(width, height);
     cam->to3D();
     light();
-    c = new Cloth(10, 30);    
+    loadCheckpointSettings();
+    int threads = scene.section("solver").getInt("threads", 0);
+    clothScene = new ClothScene(std::max(threads, 0));
+    ClothParameters params = loadParameters();
+    if(!scene.section("solver").has("seed")) //a seed in the scene makes the run reproducible, else every run differs
+        params.seed = time(NULL);
+    if(!loadCloths(params))
+        return false;
+    if(resumePath) //the first cloth continues from the checkpoint
+    {
+        string error;
+        Cloth* resumed = Cloth::loadCheckpoint(resumePath, error);
+        if(!resumed)
+        {
+            cerr << error << endl;
+            return false;
+        }
+        clothScene->replace(0, resumed);
+    }
+    c = clothScene->cloths[0];
     glClearColor(backColor[0], backColor[1], backColor[2], 0);
     glutKeyboardFunc(keyPress);
-    glutTimerFunc(1000/FPS, timer, 0);
+    glutMouseFunc(grab); //replaced by scrubbing when a cache is played back
+    glutMotionFunc(drag);
+    glutTimerFunc(1000/c->params.fps, timer, 0);
     glutDisplayFunc(draw);
-        
+    return true;
 }
 
 int main(int argc, char** argv) {
-    
-    initGlut();
+    const char* scenePath = nullptr; //arguments: [scene file] [--precision-report steps] [--ensemble steps] [--locality-report steps] [--regression golden] [--record-golden golden] [--resume checkpoint] [--cache file] [--play file]
+    const char* resumePath = nullptr;
+    const char* cachePath = nullptr;
+    const char* playPath = nullptr;
+    unsigned long reportSteps = 0;
+    unsigned long ensembleSteps = 0;
+    unsigned long localitySteps = 0;
+    const char* goldenPath = nullptr;
+    bool recordGolden = false;
+    for(int i = 1; i < argc; i++)
+    {
+        if(string(argv[i]) == "--precision-report" && i + 1 < argc)
+            reportSteps = strtoul(argv[++i], nullptr, 10);
+        else if(string(argv[i]) == "--ensemble" && i + 1 < argc)
+            ensembleSteps = strtoul(argv[++i], nullptr, 10);
+        else if(string(argv[i]) == "--locality-report" && i + 1 < argc)
+            localitySteps = strtoul(argv[++i], nullptr, 10);
+        else if((string(argv[i]) == "--regression" || string(argv[i]) == "--record-golden") && i + 1 < argc)
+        {
+            recordGolden = string(argv[i]) == "--record-golden";
+            goldenPath = argv[++i];
+        }
+        else if(string(argv[i]) == "--resume" && i + 1 < argc)
+            resumePath = argv[++i];
+        else if(string(argv[i]) == "--cache" && i + 1 < argc)
+            cachePath = argv[++i];
+        else if(string(argv[i]) == "--play" && i + 1 < argc)
+            playPath = argv[++i];
+        else
+            scenePath = argv[i];
+    }
+    if(scenePath) //load the scene given on the command line
+    {
+        string error;
+        if(!scene.load(scenePath, error))
+        {
+            cerr << error << endl;
+            return 1;
+        }
+    }
+    if(reportSteps > 0)
+        return runPrecisionReport(reportSteps) ? 0 : 1;
+    if(ensembleSteps > 0)
+        return runEnsemble(ensembleSteps) ? 0 : 1;
+    if(localitySteps > 0)
+        return runLocalityReport(localitySteps) ? 0 : 1;
+    if(goldenPath)
+        return runRegression(goldenPath, recordGolden) ? 0 : 1;
+    if(!initGlut(resumePath) || !(playPath ? openPlayer(playPath) : openFrameCache(cachePath)))
+        return 1;
+    scene.warnUnused();
     glutMainLoop();
     return 0;
 }
@@ -7,9 +7,48 @@
 
 #include "Constraint.h"
 #include "Particle.h"
+#include "Parameters.h"
+#include "WindField.h"
+#include "../common/Profiler.h"
+#include "../common/Checkpoint.h"
+#include "../common/ClothMesh.h"
+#include "../common/LocalityReport.h"
+#include "../common/SignedDistanceField.h"
 
 #define PI 3.14159265
-#define CONSTRAINT_ITERATIONS 15 // refers to the number of iterations required to satisfy the constraints per frame
+#define SLEEP_TILE_SIZE 8 // number of particles along each side of a sleeping tile
+
+#define STEP_DAMPING 1 // kernel feature: the velocities are damped when integrating
+#define STEP_WIND 2 // kernel feature: the wind is applied along the triangle normals
+#define STEP_COLLISIONS 4 // kernel feature: collisions with spheres, capsules and meshes are resolved
+#define STEP_NUM_FEATURE_SETS 8 // number of combinations of the kernel features
+#define STEP_DYNAMIC_ITERATIONS 0 // iteration count of the kernels which read the number of sweeps at run time
+
+//phases of a step, in the order they run; see Cloth::stepPhase
+#define STEP_PHASE_FORCES 0 // gravity and wind
+#define STEP_PHASE_AIR 1 // drag and lift of the triangles, in tasks of AIR_TASK_SIZE triangles
+#define STEP_PHASE_AIR_FORCES 2 // drag and lift gathered at the particles, in tasks of AIR_TASK_SIZE particles
+#define STEP_PHASE_CONSTRAINTS 3 // tearing and the sweeps over the constraints
+#define STEP_PHASE_INTEGRATION 4 // sleeping and the integration of the particles
+#define STEP_PHASE_COLLISIONS 5 // collisions with the spheres, capsules and meshes
+#define STEP_NUM_PHASES 6
+#define AIR_TASK_SIZE 2048 // triangles or particles per task of the aerodynamic phases
+
+//sections of a checkpoint of the spring mass cloth
+#define CHECKPOINT_CLOTH 1 // ClothCheckpointInfo
+#define CHECKPOINT_PARAMETERS 2 // SimulationParameters
+#define CHECKPOINT_PARTICLES 3 // the particles row by row, in the precision of the cloth
+#define CHECKPOINT_CONSTRAINTS 4 // ConstraintCheckpoint for each constraint
+#define CHECKPOINT_CONSTRAINT_TRIANGLES 5 // triangles next to each constraint
+#define CHECKPOINT_TRIANGLES 6 // indices of the three particles of each triangle
+#define CHECKPOINT_TRIANGLE_CONSTRAINTS 7 // constraints along the edges of each triangle
+#define CHECKPOINT_TRIANGLE_PRIMARY 8 // one byte per triangle, 1 if drawn in the primary color
+#define CHECKPOINT_TRIANGLE_TILES 9 // tile of the first corner of each triangle, no longer written: restoring follows the corners
+#define CHECKPOINT_TILE_ASLEEP 10 // one byte per tile, 1 if asleep
+#define CHECKPOINT_TILE_QUIET_FRAMES 11 // frames each tile has been at rest
+#define CHECKPOINT_TILE_BOUNDS 12 // bounding box of each tile
+#define CHECKPOINT_EXPORT_ORDER 13 // index of every particle of an imported mesh before it was reordered
+#define CHECKPOINT_CONTACTS 14 // the contact cache of the spheres and capsules
 
 using namespace std;
 using namespace glm;
@@ -22,16 +61,789 @@ struct Color {
 };
 
 /**
- * Defines the cloth piece
+ * A sphere or a capsule which moves in a straight line during a step, without turning
+ */
+struct SweptCollider {
+    dvec3 start, end; // centre at the start and at the end of the step
+    dvec3 axis; // segment of a capsule from one end to the other, centred on the centre; zero for a sphere
+    double radius;
+};
+
+/**
+ * Everything which acts on the cloth during one step of the simulation
+ */
+struct StepInput {
+    dvec3 gravity; // force applied to every particle
+    dvec3 wind; // force projected onto the triangle normals
+    const WindField *gusts = nullptr; // gusts added to the wind at the centroid of each triangle, nullptr for none
+    double gust_scale = 0; // factor turning the gusts of the field into forces, like the wind
+    int iterations; // number of sweeps over the constraints
+    bool collisions; // whether collisions with the colliders and meshes are resolved in this step
+    vector<SweptCollider> colliders; // the spheres and capsules
+    vector<pair<const SignedDistanceField *, double> > meshes; // distance field and thickness of each static mesh
+};
+
+/**
+ * Size and placement of a cloth stored in a checkpoint
+ */
+struct ClothCheckpointInfo {
+    uint64_t num_col, num_row; // number of rows and columns of particles
+    double position[3]; // position of the top left end of the cloth
+    double height, width; // height and width of the cloth
+    uint64_t frame; // frame of the simulation in which the checkpoint was taken
+};
+
+/**
+ * A constraint stored in a checkpoint
+ */
+struct ConstraintCheckpoint {
+    uint32_t first, second; // indices of the particles, row by row
+    double rest_length;
+};
+
+/**
+ * Defines the cloth piece. The cloth is stored in the precision chosen when it is created,
+ * see ClothT for the implementation.
  */
 class Cloth {
+public:
+    virtual ~Cloth() {}
+
+    /**
+     * Creates a cloth stored in double precision, or in single precision if the parameters ask for it
+     * @param height height of the cloth
+     * @param width width of the cloth
+     * @param num_col number of particles in a column
+     * @param num_row number of particles in a row
+     * @param mass mass of each particle
+     * @param params settings of the solver
+     * @return the cloth
+     */
+    static Cloth *create(dvec3 pos, double height, double width, unsigned long num_col, unsigned long num_row,
+                         double mass, const SimulationParameters &params = SimulationParameters());
+
+    /**
+     * Creates a garment from an imported triangle mesh, stored in the precision the parameters ask for
+     * @param mesh the mesh, with its edges built
+     * @param pos displacement of the mesh
+     * @param mass mass of each particle
+     * @param params settings of the solver
+     * @return the cloth
+     */
+    static Cloth *create(const ClothMesh &mesh, dvec3 pos, double mass,
+                         const SimulationParameters &params = SimulationParameters());
+
+    /**
+     * Restores a cloth, in the precision it was saved in, from a checkpoint
+     * @param path path of the checkpoint
+     * @param frame set to the frame in which the checkpoint was taken
+     * @param error set to a description of the problem if the checkpoint cannot be loaded
+     * @return the cloth, nullptr on failure
+     */
+    static Cloth *loadCheckpoint(const string &path, unsigned long &frame, string &error);
+
+    /**
+     * Saves the complete state of the cloth: particles, pins, the intact constraints and
+     * triangles, sleeping tiles and solver settings
+     * @param path path of the checkpoint
+     * @param frame current frame of the simulation, stored for resuming
+     * @param error set to a description of the problem if the checkpoint cannot be written
+     * @return true if the checkpoint was written
+     */
+    virtual bool saveCheckpoint(const string &path, unsigned long frame, string &error) = 0;
+
+    /**
+     * Enables or disables tearing of the cloth
+     * @param enable whether overstretched constraints should tear
+     * @param ratio ratio of current length to rest length beyond which a constraint tears
+     */
+    virtual void setTearing(bool enable, double ratio = DEFAULT_TEAR_RATIO) = 0;
+
+    /**
+     * Returns whether tearing is enabled
+     * @return true if overstretched constraints tear
+     */
+    virtual bool isTearing() = 0;
+
+    /**
+     * Enables or disables sleeping of the regions of the cloth which have come to rest
+     * @param enable whether settled tiles should be put to sleep
+     */
+    virtual void setSleeping(bool enable) = 0;
+
+    /**
+     * Returns whether sleeping is enabled
+     * @return true if settled tiles are put to sleep
+     */
+    virtual bool isSleeping() = 0;
+
+    /**
+     * Returns the number of tiles which are currently asleep
+     * @return the number of sleeping tiles
+     */
+    virtual unsigned long getNumSleepingTiles() = 0;
+
+    /**
+     * Returns the number of constraints which are still intact
+     * @return the number of constraints
+     */
+    virtual unsigned long getNumConstraints() = 0;
+
+    /**
+     * Returns how far the most stretched intact constraint is beyond its rest length
+     * @return the largest ratio of current length to rest length minus one, negative if all are compressed
+     */
+    virtual double getMaxStretch() = 0;
+
+    /**
+     * Makes the particle at index i,j in the grid immovable. Used to hang the cloth.
+     * @param i Row number of the particle
+     * @param j Column number of the particle
+     */
+    virtual void makeParticleImmovable(int i, int j) = 0;
+
+    /**
+     * Copies the positions of all the particles, row by row, in double precision. The particles of an imported
+     * mesh are put back into the order of the mesh file.
+     * @param positions filled with the positions
+     */
+    virtual void getPositions(vector<dvec3> &positions) = 0;
+
+    /**
+     * Places all the particles without simulating, e.g. at positions played back from a frame cache
+     * @param positions the positions, in the order returned by getPositions
+     * @return false if the number of positions does not match the cloth
+     */
+    virtual bool setPositions(const vector<dvec3> &positions) = 0;
+
+    /**
+     * Replays the memory accesses of the loops over the constraints and triangles in one step on a cache model
+     * @param cache the cache model
+     */
+    virtual void traceAccesses(CacheModel &cache) = 0;
+
+    /**
+     * Draws the cloth by dividing it into a set of triangles
+     * @param primaryColor primary color of the cloth
+     * @param secondaryColor secondary color of the cloth
+     */
+    virtual void draw(Color primaryColor, Color secondaryColor) = 0;
+
+    /**
+     * Returns the settings of the solver
+     * @return the parameters
+     */
+    virtual const SimulationParameters &getParameters() = 0;
+
+    /**
+     * Advances the cloth by one step: applies the forces, satisfies the constraints, integrates
+     * and resolves collisions
+     * @param input forces, sweeps and colliders of the step
+     */
+    virtual void step(const StepInput &input) = 0;
+
+    /**
+     * Returns into how many tasks a phase of a step is split. The tasks of a phase may run in parallel.
+     * @param phase one of the STEP_PHASE_* phases
+     * @return the number of tasks, 0 if the phase has nothing to do for this cloth
+     */
+    virtual size_t getNumPhaseTasks(int phase) = 0;
+
+    /**
+     * Runs one task of a phase of a step. Running all the tasks of the STEP_NUM_PHASES phases in order with the
+     * same input is the same as step(), but lets a scheduler interleave the phases of different cloths.
+     * @param phase one of the STEP_PHASE_* phases
+     * @param input forces, sweeps and colliders of the step
+     * @param task index of the task
+     * @param num_tasks number of tasks the phase is split into, as returned by getNumPhaseTasks
+     */
+    virtual void stepPhase(int phase, const StepInput &input, size_t task = 0, size_t num_tasks = 1) = 0;
+};
+
+/**
+ * Implementation of the cloth for one storage precision. Sums over many particles, such as
+ * the energy of the tiles, are accumulated in double whatever the storage precision.
+ * @tparam Real scalar type in which the particles and constraints are stored
+ */
+template<typename Real>
+class ClothT : public Cloth {
+    typedef typename Vector3<Real>::type Vec3;
+    typedef ParticleT<Real> ParticleType;
+    typedef ConstraintT<Real> ConstraintType;
+    typedef void (ClothT::*StepKernel)(const StepInput &);
+
+    /**
+     * A particle touching a sphere or capsule, kept from one step to the next
+     */
+    struct Contact {
+        uint32_t particle; //index of the particle, row by row
+        uint32_t collider; //index of the collider in the step input
+        Vec3 anchor; //where the particle touched the collider, seen from the first end of its segment
+    };
+
     dvec3 position; //position of the top left end of the cloth
     double height, width; //height and width of the cloth
     unsigned long num_row, num_col; //number of rows and columns of particles respectively
     double distance_row, distance_col; //rest distance between adjacent particles in a row and in a column respectively
-    vector<vector<Particle> > particles;
-    vector<vector<Particle *> > triangles;
-    vector<Constraint> constraints;
+    vector<vector<ParticleType> > particles;
+    vector<vector<ParticleType *> > triangles;
+    vector<ConstraintType> constraints;
+    vector<array<long, 2> > constraint_triangles; //triangles which have the constraint as an edge (-1 if none)
+    vector<array<long, 3> > triangle_constraints; //constraints which form the edges of each triangle (-1 if none)
+    vector<bool> triangle_primary; //whether the triangle is drawn in the primary or the secondary color
+    SimulationParameters params; //settings of the solver
+    unsigned long tile_rows, tile_cols; //number of tiles along the columns and rows of particles
+    vector<double> tile_energy; //mean squared displacement of the particles of each tile in the last step
+    vector<int> tile_quiet_frames; //number of consecutive frames for which each tile has been at rest
+    vector<bool> tile_asleep; //whether each tile is asleep
+    vector<pair<Vec3, Vec3> > tile_bounds; //bounding box of each tile: of its path over the last step while it is
+                                           //awake, of where it rests while it is asleep
+    vector<array<unsigned long, 2> > constraint_tiles; //tiles of the two particles of each constraint
+    vector<array<unsigned long, 3> > triangle_tiles; //tiles of the three corners of each triangle
+    vector<unsigned long> active_constraints; //constraints with at least one particle in an awake tile
+    bool active_dirty; //whether the active constraints have to be collected again
+    vector<uint32_t> export_order; //index of each particle of an imported mesh before reordering, empty for a grid
+    vector<float> gust_points, gusts; //centroids of the awake triangles and the gusts there, 4 floats each
+    vector<Vec3> air_forces; //force of the air on each corner of each triangle
+    vector<float> mesh_points, mesh_distances, mesh_gradients; //particles near a mesh collider, 4 floats each
+    vector<unsigned long> mesh_tiles; //tiles whose particles are in mesh_points, in order
+    vector<uint32_t> corner_offsets; //start of the triangles around each particle in corner_triangles, row by row
+    vector<uint32_t> corner_triangles; //triangles around each particle
+    bool corners_dirty; //whether the triangles around the particles have to be collected again
+    vector<Contact> contacts; //particles which touched a sphere or capsule in the last step, by collider
+    vector<Contact> next_contacts; //contacts found in the current step
+    vector<uint32_t> contact_marks; //1 + index of the collider each particle was resolved against from the cache
+
+    /**
+     * Adds a triangle along with the constraints which form its edges
+     * @param triangle the three particles of the triangle
+     * @param edges indices of the constraints along the edges of the triangle (-1 if none)
+     * @param primary whether the triangle is drawn in the primary color
+     * @param tiles tiles of the three particles of the triangle
+     */
+    void addTriangle(const vector<ParticleType *> &triangle, array<long, 3> edges, bool primary,
+                     array<unsigned long, 3> tiles) {
+        long t = triangles.size();
+        corners_dirty = true;
+        triangles.push_back(triangle);
+        triangle_constraints.push_back(edges);
+        triangle_primary.push_back(primary);
+        triangle_tiles.push_back(tiles);
+        for (int k = 0; k < 3; ++k) {
+            if (edges[k] >= 0)
+                constraint_triangles[edges[k]][constraint_triangles[edges[k]][0] < 0 ? 0 : 1] = t;
+        }
+    }
+
+    /**
+     * Removes a triangle in O(1) by moving the last triangle into its slot.
+     * The links between the constraints and the moved triangle are patched up.
+     * @param t index of the triangle to be removed
+     */
+    void removeTriangle(long t) {
+        long last = triangles.size() - 1;
+        corners_dirty = true;
+        for (int k = 0; k < 3; ++k) {
+            long e = triangle_constraints[t][k];
+            if (e >= 0)
+                replace(constraint_triangles[e].begin(), constraint_triangles[e].end(), t, -1L);
+        }
+        if (t != last) {
+            for (int k = 0; k < 3; ++k) {
+                long e = triangle_constraints[last][k];
+                if (e >= 0)
+                    replace(constraint_triangles[e].begin(), constraint_triangles[e].end(), last, t);
+            }
+            triangles[t].swap(triangles[last]);
+            triangle_constraints[t] = triangle_constraints[last];
+            triangle_primary[t] = triangle_primary[last];
+            triangle_tiles[t] = triangle_tiles[last];
+        }
+        triangles.pop_back();
+        triangle_constraints.pop_back();
+        triangle_primary.pop_back();
+        triangle_tiles.pop_back();
+    }
+
+    /**
+     * Removes a constraint in O(1) by moving the last constraint into its slot.
+     * The triangles which have the constraint as an edge are split off the cloth.
+     * @param c index of the constraint to be removed
+     */
+    void removeConstraint(long c) {
+        while (constraint_triangles[c][0] >= 0 || constraint_triangles[c][1] >= 0)
+            removeTriangle(max(constraint_triangles[c][0], constraint_triangles[c][1]));
+        long last = constraints.size() - 1;
+        if (c != last) {
+            for (int k = 0; k < 2; ++k) {
+                long t = constraint_triangles[last][k];
+                if (t >= 0)
+                    replace(triangle_constraints[t].begin(), triangle_constraints[t].end(), last, c);
+            }
+            constraints[c] = constraints[last];
+            constraint_triangles[c] = constraint_triangles[last];
+            constraint_tiles[c] = constraint_tiles[last];
+        }
+        constraints.pop_back();
+        constraint_triangles.pop_back();
+        constraint_tiles.pop_back();
+        active_dirty = true;
+    }
+
+    /**
+     * Tears all the constraints which are stretched beyond the tear ratio.
+     * The constraints are visited from the back so that the constraint swapped into
+     * a freed slot has already been checked. Nothing is allocated.
+     */
+    void tear() {
+        for (long c = (long) constraints.size() - 1; c >= 0; --c) {
+            if (constraints[c].isOverstretched(params.tear_ratio))
+                removeConstraint(c);
+        }
+    }
+
+    /**
+     * Returns the tile which the particle at index i,j belongs to
+     * @param i Row number of the particle
+     * @param j Column number of the particle
+     * @return index of the tile
+     */
+    unsigned long tileOf(unsigned long i, unsigned long j) {
+        return (i / SLEEP_TILE_SIZE) * tile_cols + j / SLEEP_TILE_SIZE;
+    }
+
+    /**
+     * Checks whether a triangle lies entirely in sleeping tiles, in which case it neither moves nor feels the air
+     * @param t index of the triangle
+     * @return true if the tiles of all three of its particles are asleep
+     */
+    bool triangleAsleep(size_t t) const {
+        const array<unsigned long, 3> &tiles = triangle_tiles[t];
+        return tile_asleep[tiles[0]] && tile_asleep[tiles[1]] && tile_asleep[tiles[2]];
+    }
+
+    /**
+     * Calls the given function for every particle of a tile
+     * @param t index of the tile
+     * @param f function taking a reference to the particle
+     */
+    template<typename F>
+    void forEachParticleInTile(unsigned long t, F f) {
+        unsigned long row_begin = (t / tile_cols) * SLEEP_TILE_SIZE;
+        unsigned long col_begin = (t % tile_cols) * SLEEP_TILE_SIZE;
+        unsigned long row_end = min(row_begin + SLEEP_TILE_SIZE, num_col);
+        unsigned long col_end = min(col_begin + SLEEP_TILE_SIZE, num_row);
+        for (unsigned long i = row_begin; i < row_end; ++i) {
+            for (unsigned long j = col_begin; j < col_end; ++j) {
+                f(particles[i][j]);
+            }
+        }
+    }
+
+    /**
+     * Calls the given function for every particle of a tile along with its index
+     * @param t index of the tile
+     * @param f function taking a reference to the particle and its index, row by row
+     */
+    template<typename F>
+    void forEachIndexedParticleInTile(unsigned long t, F f) {
+        unsigned long row_begin = (t / tile_cols) * SLEEP_TILE_SIZE;
+        unsigned long col_begin = (t % tile_cols) * SLEEP_TILE_SIZE;
+        unsigned long row_end = min(row_begin + SLEEP_TILE_SIZE, num_col);
+        unsigned long col_end = min(col_begin + SLEEP_TILE_SIZE, num_row);
+        for (unsigned long i = row_begin; i < row_end; ++i) {
+            for (unsigned long j = col_begin; j < col_end; ++j) {
+                f(particles[i][j], (uint32_t) (i * num_row + j));
+            }
+        }
+    }
+
+    /**
+     * Divides the particles into square tiles which can fall asleep independently
+     */
+    void initTiles() {
+        tile_rows = (num_col + SLEEP_TILE_SIZE - 1) / SLEEP_TILE_SIZE;
+        tile_cols = (num_row + SLEEP_TILE_SIZE - 1) / SLEEP_TILE_SIZE;
+        tile_energy.assign(tile_rows * tile_cols, 0.0);
+        tile_quiet_frames.assign(tile_rows * tile_cols, 0);
+        tile_asleep.assign(tile_rows * tile_cols, false);
+        tile_bounds.resize(tile_rows * tile_cols);
+    }
+
+    /**
+     * Adds a constraint between the particles at the given indices
+     * @param i1 Row number of the first particle
+     * @param j1 Column number of the first particle
+     * @param i2 Row number of the second particle
+     * @param j2 Column number of the second particle
+     */
+    void addConstraint(unsigned long i1, unsigned long j1, unsigned long i2, unsigned long j2) {
+        constraints.push_back(ConstraintType(particles[i1][j1], particles[i2][j2]));
+        constraint_tiles.push_back({{tileOf(i1, j1), tileOf(i2, j2)}});
+    }
+
+    /**
+     * Puts a tile to sleep. Its particles are brought to rest and pinned in place, and its
+     * bounding box is recorded so that contacts can wake it up again.
+     * @param t index of the tile
+     */
+    void sleepTile(unsigned long t) {
+        Vec3 low(numeric_limits<Real>::max()), high(-numeric_limits<Real>::max());
+        forEachParticleInTile(t, [&](ParticleType &p) {
+            p.sleep();
+            low = glm::min(low, p.getCurrentPos());
+            high = glm::max(high, p.getCurrentPos());
+        });
+        tile_bounds[t] = make_pair(low, high);
+        tile_asleep[t] = true;
+        active_dirty = true;
+    }
+
+    /**
+     * Wakes a sleeping tile. The forces its particles received from neighbouring
+     * tiles while asleep are discarded.
+     * @param t index of the tile
+     */
+    void wakeTile(unsigned long t) {
+        forEachParticleInTile(t, [](ParticleType &p) {
+            p.wake();
+        });
+        tile_asleep[t] = false;
+        tile_quiet_frames[t] = 0;
+        active_dirty = true;
+    }
+
+    /**
+     * Wakes the tiles next to tiles which are moving and puts tiles which have been
+     * at rest for long enough to sleep. Next to means next to in the grid of tiles, or sharing a triangle,
+     * which for an imported mesh links tiles which are far apart along the curve of its particles.
+     */
+    void updateSleepingTiles() {
+        for (unsigned long t = 0; t < tile_asleep.size(); ++t) {
+            if (tile_asleep[t] || tile_energy[t] < params.wake_energy)
+                continue;
+            long ti = t / tile_cols, tj = t % tile_cols;
+            for (long ni = max(ti - 1, 0L); ni <= min(ti + 1, (long) tile_rows - 1); ++ni) {
+                for (long nj = max(tj - 1, 0L); nj <= min(tj + 1, (long) tile_cols - 1); ++nj) {
+                    if (tile_asleep[ni * tile_cols + nj])
+                        wakeTile(ni * tile_cols + nj);
+                }
+            }
+        }
+        for (const array<unsigned long, 3> &tiles : triangle_tiles) {
+            bool moving = false;
+            for (unsigned long t : tiles)
+                moving = moving || (!tile_asleep[t] && tile_energy[t] >= params.wake_energy);
+            for (unsigned long t : tiles) {
+                if (moving && tile_asleep[t])
+                    wakeTile(t);
+            }
+        }
+        for (unsigned long t = 0; t < tile_asleep.size(); ++t) {
+            if (tile_asleep[t])
+                continue;
+            if (tile_energy[t] >= params.sleep_energy)
+                tile_quiet_frames[t] = 0;
+            else if (++tile_quiet_frames[t] >= params.sleep_frames)
+                sleepTile(t);
+        }
+    }
+
+    /**
+     * Collects the constraints which have at least one particle in an awake tile
+     */
+    void collectActiveConstraints() {
+        active_constraints.clear();
+        for (unsigned long c = 0; c < constraints.size(); ++c) {
+            if (!tile_asleep[constraint_tiles[c][0]] || !tile_asleep[constraint_tiles[c][1]])
+                active_constraints.push_back(c);
+        }
+        active_dirty = false;
+    }
+
+    /**
+     * Collects the triangles around each particle, from which the particle gathers the forces of the air
+     */
+    void collectCorners() {
+        unsigned long num_particles = num_col * num_row;
+        vector<uint32_t> corner_particles(3 * triangles.size());
+        corner_offsets.assign(num_particles + 1, 0);
+        for (size_t t = 0; t < triangles.size(); ++t) {
+            for (int k = 0; k < 3; ++k) {
+                corner_particles[3 * t + k] = particleIndex(triangles[t][k]);
+                ++corner_offsets[corner_particles[3 * t + k] + 1];
+            }
+        }
+        partial_sum(corner_offsets.begin(), corner_offsets.end(), corner_offsets.begin());
+        vector<uint32_t> next(corner_offsets.begin(), corner_offsets.end() - 1);
+        corner_triangles.resize(corner_particles.size());
+        for (size_t c = 0; c < corner_particles.size(); ++c)
+            corner_triangles[next[corner_particles[c]]++] = c / 3;
+        corners_dirty = false;
+    }
+
+    /**
+     * Returns the index of a particle, counting row by row
+     * @param p the particle
+     * @return the index
+     */
+    unsigned long particleIndex(const ParticleType *p) {
+        for (unsigned long i = 0; i < num_col; ++i) {
+            if (!less<const ParticleType *>()(p, particles[i].data()) &&
+                less<const ParticleType *>()(p, particles[i].data() + num_row))
+                return i * num_row + (p - particles[i].data());
+        }
+        return num_col * num_row;
+    }
+
+    /**
+     * Replaces the particles, constraints, triangles and tiles with the ones of a checkpoint
+     * of a cloth of the same size and precision
+     * @param checkpoint the checkpoint
+     * @param error set to a description of the problem if the checkpoint is inconsistent
+     * @return true if the state was restored
+     */
+    bool restoreState(const CheckpointReader &checkpoint, string &error) {
+        unsigned long num_particles = num_col * num_row, num_tiles = tile_asleep.size();
+        size_t count, num_constraints, num_triangles;
+        const ParticleType *stored = checkpoint.array<ParticleType>(CHECKPOINT_PARTICLES, count);
+        const ConstraintCheckpoint *records = checkpoint.array<ConstraintCheckpoint>(CHECKPOINT_CONSTRAINTS,
+                                                                                   num_constraints);
+        const array<uint32_t, 3> *corners = checkpoint.array<array<uint32_t, 3> >(CHECKPOINT_TRIANGLES,
+                                                                                num_triangles);
+        vector<uint8_t> primary, asleep;
+        if (!stored || count != num_particles || !records || !corners ||
+            !checkpoint.read(CHECKPOINT_CONSTRAINT_TRIANGLES, constraint_triangles) ||
+            !checkpoint.read(CHECKPOINT_TRIANGLE_CONSTRAINTS, triangle_constraints) ||
+            !checkpoint.read(CHECKPOINT_TRIANGLE_PRIMARY, primary) ||
+            !checkpoint.read(CHECKPOINT_TILE_ASLEEP, asleep) ||
+            !checkpoint.read(CHECKPOINT_TILE_QUIET_FRAMES, tile_quiet_frames) ||
+            !checkpoint.read(CHECKPOINT_TILE_BOUNDS, tile_bounds) ||
+            constraint_triangles.size() != num_constraints || triangle_constraints.size() != num_triangles ||
+            primary.size() != num_triangles ||
+            asleep.size() != num_tiles || tile_quiet_frames.size() != num_tiles || tile_bounds.size() != num_tiles) {
+            error = "checkpoint does not match the size of the cloth";
+            return false;
+        }
+        //the links between constraints and triangles must stay in range, whatever the file says
+        for (size_t c = 0; c < num_constraints; ++c) {
+            bool valid = records[c].first < num_particles && records[c].second < num_particles;
+            for (int k = 0; k < 2; ++k)
+                valid = valid && constraint_triangles[c][k] >= -1 && constraint_triangles[c][k] < (long) num_triangles;
+            if (!valid) {
+                error = "checkpoint has an invalid constraint";
+                return false;
+            }
+        }
+        for (size_t t = 0; t < num_triangles; ++t) {
+            bool valid = true;
+            for (int k = 0; k < 3; ++k) {
+                valid = valid && corners[t][k] < num_particles && triangle_constraints[t][k] >= -1 &&
+                        triangle_constraints[t][k] < (long) num_constraints;
+            }
+            if (!valid) {
+                error = "checkpoint has an invalid triangle";
+                return false;
+            }
+        }
+
+        for (unsigned long i = 0; i < num_col; ++i)
+            memcpy(particles[i].data(), stored + i * num_row, num_row * sizeof(ParticleType));
+        constraints.clear();
+        constraint_tiles.clear();
+        for (size_t c = 0; c < num_constraints; ++c) {
+            unsigned long i1 = records[c].first / num_row, j1 = records[c].first % num_row;
+            unsigned long i2 = records[c].second / num_row, j2 = records[c].second % num_row;
+            constraints.push_back(ConstraintType(particles[i1][j1], particles[i2][j2], records[c].rest_length));
+            constraint_tiles.push_back({{tileOf(i1, j1), tileOf(i2, j2)}});
+        }
+        triangles.assign(num_triangles, vector<ParticleType *>(3));
+        triangle_tiles.resize(num_triangles);
+        for (size_t t = 0; t < num_triangles; ++t) {
+            for (int k = 0; k < 3; ++k) {
+                triangles[t][k] = &particles[corners[t][k] / num_row][corners[t][k] % num_row];
+                triangle_tiles[t][k] = tileOf(corners[t][k] / num_row, corners[t][k] % num_row);
+            }
+        }
+        triangle_primary.assign(primary.begin(), primary.end());
+        tile_asleep.assign(asleep.begin(), asleep.end());
+        active_dirty = true;
+        corners_dirty = true;
+        if (checkpoint.read(CHECKPOINT_EXPORT_ORDER, export_order)) {
+            vector<bool> seen(num_particles, false);
+            for (uint32_t p : export_order) {
+                if (export_order.size() != num_particles || p >= num_particles || seen[p]) {
+                    error = "checkpoint has an invalid particle order";
+                    return false;
+                }
+                seen[p] = true;
+            }
+        }
+        if (!checkpoint.read(CHECKPOINT_CONTACTS, contacts))
+            contacts.clear();
+        for (size_t k = 0; k < contacts.size(); ++k) {
+            if (contacts[k].particle >= num_particles || (k > 0 && contacts[k].collider < contacts[k - 1].collider)) {
+                error = "checkpoint has an invalid contact";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Satisfies the constraints, puts settled tiles to sleep and integrates the particles
+     * @tparam Iterations number of sweeps over the constraints, STEP_DYNAMIC_ITERATIONS to use the argument
+     * @tparam Damped whether the velocities are damped
+     * @param iterations number of sweeps over the constraints if they are not fixed at compile time
+     */
+    template<int Iterations, bool Damped>
+    void simulate(int iterations) {
+        satisfyConstraints<Iterations>(iterations);
+        integrateParticles<Damped>();
+    }
+
+    /**
+     * Tears overstretched constraints and satisfies the constraints of the awake tiles
+     * @tparam Iterations number of sweeps over the constraints, STEP_DYNAMIC_ITERATIONS to use the argument
+     * @param iterations number of sweeps over the constraints if they are not fixed at compile time
+     */
+    template<int Iterations>
+    void satisfyConstraints(int iterations) {
+        if (params.tearing) {
+            PROFILE_SCOPE("tearing");
+            tear();
+        }
+        if (params.sleeping && active_dirty)
+            collectActiveConstraints();
+
+        // Satisfying the constraints
+        {
+            PROFILE_SCOPE("constraints");
+            const int sweeps = Iterations == STEP_DYNAMIC_ITERATIONS ? iterations : Iterations;
+            for (int i = 0; i < sweeps; i++) // iterating over the constraints multiple times
+            {
+                if (params.sleeping) {
+                    for (int j = 0; j < active_constraints.size(); ++j) {
+                        constraints[active_constraints[j]].correctParticlePositions(); // skipping sleeping tiles
+                    }
+                } else {
+                    for (int j = 0; j < constraints.size(); ++j) {
+                        constraints[j].correctParticlePositions(); // correct each particle pair position (constraint satisfaction)
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Puts settled tiles to sleep and integrates the particles of the awake tiles
+     * @tparam Damped whether the velocities are damped
+     */
+    template<bool Damped>
+    void integrateParticles() {
+        // Measuring how much each awake tile moved since the last step.
+        // Tiles are put to sleep before integrating so that they rest where the constraints hold.
+        if (params.sleeping) {
+            PROFILE_SCOPE("sleeping");
+            for (unsigned long t = 0; t < tile_asleep.size(); ++t) {
+                if (tile_asleep[t])
+                    continue;
+                double energy = 0;
+                unsigned long count = 0;
+                forEachParticleInTile(t, [&](ParticleType &p) {
+                    Vec3 displacement = p.getCurrentPos() - p.getOldPos();
+                    energy += dot(displacement, displacement);
+                    ++count;
+                });
+                tile_energy[t] = energy / count;
+            }
+            updateSleepingTiles();
+        }
+
+        // Now updating the positions of the particles of the awake tiles, and the boxes of their paths which
+        // the collisions are culled with
+        PROFILE_SCOPE("integration");
+        for (unsigned long t = 0; t < tile_asleep.size(); ++t) {
+            if (tile_asleep[t])
+                continue;
+            Vec3 low(numeric_limits<Real>::max()), high(-numeric_limits<Real>::max());
+            forEachParticleInTile(t, [&](ParticleType &p) {
+                p.template timeStep<Damped>(params.damping, params.time_step);
+                low = glm::min(low, glm::min(p.getOldPos(), p.getCurrentPos()));
+                high = glm::max(high, glm::max(p.getOldPos(), p.getCurrentPos()));
+            });
+            tile_bounds[t] = make_pair(low, high);
+        }
+    }
+
+    /**
+     * Returns the step kernel of a fixed number of sweeps for a set of features
+     * @tparam Iterations number of sweeps over the constraints
+     * @param features the STEP_* features which are enabled
+     * @return the kernel
+     */
+    template<int Iterations>
+    static StepKernel kernelFor(int features) {
+        static const StepKernel kernels[STEP_NUM_FEATURE_SETS] = {
+                &ClothT::stepKernel<Iterations, 0>, &ClothT::stepKernel<Iterations, 1>,
+                &ClothT::stepKernel<Iterations, 2>, &ClothT::stepKernel<Iterations, 3>,
+                &ClothT::stepKernel<Iterations, 4>, &ClothT::stepKernel<Iterations, 5>,
+                &ClothT::stepKernel<Iterations, 6>, &ClothT::stepKernel<Iterations, 7>};
+        return kernels[features];
+    }
+
+    /**
+     * Picks the step kernel for a number of sweeps and a set of features. The sweep counts
+     * listed here are specialized; any other count uses the kernel which reads it at run time.
+     * @param iterations number of sweeps over the constraints
+     * @param features the STEP_* features which are enabled
+     * @return the kernel
+     */
+    static StepKernel selectKernel(int iterations, int features) {
+        switch (iterations) {
+            case 2:
+                return kernelFor<2>(features);
+            case 4:
+                return kernelFor<4>(features);
+            case 8:
+                return kernelFor<8>(features);
+            case 15:
+                return kernelFor<15>(features);
+            default:
+                return kernelFor<STEP_DYNAMIC_ITERATIONS>(features);
+        }
+    }
+
+    /**
+     * Constructor to initialize the particles of an imported mesh, stored as a single row in the order of the
+     * mesh, without constraints or triangles
+     * @param positions positions of the particles relative to pos
+     * @param pos displacement of the mesh
+     * @param mass mass of each particle
+     * @param params settings of the solver
+     */
+    ClothT(const vector<dvec3> &positions, dvec3 pos, double mass, const SimulationParameters &params) {
+        this->params = params;
+        position = pos;
+        num_col = 1;
+        num_row = positions.size();
+        dvec3 low(numeric_limits<double>::max()), high(-numeric_limits<double>::max());
+        for (const dvec3 &p : positions) {
+            low = glm::min(low, p);
+            high = glm::max(high, p);
+        }
+        height = positions.empty() ? 0 : high.y - low.y;
+        width = positions.empty() ? 0 : high.x - low.x;
+        distance_col = distance_row = 0; //the particles are not on a grid
+        particles.resize(1);
+        particles[0].reserve(num_row);
+        for (const dvec3 &p : positions)
+            particles[0].push_back(ParticleType(Vec3(p + position), mass));
+        //the particles are in a cache friendly order, so runs of SLEEP_TILE_SIZE of them are close on the cloth
+        initTiles();
+        active_dirty = true;
+        corners_dirty = true;
+    }
 
 public:
     /**
@@ -41,8 +853,11 @@ public:
      * @param num_col number of particles in a column
      * @param num_row number of particles in a row
      * @param mass mass of each particle
+     * @param params settings of the solver
      */
-    Cloth(dvec3 pos, double height, double width, unsigned long num_col, unsigned long num_row, double mass) {
+    ClothT(dvec3 pos, double height, double width, unsigned long num_col, unsigned long num_row, double mass,
+          const SimulationParameters &params = SimulationParameters()) {
+        this->params = params;
         position = pos;
         this->height = height;
         this->width = width;
@@ -56,48 +871,198 @@ public:
         for (int i = 0; i < num_col; ++i) {
             for (int j = 0; j < num_row; ++j) {
                 particles[i].push_back(
-                        Particle(dvec3((double) j * distance_col, -(double) i * distance_row, 0) + position, mass));
+                        ParticleType(Vec3(dvec3((double) j * distance_col, -(double) i * distance_row, 0) + position),
+                                     mass));
             }
         }
 
+        initTiles();
+
         //add structural constraints between adjacent particles,
         //shear constraints between diagonal particles and
         //bending constraints between a particle and the particle
         //at a distance of 2 along each row, column and diagonal
-        //Also, create triangles for drawing and adding wind
+        //The indices of the constraints which form triangle edges are
+        //remembered so that the triangles can be linked to them
+        vector<long> row_edge(num_col * num_row, -1), col_edge(num_col * num_row, -1), diag_edge(
+                num_col * num_row, -1);
         for (int i = 0; i < num_col; ++i) {
             for (int j = 0; j < num_row; ++j) {
-                if (j < num_row - 1)
-                    constraints.push_back(Constraint(particles[i][j], particles[i][j + 1]));
-                if (i < num_col - 1)
-                    constraints.push_back(Constraint(particles[i][j], particles[i + 1][j]));
+                if (j < num_row - 1) {
+                    row_edge[i * num_row + j] = constraints.size();
+                    addConstraint(i, j, i, j + 1);
+                }
+                if (i < num_col - 1) {
+                    col_edge[i * num_row + j] = constraints.size();
+                    addConstraint(i, j, i + 1, j);
+                }
                 if (j < num_row - 1 && i < num_col - 1) {
-                    constraints.push_back(Constraint(particles[i][j], particles[i + 1][j + 1]));
-                    constraints.push_back(Constraint(particles[i + 1][j], particles[i][j + 1]));
-
-                    //creating triangles
-                    vector<Particle *> tri1, tri2;
-                    tri1.push_back(&particles[i + 1][j]);
-                    tri1.push_back(&particles[i][j]);
-                    tri1.push_back(&particles[i][j + 1]);
-
-                    tri2.push_back(&particles[i + 1][j + 1]);
-                    tri2.push_back(&particles[i + 1][j]);
-                    tri2.push_back(&particles[i][j + 1]);
-
-                    triangles.push_back(tri1);
-                    triangles.push_back(tri2);
+                    addConstraint(i, j, i + 1, j + 1);
+                    diag_edge[i * num_row + j] = constraints.size();
+                    addConstraint(i + 1, j, i, j + 1);
                 }
                 if (j < num_row - 2)
-                    constraints.push_back(Constraint(particles[i][j], particles[i][j + 2]));
+                    addConstraint(i, j, i, j + 2);
                 if (i < num_col - 2)
-                    constraints.push_back(Constraint(particles[i][j], particles[i + 2][j]));
+                    addConstraint(i, j, i + 2, j);
                 if (j < num_row - 2 && i < num_col - 2) {
-                    constraints.push_back(Constraint(particles[i][j], particles[i + 2][j + 2]));
-                    constraints.push_back(Constraint(particles[i + 2][j], particles[i][j + 2]));
+                    addConstraint(i, j, i + 2, j + 2);
+                    addConstraint(i + 2, j, i, j + 2);
                 }
             }
         }
+        constraint_triangles.assign(constraints.size(), {{-1, -1}});
+        active_constraints.reserve(constraints.size());
+        active_dirty = true;
+        corners_dirty = true;
+
+        //create triangles for drawing and adding wind
+        for (int i = 0; i < num_col - 1; ++i) {
+            for (int j = 0; j < num_row - 1; ++j) {
+                vector<ParticleType *> tri1, tri2;
+                tri1.push_back(&particles[i + 1][j]);
+                tri1.push_back(&particles[i][j]);
+                tri1.push_back(&particles[i][j + 1]);
+
+                tri2.push_back(&particles[i + 1][j + 1]);
+                tri2.push_back(&particles[i + 1][j]);
+                tri2.push_back(&particles[i][j + 1]);
+
+                addTriangle(tri1, {{row_edge[i * num_row + j], col_edge[i * num_row + j],
+                                    diag_edge[i * num_row + j]}}, true,
+                            {{tileOf(i + 1, j), tileOf(i, j), tileOf(i, j + 1)}});
+                addTriangle(tri2, {{row_edge[(i + 1) * num_row + j], col_edge[i * num_row + j + 1],
+                                    diag_edge[i * num_row + j]}}, false,
+                            {{tileOf(i + 1, j + 1), tileOf(i + 1, j), tileOf(i, j + 1)}});
+            }
+        }
+    }
+
+    /**
+     * Constructor to create a garment from an imported triangle mesh. Every edge of the mesh becomes a
+     * structural constraint and every cross edge, joining the particles opposite an edge, a bending constraint.
+     * The rest lengths are taken from the positions in the mesh. Consecutive groups of the mesh alternate
+     * between the primary and the secondary color. The constraints are sorted by their first particle, so that
+     * a sweep over them walks through the particles in the order the mesh stores them.
+     * @param mesh the mesh, with its edges built
+     * @param pos displacement of the mesh
+     * @param mass mass of each particle
+     * @param params settings of the solver
+     */
+    ClothT(const ClothMesh &mesh, dvec3 pos, double mass, const SimulationParameters &params = SimulationParameters())
+            : ClothT(mesh.positions, pos, mass, params) {
+        export_order = mesh.original_of_particle;
+        //(first particle, second particle, index among the edges followed by the cross edges)
+        vector<tuple<uint32_t, uint32_t, size_t> > sorted;
+        sorted.reserve(mesh.edges.size() + mesh.cross_edges.size());
+        for (size_t e = 0; e < mesh.edges.size(); ++e)
+            sorted.push_back(make_tuple(mesh.edges[e][0], mesh.edges[e][1], e));
+        for (size_t e = 0; e < mesh.cross_edges.size(); ++e) {
+            const array<uint32_t, 2> &edge = mesh.cross_edges[e];
+            sorted.push_back(make_tuple(std::min(edge[0], edge[1]), std::max(edge[0], edge[1]),
+                                        mesh.edges.size() + e));
+        }
+        sort(sorted.begin(), sorted.end());
+        vector<long> constraint_of_edge(mesh.edges.size());
+        constraints.reserve(sorted.size());
+        constraint_tiles.reserve(sorted.size());
+        for (const tuple<uint32_t, uint32_t, size_t> &edge : sorted) {
+            if (get<2>(edge) < mesh.edges.size())
+                constraint_of_edge[get<2>(edge)] = constraints.size();
+            addConstraint(0, get<0>(edge), 0, get<1>(edge));
+        }
+        constraint_triangles.assign(constraints.size(), {{-1, -1}});
+        active_constraints.reserve(constraints.size());
+
+        //link every triangle to the constraints along its edges; an edge of more than two triangles
+        //is only linked to the first two
+        vector<array<long, 3> > edges(mesh.triangles.size(), {{-1, -1, -1}});
+        for (size_t e = 0; e < mesh.edges.size(); ++e) {
+            for (uint32_t t : mesh.edge_triangles[e]) {
+                if (t == CLOTH_MESH_NONE)
+                    continue;
+                for (int k = 0; k < 3; ++k) {
+                    uint32_t a = mesh.triangles[t][k], b = mesh.triangles[t][(k + 1) % 3];
+                    if (std::min(a, b) == mesh.edges[e][0] && std::max(a, b) == mesh.edges[e][1])
+                        edges[t][k] = constraint_of_edge[e];
+                }
+            }
+        }
+        triangles.reserve(mesh.triangles.size());
+        for (size_t t = 0; t < mesh.triangles.size(); ++t) {
+            const array<uint32_t, 3> &corners = mesh.triangles[t];
+            addTriangle({&particles[0][corners[0]], &particles[0][corners[1]], &particles[0][corners[2]]}, edges[t],
+                        mesh.groups[t] % 2 == 0, {{tileOf(0, corners[0]), tileOf(0, corners[1]), tileOf(0, corners[2])}});
+        }
+    }
+
+    /**
+     * Enables or disables tearing of the cloth
+     * @param enable whether overstretched constraints should tear
+     * @param ratio ratio of current length to rest length beyond which a constraint tears
+     */
+    void setTearing(bool enable, double ratio = DEFAULT_TEAR_RATIO) {
+        params.tearing = enable;
+        params.tear_ratio = ratio;
+    }
+
+    /**
+     * Returns whether tearing is enabled
+     * @return true if overstretched constraints tear
+     */
+    bool isTearing() {
+        return params.tearing;
+    }
+
+    /**
+     * Enables or disables sleeping of the regions of the cloth which have come to rest
+     * @param enable whether settled tiles should be put to sleep
+     */
+    void setSleeping(bool enable) {
+        params.sleeping = enable;
+        for (unsigned long t = 0; t < tile_asleep.size(); ++t) {
+            if (tile_asleep[t])
+                wakeTile(t);
+            tile_quiet_frames[t] = 0;
+        }
+    }
+
+    /**
+     * Returns whether sleeping is enabled
+     * @return true if settled tiles are put to sleep
+     */
+    bool isSleeping() {
+        return params.sleeping;
+    }
+
+    /**
+     * Returns the number of tiles which are currently asleep
+     * @return the number of sleeping tiles
+     */
+    unsigned long getNumSleepingTiles() {
+        return count(tile_asleep.begin(), tile_asleep.end(), true);
+    }
+
+    /**
+     * Returns the number of constraints which are still intact
+     * @return the number of constraints
+     */
+    unsigned long getNumConstraints() {
+        return constraints.size();
+    }
+
+    /**
+     * Returns how far the most stretched intact constraint is beyond its rest length
+     * @return the largest ratio of current length to rest length minus one, negative if all are compressed
+     */
+    double getMaxStretch() {
+        double stretch = -1;
+        for (ConstraintType &constraint : constraints) {
+            pair<ParticleType *, ParticleType *> ends = constraint.getParticles();
+            double current = length(dvec3(ends.second->getCurrentPos() - ends.first->getCurrentPos()));
+            stretch = std::max(stretch, current / (double) constraint.getRestLength() - 1);
+        }
+        return stretch;
     }
 
     /**
@@ -109,34 +1074,87 @@ public:
         particles[i][j].makeImmovable();
     }
 
+    /**
+     * Copies the positions of all the particles, row by row, in double precision. The particles of an imported
+     * mesh are put back into the order of the mesh file.
+     * @param positions filled with the positions
+     */
+    void getPositions(vector<dvec3> &positions) {
+        positions.resize(num_col * num_row);
+        for (unsigned long i = 0; i < num_col; ++i) {
+            for (unsigned long j = 0; j < num_row; ++j) {
+                unsigned long index = i * num_row + j;
+                positions[export_order.empty() ? index : export_order[index]] = dvec3(particles[i][j].getCurrentPos());
+            }
+        }
+    }
+
+    /**
+     * Places all the particles without simulating, e.g. at positions played back from a frame cache
+     * @param positions the positions, in the order returned by getPositions
+     * @return false if the number of positions does not match the cloth
+     */
+    bool setPositions(const vector<dvec3> &positions) {
+        if (positions.size() != num_col * num_row)
+            return false;
+        for (unsigned long i = 0; i < num_col; ++i) {
+            for (unsigned long j = 0; j < num_row; ++j) {
+                unsigned long index = i * num_row + j;
+                particles[i][j].placeAt(Vec3(positions[export_order.empty() ? index : export_order[index]]));
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Replays the memory accesses of the loops over the constraints and triangles in one step on a cache model
+     * @param cache the cache model
+     */
+    void traceAccesses(CacheModel &cache) {
+        for (ConstraintType &constraint : constraints) {
+            cache.access(constraint);
+            cache.access(*constraint.getParticles().first);
+            cache.access(*constraint.getParticles().second);
+        }
+        for (size_t t = 0; t < triangles.size(); ++t) {
+            cache.access(triangle_tiles[t]);
+            cache.access(triangles[t].data(), 3 * sizeof(ParticleType *));
+            for (ParticleType *p : triangles[t])
+                cache.access(*p);
+        }
+    }
+
     /**
      * Draws the cloth by dividing it into a set of triangles
      * @param primaryColor primary color of the cloth
      * @param secondaryColor secondary color of the cloth
      */
     void draw(Color primaryColor, Color secondaryColor) {
-        for (int i = 0; i < num_col; ++i) {
-            for (int j = 0; j < num_row; ++j) {
-                particles[i][j].resetNormal();
+        {
+            PROFILE_SCOPE("normals");
+            for (int i = 0; i < num_col; ++i) {
+                for (int j = 0; j < num_row; ++j) {
+                    particles[i][j].resetNormal();
+                }
             }
-        }
-        //accumulating normal. This leads to a smoother simulation
-        for (int i = 0; i < triangles.size(); ++i) {
-            dvec3 normal = triangleNormal(triangles[i][0]->getCurrentPos(), triangles[i][1]->getCurrentPos(),
-                                          triangles[i][2]->getCurrentPos());
-            for (int j = 0; j < triangles[i].size(); ++j) {
-                triangles[i][j]->updateNormal(normal);
+            //accumulating normal. This leads to a smoother simulation
+            for (int i = 0; i < triangles.size(); ++i) {
+                Vec3 normal = triangleNormal(triangles[i][0]->getCurrentPos(), triangles[i][1]->getCurrentPos(),
+                                             triangles[i][2]->getCurrentPos());
+                for (int j = 0; j < triangles[i].size(); ++j) {
+                    triangles[i][j]->updateNormal(normal);
+                }
             }
         }
 
         glBegin(GL_TRIANGLES);
         for (int i = 0; i < triangles.size(); ++i) {
-            if (i % 2 == 0)
+            if (triangle_primary[i])
                 glColor3d(primaryColor.r, primaryColor.g, primaryColor.b);
             else
                 glColor3d(secondaryColor.r, secondaryColor.g, secondaryColor.b);
             for (int j = 0; j < triangles[i].size(); ++j) {
-                dvec3 normal = normalize(triangles[i][j]->getNormal());
+                Vec3 normal = normalize(triangles[i][j]->getNormal());
                 glNormal3d(normal.x, normal.y, normal.z);
                 glVertex3d(triangles[i][j]->getCurrentPos().x, triangles[i][j]->getCurrentPos().y,
                            triangles[i][j]->getCurrentPos().z);
@@ -145,26 +1163,223 @@ public:
         glEnd();
     }
 
+    /**
+     * Saves the complete state of the cloth: particles, pins, the intact constraints and
+     * triangles, sleeping tiles and solver settings
+     * @param path path of the checkpoint
+     * @param frame current frame of the simulation, stored for resuming
+     * @param error set to a description of the problem if the checkpoint cannot be written
+     * @return true if the checkpoint was written
+     */
+    bool saveCheckpoint(const string &path, unsigned long frame, string &error) {
+        CheckpointWriter checkpoint(CHECKPOINT_MODEL_SPRINGMASS, sizeof(Real));
+        ClothCheckpointInfo info = {num_col, num_row, {position.x, position.y, position.z}, height, width, frame};
+        checkpoint.append(CHECKPOINT_CLOTH, &info, sizeof(info));
+        checkpoint.append(CHECKPOINT_PARAMETERS, &params, sizeof(params));
+        for (unsigned long i = 0; i < num_col; ++i)
+            checkpoint.append(CHECKPOINT_PARTICLES, particles[i]);
+        vector<ConstraintCheckpoint> records(constraints.size());
+        for (size_t c = 0; c < constraints.size(); ++c) {
+            records[c].first = particleIndex(constraints[c].getParticles().first);
+            records[c].second = particleIndex(constraints[c].getParticles().second);
+            records[c].rest_length = constraints[c].getRestLength();
+        }
+        checkpoint.append(CHECKPOINT_CONSTRAINTS, records);
+        checkpoint.append(CHECKPOINT_CONSTRAINT_TRIANGLES, constraint_triangles);
+        vector<array<uint32_t, 3> > corners(triangles.size());
+        for (size_t t = 0; t < triangles.size(); ++t) {
+            for (int k = 0; k < 3; ++k)
+                corners[t][k] = particleIndex(triangles[t][k]);
+        }
+        checkpoint.append(CHECKPOINT_TRIANGLES, corners);
+        checkpoint.append(CHECKPOINT_TRIANGLE_CONSTRAINTS, triangle_constraints);
+        checkpoint.append(CHECKPOINT_TRIANGLE_PRIMARY, vector<uint8_t>(triangle_primary.begin(), triangle_primary.end()));
+        checkpoint.append(CHECKPOINT_TILE_ASLEEP, vector<uint8_t>(tile_asleep.begin(), tile_asleep.end()));
+        checkpoint.append(CHECKPOINT_TILE_QUIET_FRAMES, tile_quiet_frames);
+        checkpoint.append(CHECKPOINT_TILE_BOUNDS, tile_bounds);
+        if (!export_order.empty())
+            checkpoint.append(CHECKPOINT_EXPORT_ORDER, export_order);
+        checkpoint.append(CHECKPOINT_CONTACTS, contacts);
+        return checkpoint.write(path, error);
+    }
+
+    /**
+     * Creates a cloth from a checkpoint which was saved in the precision of this class
+     * @param checkpoint the mapped checkpoint
+     * @param frame set to the frame in which the checkpoint was taken
+     * @param error set to a description of the problem if the checkpoint cannot be used
+     * @return the cloth, nullptr on failure
+     */
+    static ClothT *restore(const CheckpointReader &checkpoint, unsigned long &frame, string &error) {
+        size_t count, num_params;
+        const ClothCheckpointInfo *info = checkpoint.array<ClothCheckpointInfo>(CHECKPOINT_CLOTH, count);
+        const SimulationParameters *stored_params = checkpoint.array<SimulationParameters>(CHECKPOINT_PARAMETERS,
+                                                                                          num_params);
+        if (!info || count != 1 || !stored_params || num_params != 1) {
+            error = "checkpoint was written by an incompatible version of the simulation";
+            return nullptr;
+        }
+        dvec3 position(info->position[0], info->position[1], info->position[2]);
+        ClothT *cloth = info->num_col == 1 ? //an imported mesh, whose constraints and triangles are all restored
+                        new ClothT(vector<dvec3>(info->num_row), position, 1, *stored_params) :
+                        new ClothT(position, info->height, info->width, info->num_col, info->num_row, 1, *stored_params);
+        if (!cloth->restoreState(checkpoint, error)) {
+            delete cloth;
+            return nullptr;
+        }
+        frame = info->frame;
+        return cloth;
+    }
+
+    /**
+     * Returns the settings of the solver
+     * @return the parameters
+     */
+    const SimulationParameters &getParameters() {
+        return params;
+    }
+
     /**
      * Funtion to simulate the cloth by constraint satisfaction and subsequent update of particles
+     * using the number of sweeps given in the parameters
      */
     void simulateCloth() {
-        // Satisfying the constraints
+        simulateCloth(params.constraint_iterations);
+    }
 
-        for (int i = 0; i < CONSTRAINT_ITERATIONS; i++) // iterating over the constraints multiple times
-        {
-            for (int j = 0; j < constraints.size(); ++j) {
-                constraints[j].correctParticlePositions(); // correct each particle pair position (constraint satisfaction)
+    /**
+     * Funtion to simulate the cloth by constraint satisfaction and subsequent update of particles
+     * @param iterations number of sweeps over the constraints
+     */
+    void simulateCloth(int iterations) {
+        simulate<STEP_DYNAMIC_ITERATIONS, true>(iterations);
+    }
+
+    /**
+     * Advances the cloth by one step: applies the forces, satisfies the constraints, integrates
+     * and resolves collisions. The work is done by a kernel specialized for the number of sweeps
+     * and the features the step needs, so that their constants fold and unused branches vanish.
+     * @param input forces, sweeps and colliders of the step
+     */
+    void step(const StepInput &input) {
+        bool colliders = !input.colliders.empty() || !input.meshes.empty();
+        int features = (params.damping != 0 ? STEP_DAMPING : 0) |
+                       (input.wind != dvec3(0) || input.gusts ? STEP_WIND : 0) |
+                       (input.collisions && colliders ? STEP_COLLISIONS : 0);
+        (this->*selectKernel(input.iterations, features))(input);
+    }
+
+    /**
+     * Returns into how many tasks a phase of a step is split: the aerodynamic phases into one task per
+     * AIR_TASK_SIZE triangles or particles, the other phases into a single task
+     * @param phase one of the STEP_PHASE_* phases
+     * @return the number of tasks, 0 if the phase has nothing to do for this cloth
+     */
+    size_t getNumPhaseTasks(int phase) {
+        if (phase == STEP_PHASE_AIR)
+            return isAerodynamic() ? std::max<size_t>((triangles.size() + AIR_TASK_SIZE - 1) / AIR_TASK_SIZE, 1) : 0;
+        if (phase == STEP_PHASE_AIR_FORCES)
+            return isAerodynamic() ? (num_col * num_row + AIR_TASK_SIZE - 1) / AIR_TASK_SIZE : 0;
+        return 1;
+    }
+
+    /**
+     * Runs one task of a phase of a step. Running all the tasks of the STEP_NUM_PHASES phases in order with the
+     * same input is the same as step(), but lets a scheduler interleave the phases of different cloths.
+     * @param phase one of the STEP_PHASE_* phases
+     * @param input forces, sweeps and colliders of the step
+     * @param task index of the task
+     * @param num_tasks number of tasks the phase is split into, as returned by getNumPhaseTasks
+     */
+    void stepPhase(int phase, const StepInput &input, size_t task = 0, size_t num_tasks = 1) {
+        switch (phase) {
+            case STEP_PHASE_FORCES: {
+                PROFILE_SCOPE("forces");
+                applyUniformForceAll(input.gravity);
+                if (isAerodynamic())
+                    prepareAirForces(input);
+                else if (input.wind != dvec3(0) || input.gusts)
+                    applyTriangleNormalForce(input.wind, input.gusts, input.gust_scale);
+                break;
+            }
+            case STEP_PHASE_AIR: {
+                PROFILE_SCOPE("air");
+                //the triangles may have been torn since the tasks were counted
+                computeAirForces(triangles.size() * task / num_tasks, triangles.size() * (task + 1) / num_tasks,
+                                 input);
+                break;
             }
+            case STEP_PHASE_AIR_FORCES: {
+                PROFILE_SCOPE("air");
+                unsigned long num_particles = num_col * num_row;
+                applyAirForces(num_particles * task / num_tasks, num_particles * (task + 1) / num_tasks);
+                break;
+            }
+            case STEP_PHASE_CONSTRAINTS:
+                //the same sweep counts as selectKernel are specialized
+                switch (input.iterations) {
+                    case 2:
+                        satisfyConstraints<2>(2);
+                        break;
+                    case 4:
+                        satisfyConstraints<4>(4);
+                        break;
+                    case 8:
+                        satisfyConstraints<8>(8);
+                        break;
+                    case 15:
+                        satisfyConstraints<15>(15);
+                        break;
+                    default:
+                        satisfyConstraints<STEP_DYNAMIC_ITERATIONS>(input.iterations);
+                        break;
+                }
+                break;
+            case STEP_PHASE_INTEGRATION:
+                if (params.damping != 0)
+                    integrateParticles<true>();
+                else
+                    integrateParticles<false>();
+                break;
+            case STEP_PHASE_COLLISIONS:
+                if (input.collisions) {
+                    PROFILE_SCOPE("collisions");
+                    resolveSweptCollisions(input.colliders);
+                    for (size_t i = 0; i < input.meshes.size(); ++i)
+                        resolveMeshCollision(*input.meshes[i].first, input.meshes[i].second);
+                }
+                break;
+            default:
+                break;
         }
+    }
 
-        // Now updating the positions of the particles
-        for (int i = 0; i < particles.size(); i++) {
-            for (int j = 0; j < particles[i].size(); ++j) {
-                particles[i][j].timeStep();
+    /**
+     * One step of the simulation, see step()
+     * @tparam Iterations number of sweeps over the constraints, STEP_DYNAMIC_ITERATIONS to take it from the input
+     * @tparam Features the STEP_* features which are enabled
+     * @param input forces, sweeps and colliders of the step
+     */
+    template<int Iterations, int Features>
+    void stepKernel(const StepInput &input) {
+        {
+            PROFILE_SCOPE("forces");
+            applyUniformForceAll(input.gravity);
+            if (isAerodynamic()) {
+                prepareAirForces(input);
+                computeAirForces(0, triangles.size(), input);
+                applyAirForces(0, num_col * num_row);
+            } else if (Features & STEP_WIND) {
+                applyTriangleNormalForce(input.wind, input.gusts, input.gust_scale);
             }
         }
-
+        simulate<Iterations, (Features & STEP_DAMPING) != 0>(input.iterations);
+        if (Features & STEP_COLLISIONS) {
+            PROFILE_SCOPE("collisions");
+            resolveSweptCollisions(input.colliders);
+            for (size_t i = 0; i < input.meshes.size(); ++i)
+                resolveMeshCollision(*input.meshes[i].first, input.meshes[i].second);
+        }
     }
 
     /**
@@ -172,10 +1387,13 @@ public:
      * @param force_direction refers to the direction of the force vector
      */
     void applyUniformForceAll(dvec3 force_direction) {
-        for (int i = 0; i < particles.size(); i++) {
-            for (int j = 0; j < particles[i].size(); ++j) {
-                particles[i][j].applyForce(force_direction); // apply the force to each particle
-            }
+        Vec3 force(force_direction);
+        for (unsigned long t = 0; t < tile_asleep.size(); ++t) {
+            if (tile_asleep[t])
+                continue;
+            forEachParticleInTile(t, [&](ParticleType &p) {
+                p.applyForce(force); // apply the force to each particle
+            });
         }
     }
 
@@ -183,15 +1401,43 @@ public:
      * Function to apply a force (eg. wind force) which acts on all the particles in the direction
      * of the normal to the triangle of which the particle is a vertex
      * @param force_direction refers to the vector containing the wind force attributes (direction and magnitude)
+     * @param gust_field gusts added to the force at the centroid of each triangle, nullptr for a uniform force
+     * @param gust_scale factor turning the gusts into forces
      */
-    void applyTriangleNormalForce(dvec3 force_direction) {
+    void applyTriangleNormalForce(dvec3 force_direction, const WindField *gust_field = nullptr, double gust_scale = 0) {
+        Vec3 direction(force_direction);
+        if (gust_field) {
+            //the field is sampled at all the centroids in one batch
+            gust_points.resize(4 * triangles.size());
+            size_t count = 0;
+            for (int i = 0; i < triangles.size(); ++i) {
+                if (triangleAsleep(i))
+                    continue;
+                Vec3 centroid = (triangles[i][0]->getCurrentPos() + triangles[i][1]->getCurrentPos() +
+                                 triangles[i][2]->getCurrentPos()) / Real(3);
+                float *point = &gust_points[4 * count++];
+                for (int axis = 0; axis < 3; ++axis)
+                    point[axis] = (float) centroid[axis];
+                point[3] = 0;
+            }
+            gusts.resize(4 * count);
+            gust_field->sample(gust_points.data(), count, gusts.data());
+        }
+        const float *gust = gusts.data();
         for (int i = 0; i < triangles.size(); ++i) {
-            dvec3 normal_to_triangle = triangleNormal(triangles[i][0]->getCurrentPos(),
-                                                      triangles[i][1]->getCurrentPos(),
-                                                      triangles[i][2]->getCurrentPos());
+            if (triangleAsleep(i))
+                continue;
+            Vec3 normal_to_triangle = triangleNormal(triangles[i][0]->getCurrentPos(),
+                                                     triangles[i][1]->getCurrentPos(),
+                                                     triangles[i][2]->getCurrentPos());
             normal_to_triangle = normalize(normal_to_triangle);
-            double force_magnitude = dot(normal_to_triangle, force_direction);
-            dvec3 force = normal_to_triangle * force_magnitude;
+            Vec3 wind = direction;
+            if (gust_field) {
+                wind += Vec3(gust[0], gust[1], gust[2]) * Real(gust_scale);
+                gust += 4;
+            }
+            Real force_magnitude = dot(normal_to_triangle, wind);
+            Vec3 force = normal_to_triangle * force_magnitude;
             for (int j = 0; j < triangles[i].size(); ++j) {
                 triangles[i][j]->applyForce(force);
             }
@@ -199,27 +1445,388 @@ public:
     }
 
     /**
-     * In case of collision of cloth particles with sphere,
-     * add a velocity along the vector
-     * from the centre of the sphere to the point of collision.
-     * Its magnitude is equal to the difference in length between
-     * radius and distance from centre of sphere to particle.
-     * @param pos centre of the sphere
+     * Returns whether the triangles feel drag and lift from the air
+     * @return true if the drag or the lift coefficient is set
+     */
+    bool isAerodynamic() const {
+        return params.drag != 0 || params.lift != 0;
+    }
+
+    /**
+     * Sizes the buffers of the aerodynamic phases and collects the triangles around the particles if they changed.
+     * Runs before the tasks of the aerodynamic phases, which only write their own part of the buffers.
+     * @param input the gusts of the step
+     */
+    void prepareAirForces(const StepInput &input) {
+        if (corners_dirty)
+            collectCorners();
+        air_forces.resize(triangles.size());
+        if (input.gusts) {
+            gust_points.resize(4 * triangles.size());
+            gusts.resize(4 * triangles.size());
+        }
+    }
+
+    /**
+     * Computes the force of the air on each corner of a range of triangles in one pass with their normals: the
+     * wind along the normal as in applyTriangleNormalForce, plus drag against and lift across the velocity of the
+     * triangle relative to the air, each 1/2 * air_density * speed^2 * coefficient * area facing the air, shared
+     * by the three corners. The velocity of a triangle is that of its centroid, from the Verlet positions.
+     * The gusts of the step, sampled at the centroids of the range in one batch, add to the velocity of the air.
+     * @param begin first triangle of the range
+     * @param end triangle after the last one of the range
+     * @param input the wind and gusts of the step
+     */
+    void computeAirForces(size_t begin, size_t end, const StepInput &input) {
+        if (input.gusts && end > begin) {
+            for (size_t t = begin; t < end; ++t) {
+                Vec3 centroid = (triangles[t][0]->getCurrentPos() + triangles[t][1]->getCurrentPos() +
+                                 triangles[t][2]->getCurrentPos()) / Real(3);
+                for (int axis = 0; axis < 3; ++axis)
+                    gust_points[4 * t + axis] = (float) centroid[axis];
+                gust_points[4 * t + 3] = 0;
+            }
+            input.gusts->sample(&gust_points[4 * begin], end - begin, &gusts[4 * begin]);
+        }
+        Vec3 wind(input.wind), air(params.air_velocity);
+        Real pressure_factor = Real(0.5 * params.air_density / 6); // 1/2 rho, half the cross product, a third each
+        Real drag = params.drag, lift = params.lift, time_step = params.time_step;
+        for (size_t t = begin; t < end; ++t) {
+            if (triangleAsleep(t)) {
+                air_forces[t] = Vec3(0);
+                continue;
+            }
+            ParticleType *a = triangles[t][0], *b = triangles[t][1], *c = triangles[t][2];
+            Vec3 normal = cross(c->getCurrentPos() - a->getCurrentPos(), b->getCurrentPos() - a->getCurrentPos());
+            Real twice_area = length(normal);
+            if (!(twice_area > 0)) {
+                air_forces[t] = Vec3(0);
+                continue;
+            }
+            normal /= twice_area;
+            Vec3 force = normal * dot(normal, wind);
+
+            Vec3 velocity = (a->getCurrentPos() + b->getCurrentPos() + c->getCurrentPos() - a->getOldPos() -
+                             b->getOldPos() - c->getOldPos()) / (Real(3) * time_step);
+            Vec3 relative = velocity - air;
+            if (input.gusts)
+                relative -= Vec3(gusts[4 * t], gusts[4 * t + 1], gusts[4 * t + 2]);
+            Real speed_squared = dot(relative, relative);
+            if (speed_squared > 0) {
+                Vec3 direction = relative / sqrt(speed_squared);
+                Real facing = dot(normal, direction); // cosine of the angle between the normal and the flow
+                Vec3 front = facing < 0 ? -normal : normal; // normal of the side the triangle moves towards
+                facing = std::abs(facing);
+                Real pressure = pressure_factor * speed_squared * twice_area * facing;
+                force -= direction * (pressure * drag);
+                //lift is across the flow, in the plane of the flow and the normal, away from the front
+                Vec3 across = direction * facing - front;
+                Real across_length = length(across);
+                if (across_length > Real(1e-6))
+                    force += across * (pressure * lift / across_length);
+            }
+            air_forces[t] = force;
+        }
+    }
+
+    /**
+     * Adds the forces of the air on the triangles around each particle of a range to the particle. Every particle
+     * gathers its own forces, so that the ranges can be run in parallel without locks.
+     * @param begin first particle of the range, counting row by row
+     * @param end particle after the last one of the range
+     */
+    void applyAirForces(unsigned long begin, unsigned long end) {
+        for (unsigned long i = begin; i < end; ++i) {
+            if (corner_offsets[i] == corner_offsets[i + 1])
+                continue;
+            Vec3 force(0);
+            for (uint32_t k = corner_offsets[i]; k < corner_offsets[i + 1]; ++k)
+                force += air_forces[corner_triangles[k]];
+            particles[i / num_row][i % num_row].applyForce(force);
+        }
+    }
+
+    /**
+     * Pushes the particles which are closer to a static mesh than its thickness, or inside it, out along the
+     * gradient of its distance field, less the Coulomb friction on their slip along the surface. The particles of
+     * the awake tiles are looked up in one batch; a sleeping tile is only woken up if the surface may touch its
+     * bounding box.
+     * @param field distance field of the mesh
+     * @param mesh_thickness distance the particles keep from the surface
+     */
+    void resolveMeshCollision(const SignedDistanceField &field, double mesh_thickness) {
+        float thickness = (float) mesh_thickness;
+        Real friction = params.friction;
+        mesh_points.clear();
+        mesh_tiles.clear();
+        for (unsigned long t = 0; t < tile_asleep.size(); ++t) {
+            if (tile_asleep[t]) {
+                Vec3 centre = (tile_bounds[t].first + tile_bounds[t].second) / Real(2);
+                float point[4] = {(float) centre.x, (float) centre.y, (float) centre.z, 0}, distance, gradient[4];
+                field.sample(point, 1, &distance, gradient);
+                if (distance - (float) length(tile_bounds[t].second - centre) >= thickness)
+                    continue;
+                wakeTile(t);
+            }
+            mesh_tiles.push_back(t);
+            forEachParticleInTile(t, [&](ParticleType &p) {
+                Vec3 position = p.getCurrentPos();
+                mesh_points.insert(mesh_points.end(), {(float) position.x, (float) position.y, (float) position.z, 0});
+            });
+        }
+        mesh_distances.resize(mesh_points.size() / 4);
+        mesh_gradients.resize(mesh_points.size());
+        field.sample(mesh_points.data(), mesh_distances.size(), mesh_distances.data(), mesh_gradients.data());
+        size_t i = 0;
+        for (unsigned long t : mesh_tiles) {
+            forEachParticleInTile(t, [&](ParticleType &p) {
+                float distance = mesh_distances[i];
+                Vec3 gradient(mesh_gradients[4 * i], mesh_gradients[4 * i + 1], mesh_gradients[4 * i + 2]);
+                ++i;
+                Real gradient_length = length(gradient);
+                if (distance < thickness && gradient_length > 0) {
+                    Vec3 normal = gradient / gradient_length, update = normal * Real(thickness - distance);
+                    if (friction > 0) {
+                        //the mesh stands still, so the particle slipped by its motion along the surface
+                        Vec3 slip = p.getCurrentPos() + update - p.getOldPos();
+                        slip -= normal * dot(slip, normal);
+                        Real slip_length = length(slip), limit = friction * Real(thickness - distance);
+                        if (slip_length > 0)
+                            update -= slip * (slip_length <= limit ? Real(1) : limit / slip_length);
+                    }
+                    p.updatePosition(update);
+                }
+            });
+        }
+    }
+
+    /**
+     * Returns when a point moving in a straight line during a step first reaches a sphere around the origin
+     * @param a position of the point at the start of the step, outside the sphere
+     * @param d motion of the point during the step
      * @param radius radius of the sphere
+     * @return the fraction of the step, or -1 if the point does not reach the sphere during the step
      */
-    void resolveSphereCollision(dvec3 pos, double radius) {
-        for (int i = 0; i < particles.size(); ++i) {
-            for (int j = 0; j < particles[i].size(); ++j) {
-                if (radius > length(particles[i][j].getCurrentPos() - pos)) {
-                    dvec3 update = normalize(particles[i][j].getCurrentPos() - pos);
-                    update = update * (radius - length(particles[i][j].getCurrentPos() - pos));
-                    particles[i][j].updatePosition(update);
+    static Real sweptSphereHit(const Vec3 &a, const Vec3 &d, Real radius) {
+        Real dd = dot(d, d), ad = dot(a, d);
+        if (!(ad < 0))
+            return -1; //not moving towards the sphere
+        Real h = ad * ad - dd * (dot(a, a) - radius * radius);
+        if (h < 0)
+            return -1;
+        Real t = (-ad - sqrt(h)) / dd;
+        return t <= 1 ? std::max(t, Real(0)) : -1;
+    }
 
+    /**
+     * Returns when a point moving in a straight line during a step first reaches a capsule: the earliest time at
+     * which it reaches the side of the cylinder between the two ends, or either of the spheres at the ends
+     * @param a position of the point at the start of the step, outside the capsule
+     * @param d motion of the point during the step
+     * @param axis segment of the capsule, from the origin to its other end
+     * @param radius radius of the capsule
+     * @return the fraction of the step, or -1 if the point does not reach the capsule during the step
+     */
+    static Real sweptCapsuleHit(const Vec3 &a, const Vec3 &d, const Vec3 &axis, Real radius) {
+        Real first = sweptSphereHit(a, d, radius);
+        Real second = sweptSphereHit(a - axis, d, radius);
+        if (second >= 0 && (first < 0 || second < first))
+            first = second;
+        Real axis_squared = dot(axis, axis), axis_d = dot(axis, d), axis_a = dot(axis, a);
+        Real along = axis_squared * dot(d, d) - axis_d * axis_d; // zero when moving along the axis
+        if (along > 0) {
+            Real b = axis_squared * dot(d, a) - axis_a * axis_d;
+            Real c = axis_squared * dot(a, a) - axis_a * axis_a - radius * radius * axis_squared;
+            Real h = b * b - along * c;
+            if (h >= 0) {
+                Real t = (-b - sqrt(h)) / along; // reaches the infinite cylinder
+                Real y = axis_a + t * axis_d;
+                if (t >= 0 && t <= 1 && y > 0 && y < axis_squared && (first < 0 || t < first))
+                    first = t;
+            }
+        }
+        return first;
+    }
+
+    /**
+     * Resolves the collisions of the particles with a sphere or capsule which moves during the step, continuously,
+     * so that fast colliders and large time steps do not tunnel through the cloth. Seen from the collider, a
+     * particle moves in a straight line from its old to its current position; if that line enters the collider,
+     * the particle is put where it reached the surface and slid along the surface by the rest of its motion.
+     * Whatever still ends up inside is pushed out the shortest way, and Coulomb friction then takes back up to
+     * "friction" times the distance the particle was pushed of how far it slipped from where it touched.
+     *
+     * The particles which touched the collider in the last step are resolved first, from the contact cache: they
+     * are still in contact as long as they are inside, which needs no swept test, and where they touched is the
+     * anchor their slip is measured from, so that a resting cloth does not creep. The tiles whose boxes overlap
+     * the box swept by the collider are then searched for new contacts, skipping the cached ones; only the
+     * sleeping tiles among them are woken up.
+     * @param collider the collider
+     * @param c index of the collider in the step input, which its contacts are cached under
+     */
+    void resolveSweptCollision(const SweptCollider &collider, uint32_t c) {
+        //seen from one end of the segment
+        Vec3 axis(collider.axis), start = Vec3(collider.start) - axis / Real(2);
+        Vec3 end = Vec3(collider.end) - axis / Real(2);
+        Real radius = collider.radius, axis_squared = dot(axis, axis), friction = params.friction;
+        Vec3 low = glm::min(glm::min(start, start + axis), glm::min(end, end + axis)) - Vec3(radius);
+        Vec3 high = glm::max(glm::max(start, start + axis), glm::max(end, end + axis)) + Vec3(radius);
+        //offset of a point from the segment of the collider, seen from the collider
+        auto offset = [&](const Vec3 &q) {
+            Real s = axis_squared > 0 ? glm::clamp(dot(q, axis) / axis_squared, Real(0), Real(1)) : Real(0);
+            return q - axis * s;
+        };
+        //pushes a point inside the collider out the shortest way
+        auto pushOut = [&](Vec3 &q) {
+            Vec3 away = offset(q);
+            Real distance = length(away);
+            if (distance < radius && distance > 0)
+                q += away * ((radius - distance) / distance);
+        };
+        //applies the friction to a particle touching the collider and moves it, b being where the integration
+        //left it and target where the collision put it
+        auto settle = [&](ParticleType &p, uint32_t index, const Vec3 &b, Vec3 target, const Vec3 &anchor) {
+            if (friction > 0) {
+                Vec3 normal = offset(target);
+                Real normal_length = length(normal);
+                if (normal_length > 0)
+                    normal /= normal_length;
+                Vec3 slip = target - anchor;
+                slip -= normal * dot(slip, normal);
+                Real slip_length = length(slip), limit = friction * length(target - b);
+                if (slip_length > 0) {
+                    target -= slip * (slip_length <= limit ? Real(1) : limit / slip_length);
+                    pushOut(target); //a curved surface is left by moving along its tangent
                 }
             }
+            if (target != b)
+                p.updatePosition(target - b);
+            next_contacts.push_back({index, c, target});
+            contact_marks[index] = c + 1;
+        };
+
+        size_t first_contact = next_contacts.size();
+        auto cached = equal_range(contacts.begin(), contacts.end(), Contact{0, c, Vec3(0)},
+                                  [](const Contact &x, const Contact &y) { return x.collider < y.collider; });
+        for (auto k = cached.first; k != cached.second; ++k) {
+            unsigned long i = k->particle / num_row, j = k->particle % num_row;
+            if (tile_asleep[tileOf(i, j)]) {
+                //kept for when the tile wakes up, as the particle cannot move
+                next_contacts.push_back(*k);
+                contact_marks[k->particle] = c + 1;
+                continue;
+            }
+            ParticleType &p = particles[i][j];
+            Vec3 b = p.getCurrentPos() - end, away = offset(b);
+            if (dot(away, away) >= radius * radius)
+                continue; //lifted off, left to the search for new contacts
+            Vec3 target = b;
+            pushOut(target);
+            settle(p, k->particle, b, target, k->anchor);
+        }
+
+        for (unsigned long t = 0; t < tile_asleep.size(); ++t) {
+            bool overlaps = true;
+            for (int axis = 0; axis < 3; ++axis) {
+                overlaps = overlaps && tile_bounds[t].second[axis] >= low[axis] &&
+                           tile_bounds[t].first[axis] <= high[axis];
+            }
+            if (!overlaps)
+                continue;
+            if (tile_asleep[t])
+                wakeTile(t);
+            forEachIndexedParticleInTile(t, [&](ParticleType &p, uint32_t index) {
+                if (contact_marks[index] == c + 1)
+                    return;
+                Vec3 a = p.getOldPos() - start, b = p.getCurrentPos() - end, target = b, anchor = a;
+                Vec3 away = offset(a);
+                bool touched = false;
+                if (dot(away, away) > radius * radius) {
+                    Vec3 d = b - a;
+                    Real hit = sweptCapsuleHit(a, d, axis, radius);
+                    if (hit >= 0) {
+                        Vec3 contact = a + d * hit, normal = offset(contact), rest = d * (1 - hit);
+                        Real normal_length = length(normal);
+                        if (normal_length > 0)
+                            normal /= normal_length;
+                        target = contact + rest - normal * std::min(dot(rest, normal), Real(0));
+                        anchor = contact;
+                        touched = true;
+                    }
+                }
+                away = offset(target);
+                if (dot(away, away) < radius * radius) {
+                    pushOut(target);
+                    touched = true;
+                }
+                if (touched)
+                    settle(p, index, b, target, anchor);
+            });
         }
+        for (size_t k = first_contact; k < next_contacts.size(); ++k)
+            contact_marks[next_contacts[k].particle] = 0;
+    }
+
+    /**
+     * Resolves the collisions with all the spheres and capsules of a step and keeps their contacts for the next
+     * @param colliders the colliders
+     */
+    void resolveSweptCollisions(const vector<SweptCollider> &colliders) {
+        contact_marks.resize(num_col * num_row, 0);
+        next_contacts.clear();
+        for (size_t c = 0; c < colliders.size(); ++c)
+            resolveSweptCollision(colliders[c], c);
+        contacts.swap(next_contacts);
     }
 };
 
+inline Cloth *Cloth::create(dvec3 pos, double height, double width, unsigned long num_col, unsigned long num_row,
+                            double mass, const SimulationParameters &params) {
+    if (params.single_precision)
+        return new ClothT<float>(pos, height, width, num_col, num_row, mass, params);
+    return new ClothT<double>(pos, height, width, num_col, num_row, mass, params);
+}
+
+inline Cloth *Cloth::create(const ClothMesh &mesh, dvec3 pos, double mass, const SimulationParameters &params) {
+    if (params.single_precision)
+        return new ClothT<float>(mesh, pos, mass, params);
+    return new ClothT<double>(mesh, pos, mass, params);
+}
+
+inline Cloth *Cloth::loadCheckpoint(const string &path, unsigned long &frame, string &error) {
+    CheckpointReader checkpoint;
+    if (!checkpoint.open(path, CHECKPOINT_MODEL_SPRINGMASS, error))
+        return nullptr;
+    if (checkpoint.getScalarSize() == sizeof(float))
+        return ClothT<float>::restore(checkpoint, frame, error);
+    if (checkpoint.getScalarSize() == sizeof(double))
+        return ClothT<double>::restore(checkpoint, frame, error);
+    error = path + " stores particles of an unknown precision";
+    return nullptr;
+}
+
+// declares or defines the step kernels of one scalar type and sweep count for every set of features
+#define STEP_KERNELS(declaration, Real, Iterations) \
+    declaration void ClothT<Real>::stepKernel<Iterations, 0>(const StepInput &); \
+    declaration void ClothT<Real>::stepKernel<Iterations, 1>(const StepInput &); \
+    declaration void ClothT<Real>::stepKernel<Iterations, 2>(const StepInput &); \
+    declaration void ClothT<Real>::stepKernel<Iterations, 3>(const StepInput &); \
+    declaration void ClothT<Real>::stepKernel<Iterations, 4>(const StepInput &); \
+    declaration void ClothT<Real>::stepKernel<Iterations, 5>(const StepInput &); \
+    declaration void ClothT<Real>::stepKernel<Iterations, 6>(const StepInput &); \
+    declaration void ClothT<Real>::stepKernel<Iterations, 7>(const StepInput &);
+
+// declares or defines all the step kernels of one scalar type, matching ClothT::selectKernel
+#define STEP_SPECIALIZATIONS(declaration, Real) \
+    declaration class ClothT<Real>; \
+    STEP_KERNELS(declaration, Real, STEP_DYNAMIC_ITERATIONS) \
+    STEP_KERNELS(declaration, Real, 2) \
+    STEP_KERNELS(declaration, Real, 4) \
+    STEP_KERNELS(declaration, Real, 8) \
+    STEP_KERNELS(declaration, Real, 15)
+
+//the kernels are compiled once, in SolverKernels.cpp
+STEP_SPECIALIZATIONS(extern template, double)
+STEP_SPECIALIZATIONS(extern template, float)
 
 #endif //CLOTH_SIMULATION_CLOTH_H
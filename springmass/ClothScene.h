@@ -0,0 +1,144 @@
+//
+// The cloths of a scene, stepped together on a work-stealing thread pool.
+//
+
+#ifndef CLOTH_SIMULATION_CLOTHSCENE_H
+#define CLOTH_SIMULATION_CLOTHSCENE_H
+
+#include "Cloth.h"
+#include "../common/TaskScheduler.h"
+
+/**
+ * Any number of cloths, each with its own parameters. A frame is a task graph with a chain of
+ * STEP_NUM_PHASES phases for every cloth. The chains do not depend on each other, so the scheduler
+ * spreads hundreds of small cloths over the cores and lets idle threads steal the phases of large ones.
+ * A phase split into several tasks, such as the aerodynamics of a large cloth, runs them in parallel
+ * between two joins.
+ */
+class ClothScene {
+    vector<Cloth *> cloths;
+    vector<StepInput> inputs; // forces and colliders of each cloth in the current frame
+    int reference_iterations; // sweeps of the scene, relative to which the sweeps of a frame are scaled
+    TaskScheduler scheduler;
+    TaskGraph frame; // the phases of all cloths, rebuilt when a cloth is added
+    bool frame_dirty;
+
+    void buildFrame() {
+        frame.clear();
+        for (size_t c = 0; c < cloths.size(); ++c) {
+            long previous = -1; // the task the next phase waits for
+            for (int phase = 0; phase < STEP_NUM_PHASES; ++phase) {
+                size_t num_tasks = cloths[c]->getNumPhaseTasks(phase);
+                if (num_tasks == 0)
+                    continue;
+                size_t join = num_tasks > 1 ? frame.add([] {}) : 0;
+                for (size_t k = 0; k < num_tasks; ++k) {
+                    size_t task = frame.add([this, c, phase, k, num_tasks] {
+                        cloths[c]->stepPhase(phase, inputs[c], k, num_tasks);
+                    });
+                    if (previous >= 0)
+                        frame.precede(previous, task);
+                    if (num_tasks > 1)
+                        frame.precede(task, join);
+                    else
+                        join = task;
+                }
+                previous = join;
+            }
+        }
+        frame_dirty = false;
+    }
+
+public:
+    /**
+     * Constructor to start an empty scene
+     * @param reference_iterations sweeps over the constraints of the scene; a cloth with its own sweep count
+     *                             gets the same share of it when a frame asks for fewer sweeps
+     * @param threads number of threads stepping the cloths, 0 for one per core
+     */
+    ClothScene(int reference_iterations, unsigned threads) : reference_iterations(std::max(reference_iterations, 1)),
+                                                             scheduler(threads), frame_dirty(true) {}
+
+    ~ClothScene() {
+        for (Cloth *cloth : cloths)
+            delete cloth;
+    }
+
+    /**
+     * Adds a cloth, which the scene deletes when it is destroyed
+     * @param cloth the cloth
+     */
+    void add(Cloth *cloth) {
+        cloths.push_back(cloth);
+        inputs.push_back(StepInput());
+        frame_dirty = true;
+    }
+
+    /**
+     * Replaces a cloth, e.g. by one restored from a checkpoint, deleting the old one
+     * @param index index of the cloth
+     * @param cloth the new cloth
+     */
+    void replace(size_t index, Cloth *cloth) {
+        delete cloths[index];
+        cloths[index] = cloth;
+        frame_dirty = true; // the new cloth may split into other tasks
+    }
+
+    /**
+     * Returns the number of cloths
+     * @return the number of cloths
+     */
+    size_t size() const {
+        return cloths.size();
+    }
+
+    /**
+     * Returns a cloth
+     * @param index index of the cloth
+     * @return the cloth
+     */
+    Cloth *get(size_t index) const {
+        return cloths[index];
+    }
+
+    /**
+     * Returns the number of threads stepping the cloths
+     * @return the number of threads
+     */
+    unsigned getNumThreads() const {
+        return scheduler.getNumThreads();
+    }
+
+    /**
+     * Advances every cloth by one step
+     * @param input sweeps and colliders of the frame; the forces are taken from the parameters of each cloth
+     */
+    void step(const StepInput &input) {
+        for (size_t c = 0; c < cloths.size(); ++c) {
+            const SimulationParameters &params = cloths[c]->getParameters();
+            double time_step_squared = params.time_step * params.time_step;
+            StepInput &clothInput = inputs[c];
+            clothInput.gravity = params.gravity * time_step_squared;
+            clothInput.wind = params.wind * time_step_squared;
+            clothInput.gusts = input.gusts;
+            clothInput.gust_scale = time_step_squared;
+            clothInput.iterations = params.constraint_iterations == reference_iterations ? input.iterations :
+                                    std::max(1, (int) lround((double) input.iterations *
+                                                             params.constraint_iterations / reference_iterations));
+            clothInput.collisions = input.collisions;
+            clothInput.colliders = input.colliders;
+            clothInput.meshes = input.meshes;
+        }
+        if (cloths.size() == 1 &&
+            (scheduler.getNumThreads() == 1 || cloths[0]->getNumPhaseTasks(STEP_PHASE_AIR) <= 1)) {
+            cloths[0]->step(inputs[0]); // the fused kernel is faster than the separate phases
+            return;
+        }
+        if (frame_dirty)
+            buildFrame();
+        scheduler.run(frame);
+    }
+};
+
+#endif //CLOTH_SIMULATION_CLOTHSCENE_H
@@ -7,29 +7,82 @@
 
 #include "Particle.h"
 
-class Constraint
+/**
+ * Keeps two particles at the distance they had when the constraint was created
+ * @tparam Real scalar type in which the particles are stored
+ */
+template<typename Real>
+class ConstraintT
 {
-    double rest_length;
-    pair<Particle*,Particle*> particles;
+    typedef typename Vector3<Real>::type Vec3;
+
+    Real rest_length;
+    pair<ParticleT<Real>*,ParticleT<Real>*> particles;
 public:
-    Constraint(Particle &first_particle, Particle &second_particle)
+    ConstraintT(ParticleT<Real> &first_particle, ParticleT<Real> &second_particle)
     {
         particles.first = &first_particle;
         particles.second = &second_particle;
         rest_length = length(particles.second->getCurrentPos() - particles.first->getCurrentPos());
     }
 
+    /**
+     * Creates a constraint with a known rest length, e.g. one restored from a checkpoint
+     * @param first_particle the first particle
+     * @param second_particle the second particle
+     * @param rest_length the distance the particles are kept at
+     */
+    ConstraintT(ParticleT<Real> &first_particle, ParticleT<Real> &second_particle, Real rest_length)
+    {
+        particles.first = &first_particle;
+        particles.second = &second_particle;
+        this->rest_length = rest_length;
+    }
+
+    /**
+     * Returns the particles which the constraint connects
+     * @return the two particles
+     */
+    pair<ParticleT<Real>*,ParticleT<Real>*> getParticles()
+    {
+        return particles;
+    }
+
+    /**
+     * Returns the distance the particles are kept at
+     * @return the rest length
+     */
+    Real getRestLength()
+    {
+        return rest_length;
+    }
+
     void correctParticlePositions()
     {
         //calculate the compensations to be made to bring back the particles to their rest positions
-        dvec3 current_displacement = particles.second->getCurrentPos() - particles.first->getCurrentPos();
-        dvec3 correction_first_particle =
-                current_displacement * ((1.0 - rest_length / length(current_displacement)) / 2.0);
-        dvec3 correction_second_particle = -correction_first_particle;
+        Vec3 current_displacement = particles.second->getCurrentPos() - particles.first->getCurrentPos();
+        Vec3 correction_first_particle =
+                current_displacement * ((Real(1) - rest_length / length(current_displacement)) / Real(2));
+        Vec3 correction_second_particle = -correction_first_particle;
 
         //update the positions of the particles
         particles.first->updatePosition(correction_first_particle);
         particles.second->updatePosition(correction_second_particle);
     }
+
+    /**
+     * Checks whether the constraint has been stretched beyond the given ratio of its rest length.
+     * Compares squared lengths so that no square root is needed.
+     * @param max_stretch_ratio maximum allowed ratio of current length to rest length
+     * @return true if the constraint is stretched beyond the ratio
+     */
+    bool isOverstretched(Real max_stretch_ratio)
+    {
+        Vec3 current_displacement = particles.second->getCurrentPos() - particles.first->getCurrentPos();
+        Real max_length = rest_length * max_stretch_ratio;
+        return dot(current_displacement, current_displacement) > max_length * max_length;
+    }
 };
+
+typedef ConstraintT<double> Constraint;
 #endif //CLOTH_SIMULATION_CONSTRAINT_H
@@ -0,0 +1,212 @@
+//
+// Adapts the solver effort of each frame to a frame time budget.
+//
+
+#ifndef CLOTH_SIMULATION_FRAMEGOVERNOR_H
+#define CLOTH_SIMULATION_FRAMEGOVERNOR_H
+
+#include <bits/stdc++.h>
+
+using namespace std;
+
+#define GOVERNOR_WINDOW 120 // number of recent frames over which the latency is measured
+#define GOVERNOR_COOLDOWN 30 // number of frames to wait after a change before changing the quality again
+#define GOVERNOR_HEADROOM 0.85 // fraction of the budget the estimated cost of a better level has to fit in
+
+/**
+ * Settings of the solver for one quality level
+ */
+struct QualityLevel {
+    int iterations; // number of sweeps over the constraints
+    int collision_interval; // collisions are resolved every this many frames
+};
+
+/**
+ * Measures the time spent on each frame and picks the best quality level whose cost fits
+ * into a target frame time. When the 95th percentile of the recent frame times goes over the
+ * target, quality drops to the best level estimated to fit. It is raised again one level at a
+ * time when the estimated cost of the next level leaves enough headroom.
+ */
+class FrameGovernor {
+    double target_ms; // target time for a frame
+    vector<QualityLevel> levels; // quality levels from the cheapest to the best
+    vector<double> level_cost; // running average of the frame time measured at each level, 0 if unknown
+    int level; // current quality level
+    bool enabled; // when disabled, as it is until setEnabled, the best level is always used
+    double samples[GOVERNOR_WINDOW]; // ring buffer of recent frame times
+    int num_samples, next_sample;
+    int cooldown; // frames left before the quality may change again
+    unsigned long frame; // number of frames seen so far
+    double frame_work; // time spent working on the current frame
+    chrono::steady_clock::time_point work_start;
+    double p95; // 95th percentile of the recent frame times
+
+    /**
+     * Computes the 95th percentile of the recent frame times
+     */
+    void updateP95() {
+        double sorted[GOVERNOR_WINDOW];
+        copy(samples, samples + num_samples, sorted);
+        int k = min(num_samples - 1, (int) (0.95 * num_samples));
+        nth_element(sorted, sorted + k, sorted + num_samples);
+        p95 = sorted[k];
+    }
+
+    /**
+     * Estimates the frame time at a quality level from measurements at that level or,
+     * if it has not been measured, by scaling the cost of the current level by the work done
+     * @param l the quality level
+     * @return the estimated frame time in milliseconds
+     */
+    double estimateCost(int l) {
+        if (level_cost[l] > 0)
+            return level_cost[l];
+        double work = levels[l].iterations + 1.0 / levels[l].collision_interval;
+        double current_work = levels[level].iterations + 1.0 / levels[level].collision_interval;
+        return level_cost[level] * work / current_work;
+    }
+
+    /**
+     * Moves to another quality level and starts measuring afresh
+     * @param l the new quality level
+     */
+    void setLevel(int l) {
+        level = l;
+        num_samples = next_sample = 0;
+        cooldown = GOVERNOR_COOLDOWN;
+    }
+
+public:
+    /**
+     * Constructor to initialize the governor
+     * @param target_ms target time for a frame in milliseconds
+     * @param min_iterations fewest sweeps over the constraints that may be used
+     * @param max_iterations most sweeps over the constraints that may be used
+     * @param max_collision_interval largest number of frames between collision passes
+     */
+    FrameGovernor(double target_ms, int min_iterations, int max_iterations, int max_collision_interval) {
+        this->target_ms = target_ms;
+        //the cheapest levels resolve collisions less often, the rest add sweeps
+        for (int interval = max_collision_interval; interval > 1; --interval)
+            levels.push_back({min_iterations, interval});
+        for (int iterations = min_iterations; iterations <= max_iterations; ++iterations)
+            levels.push_back({iterations, 1});
+        level_cost.assign(levels.size(), 0.0);
+        level = levels.size() - 1;
+        enabled = false;
+        num_samples = next_sample = 0;
+        cooldown = 0;
+        frame = 0;
+        frame_work = 0;
+        p95 = 0;
+    }
+
+    /**
+     * Starts timing work which belongs to the current frame
+     */
+    void startWork() {
+        work_start = chrono::steady_clock::now();
+    }
+
+    /**
+     * Stops timing work which belongs to the current frame
+     */
+    void stopWork() {
+        frame_work += chrono::duration<double, milli>(chrono::steady_clock::now() - work_start).count();
+    }
+
+    /**
+     * Closes the current frame, records its cost and adapts the quality level
+     */
+    void nextFrame() {
+        if (frame++ == 0)
+            return;
+        samples[next_sample] = frame_work;
+        next_sample = (next_sample + 1) % GOVERNOR_WINDOW;
+        num_samples = min(num_samples + 1, GOVERNOR_WINDOW);
+        level_cost[level] = level_cost[level] > 0 ? 0.95 * level_cost[level] + 0.05 * frame_work : frame_work;
+        frame_work = 0;
+        updateP95();
+        if (!enabled || cooldown > 0) {
+            cooldown = max(cooldown - 1, 0);
+            return;
+        }
+        if (p95 > target_ms && level > 0) {
+            //jump straight to the best level which is estimated to fit
+            int l = level - 1;
+            while (l > 0 && estimateCost(l) > GOVERNOR_HEADROOM * target_ms)
+                --l;
+            setLevel(l);
+        } else if (num_samples == GOVERNOR_WINDOW && level + 1 < (int) levels.size() &&
+                 estimateCost(level + 1) < GOVERNOR_HEADROOM * target_ms)
+            setLevel(level + 1);
+    }
+
+    /**
+     * Returns the number of sweeps over the constraints for the current frame
+     * @return the number of sweeps
+     */
+    int getIterations() {
+        return levels[level].iterations;
+    }
+
+    /**
+     * Checks whether collisions have to be resolved in the current frame
+     * @return true if collisions have to be resolved
+     */
+    bool shouldResolveCollisions() {
+        return frame % levels[level].collision_interval == 0;
+    }
+
+    /**
+     * Enables or disables the governor. When disabled the best quality level is used.
+     * @param enable whether to adapt the quality level
+     */
+    void setEnabled(bool enable) {
+        enabled = enable;
+        if (!enabled)
+            setLevel(levels.size() - 1);
+    }
+
+    /**
+     * Returns whether the governor is enabled
+     * @return true if the quality level is adapted
+     */
+    bool isEnabled() {
+        return enabled;
+    }
+
+    /**
+     * Returns the current quality level
+     * @return the quality level, from 0 (cheapest) to getNumQualityLevels() - 1 (best)
+     */
+    int getQualityLevel() {
+        return level;
+    }
+
+    /**
+     * Returns the number of quality levels
+     * @return the number of quality levels
+     */
+    int getNumQualityLevels() {
+        return levels.size();
+    }
+
+    /**
+     * Returns the 95th percentile of the recent frame times
+     * @return the latency in milliseconds
+     */
+    double getP95() {
+        return p95;
+    }
+
+    /**
+     * Returns the target frame time
+     * @return the target in milliseconds
+     */
+    double getTarget() {
+        return target_ms;
+    }
+};
+
+#endif //CLOTH_SIMULATION_FRAMEGOVERNOR_H
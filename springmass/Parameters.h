@@ -0,0 +1,163 @@
+//
+// Runtime parameters of the spring mass model, read from a scene file.
+//
+
+#ifndef CLOTH_SIMULATION_PARAMETERS_H
+#define CLOTH_SIMULATION_PARAMETERS_H
+
+#include "Particle.h"
+#include "../common/SceneConfig.h"
+
+#define CONSTRAINT_ITERATIONS 15 // refers to the number of iterations required to satisfy the constraints per frame
+#define DEFAULT_TEAR_RATIO 1.5 // ratio of current length to rest length beyond which a constraint tears
+#define SLEEP_ENERGY 1e-7 // mean squared displacement per step below which a tile is considered at rest
+#define WAKE_ENERGY 1e-4 // mean squared displacement per step above which a tile wakes its neighbours
+#define SLEEP_FRAMES 30 // number of consecutive frames a tile has to be at rest before it is put to sleep
+#define MESH_COLLIDER_CELLS 128 // default number of cells of a distance field along the largest extent of its mesh
+#define MESH_COLLIDER_BAND 8 // default number of cells from the surface up to which a distance field is exact
+
+/**
+ * Settings read by the solver kernels. The defaults reproduce the compile time constants.
+ */
+struct SimulationParameters {
+    double damping = DAMPING_FACTOR; // damping of the cloth for each frame
+    double time_step = TIME_STEP; // timestep taken by each particle in each frame
+    int constraint_iterations = CONSTRAINT_ITERATIONS; // sweeps over the constraints per frame
+    dvec3 gravity = dvec3(0, -0.2, 0); // gravity force on each particle
+    dvec3 wind = dvec3(0.001, 0, 0.01); // wind force projected onto the triangle normals
+    dvec3 air_velocity = dvec3(0); // velocity of the air, against which the triangles feel drag and lift
+    double air_density = 1; // density of the air
+    double drag = 0; // drag coefficient of the triangles, 0 for no aerodynamics
+    double lift = 0; // lift coefficient of the triangles
+    double friction = 0; // Coulomb friction coefficient of the contacts with the colliders, 0 for frictionless
+    bool tearing = false; // whether overstretched constraints tear
+    double tear_ratio = DEFAULT_TEAR_RATIO; // ratio of current length to rest length beyond which a constraint tears
+    bool sleeping = false; // whether settled regions are put to sleep
+    double sleep_energy = SLEEP_ENERGY; // mean squared displacement below which a tile is at rest
+    double wake_energy = WAKE_ENERGY; // mean squared displacement above which a tile wakes its neighbours
+    int sleep_frames = SLEEP_FRAMES; // frames a tile has to be at rest before it sleeps
+    bool single_precision = false; // whether the particles are stored in float instead of double
+
+    /**
+     * Reads the parameters from the [material], [solver] and [wind] sections of a scene
+     * @param scene the scene
+     * @return the parameters, with defaults for everything the scene does not set
+     */
+    static SimulationParameters fromScene(const SceneConfig &scene) {
+        SimulationParameters p;
+        p.apply(scene.section("material"));
+        p.apply(scene.section("solver"));
+        const SceneSection &wind = scene.section("wind");
+        p.wind = wind.getVec3("force", p.wind);
+        p.air_velocity = wind.getVec3("air_velocity", p.air_velocity);
+        p.air_density = wind.getDouble("air_density", p.air_density);
+        return p;
+    }
+
+    /**
+     * Overrides the parameters which a section sets, with the keys of the [material] and [solver]
+     * sections, "wind" for the wind force and "air_velocity" and "air_density" for the air. Used for the settings
+     * of a single cloth.
+     * @param section the section
+     */
+    void apply(const SceneSection &section) {
+        damping = section.getDouble("damping", damping);
+        tear_ratio = section.getDouble("tear_ratio", tear_ratio);
+        tearing = section.getBool("tearing", tearing);
+        time_step = section.getDouble("time_step", time_step);
+        constraint_iterations = section.getInt("iterations", constraint_iterations);
+        gravity = section.getVec3("gravity", gravity);
+        wind = section.getVec3("wind", wind);
+        air_velocity = section.getVec3("air_velocity", air_velocity);
+        air_density = section.getDouble("air_density", air_density);
+        drag = section.getDouble("drag", drag);
+        lift = section.getDouble("lift", lift);
+        friction = std::max(section.getDouble("friction", friction), 0.0);
+        sleeping = section.getBool("sleeping", sleeping);
+        sleep_energy = section.getDouble("sleep_energy", sleep_energy);
+        wake_energy = section.getDouble("wake_energy", wake_energy);
+        sleep_frames = section.getInt("sleep_frames", sleep_frames);
+        string precision = section.getString("precision", single_precision ? "float" : "double");
+        if (precision == "float" || precision == "double")
+            single_precision = precision == "float";
+        else
+            cerr << "scene: ignoring unknown precision " << precision << endl;
+    }
+};
+
+/**
+ * A sphere or a capsule which oscillates along a direction: center + motion * cos(frame * speed). A capsule is the
+ * set of points within its radius of a segment, centred on the centre and spanning its axis.
+ */
+struct MovingCollider {
+    dvec3 center; // centre of the oscillation
+    dvec3 motion; // amplitude and direction of the oscillation
+    double speed; // angular speed of the oscillation in radians per frame
+    double radius; // radius of the sphere or capsule
+    dvec3 axis; // segment of a capsule from one end to the other, zero for a sphere
+
+    /**
+     * Returns the centre of the collider in a frame
+     * @param frame the frame
+     * @return position of the centre
+     */
+    dvec3 positionAt(double frame) const {
+        return center + motion * cos(frame * speed);
+    }
+
+    /**
+     * Reads all the sphere and capsule colliders of a scene from its [collider] sections
+     * @param scene the scene
+     * @return the colliders
+     */
+    static vector<MovingCollider> fromScene(const SceneConfig &scene) {
+        vector<MovingCollider> colliders;
+        for (const SceneSection *s : scene.all("collider")) {
+            string type = s->getString("type", "sphere");
+            if (type == "mesh")
+                continue; //see MeshCollider
+            if (type != "sphere" && type != "capsule") {
+                cerr << "scene: ignoring collider of unsupported type " << s->getString("type", "") << endl;
+                continue;
+            }
+            colliders.push_back({s->getVec3("center", dvec3(0)), s->getVec3("motion", dvec3(0)),
+                                 s->getDouble("speed", 0), s->getDouble("radius", 1),
+                                 type == "capsule" ? s->getVec3("axis", dvec3(0, 1, 0)) : dvec3(0)});
+        }
+        return colliders;
+    }
+};
+
+/**
+ * A static collider of any shape, such as a body: a closed mesh from an OBJ file, which the particles are kept
+ * out of through its signed distance field
+ */
+struct MeshCollider {
+    string mesh; // path of the OBJ file
+    dvec3 position; // displacement of the mesh from the coordinates of the file
+    double scale; // factor the coordinates of the file are multiplied by
+    double cell; // distance between the nodes of the field, 0 for MESH_COLLIDER_CELLS along the largest extent
+    double band; // distance from the surface up to which the field is exact, 0 for MESH_COLLIDER_BAND cells
+    double thickness; // distance the particles keep from the surface
+    string cache; // file the field is saved to and loaded from, empty to build it on every run
+
+    /**
+     * Reads all the mesh colliders of a scene from its [collider] sections of type "mesh"
+     * @param scene the scene
+     * @return the colliders
+     */
+    static vector<MeshCollider> fromScene(const SceneConfig &scene) {
+        vector<MeshCollider> colliders;
+        for (const SceneSection *s : scene.all("collider")) {
+            if (s->getString("type", "sphere") != "mesh")
+                continue;
+            string mesh = scene.resolve(s->getString("mesh", ""));
+            colliders.push_back({mesh, s->getVec3("position", dvec3(0)), s->getDouble("scale", 1),
+                                 s->getDouble("cell", 0), s->getDouble("band", 0), s->getDouble("thickness", 0.1),
+                                 s->has("cache") ? scene.resolve(s->getString("cache", "")) : mesh + ".sdf"});
+        }
+        return colliders;
+    }
+};
+
+#endif //CLOTH_SIMULATION_PARAMETERS_H
@@ -14,6 +14,7 @@
 #include <glm/gtx/rotate_vector.hpp>
 #include <glm/gtx/normal.hpp>
 #include <glm/gtx/vector_angle.hpp>
+#include "../common/Vector3.h"
 
 using namespace std;
 using namespace glm;
@@ -23,14 +24,19 @@ using namespace glm;
 
 /**
  * Class which is used to define the particles of the cloth
+ * @tparam Real scalar type in which the state of the particle is stored
  */
-class Particle {
+template<typename Real>
+class ParticleT {
+    typedef typename Vector3<Real>::type Vec3;
+
     bool is_movable; // to check whether the particle is movable or not
-    double mass; // defines the mass of the particle (default = 1)
-    dvec3 current_pos; // defines the current position of the particle
-    dvec3 old_pos; // defines the old position of the particle
-    dvec3 acceleration; // defines the acceleration of the particle
-    dvec3 normal; // defines the normal to the cloth at the position of the particle - used for shading
+    bool is_asleep; // to check whether the particle belongs to a region of the cloth which is asleep
+    Real mass; // defines the mass of the particle (default = 1)
+    Vec3 current_pos; // defines the current position of the particle
+    Vec3 old_pos; // defines the old position of the particle
+    Vec3 acceleration; // defines the acceleration of the particle
+    Vec3 normal; // defines the normal to the cloth at the position of the particle - used for shading
 
 public:
     /**
@@ -38,20 +44,21 @@ public:
      * @param current_pos position of the particle
      * @param mass mass of the particle
      */
-    Particle(dvec3 current_pos, double mass) {
+    ParticleT(Vec3 current_pos, Real mass) {
         is_movable = true;
+        is_asleep = false;
         this->mass = mass;
         this->current_pos = current_pos;
         old_pos = current_pos;
-        acceleration = dvec3(0, 0, 0);
-        normal = dvec3(0, 0, 0);
+        acceleration = Vec3(0, 0, 0);
+        normal = Vec3(0, 0, 0);
     }
 
     /**
      * Update the normal by adding the given update vector
      * @param update update vector
      */
-    void updateNormal(dvec3 update) {
+    void updateNormal(Vec3 update) {
         normal = normal + normalize(update);
     }
 
@@ -59,7 +66,7 @@ public:
      * Resets the normal to 0
      */
     void resetNormal() {
-        normal = dvec3(0, 0, 0);
+        normal = Vec3(0, 0, 0);
     }
 
     /**
@@ -73,34 +80,81 @@ public:
      * Function to apply a force vector on a particle (to change the acceleration of the particle)
      * @param force refers to the force vector to be applied on the particle
      */
-    void applyForce(dvec3 force) {
-        acceleration += force / (double) mass;
+    void applyForce(Vec3 force) {
+        acceleration += force / mass;
     }
 
     /**
      * Function to get the current position of the particle
      * @return returns the current position of the particle
      */
-    dvec3 getCurrentPos() {
+    Vec3 getCurrentPos() {
         return current_pos;
     }
 
+    /**
+     * Function to get the position of the particle in the previous time step
+     * @return returns the old position of the particle
+     */
+    Vec3 getOldPos() {
+        return old_pos;
+    }
+
+    /**
+     * Brings the particle to rest by discarding its velocity and the accumulated acceleration
+     */
+    void settle() {
+        old_pos = current_pos;
+        resetAcceleration();
+    }
+
+    /**
+     * Moves the particle to a position and brings it to rest there
+     * @param pos the new position
+     */
+    void placeAt(Vec3 pos) {
+        current_pos = pos;
+        settle();
+    }
+
+    /**
+     * Puts the particle to sleep. A sleeping particle is brought to rest and is not moved
+     * by constraints until it is woken up, so it acts like a pinned particle for its neighbours.
+     */
+    void sleep() {
+        settle();
+        is_asleep = true;
+    }
+
+    /**
+     * Wakes the particle up, discarding the forces it received while asleep
+     */
+    void wake() {
+        settle();
+        is_asleep = false;
+    }
+
     /**
      * Function to reset the value of the acceleration
      */
     void resetAcceleration() {
-        acceleration = dvec3(0.0, 0.0, 0.0);
+        acceleration = Vec3(0, 0, 0);
     }
 
     /**
-     * Function to progress the time by one time step define by TIME_STEP
+     * Function to progress the time by one time step
 	 * Uses Verlet integration to find the new pos of the particle
+     * @tparam Damped whether the velocity is damped; the solver kernels drop the damping when it is off
+     * @param damping damping of the velocity in each time step
+     * @param time_step length of the time step
      */
-    void timeStep() {
+    template<bool Damped = true>
+    void timeStep(Real damping = DAMPING_FACTOR, Real time_step = TIME_STEP) {
         if (is_movable) {
-            dvec3 temp = current_pos;
-            current_pos = current_pos + (current_pos - old_pos) * (1.0 - DAMPING_FACTOR) +
-                          acceleration * pow(TIME_STEP, 2); // gives the new position of the particle
+            Vec3 temp = current_pos;
+            Vec3 velocity = Damped ? (current_pos - old_pos) * (Real(1) - damping) : current_pos - old_pos;
+            current_pos = current_pos + velocity +
+                          acceleration * (time_step * time_step); // gives the new position of the particle
             old_pos = temp;
             resetAcceleration();  // changing the position resets the acceleration of the particle
         }
@@ -118,8 +172,8 @@ public:
      * Function to offset the position of a particle wrt given update vector
      * @param update refers to the update vector
      */
-    void updatePosition(dvec3 update) {
-        if (is_movable) {
+    void updatePosition(Vec3 update) {
+        if (is_movable && !is_asleep) {
             current_pos += update;
         }
     }
@@ -128,9 +182,11 @@ public:
      * Returns the normal
      * @return the normal
      */
-    dvec3 getNormal() {
+    Vec3 getNormal() {
         return normal;
     }
 };
 
+typedef ParticleT<double> Particle;
+
 #endif //CLOTH_SIMULATION_PARTICLE_H
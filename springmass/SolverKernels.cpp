@@ -0,0 +1,8 @@
+//
+// Explicit instantiations of the cloth and its specialized step kernels.
+//
+
+#include "Cloth.h"
+
+STEP_SPECIALIZATIONS(template, double)
+STEP_SPECIALIZATIONS(template, float)
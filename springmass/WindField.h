@@ -0,0 +1,211 @@
+//
+// Turbulent wind: a periodic grid of gust velocities which changes over time, sampled at the triangles of the cloths.
+//
+
+#ifndef CLOTH_SIMULATION_WINDFIELD_H
+#define CLOTH_SIMULATION_WINDFIELD_H
+
+#include <bits/stdc++.h>
+#include <glm/glm.hpp>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "../common/CounterRandom.h"
+#include "../common/SceneConfig.h"
+
+using namespace std;
+using namespace glm;
+
+#define WIND_RESOLUTION 16 // default number of grid nodes along each axis
+#define WIND_GUST_SIZE 4.0 // default distance between neighbouring nodes, about the size of a gust
+#define WIND_GUST_PERIOD 120 // default number of frames from one random keyframe of the gusts to the next
+
+/**
+ * Gusts added to the uniform wind. The gust at each node of a grid is blended from one random keyframe to the
+ * next over "gust_period" frames; the keyframe after the next one is generated a slice per frame, so that no frame
+ * pays for a whole grid. The grid repeats in space and drifts with "gust_velocity", so it covers cloths
+ * anywhere in the scene. Every keyframe is a pure function of the seed and its number, so the gusts of a frame
+ * do not depend on where the simulation started, e.g. when resuming from a checkpoint.
+ *
+ * The nodes hold the three components and a padding float, so a node is one 16 byte load and the trilinear
+ * interpolation of a sample blends all three components at once with SSE2.
+ */
+class WindField {
+    uint32_t bits; // log2 of the number of nodes along each axis
+    uint32_t mask; // nodes along each axis - 1
+    size_t num_nodes;
+    double cell; // distance between neighbouring nodes
+    double strength; // largest gust along each axis
+    dvec3 velocity; // drift of the grid per frame
+    unsigned long period; // frames from one keyframe to the next
+    CounterRandom random;
+
+    vector<float> keys[3]; // the previous, the next and the following keyframe, 4 floats per node
+    size_t generated; // nodes of the following keyframe generated so far
+    vector<float> nodes; // the gusts of the current frame, 4 floats per node
+    long frame; // frame the nodes are blended for, -1 before the first
+    float origin[4]; // position of node 0 in the current frame, wrapped into one period of the grid
+    float inverse_cell;
+
+    // bound of the grid coordinates of a sample; a multiple of the period of the grid, and past 2^23 a float has
+    // no fraction left, so clamping far away points to it only picks a defined node
+    static constexpr float max_coordinate = 1073741824.0f;
+
+    /**
+     * Generates nodes of a keyframe
+     * @param key number of the keyframe
+     * @param values the keyframe
+     * @param begin first node to generate
+     * @param end node after the last one to generate
+     */
+    void generate(unsigned long key, vector<float> &values, size_t begin, size_t end) const {
+        for (size_t n = begin; n < end; ++n) {
+            uint64_t counter = (uint64_t) key * num_nodes + n;
+            for (uint32_t axis = 0; axis < 3; ++axis)
+                values[4 * n + axis] = (float) (strength * (2 * random.uniform(counter, axis) - 1));
+            values[4 * n + 3] = 0;
+        }
+    }
+
+    /**
+     * Returns the index of a node
+     * @param x,y,z coordinates of the node, already wrapped
+     */
+    size_t node(uint32_t x, uint32_t y, uint32_t z) const {
+        return ((size_t) z << (2 * bits)) | ((size_t) y << bits) | x;
+    }
+
+public:
+    /**
+     * Constructor reading the gusts from the [wind] section of a scene: "turbulence", the largest gust along each
+     * axis in the units of "force", or of "air_velocity" for cloths with drag or lift; "gust_size", the distance
+     * between the nodes; "gust_period", the frames from one keyframe to the next; "gust_velocity", the drift of the
+     * gusts per frame; "resolution", rounded up to a power of two; and "seed"
+     * @param section the section
+     */
+    explicit WindField(const SceneSection &section)
+            : cell(std::max(section.getDouble("gust_size", WIND_GUST_SIZE), 1e-6)),
+              strength(section.getDouble("turbulence", 0)), velocity(section.getVec3("gust_velocity", dvec3(0))),
+              period(std::max(section.getInt("gust_period", WIND_GUST_PERIOD), 1L)),
+              random(section.getInt("seed", 1)), generated(0), frame(-1) {
+        long resolution = std::min(std::max(section.getInt("resolution", WIND_RESOLUTION), 2L), 256L);
+        bits = 1;
+        while ((1L << bits) < resolution)
+            ++bits;
+        mask = (1u << bits) - 1;
+        num_nodes = (size_t) 1 << (3 * bits);
+        inverse_cell = (float) (1 / cell);
+        for (int k = 0; k < 3; ++k)
+            keys[k].assign(4 * num_nodes, 0);
+        nodes.assign(4 * num_nodes, 0);
+        memset(origin, 0, sizeof(origin));
+    }
+
+    /**
+     * Returns whether there are any gusts
+     * @return false if the turbulence is 0
+     */
+    bool isEnabled() const {
+        return strength != 0;
+    }
+
+    /**
+     * Blends the gusts of a frame. Moving on by one frame only blends the grid and generates a slice of the
+     * following keyframe; any other frame regenerates the keyframes around it.
+     * @param new_frame the frame
+     */
+    void setFrame(unsigned long new_frame) {
+        if ((long) new_frame == frame)
+            return;
+        unsigned long key = new_frame / period, phase = new_frame % period;
+        if (frame < 0 || (long) new_frame != frame + 1) {
+            generate(key, keys[0], 0, num_nodes);
+            generate(key + 1, keys[1], 0, num_nodes);
+            generated = 0;
+        } else if (phase == 0) {
+            //the following keyframe is complete by now and becomes the next one
+            swap(keys[0], keys[1]);
+            swap(keys[1], keys[2]);
+            generated = 0;
+        }
+        size_t target = std::min(num_nodes, (num_nodes * (phase + 1) + period - 1) / period);
+        generate(key + 2, keys[2], generated, target);
+        generated = target;
+        frame = new_frame;
+
+        double s = (double) phase / period;
+        float blend = (float) (s * s * (3 - 2 * s)); // eases in and out of every keyframe
+        const float *previous = keys[0].data(), *next = keys[1].data();
+        for (size_t i = 0; i < nodes.size(); ++i)
+            nodes[i] = previous[i] + (next[i] - previous[i]) * blend;
+
+        double size = cell * (mask + 1);
+        for (int axis = 0; axis < 3; ++axis) {
+            double shift = fmod(velocity[axis] * (double) new_frame, size);
+            origin[axis] = (float) (shift < 0 ? shift + size : shift);
+        }
+        origin[3] = 0;
+    }
+
+    /**
+     * Interpolates the gusts at a batch of points
+     * @param points the points, 4 floats each of which the last is ignored
+     * @param count number of points
+     * @param gusts filled with the gust at each point, 4 floats each of which the last is 0
+     */
+    void sample(const float *points, size_t count, float *gusts) const {
+        const float *grid = nodes.data();
+#ifdef __SSE2__
+        const __m128 shift = _mm_loadu_ps(origin), scale = _mm_set1_ps(inverse_cell), one = _mm_set1_ps(1);
+        const __m128 reach = _mm_set1_ps(max_coordinate), least = _mm_set1_ps(-max_coordinate);
+        const __m128i wrap = _mm_set1_epi32((int) mask), next = _mm_set1_epi32(1);
+        alignas(16) int32_t low[4], high[4];
+        for (size_t i = 0; i < count; ++i) {
+            __m128 g = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(points + 4 * i), shift), scale);
+            //the conversion turns coordinates out of the range of int32_t into INT_MIN, max takes the bound for NaN
+            g = _mm_min_ps(_mm_max_ps(g, least), reach);
+            //floor, as the truncation rounds negative coordinates up
+            __m128i c = _mm_cvttps_epi32(g);
+            c = _mm_add_epi32(c, _mm_castps_si128(_mm_cmplt_ps(g, _mm_cvtepi32_ps(c))));
+            __m128 f = _mm_sub_ps(g, _mm_cvtepi32_ps(c));
+            _mm_store_si128(reinterpret_cast<__m128i *>(low), _mm_and_si128(c, wrap));
+            _mm_store_si128(reinterpret_cast<__m128i *>(high), _mm_and_si128(_mm_add_epi32(c, next), wrap));
+            __m128 fx = _mm_shuffle_ps(f, f, 0x00), fy = _mm_shuffle_ps(f, f, 0x55), fz = _mm_shuffle_ps(f, f, 0xaa);
+            __m128 gx = _mm_sub_ps(one, fx), gy = _mm_sub_ps(one, fy), gz = _mm_sub_ps(one, fz);
+            //all three components of two nodes blended along x at once
+            auto alongX = [&](int32_t y, int32_t z) {
+                return _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(grid + 4 * node(low[0], y, z)), gx),
+                                  _mm_mul_ps(_mm_loadu_ps(grid + 4 * node(high[0], y, z)), fx));
+            };
+            __m128 c0 = _mm_add_ps(_mm_mul_ps(alongX(low[1], low[2]), gy), _mm_mul_ps(alongX(high[1], low[2]), fy));
+            __m128 c1 = _mm_add_ps(_mm_mul_ps(alongX(low[1], high[2]), gy), _mm_mul_ps(alongX(high[1], high[2]), fy));
+            _mm_storeu_ps(gusts + 4 * i, _mm_add_ps(_mm_mul_ps(c0, gz), _mm_mul_ps(c1, fz)));
+        }
+#else
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t low[3], high[3];
+            float f[3];
+            for (int axis = 0; axis < 3; ++axis) {
+                float g = (points[4 * i + axis] - origin[axis]) * inverse_cell;
+                g = fmin(fmax(g, -max_coordinate), max_coordinate); // in the range of int32_t, NaN on the bound
+                float c = floor(g);
+                f[axis] = g - c;
+                low[axis] = (uint32_t) (int32_t) c & mask;
+                high[axis] = (low[axis] + 1) & mask;
+            }
+            for (int axis = 0; axis < 3; ++axis) {
+                const float *v = grid + axis;
+                auto alongX = [&](uint32_t y, uint32_t z) {
+                    return v[4 * node(low[0], y, z)] * (1 - f[0]) + v[4 * node(high[0], y, z)] * f[0];
+                };
+                float c0 = alongX(low[1], low[2]) * (1 - f[1]) + alongX(high[1], low[2]) * f[1];
+                float c1 = alongX(low[1], high[2]) * (1 - f[1]) + alongX(high[1], high[2]) * f[1];
+                gusts[4 * i + axis] = c0 * (1 - f[2]) + c1 * f[2];
+            }
+            gusts[4 * i + 3] = 0;
+        }
+#endif
+    }
+};
+
+#endif //CLOTH_SIMULATION_WINDFIELD_H
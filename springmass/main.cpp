@@ -3,30 +3,45 @@
 //
 
 #include "Cloth.h"
+#include "ClothScene.h"
+#include "FrameGovernor.h"
+#include "../common/PrecisionReport.h"
+#include "../common/FramePlayer.h"
+#include "../common/Ensemble.h"
+#include "../common/RegressionReport.h"
 
 using namespace std;
 using namespace glm;
 
-double multiplierBall1 = 7;
-double multiplierBall2 = 2;
-dvec3 ball1Position(7, -5, 0); // the center of the first ball
-dvec3 ball2Position(4, -5, 2); // the center of the second ball
-double ballRadius = 2; // the radius of the ball
-double ballZ = 0; // counter for used to calculate the z coordinates of the ball
-double ballX = 0;
-double cloth_width = 14;
-double cloth_height = 10;
-unsigned long cloth_nrow = 55;
-unsigned long cloth_ncol = 45;
-double cloth_mass = 1;
+#define PLAYBACK_FPS 60 // frames shown per second when a cache is played back
+
 Color ballColor = {0.5, 0.6, 0.1};
-int width = 1366 // width of the window
-int height = 768 // height of the window
+int width = 1366; // width of the window
+int height = 768; // height of the window
 Color clothColorPrimary = {0.9, 0.1, 0.1};
 Color clothColorSecondary = {0.1, 0.1, 0.1};
-dvec3 clothPosition(0, -2, 0);
+double tearRatio = 1.5; // ratio of current length to rest length beyond which the cloth tears
+unsigned long frameCount = 0; // number of frames simulated so far
 
-Cloth cloth1(clothPosition, cloth_height, cloth_width, cloth_ncol, cloth_nrow, cloth_mass);
+SceneConfig scene; // scene description given on the command line, empty for the default scene
+SimulationParameters params; // settings of the solver
+vector<MovingCollider> colliders; // the balls and capsules
+vector<dvec3> colliderPositions; // current centres of the balls and capsules
+vector<MeshCollider> meshColliders; // the static meshes, such as bodies
+vector<unique_ptr<SignedDistanceField> > meshFields; // distance field of each static mesh
+vector<vector<dvec3> > meshPositions; // vertices of each static mesh where it is placed, for drawing
+vector<const vector<array<uint32_t, 3> > *> meshTriangles; // triangles of each static mesh, for drawing
+ClothScene *clothScene; // all the cloths of the scene
+Cloth *cloth1; // the first cloth of the scene, the one which is checkpointed, cached and played back
+StepInput stepInput; // forces and colliders of the current frame, reused to avoid allocations
+WindField *windField; // gusts added to the wind
+int meshCurve = CURVE_HILBERT; // curve along which the particles of imported meshes are sorted
+string checkpointPath = "cloth.ckpt"; // where checkpoints are saved
+unsigned long checkpointInterval = 0; // frames between automatic checkpoints, 0 to save only on request
+FrameGovernor *governor; // adapts the solver effort to the frame time budget
+FrameCacheWriter frameCache; // streams the positions of every frame to disk if a cache is requested
+vector<dvec3> cachePositions; // positions handed to the frame cache, reused to avoid allocations
+FramePlayer *player = nullptr; // plays a frame cache back instead of simulating, see --play
 dvec3 cameraPosition = dvec3(-6.5, 6, -9.0);
 double roll_angle = 0, pitch_angle = 25, yaw_angle = 0;
 
@@ -34,6 +49,8 @@ double roll_angle = 0, pitch_angle = 25, yaw_angle = 0;
  * Function which assembles the various objects and creates the scene with the ball
  */
 void renderSceneBall() {
+    PROFILE_SCOPE("draw");
+    governor->startWork();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glLoadIdentity();
 
@@ -45,27 +62,144 @@ void renderSceneBall() {
     glRotated(pitch_angle, 0, 1, 0);
     glRotated(yaw_angle, 1, 0, 0);
 
-    //draw cloth
-    cloth1.draw(clothColorPrimary, clothColorSecondary);
+    //draw cloths
+    for (size_t i = 0; i < clothScene->size(); ++i)
+        clothScene->get(i)->draw(clothColorPrimary, clothColorSecondary);
 
-    //draw balls
-    glPushMatrix();
-    glTranslated(ball1Position.x, ball1Position.y,
-                 ball1Position.z);
-    glColor3d(ballColor.r, ballColor.b, ballColor.g);
-    glutSolidSphere(ballRadius - 0.1, 64, 64); // draw the sphere. radius reduced a bit to avoid minute collisions
-    glPopMatrix();
+    //draw balls and capsules
+    for (int i = 0; i < colliders.size(); ++i) {
+        glPushMatrix();
+        glColor3d(ballColor.r, ballColor.b, ballColor.g);
+        dvec3 axis = colliders[i].axis, end = colliderPositions[i] - axis / 2.0;
+        double radius = colliders[i].radius - 0.1; // radius reduced a bit to avoid minute collisions
+        glTranslated(end.x, end.y, end.z);
+        glutSolidSphere(radius, 64, 64); // draw the sphere, or one end of the capsule
+        double axis_length = length(axis);
+        if (axis_length > 0) {
+            //gluCylinder runs along z, turn it onto the axis
+            dvec3 turn = cross(dvec3(0, 0, 1), axis);
+            double angle = atan2(length(turn), axis.z) * 180 / M_PI;
+            if (length(turn) > 0)
+                glRotated(angle, turn.x, turn.y, turn.z);
+            else
+                glRotated(angle, 1, 0, 0);
+            GLUquadric *quadric = gluNewQuadric();
+            gluCylinder(quadric, radius, radius, axis_length, 64, 1);
+            gluDeleteQuadric(quadric);
+            glTranslated(0, 0, axis_length);
+            glutSolidSphere(radius, 64, 64);
+        }
+        glPopMatrix();
+    }
 
-    glPushMatrix();
-    glTranslated(ball2Position.x, ball2Position.y,
-                 ball2Position.z);
+    //draw the static meshes
     glColor3d(ballColor.r, ballColor.b, ballColor.g);
-    glutSolidSphere(ballRadius - 0.1, 64, 64); // draw the sphere. radius reduced a bit to avoid minute collisions
-    glPopMatrix();
+    glBegin(GL_TRIANGLES);
+    for (size_t i = 0; i < meshColliders.size(); ++i) {
+        const vector<dvec3> &positions = meshPositions[i];
+        for (const array<uint32_t, 3> &t : *meshTriangles[i]) {
+            dvec3 normal = triangleNormal(positions[t[0]], positions[t[2]], positions[t[1]]);
+            glNormal3d(normal.x, normal.y, normal.z);
+            for (int k = 0; k < 3; ++k)
+                glVertex3d(positions[t[k]].x, positions[t[k]].y, positions[t[k]].z);
+        }
+    }
+    glEnd();
 
+    //the swap waits for the display, which is not work the governor can save
+    governor->stopWork();
     glutSwapBuffers();
 }
 
+/**
+ * Saves the state of the cloth to the checkpoint file, reporting failures
+ */
+void saveCheckpoint() {
+    PROFILE_SCOPE("checkpoint");
+    string error;
+    if (cloth1->saveCheckpoint(checkpointPath, frameCount, error))
+        cout << "saved checkpoint of frame " << frameCount << " to " << checkpointPath << endl;
+    else
+        cerr << error << endl;
+}
+
+/**
+ * Starts streaming every simulated frame to the cache described by the [cache] section of the scene
+ * @param path path of the cache, overriding the scene; nullptr to use the path of the scene, if any
+ */
+void openFrameCache(const char *path) {
+    const SceneSection &section = scene.section("cache");
+    string cachePath = section.getString("path", "");
+    double error_bound = section.getDouble("error", 1e-4);
+    long keyframe_interval = section.getInt("keyframe_interval", 30);
+    if (path)
+        cachePath = path;
+    if (cachePath.empty())
+        return;
+    string error;
+    if (!frameCache.open(cachePath, error_bound, keyframe_interval, error)) {
+        cerr << error << endl;
+        exit(1);
+    }
+    atexit([] {
+        string error;
+        if (!frameCache.close(error))
+            cerr << error << endl;
+        else if (frameCache.getNumFrames() > 0)
+            cout << "cached " << frameCache.getNumFrames() << " frames in " << frameCache.getBytesWritten()
+                 << " bytes" << endl;
+    });
+}
+
+/**
+ * Plays, pauses or scrubs a played back cache
+ * @param key space to play or pause, ',' and '.' to step one frame, '[' and ']' to jump 100 frames
+ */
+void controlPlayback(unsigned char key) {
+    switch (key) {
+        case ' ':
+            player->setPlaying(!player->isPlaying());
+            break;
+        case ',':
+            player->skip(-1);
+            break;
+        case '.':
+            player->skip(1);
+            break;
+        case '[':
+            player->skip(-100);
+            break;
+        case ']':
+            player->skip(100);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Scrubs a played back cache by dragging the mouse: the width of the window spans all the frames
+ * @param x horizontal position of the mouse
+ * @param y vertical position of the mouse
+ */
+void scrub(int x, int y) {
+    int w = max(glutGet(GLUT_WINDOW_WIDTH), 1);
+    player->seek((long) ((double) x / w * player->getNumFrames()));
+    glutPostRedisplay();
+}
+
+/**
+ * Starts scrubbing when the left mouse button is pressed
+ * @param button the button
+ * @param state whether it was pressed or released
+ * @param x horizontal position of the mouse
+ * @param y vertical position of the mouse
+ */
+void mousePress(int button, int state, int x, int y) {
+    if (button == GLUT_LEFT_BUTTON && state == GLUT_DOWN)
+        scrub(x, y);
+}
+
 /**
  * Handles key presses
  * @param key the keyboard input given by the user
@@ -122,6 +256,34 @@ void keyPress(unsigned char key, int x, int y) {
         case 'x':
             roll_angle += 1;
             break;
+            //Toggle tearing
+        case 't':
+            for (size_t i = 0; i < clothScene->size(); ++i)
+                clothScene->get(i)->setTearing(!cloth1->isTearing(), tearRatio);
+            break;
+            //Toggle sleeping of settled regions
+        case 'p':
+            for (size_t i = 0; i < clothScene->size(); ++i)
+                clothScene->get(i)->setSleeping(!cloth1->isSleeping());
+            break;
+            //Toggle the frame budget governor
+        case 'g':
+            governor->setEnabled(!governor->isEnabled());
+            break;
+            //Save a checkpoint
+        case 'c':
+            saveCheckpoint();
+            break;
+            //Play, pause and step through a played back cache
+        case ' ':
+        case ',':
+        case '.':
+        case '[':
+        case ']':
+            if (!player)
+                return;
+            controlPlayback(key);
+            break;
         default:
             return;
     }
@@ -172,27 +334,579 @@ void reshape(int w, int h) {
     glLoadIdentity();
 }
 
+/**
+ * Moves on to the next frame: moves the balls and fills in the forces and colliders of the step
+ * @param iterations number of sweeps over the constraints
+ * @param collisions whether collisions are resolved in this frame
+ */
+void prepareStep(int iterations, bool collisions) {
+    ++frameCount;
+    for (int i = 0; i < colliders.size(); ++i)
+        colliderPositions[i] = colliders[i].positionAt(frameCount);
+
+    double time_step_squared = params.time_step * params.time_step;
+    stepInput.gravity = params.gravity * time_step_squared; // add gravity
+    stepInput.wind = params.wind * time_step_squared; // add wind
+    stepInput.gusts = windField->isEnabled() ? windField : nullptr;
+    stepInput.gust_scale = time_step_squared;
+    if (stepInput.gusts)
+        windField->setFrame(frameCount);
+    stepInput.iterations = iterations;
+    stepInput.collisions = collisions;
+    stepInput.colliders.resize(colliders.size());
+    for (int i = 0; i < colliders.size(); ++i)
+        stepInput.colliders[i] = {colliders[i].positionAt(frameCount - 1), colliderPositions[i], colliders[i].axis,
+                                  colliders[i].radius};
+    stepInput.meshes.resize(meshColliders.size());
+    for (size_t i = 0; i < meshColliders.size(); ++i)
+        stepInput.meshes[i] = make_pair(meshFields[i].get(), meshColliders[i].thickness);
+}
+
 /**
  * Handles updates of positions
  */
 void idle() {
+    PROFILE_FRAME();
+    governor->nextFrame();
+    governor->startWork();
     // calculating positions
-    ball1Position.z = multiplierBall1 * cos(++ballZ / 50.0);
-    ball2Position.x = multiplierBall2 * cos(++ballX / 50.0);
-
-    cloth1.applyUniformForceAll(dvec3(0, -0.2, 0) * pow(TIME_STEP, 2)); // add gravity
-    cloth1.applyTriangleNormalForce(dvec3(0.001, 0, 0.01) * pow(TIME_STEP, 2)); // add wind
-    cloth1.simulateCloth(); // calculate the particle positions
-    cloth1.resolveSphereCollision(ball1Position, ballRadius);
-    cloth1.resolveSphereCollision(ball2Position, ballRadius);
+    prepareStep(governor->getIterations(), governor->shouldResolveCollisions());
+    clothScene->step(stepInput); // calculate the particle positions
+    if (frameCache.isOpen()) {
+        PROFILE_SCOPE("cache");
+        cloth1->getPositions(cachePositions);
+        frameCache.addFrame(cachePositions); // coded and written on the thread of the cache
+    }
+    governor->stopWork();
+    if (checkpointInterval > 0 && frameCount % checkpointInterval == 0)
+        saveCheckpoint();
+
+    //show the chosen quality and the achieved latency
+    if (frameCount % 60 == 0) {
+        ostringstream title;
+        title << "Cloth Simulation - quality " << governor->getQualityLevel() + 1 << "/"
+              << governor->getNumQualityLevels() << ", p95 " << fixed << setprecision(1) << governor->getP95()
+              << " ms of " << governor->getTarget() << " ms" << (governor->isEnabled() ? "" : " (governor off)");
+        glutSetWindowTitle(title.str().c_str());
+    }
     glutPostRedisplay();
 }
 
-int main()
+/**
+ * Shows the current frame of a played back cache, advancing it while playing, at PLAYBACK_FPS
+ * @param value unused
+ */
+void playbackTimer(int value) {
+    PROFILE_FRAME();
+    player->advance();
+    shared_ptr<const vector<dvec3> > frame = player->currentFrame();
+    cloth1->setPositions(*frame);
+    for (int i = 0; i < colliders.size(); ++i)
+        colliderPositions[i] = colliders[i].positionAt(player->getCurrentFrame() + 1); // frame 0 is the first step
+
+    ostringstream title;
+    title << "Cloth Simulation - frame " << player->getCurrentFrame() + 1 << "/" << player->getNumFrames()
+          << (player->isPlaying() ? "" : " (paused)");
+    glutSetWindowTitle(title.str().c_str());
+    glutPostRedisplay();
+    glutTimerFunc(1000 / PLAYBACK_FPS, playbackTimer, 0);
+}
+
+/**
+ * Opens a frame cache for playback. The cloth of the scene is only used to draw the cached positions.
+ * @param path path of the cache
+ */
+void openPlayer(const char *path) {
+    player = new FramePlayer();
+    string error;
+    if (!player->open(path, error)) {
+        cerr << error << endl;
+        exit(1);
+    }
+    vector<dvec3> positions;
+    cloth1->getPositions(positions);
+    if (player->getNumParticles() != positions.size()) {
+        cerr << path << " holds " << player->getNumParticles() << " particles, the cloth of the scene has "
+             << positions.size() << endl;
+        exit(1);
+    }
+    player->setPlaying(true);
+}
+
+/**
+ * Pins the particles listed by the "row" and "pin" keys of a section
+ * @param cloth the cloth
+ * @param section the section
+ * @param cloth_ncol number of rows of particles
+ * @param cloth_nrow number of columns of particles
+ */
+void pinParticles(Cloth *cloth, const SceneSection &section, unsigned long cloth_ncol, unsigned long cloth_nrow) {
+    for (const string &row : section.getAll("row")) {
+        istringstream in(row);
+        int i;
+        if (!(in >> i) || i < 0 || i >= cloth_ncol) {
+            cerr << "scene: ignoring invalid pinned row " << row << endl;
+            continue;
+        }
+        for (int j = 0; j < cloth_nrow; ++j)
+            cloth->makeParticleImmovable(i, j);
+    }
+    for (const string &pin : section.getAll("pin")) {
+        istringstream in(pin);
+        int i, j;
+        if (in >> i >> j && i >= 0 && i < cloth_ncol && j >= 0 && j < cloth_nrow)
+            cloth->makeParticleImmovable(i, j);
+        else
+            cerr << "scene: ignoring invalid pin " << pin << endl;
+    }
+}
+
+/**
+ * Imports the OBJ file of a garment, once per file and curve however many cloths use it. Exits if the file cannot
+ * be loaded.
+ * @param path path of the file
+ * @param curve the CURVE_* curve to sort the particles along
+ * @return the mesh
+ */
+const ClothMesh &loadMesh(const string &path, int curve) {
+    static map<pair<string, int>, unique_ptr<ClothMesh> > meshes;
+    static mutex meshes_mutex; //the variants of an ensemble are created concurrently
+    lock_guard<mutex> lock(meshes_mutex);
+    unique_ptr<ClothMesh> &mesh = meshes[make_pair(path, curve)];
+    if (!mesh) {
+        mesh.reset(new ClothMesh());
+        string error;
+        auto start = chrono::steady_clock::now();
+        if (!mesh->loadObj(path, error, curve)) {
+            cerr << error << endl;
+            exit(1);
+        }
+        cerr << path << ": " << mesh->positions.size() << " particles, " << mesh->triangles.size() << " triangles, "
+             << mesh->edges.size() << " edges in "
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+    }
+    return *mesh;
+}
+
+/**
+ * Places the mesh of a static collider and gets its distance field: from the cache of the collider if it was built
+ * from the same mesh and settings, else by building it and saving it to the cache. Exits if the mesh cannot be
+ * loaded or the field cannot be built.
+ * @param collider the collider
+ */
+void loadMeshCollider(const MeshCollider &collider) {
+    const ClothMesh &mesh = loadMesh(collider.mesh, CURVE_NONE);
+    vector<dvec3> positions(mesh.positions.size());
+    dvec3 low(numeric_limits<double>::max()), high(-numeric_limits<double>::max());
+    for (size_t i = 0; i < positions.size(); ++i) {
+        positions[i] = mesh.positions[i] * collider.scale + collider.position;
+        low = glm::min(low, positions[i]);
+        high = glm::max(high, positions[i]);
+    }
+    dvec3 size = high - low;
+    double cell = collider.cell > 0 ? collider.cell : std::max(std::max(size.x, size.y), size.z) / MESH_COLLIDER_CELLS;
+    double band = collider.band > 0 ? collider.band : cell * MESH_COLLIDER_BAND;
+
+    unique_ptr<SignedDistanceField> field(new SignedDistanceField());
+    uint64_t key = SignedDistanceField::fingerprint(positions, mesh.triangles, cell, band);
+    string error;
+    auto start = chrono::steady_clock::now();
+    if (!collider.cache.empty() && field->load(collider.cache, key, error)) {
+        cerr << collider.cache << ": distance field of " << field->getBytes() / 1024 << " KB loaded in ";
+    } else {
+        if (!field->build(positions, mesh.triangles, cell, band, error)) {
+            cerr << collider.mesh << ": " << error << endl;
+            exit(1);
+        }
+        if (!collider.cache.empty() && !field->save(collider.cache, error))
+            cerr << error << endl;
+        cerr << collider.mesh << ": distance field of " << field->getBytes() / 1024 << " KB built in ";
+    }
+    cerr << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+    meshFields.push_back(move(field));
+    meshPositions.push_back(positions);
+    meshTriangles.push_back(&mesh.triangles);
+}
+
+/**
+ * Creates a garment from the OBJ file named by the "mesh" key of a [cloth] section. It is pinned at the vertices
+ * listed by the "pin" keys of the section, counted from 1 as in the file, or else at its top. The [pins] sections,
+ * which name particles of grids, do not apply to it.
+ * @param section the [cloth] section
+ * @param clothParams settings of the solver for the cloth
+ * @param offset displacement of the cloth from the position given in the section
+ * @param extent set to the length of the diagonal of the bounding box of the mesh
+ * @param curve the CURVE_* curve to sort the particles along
+ * @return the cloth
+ */
+Cloth *createMeshCloth(const SceneSection &section, const SimulationParameters &clothParams, dvec3 offset,
+                       double &extent, int curve = meshCurve) {
+    const ClothMesh &mesh = loadMesh(scene.resolve(section.getString("mesh", "")), curve);
+    dvec3 low(numeric_limits<double>::max()), high(-numeric_limits<double>::max());
+    for (const dvec3 &p : mesh.positions) {
+        low = glm::min(low, p);
+        high = glm::max(high, p);
+    }
+    extent = length(high - low);
+    Cloth *cloth = Cloth::create(mesh, section.getVec3("position", dvec3(0)) + offset, section.getDouble("mass", 1),
+                                 clothParams);
+
+    for (const string &pin : section.getAll("pin")) {
+        istringstream in(pin);
+        long v;
+        if (in >> v && v >= 1 && v <= (long) mesh.particle_of_vertex.size() &&
+            mesh.particle_of_vertex[v - 1] != CLOTH_MESH_NONE)
+            cloth->makeParticleImmovable(0, mesh.particle_of_vertex[v - 1]);
+        else
+            cerr << "scene: ignoring invalid pin " << pin << endl;
+    }
+    if (section.getAll("pin").empty()) {
+        for (uint32_t p : mesh.topParticles())
+            cloth->makeParticleImmovable(0, p);
+    }
+    return cloth;
+}
+
+/**
+ * Creates a cloth described by a [cloth] section of the scene: the garment of its "mesh" if it has one, see
+ * createMeshCloth, else a grid. A grid is pinned by the "row" and "pin" keys of the section, or if it has none
+ * by the [pins] sections, or else along its top row.
+ * @param section the [cloth] section
+ * @param clothParams settings of the solver for the cloth
+ * @param offset displacement of the cloth from the position given in the section
+ * @param extent set to the length of the diagonal of the cloth
+ * @return the cloth
+ */
+Cloth *createCloth(const SceneSection &section, const SimulationParameters &clothParams, dvec3 offset,
+                   double &extent) {
+    if (section.has("mesh"))
+        return createMeshCloth(section, clothParams, offset, extent);
+    unsigned long cloth_nrow = section.getInt("columns", 55);
+    unsigned long cloth_ncol = section.getInt("rows", 45);
+    double cloth_height = section.getDouble("height", 10), cloth_width = section.getDouble("width", 14);
+    extent = sqrt(cloth_height * cloth_height + cloth_width * cloth_width);
+    Cloth *cloth = Cloth::create(section.getVec3("position", dvec3(0, -2, 0)) + offset, cloth_height, cloth_width,
+                                 cloth_ncol, cloth_nrow, section.getDouble("mass", 1), clothParams);
+
+    //anchor cloth, by default along the top row
+    vector<const SceneSection *> pins = scene.all("pins");
+    if (!section.getAll("row").empty() || !section.getAll("pin").empty()) {
+        pinParticles(cloth, section, cloth_ncol, cloth_nrow);
+    } else if (!pins.empty()) {
+        for (const SceneSection *pinSection : pins)
+            pinParticles(cloth, *pinSection, cloth_ncol, cloth_nrow);
+    } else {
+        for (int i = 0; i < cloth_nrow; ++i)
+            cloth->makeParticleImmovable(0, i);
+    }
+    return cloth;
+}
+
+/**
+ * Builds the scene from a scene file, or the default scene if none is given
+ * @param path path of the scene file, nullptr for the default scene
+ * @param resumePath path of a checkpoint to take the first cloth from, nullptr to create the cloths of the scene
+ */
+void loadScene(const char *path, const char *resumePath) {
+    if (path) {
+        string error;
+        if (!scene.load(path, error)) {
+            cerr << error << endl;
+            exit(1);
+        }
+    }
+    params = SimulationParameters::fromScene(scene);
+    colliders = MovingCollider::fromScene(scene);
+    if (scene.all("collider").empty()) {
+        colliders.push_back({dvec3(7, -5, 0), dvec3(0, 0, 7), 1 / 50.0, 2, dvec3(0)});
+        colliders.push_back({dvec3(0, -5, 2), dvec3(2, 0, 0), 1 / 50.0, 2, dvec3(0)});
+    }
+    colliderPositions.resize(colliders.size());
+    meshColliders = MeshCollider::fromScene(scene);
+    for (const MeshCollider &collider : meshColliders)
+        loadMeshCollider(collider);
+    windField = new WindField(scene.section("wind"));
+
+    const SceneSection &checkpoint = scene.section("checkpoint");
+    checkpointPath = checkpoint.getString("path", checkpointPath);
+    checkpointInterval = checkpoint.getInt("interval", 0);
+
+    //every [cloth] section adds "count" cloths, each "offset" away from the previous one
+    const SceneSection &solver = scene.section("solver");
+    string curve = solver.getString("reorder", "hilbert");
+    if (!ParticleOrder::curveFromName(curve, meshCurve))
+        cerr << "scene: ignoring unknown reorder curve " << curve << endl;
+    clothScene = new ClothScene(params.constraint_iterations, max(solver.getInt("threads", 0), 0L));
+    vector<const SceneSection *> sections = scene.all("cloth");
+    SceneSection defaultCloth("cloth");
+    if (sections.empty())
+        sections.push_back(&defaultCloth);
+    for (const SceneSection *section : sections) {
+        SimulationParameters clothParams = params;
+        clothParams.apply(*section);
+        long count = section->getInt("count", 1);
+        dvec3 offset = section->getVec3("offset", dvec3(0, 0, 0));
+        for (long k = 0; k < count; ++k) {
+            double extent;
+            clothScene->add(createCloth(*section, clothParams, offset * (double) k, extent));
+        }
+    }
+    if (clothScene->size() == 0) {
+        cerr << "scene: no cloths" << endl;
+        exit(1);
+    }
+
+    if (resumePath) {
+        //the checkpoint brings its own cloth and solver settings
+        string error;
+        Cloth *restored = Cloth::loadCheckpoint(resumePath, frameCount, error);
+        if (!restored) {
+            cerr << error << endl;
+            exit(1);
+        }
+        clothScene->replace(0, restored);
+        params = restored->getParameters();
+    }
+    cloth1 = clothScene->get(0);
+    tearRatio = params.tear_ratio;
+
+    governor = new FrameGovernor(solver.getDouble("target_frame_time", 16.0), solver.getInt("min_iterations", 2),
+                                 params.constraint_iterations, solver.getInt("max_collision_interval", 4));
+    governor->setEnabled(solver.getBool("governor", false)); // off unless the scene asks for it, or 'g' is pressed
+}
+
+/**
+ * Simulates the scene in double and in single precision side by side, without a window,
+ * and prints how far the single precision cloth drifts from the double precision one
+ * @param steps number of steps to simulate
+ */
+void runPrecisionReport(unsigned long steps) {
+    SimulationParameters reportParams = params;
+    double extent;
+    vector<const SceneSection *> sections = scene.all("cloth");
+    SceneSection defaultCloth("cloth");
+    const SceneSection &section = sections.empty() ? defaultCloth : *sections[0];
+    reportParams.apply(section);
+    reportParams.single_precision = false;
+    Cloth *reference = createCloth(section, reportParams, dvec3(0), extent);
+    reportParams.single_precision = true;
+    Cloth *single = createCloth(section, reportParams, dvec3(0), extent);
+
+    PrecisionReport report(extent);
+    vector<dvec3> referencePositions, singlePositions;
+    unsigned long interval = max(steps / 20, 1UL);
+    for (unsigned long s = 1; s <= steps; ++s) {
+        PROFILE_FRAME();
+        prepareStep(params.constraint_iterations, true);
+        auto start = chrono::steady_clock::now();
+        reference->step(stepInput);
+        auto middle = chrono::steady_clock::now();
+        single->step(stepInput);
+        auto end = chrono::steady_clock::now();
+        report.addTiming(chrono::duration<double, milli>(middle - start).count(),
+                         chrono::duration<double, milli>(end - middle).count());
+        if (s % interval == 0 || s == steps) {
+            reference->getPositions(referencePositions);
+            single->getPositions(singlePositions);
+            report.sample(s, referencePositions, singlePositions);
+        }
+    }
+    PROFILE_FRAME(); // closes the last step
+    report.print(cout);
+    delete reference;
+    delete single;
+}
+
+/**
+ * Simulates the garment of the first cloth of the scene twice without a window, once with its particles in the
+ * order of the mesh file and once sorted along the curve of the scene, and prints the time per step and the
+ * cache misses of both
+ * @param steps number of steps to simulate
+ * @return false if the first cloth of the scene is not an imported mesh
+ */
+bool runLocalityReport(unsigned long steps) {
+    vector<const SceneSection *> sections = scene.all("cloth");
+    if (sections.empty() || !sections[0]->has("mesh")) {
+        cerr << "locality report: the first [cloth] section of the scene does not import a mesh" << endl;
+        return false;
+    }
+    const SceneSection &section = *sections[0];
+    int curve = meshCurve == CURVE_NONE ? CURVE_HILBERT : meshCurve; //something to compare against
+    SimulationParameters reportParams = params;
+    reportParams.apply(section);
+    double extent;
+    Cloth *cloths[2] = {createMeshCloth(section, reportParams, dvec3(0), extent, CURVE_NONE),
+                        createMeshCloth(section, reportParams, dvec3(0), extent, curve)};
+
+    LocalityReport report(curve == CURVE_MORTON ? "morton" : "hilbert", extent);
+    for (int k = 0; k < 2; ++k) {
+        CacheModel cache;
+        cloths[k]->traceAccesses(cache);
+        report.addModel(k == 1, cache);
+    }
+    for (unsigned long s = 1; s <= steps; ++s) {
+        PROFILE_FRAME();
+        prepareStep(params.constraint_iterations, true);
+        for (int k = 0; k < 2; ++k) //in turn, so that both see the same state of the machine
+            report.timeStep(k == 1, [&]() { cloths[k]->step(stepInput); });
+    }
+    PROFILE_FRAME(); // closes the last step
+    vector<dvec3> positions[2];
+    for (int k = 0; k < 2; ++k) {
+        cloths[k]->getPositions(positions[k]);
+        delete cloths[k];
+    }
+    report.compare(positions[0], positions[1]);
+    report.print(cout);
+    return true;
+}
+
+/**
+ * Simulates the variants listed in the [ensemble] section of the scene without a window, in parallel, and
+ * prints the drape error, largest stretch and runtime of each. Every variant is the first cloth of the scene
+ * with the overrides of the variant, stepped against the same moving balls.
+ * @param steps number of steps to simulate each variant
+ * @return false if the sweep or its reference drape is invalid
+ */
+bool runEnsemble(unsigned long steps) {
+    ParameterSweep sweep;
+    EnsembleRunner runner(sweep);
+    const SceneSection &ensemble = scene.section("ensemble");
+    string error;
+    SimulationParameters probe;
+    if (!sweep.fromScene(scene, [&probe](const SceneSection &s) { probe.apply(s); }, error) ||
+        (ensemble.has("reference") && !runner.loadReference(ensemble.getString("reference", ""), error))) {
+        cerr << error << endl;
+        return false;
+    }
+    vector<const SceneSection *> sections = scene.all("cloth");
+    SceneSection defaultCloth("cloth");
+    const SceneSection &section = sections.empty() ? defaultCloth : *sections[0];
+    auto begin = chrono::steady_clock::now();
+    PROFILE_FRAME(); // the whole sweep is one frame, as its variants step at the same time on several threads
+    runner.run(max(ensemble.getInt("threads", 0), 0L), [&](const SceneSection &overrides, EnsembleResult &result) {
+        SimulationParameters variant = params;
+        variant.apply(section);
+        variant.apply(overrides);
+        double extent;
+        Cloth *cloth = createCloth(section, variant, dvec3(0), extent);
+        double time_step_squared = variant.time_step * variant.time_step;
+        StepInput input;
+        input.gravity = variant.gravity * time_step_squared;
+        input.wind = variant.wind * time_step_squared;
+        WindField gusts(scene.section("wind")); // every variant blends its own grid
+        input.gusts = gusts.isEnabled() ? &gusts : nullptr;
+        input.gust_scale = time_step_squared;
+        input.iterations = variant.constraint_iterations;
+        input.collisions = true;
+        input.colliders.resize(colliders.size());
+        input.meshes.resize(meshColliders.size());
+        for (size_t i = 0; i < meshColliders.size(); ++i)
+            input.meshes[i] = make_pair(meshFields[i].get(), meshColliders[i].thickness);
+        for (unsigned long s = 1; s <= steps; ++s) {
+            for (size_t i = 0; i < colliders.size(); ++i)
+                input.colliders[i] = {colliders[i].positionAt(s - 1), colliders[i].positionAt(s), colliders[i].axis,
+                                      colliders[i].radius};
+            if (input.gusts)
+                gusts.setFrame(s);
+            double start = EnsembleResult::threadMilliseconds();
+            cloth->step(input);
+            result.runtime_ms += EnsembleResult::threadMilliseconds() - start;
+            result.max_stretch = max(result.max_stretch, cloth->getMaxStretch());
+        }
+        cloth->getPositions(result.positions);
+        delete cloth;
+    });
+    PROFILE_FRAME();
+    runner.print(cout, chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count());
+    return true;
+}
+
+/**
+ * Simulates all cloths of the scene without a window for the number of steps of its [regression] section and
+ * compares their particles with a golden trajectory every "interval" steps, or records that trajectory
+ * @param golden_path path of the golden trajectory
+ * @param record true to record the golden trajectory, false to compare with it
+ * @return false if the golden trajectory cannot be opened or written, or the run diverged from it
+ */
+bool runRegression(const char *golden_path, bool record) {
+    GoldenTrajectory golden(scene.section("regression"));
+    string error;
+    if (!golden.open(golden_path, record, error)) {
+        cerr << error << endl;
+        return false;
+    }
+    scene.warnUnused();
+    vector<dvec3> positions, cloth_positions;
+    for (unsigned long s = 0; s <= golden.getSteps(); ++s) {
+        if (s > 0) {
+            PROFILE_FRAME();
+            prepareStep(params.constraint_iterations, true);
+            golden.timeStep([]() { clothScene->step(stepInput); });
+        }
+        if (!golden.samples(s))
+            continue;
+        positions.clear();
+        for (size_t c = 0; c < clothScene->size(); ++c) {
+            clothScene->get(c)->getPositions(cloth_positions);
+            positions.insert(positions.end(), cloth_positions.begin(), cloth_positions.end());
+            golden.addStretch(s, clothScene->get(c)->getMaxStretch());
+        }
+        golden.addFrame(s, positions);
+    }
+    PROFILE_FRAME(); // closes the last step
+    if (!golden.finish(cout, error)) {
+        cerr << error << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
 {
+    //arguments: [scene file] [--precision-report steps] [--ensemble steps] [--locality-report steps] [--resume checkpoint]
+    //[--cache file] [--play file] [--regression golden] [--record-golden golden]
+    const char *scenePath = nullptr, *resumePath = nullptr, *cachePath = nullptr, *playPath = nullptr;
+    const char *goldenPath = nullptr;
+    bool recordGolden = false;
+    unsigned long reportSteps = 0, ensembleSteps = 0, localitySteps = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (string(argv[i]) == "--precision-report" && i + 1 < argc)
+            reportSteps = strtoul(argv[++i], nullptr, 10);
+        else if (string(argv[i]) == "--ensemble" && i + 1 < argc)
+            ensembleSteps = strtoul(argv[++i], nullptr, 10);
+        else if (string(argv[i]) == "--locality-report" && i + 1 < argc)
+            localitySteps = strtoul(argv[++i], nullptr, 10);
+        else if ((string(argv[i]) == "--regression" || string(argv[i]) == "--record-golden") && i + 1 < argc) {
+            recordGolden = string(argv[i]) == "--record-golden";
+            goldenPath = argv[++i];
+        } else if (string(argv[i]) == "--resume" && i + 1 < argc)
+            resumePath = argv[++i];
+        else if (string(argv[i]) == "--cache" && i + 1 < argc)
+            cachePath = argv[++i];
+        else if (string(argv[i]) == "--play" && i + 1 < argc)
+            playPath = argv[++i];
+        else
+            scenePath = argv[i];
+    }
+    loadScene(scenePath, resumePath);
+    if (reportSteps > 0) {
+        runPrecisionReport(reportSteps);
+        return 0;
+    }
+    if (ensembleSteps > 0)
+        return runEnsemble(ensembleSteps) ? 0 : 1;
+    if (localitySteps > 0)
+        return runLocalityReport(localitySteps) ? 0 : 1;
+    if (goldenPath)
+        return runRegression(goldenPath, recordGolden) ? 0 : 1;
+    if (playPath)
+        openPlayer(playPath);
+    else
+        openFrameCache(cachePath);
+
     // init GLUT and create Window
-    int x = 0;
-    glutInit(&x, nullptr);
+    glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
     glutInitWindowSize(width,height);
     glutCreateWindow("Cloth Simulation");
@@ -201,18 +915,18 @@ int main()
     glutReshapeFunc(reshape);
     glutDisplayFunc(renderSceneBall);
     glutKeyboardFunc(keyPress);
-    glutIdleFunc(idle);
+    if (player) {
+        glutMouseFunc(mousePress);
+        glutMotionFunc(scrub);
+        glutTimerFunc(0, playbackTimer, 0);
+    } else {
+        glutIdleFunc(idle);
+    }
 
     //light the scene
     light();
 
-    //anchor cloth
-    for (int i = 0; i < cloth_nrow; ++i) {
-        cloth1.makeParticleImmovable(0, i);
-        cloth1.makeParticleImmovable(0, cloth_nrow - i - 1);
-    }
-
+    scene.warnUnused();
     // enter GLUT event processing cycle
     glutMainLoop();
 }
-